@@ -1,5 +1,10 @@
 #include "dfly_wrap.h"
 #include <linux/errno.h>
+#include <linux/wait.h>
+#include <linux/err.h>
+#include <linux/pagemap.h>
+#include <linux/vmalloc.h>
+#include <linux/uaccess.h>
 
 // from sys/sysctl.h
 int desiredvnodes = KERN_MAXVNODES; // Maximum number of vnodes
@@ -76,27 +81,30 @@ void Debugger (const char *msg) {
 
 // from platform/*/platform/copyio.c
 int copyout(const void *kaddr, void *udaddr, size_t len) {
-    panic("copyout");
+    if (copy_to_user((void __user *)udaddr, kaddr, len))
+        return EFAULT;
     return 0;
 }
 
 int copyin(const void *udaddr, void *kaddr, size_t len) {
-    panic("copyin");
+    if (copy_from_user(kaddr, (const void __user *)udaddr, len))
+        return EFAULT;
     return 0;
 }
 
 // from kern/vfs_bio.c
 int hidirtybufspace;
 
-int bread(struct super_block *sb, off_t loffset, int size, struct buf **bpp) {
+/*
+ * Read a buffer that does not start and end on a page boundary, or that
+ * bread() could not map, into a private copy.
+ */
+static int bread_copy(struct super_block *sb, off_t loffset, int size, struct buf **bpp) {
     struct buffer_head *bh;
     unsigned i, num;
     sector_t block;
     int error;
  
-    BUG_ON(size % BLOCK_SIZE); // size must be multiple of BLOCK_SIZE
-    BUG_ON(loffset % BLOCK_SIZE); // loffset must be multiple of BLOCK_SIZE
-
     *bpp = kzalloc(sizeof(**bpp), GFP_KERNEL);
     if(!(*bpp)) {
         error = -ENOMEM;
@@ -127,6 +135,68 @@ failed:
     return(error);
 }
 
+/*
+ * The buffer is not copied: b_data is a read-only mapping of the block
+ * device's page cache pages, which stay pinned until dfly_brelse().  The
+ * reads of all pages are started before waiting on any of them.
+ *
+ * Every cached buffer holds its own mapping, so vmalloc space can run out
+ * (it is only about 128MB on 32-bit) well before the shrinker is asked to
+ * give anything back.  The pages are then let go of and the buffer is
+ * read into a copy instead.
+ */
+int bread(struct super_block *sb, off_t loffset, int size, struct buf **bpp) {
+    struct address_space *mapping = sb->s_bdev->bd_inode->i_mapping;
+    struct page *page;
+    struct buf *bp;
+    pgoff_t index;
+    int i, num;
+    int error;
+
+    BUG_ON(size % BLOCK_SIZE); // size must be multiple of BLOCK_SIZE
+    BUG_ON(loffset % BLOCK_SIZE); // loffset must be multiple of BLOCK_SIZE
+
+    if ((loffset | size) & ~PAGE_MASK)
+        return(bread_copy(sb, loffset, size, bpp));
+
+    num = size >> PAGE_SHIFT;
+    index = loffset >> PAGE_SHIFT;
+
+    bp = kzalloc(sizeof(*bp) + num * sizeof(struct page *), GFP_NOFS);
+    if (!bp)
+        return(-ENOMEM);
+    bp->b_pages = (struct page **)(bp + 1);
+
+    for (i = 0; i < num; ++i) {
+        page = read_mapping_page_async(mapping, index + i, NULL);
+        if (IS_ERR(page)) {
+            error = PTR_ERR(page);
+            goto failed;
+        }
+        bp->b_pages[bp->b_npages++] = page;
+    }
+    for (i = 0; i < num; ++i) {
+        page = bp->b_pages[i];
+        wait_on_page_locked(page);
+        if (!PageUptodate(page)) {
+            error = -EIO;
+            goto failed;
+        }
+        mark_page_accessed(page);
+    }
+
+    bp->b_data = vmap(bp->b_pages, num, VM_MAP, PAGE_KERNEL_RO);
+    if (!bp->b_data) {
+        dfly_brelse(bp);
+        return(bread_copy(sb, loffset, size, bpp));
+    }
+    *bpp = bp;
+    return 0;
+failed:
+    dfly_brelse(bp);
+    return(error);
+}
+
 #ifndef _LINUX_BUFFER_HEAD_H
 void brelse(struct buf *bp) {
     panic("brelse");
@@ -151,31 +221,189 @@ int vmntvnodescan(
 }
 
 // from kern/kern_slaballoc.c
+/*
+ * A malloc_type given a slab cache by dfly_malloc_cache_create() serves
+ * all its allocations from that cache, so it must only be used for
+ * objects of exactly ks_size bytes.  Other types use the generic kmalloc
+ * buckets.  Memory is always handed out zeroed, the core has never been
+ * audited for M_ZERO.
+ *
+ * As on DragonFly, usage is accounted per cpu in ks_inuse and ks_memuse,
+ * so one slot may go negative when objects are freed on another cpu.
+ */
+struct malloc_type *kmemstatistics;    /* all types, see malloc_init() */
+
+static void
+dfly_malloc_account(struct malloc_type *type, long bytes, long count)
+{
+    int cpu;
+
+    cpu = get_cpu() % SMP_MAXCPU;
+    type->ks_inuse[cpu] += count;
+    type->ks_memuse[cpu] += bytes;
+    put_cpu();
+}
+
+void malloc_init(void *data) {
+    struct malloc_type *type = data;
+
+    type->ks_next = kmemstatistics;
+    kmemstatistics = type;
+}
+
+void malloc_uninit(void *data) {
+    struct malloc_type *type = data;
+    struct malloc_type **tp;
+
+    for (tp = &kmemstatistics; *tp; tp = &(*tp)->ks_next) {
+        if (*tp == type) {
+            *tp = type->ks_next;
+            break;
+        }
+    }
+    type->ks_next = NULL;
+    if (type->ks_cache) {
+        kmem_cache_destroy(type->ks_cache);
+        type->ks_cache = NULL;
+    }
+}
+
+/*
+ * Back type with a slab cache of size byte objects, named after the
+ * type.  Returns 0 or -ENOMEM.
+ */
+int dfly_malloc_cache_create(struct malloc_type *type, size_t size) {
+    type->ks_cache = kmem_cache_create(type->ks_shortdesc, size, 0,
+                                       SLAB_HWCACHE_ALIGN |
+                                       SLAB_RECLAIM_ACCOUNT |
+                                       SLAB_MEM_SPREAD, NULL);
+    if (type->ks_cache == NULL)
+        return -ENOMEM;
+    type->ks_size = size;
+    return 0;
+}
+
 #undef kfree
 void dfly_kfree(void *ptr, struct malloc_type *type) {
-    kfree(ptr);
+    if (ptr == NULL)
+        return;
+    if (type->ks_cache) {
+        dfly_malloc_account(type, -type->ks_size, -1);
+        kmem_cache_free(type->ks_cache, ptr);
+    } else {
+        dfly_malloc_account(type, -(long)ksize(ptr), -1);
+        kfree(ptr);
+    }
 }
 
 void dfly_brelse(struct buf *bp) {
-    kfree(bp->b_data);
+    int i;
+
+    if (bp->b_pages) {
+        if (bp->b_data)
+            vunmap(bp->b_data);
+        for (i = 0; i < bp->b_npages; ++i)
+            page_cache_release(bp->b_pages[i]);
+    } else {
+        kfree(bp->b_data);
+    }
     kfree(bp);
 }
 
 #undef kmalloc
 void *dfly_kmalloc(unsigned long size, struct malloc_type *type, int flags) {
-    return kzalloc(size, GFP_KERNEL);
+    void *ptr;
+
+    if (type->ks_cache) {
+        BUG_ON(size != type->ks_size);
+        ptr = kmem_cache_zalloc(type->ks_cache, GFP_KERNEL);
+        if (ptr)
+            dfly_malloc_account(type, type->ks_size, 1);
+    } else {
+        ptr = kzalloc(size, GFP_KERNEL);
+        if (ptr)
+            dfly_malloc_account(type, ksize(ptr), 1);
+    }
+    if (ptr)
+        ++type->ks_calls;
+    return ptr;
+}
+
+#undef kstrdup
+char *dfly_kstrdup(const char *str, struct malloc_type *type) {
+    size_t len;
+    char *nstr;
+
+    if (str == NULL)
+        return NULL;
+    len = strlen(str) + 1;
+    nstr = dfly_kmalloc(len, type, M_WAITOK);
+    if (nstr)
+        memcpy(nstr, str, len);
+    return nstr;
 }
 
 MALLOC_DEFINE(M_TEMP, "temp", "misc temporary data buffers");
 
 // from kern/kern_synch.c
+/*
+ * Sleepers are hashed on their ident onto a table of wait queues like
+ * DragonFly's slpque.  wakeup() wakes the whole bucket, sleepers on
+ * other idents go back to sleep after rechecking their condition.
+ */
+#define TABLESIZE	128
+#define LOOKUP(ident)	((((unsigned long)(ident)) >> 8) & (TABLESIZE - 1))
+
+static wait_queue_head_t slpque[TABLESIZE];
+
+void sleepinit(void) {
+    int i;
+
+    for (i = 0; i < TABLESIZE; ++i)
+        init_waitqueue_head(&slpque[i]);
+}
+
+/*
+ * Sleep on ident until woken up, for at most timo ticks if timo is not
+ * zero.  If spin is not NULL it is released once the caller is on the
+ * sleep queue and reacquired before returning, so a wakeup() issued by
+ * another thread after it took spin cannot be lost.  Returns 0 when
+ * woken up, EWOULDBLOCK on timeout, or EINTR on a signal with PCATCH.
+ */
+int ssleep(void *ident, spinlock_t *spin, int flags, const char *wmesg,
+           int timo) {
+    wait_queue_head_t *wq = &slpque[LOOKUP(ident)];
+    DEFINE_WAIT(wait);
+    long timeout = timo ? timo : MAX_SCHEDULE_TIMEOUT;
+    int error = 0;
+
+    prepare_to_wait(wq, &wait, (flags & PCATCH) ? TASK_INTERRUPTIBLE :
+                                                  TASK_UNINTERRUPTIBLE);
+    if (spin)
+        spin_unlock(spin);
+    if ((flags & PCATCH) && signal_pending(current))
+        error = EINTR;
+    else if (schedule_timeout(timeout) == 0 && timo)
+        error = EWOULDBLOCK;
+    else if ((flags & PCATCH) && signal_pending(current))
+        error = EINTR;
+    finish_wait(wq, &wait);
+    if (spin)
+        spin_lock(spin);
+    return error;
+}
+
+/*
+ * Callers interlock with wakeup() through their own state, as under a
+ * critical section on a uniprocessor DragonFly kernel.  Use ssleep()
+ * where a wakeup may race with going to sleep.
+ */
 int tsleep(void *ident, int flags, const char *wmesg, int timo) {
-    panic("tsleep");
-    return 0;
+    return ssleep(ident, NULL, flags, wmesg, timo);
 }
 
 void wakeup(void *ident) {
-    panic("wakeup");
+    wake_up_all(&slpque[LOOKUP(ident)]);
 }
 
 // from kern/clock.c
@@ -186,9 +414,10 @@ void getmicrotime(struct timeval *tvp) {
 }
 
 // from sys/signal2.h
+// Linux: only tells whether the current task has a signal pending, lp is
+// not a real lwp.
 int __cursig(struct lwp *lp, int mayblock, int maytrace) {
-    panic("__cursig");
-    return 0;
+    return signal_pending(current) ? 1 : 0;
 }
 
 // from kern/lwkt_thread.c
@@ -205,7 +434,7 @@ void lwkt_exit(void) {
 }
 
 // from kern/subr_param.c
-int hz;
+int hz = HZ;
 
 // from kern/kern_iosched.c
 void bwillwrite(int bytes) {
@@ -220,6 +449,26 @@ int priv_check_cred(struct ucred *cred, int priv, int flags) {
 
 // from kern/subr_prf.c
 int kvprintf(const char *fmt, __va_list ap) {
-    panic("kvprintf");
-    return 0;
+    return vprintk(fmt, ap);
+}
+
+/*
+ * Print at most rate->freq messages per second.  A negative rate->count
+ * allows an initial burst.
+ */
+void krateprintf(struct krate *rate, const char *fmt, ...) {
+    __va_list ap;
+    int now = (int)get_seconds();
+
+    if (rate->ticks != now) {
+        rate->ticks = now;
+        if (rate->count > 0)
+            rate->count = 0;
+    }
+    if (rate->count < rate->freq) {
+        ++rate->count;
+        __va_start(ap, fmt);
+        kvprintf(fmt, ap);
+        __va_end(ap);
+    }
 }
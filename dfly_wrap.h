@@ -19,6 +19,10 @@
 #include <linux/slab.h>   // for kmalloc
 #include <linux/string.h> // for memcmp, memcpy, memset
 #include <linux/buffer_head.h> // for brelse
+#include <linux/sched.h>  // for current
+#include <linux/spinlock.h> // for spinlock_t
+#include <asm/atomic.h>   // for atomic_add, atomic_sub
+#include <asm/system.h>   // for cmpxchg
 
 /*
  * required DragonFly BSD definitions
@@ -56,6 +60,7 @@ struct malloc_type {
     uint16_t ks_limblocks; /* number of times blocked for hitting limit */
     uint16_t ks_mapblocks; /* number of times blocked for kernel map */
     long    ks_reserved[4]; /* future use (module compatibility) */
+    struct kmem_cache *ks_cache;    /* Linux: slab of ks_size objects */
 };
 
 #define M_MAGIC         877983977       /* time when first defined :-) */
@@ -71,11 +76,18 @@ struct malloc_type {
 
 #define kfree(addr, type) dfly_kfree(addr, type)
 #define kmalloc(size, type, flags) dfly_kmalloc(size, type, flags)
+#define kstrdup(str, type) dfly_kstrdup(str, type)
 
 MALLOC_DECLARE(M_TEMP);
 
+extern struct malloc_type *kmemstatistics;
+
 void dfly_kfree (void *addr, struct malloc_type *type);
 void *dfly_kmalloc (unsigned long size, struct malloc_type *type, int flags);
+char *dfly_kstrdup (const char *str, struct malloc_type *type);
+void malloc_init (void *data);
+void malloc_uninit (void *data);
+int dfly_malloc_cache_create (struct malloc_type *type, size_t size);
 
 // from sys/ktr.h
 #define KTR_INFO_MASTER_EXTERN(master)
@@ -85,6 +97,25 @@ void *dfly_kmalloc (unsigned long size, struct malloc_type *type, int flags);
 
 struct lwp {};
 
+// from machine/atomic.h, an atomic_t is a bare int
+static __inline void
+atomic_add_int(volatile u_int *p, u_int v)
+{
+    atomic_add(v, (atomic_t *)p);
+}
+
+static __inline void
+atomic_subtract_int(volatile u_int *p, u_int v)
+{
+    atomic_sub(v, (atomic_t *)p);
+}
+
+static __inline int
+atomic_cmpset_int(volatile u_int *p, u_int cmpval, u_int newval)
+{
+    return cmpxchg(p, cmpval, newval) == cmpval;
+}
+
 // from sys/thread.h
 #define crit_enter()
 #define crit_exit()
@@ -99,7 +130,8 @@ extern int  lwkt_create (void (*func)(void *), void *, struct thread **,
 extern void lwkt_exit (void);
 
 // from platform/pc32/include/thread.h
-#define curthread   ((thread_t)NULL)
+// the task stands in for the thread, it is only compared, never dereferenced
+#define curthread   ((thread_t)current)
 
 // from sys/types.h
 typedef u_int32_t udev_t;         /* device number */
@@ -127,8 +159,11 @@ struct statvfs {
 };
 
 // from sys/buf.h
+struct page;
 struct buf {
     caddr_t b_data;                 /* Memory, superblocks, indirect etc. */
+    struct page **b_pages;          /* Linux: bdev pages mapped at b_data */
+    int b_npages;
 };
 struct vnode;
 int bread (struct super_block*, off_t, int, struct buf **);
@@ -274,17 +309,21 @@ typedef __builtin_va_list   __va_list;  /* internally known to gcc */
 #define kprintf printk
 #define ksnprintf snprintf
 #define strtoul simple_strtoul
-#define bcopy memcpy
+#define bcopy(src, dst, len) memmove(dst, src, len)
 #define bzero(buf, len) memset(buf, 0, len)
 void Debugger (const char *msg);
 uint32_t crc32(const void *buf, size_t size);
 uint32_t crc32_ext(const void *buf, size_t size, uint32_t ocrc);
 int tsleep (void *, int, const char *, int);
+int ssleep (void *, spinlock_t *, int, const char *, int);
 void wakeup (void *chan);
+void sleepinit (void);
 int copyin (const void *udaddr, void *kaddr, size_t len);
 int copyout (const void *kaddr, void *udaddr, size_t len);
 u_quad_t strtouq (const char *, char **, int);
 int kvprintf (const char *, __va_list);
+void krateprintf (struct krate *, const char *, ...)
+    __attribute__((format(printf, 2, 3)));
 
 // from kern/vfs_subr.c
 #define KERN_MAXVNODES           5      /* int: max vnodes */
@@ -9,6 +9,12 @@
 #include <linux/proc_fs.h>
 #include <linux/errno.h>
 #include <linux/string.h>
+#include <linux/uaccess.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
 #include "hammerfs.h"
 
 #include "dfly_wrap.h"
@@ -16,7 +22,9 @@
 
 static int hammerfs_open(struct inode *inode, struct file *file)
 {
-    printk("hammerfs_open(node->i_ino=%lu)\n", inode->i_ino);
+    hammerfs_debug((hammer_mount_t)inode->i_sb->s_fs_info,
+                   HAMMERFS_DBG_FILE, HAMMERFS_DBG_TRACE,
+                   "hammerfs_open(node->i_ino=%lu)\n", inode->i_ino);
 
     file->f_ra.ra_pages = 0;    /* No read-ahead */
     return generic_file_open (inode, file);
@@ -34,7 +42,8 @@ int hammerfs_readdir(struct file *file, void *dirent, filldir_t filldir)
     int error;
     int dtype;
 
-    printk("hammerfs_readdir(file->f_pos=%d)\n", file->f_pos);
+    hammerfs_debug(ip->hmp, HAMMERFS_DBG_DIR, HAMMERFS_DBG_TRACE,
+                   "hammerfs_readdir(file->f_pos=%lld)\n", file->f_pos);
 
    /*
     * Handle artificial entries
@@ -127,21 +136,42 @@ struct dentry *hammerfs_inode_lookup(struct inode *parent_inode, struct dentry *
     int64_t obj_id;
     int nlen;
     int flags;
+    int ispfs;
     int error;
     u_int32_t localization;
 
-    printk("hammerfs_inode_lookup(parent_inode->i_ino=%d, dentry->d_name.name=%s)\n",
-        parent_inode->i_ino, dentry->d_name.name);
-
     sb = parent_inode->i_sb;
     dip = (hammer_inode_t)parent_inode->i_private;
+
+    hammerfs_debug(dip->hmp, HAMMERFS_DBG_INODE, HAMMERFS_DBG_TRACE,
+                   "hammerfs_inode_lookup(parent_inode->i_ino=%lu, "
+                   "dentry->d_name.name=%s)\n",
+                   parent_inode->i_ino, dentry->d_name.name);
+
+   /*
+    * Extract the as-of TID and PFS of a name@@0x%016llx[:%05d] lookup.
+    * The result is a separate dentry, so each snapshot view is cached
+    * under its own name.  As-of files and directories cannot be modified.
+    */
     asof = dip->obj_asof;
     localization = dip->obj_localization;   /* for code consistency */
-    nlen = dentry->d_name.len;
+    nlen = hammerfs_name_asof(dentry->d_name.name, dentry->d_name.len,
+                              &asof, &localization, &ispfs);
     flags = dip->flags & HAMMER_INODE_RO;
+    if (asof != HAMMER_MAX_TID)
+        flags |= HAMMER_INODE_RO;
 
     hammer_simple_transaction(&trans, dip->hmp);
 
+   /*
+    * If this is a PFS softlink we dive into the PFS
+    */
+    if (ispfs && nlen == 0) {
+        obj_id = HAMMER_OBJID_ROOT;
+        error = 0;
+        goto found;
+    }
+
    /*
     * Calculate the namekey and setup the key range for the scan.  This
     * works kinda like a chained hash table where the lower 32 bits
@@ -193,6 +223,7 @@ struct dentry *hammerfs_inode_lookup(struct inode *parent_inode, struct dentry *
         }
     }
     hammer_done_cursor(&cursor);
+found:
     if (error == 0) {
         ip = hammer_get_inode(&trans, dip, obj_id,
                               asof, localization,
@@ -213,9 +244,448 @@ done:
     return NULL;
 }
 
+/*
+ * Per open file state, set up by the first ioctl that needs it.
+ */
+struct hammerfs_file {
+    struct mutex lock;
+    struct hammerfs_history_cursor history;
+};
+
+static struct hammerfs_file *hammerfs_get_file(struct file *file)
+{
+    struct hammerfs_file *hf;
+    struct hammerfs_file *old;
+
+    if ((hf = file->private_data) != NULL)
+        return(hf);
+    hf = kmalloc(sizeof(*hf), M_HAMMER, M_WAITOK | M_ZERO);
+    if (hf == NULL)
+        return(NULL);
+    mutex_init(&hf->lock);
+    hf->history.eof = -1;       /* no walk started */
+    old = cmpxchg(&file->private_data, NULL, hf);
+    if (old) {
+        kfree(hf, M_HAMMER);
+        hf = old;
+    }
+    return(hf);
+}
+
+static int hammerfs_release(struct inode *inode, struct file *file)
+{
+    struct hammerfs_file *hf = file->private_data;
+
+    if (hf) {
+        hammerfs_history_done(&hf->history);
+        kfree(hf, M_HAMMER);
+        file->private_data = NULL;
+    }
+    return 0;
+}
+
+static int hammerfs_ioctl_gethistory(struct hammer_inode *ip,
+                                     struct hammer_ioc_history __user *uhist)
+{
+    struct hammer_ioc_history *hist;
+    int error;
+
+    hist = kmalloc(sizeof(*hist), M_HAMMER, M_WAITOK);
+    if (hist == NULL)
+        return(-ENOMEM);
+    if (copy_from_user(hist, uhist, sizeof(*hist))) {
+        error = -EFAULT;
+    } else {
+        error = -hammerfs_ioc_gethistory(ip, hist);
+        if (error == 0 && copy_to_user(uhist, hist, sizeof(*hist)))
+            error = -EFAULT;
+    }
+    kfree(hist, M_HAMMER);
+    return(error);
+}
+
+/*
+ * The walk fills a kernel buffer of HAMMERFS_HISTORY_CHUNK entries at a
+ * time, it cannot copy out to the caller while it holds B-Tree locks.
+ * Each chunk picks up at the leaf the last one ended in.
+ */
+#define HAMMERFS_HISTORY_CHUNK 256
+
+static int hammerfs_ioctl_history_stream(struct file *file,
+                                         struct hammer_inode *ip,
+                                         struct hammerfs_ioc_history_stream __user *uarg)
+{
+    struct hammerfs_ioc_history_stream hs;
+    struct hammerfs_history_cursor *hc;
+    struct hammer_ioc_hist_entry *ary;
+    struct hammerfs_file *hf;
+    int error;
+    int count;
+    int n;
+
+    if (copy_from_user(&hs, uarg, sizeof(hs)))
+        return(-EFAULT);
+    if (hs.max < 2)
+        return(-EINVAL);
+    if ((hf = hammerfs_get_file(file)) == NULL)
+        return(-ENOMEM);
+    ary = kmalloc(HAMMERFS_HISTORY_CHUNK * sizeof(*ary), M_HAMMER, M_WAITOK);
+    if (ary == NULL)
+        return(-ENOMEM);
+
+    mutex_lock(&hf->lock);
+    hc = &hf->history;
+    error = 0;
+    if (hc->eof < 0 || (hs.head.flags & HAMMERFS_IOC_HISTORY_RESTART)) {
+        hc->hist.head.flags = hs.head.flags & HAMMER_IOC_HISTORY_ATKEY;
+        hc->hist.beg_tid = hs.beg_tid;
+        hc->hist.end_tid = hs.end_tid;
+        hc->hist.key = hs.key;
+        hc->hist.nxt_key = hs.nxt_key;
+        error = -hammerfs_history_start(ip, hc);
+    }
+
+    count = 0;
+    while (error == 0 && hs.max - count >= 2) {
+        error = -hammerfs_history_read(ip, hc, ary,
+                                       min(hs.max - count,
+                                           HAMMERFS_HISTORY_CHUNK), &n);
+        if (error || n == 0)
+            break;
+        if (copy_to_user(hs.hist_ary + count, ary, n * sizeof(*ary)))
+            error = -EFAULT;
+        count += n;
+    }
+
+    hs.head.flags = hc->hist.head.flags;
+    hs.obj_id = hc->hist.obj_id;
+    hs.nxt_key = hc->hist.nxt_key;
+    hs.count = count;
+    mutex_unlock(&hf->lock);
+    kfree(ary, M_HAMMER);
+
+    if (error == 0 && copy_to_user(uarg, &hs, sizeof(hs)))
+        error = -EFAULT;
+    return(error);
+}
+
+static int hammerfs_ioctl_mirror_read(struct hammer_inode *ip,
+                                      struct hammer_ioc_mirror_rw __user *umirror)
+{
+    struct hammer_ioc_mirror_rw mirror;
+    int error;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return(-EPERM);
+    if (copy_from_user(&mirror, umirror, sizeof(mirror)))
+        return(-EFAULT);
+    error = -hammerfs_ioc_mirror_read(ip, &mirror);
+    if (error == 0 && copy_to_user(umirror, &mirror, sizeof(mirror)))
+        error = -EFAULT;
+    return(error);
+}
+
+/*
+ * Mirror-read output to a pipe or a socket.  Record data of at least
+ * HAMMERFS_SPLICE_MIN bytes in a buffer bread() mapped with vmap() goes
+ * out as references to the block device's page cache pages, everything
+ * else is copied into pages of our own.  A batch holds up to
+ * HAMMERFS_SPLICE_PAGES pages, the last HAMMERFS_SPLICE_REC of them kept
+ * free for the next record: header, up to HAMMER_XBUFSIZE of data on
+ * pages of its own and padding.
+ */
+#define HAMMERFS_SPLICE_MIN     2048
+#define HAMMERFS_SPLICE_PAGES   128
+#define HAMMERFS_SPLICE_REC     (HAMMER_XBUFSIZE / PAGE_SIZE + 3)
+
+struct hammerfs_splice_sink {
+    struct hammerfs_mirror_sink sink;
+    struct file *out;
+    struct page *copy_page;     /* last page, if it can take more copies */
+    int copy_off;
+    int nr_pages;
+    struct page *pages[HAMMERFS_SPLICE_PAGES];
+    struct partial_page partial[HAMMERFS_SPLICE_PAGES];
+};
+
+static void hammerfs_pipe_buf_release(struct pipe_inode_info *pipe,
+                                      struct pipe_buffer *buf)
+{
+    page_cache_release(buf->page);
+}
+
+/*
+ * The pages may belong to the block device's page cache, they must not
+ * be stolen.
+ */
+static int hammerfs_pipe_buf_steal(struct pipe_inode_info *pipe,
+                                   struct pipe_buffer *buf)
+{
+    return 1;
+}
+
+static const struct pipe_buf_operations hammerfs_pipe_buf_ops = {
+    .can_merge = 0,
+    .map = generic_pipe_buf_map,
+    .unmap = generic_pipe_buf_unmap,
+    .confirm = generic_pipe_buf_confirm,
+    .release = hammerfs_pipe_buf_release,
+    .steal = hammerfs_pipe_buf_steal,
+    .get = generic_pipe_buf_get,
+};
+
+static void hammerfs_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+    page_cache_release(spd->pages[i]);
+}
+
+static void hammerfs_splice_push(struct hammerfs_splice_sink *ss,
+                                 struct page *page, int off, int len)
+{
+    BUG_ON(ss->nr_pages == HAMMERFS_SPLICE_PAGES);
+    ss->pages[ss->nr_pages] = page;
+    ss->partial[ss->nr_pages].offset = off;
+    ss->partial[ss->nr_pages].len = len;
+    ss->partial[ss->nr_pages].private = 0;
+    ++ss->nr_pages;
+}
+
+static int hammerfs_splice_add(struct hammerfs_mirror_sink *sink,
+                               const void *addr, int len, int isdata)
+{
+    struct hammerfs_splice_sink *ss;
+    const char *ptr = addr;
+    struct page *page;
+    int byref;
+    int off;
+    int n;
+
+    ss = container_of(sink, struct hammerfs_splice_sink, sink);
+    byref = isdata && len >= HAMMERFS_SPLICE_MIN && is_vmalloc_addr(ptr);
+    while (len > 0) {
+        if (byref) {
+            off = offset_in_page(ptr);
+            n = min_t(int, len, PAGE_SIZE - off);
+            page = vmalloc_to_page(ptr);
+            page_cache_get(page);
+            hammerfs_splice_push(ss, page, off, n);
+            ss->copy_page = NULL;
+        } else {
+            if (ss->copy_page == NULL || ss->copy_off == PAGE_SIZE) {
+                page = alloc_page(GFP_KERNEL);
+                if (page == NULL)
+                    return(ENOMEM);
+                hammerfs_splice_push(ss, page, 0, 0);
+                ss->copy_page = page;
+                ss->copy_off = 0;
+            }
+            n = min_t(int, len, PAGE_SIZE - ss->copy_off);
+            memcpy((char *)page_address(ss->copy_page) + ss->copy_off,
+                   ptr, n);
+            ss->copy_off += n;
+            ss->partial[ss->nr_pages - 1].len += n;
+        }
+        ptr += n;
+        len -= n;
+    }
+    if (ss->nr_pages > HAMMERFS_SPLICE_PAGES - HAMMERFS_SPLICE_REC)
+        sink->full = 1;
+    return(0);
+}
+
+/*
+ * Hand the batch to the pipe, PIPE_BUFFERS pages at a time, or to the
+ * socket page by page.  Both sleep while the reader is behind.
+ */
+static int hammerfs_splice_flush(struct hammerfs_mirror_sink *sink)
+{
+    struct hammerfs_splice_sink *ss;
+    struct splice_pipe_desc spd;
+    struct inode *inode;
+    ssize_t expect;
+    ssize_t n;
+    loff_t pos = 0;
+    int error = 0;
+    int i = 0;
+    int j;
+
+    ss = container_of(sink, struct hammerfs_splice_sink, sink);
+    inode = ss->out->f_path.dentry->d_inode;
+    if (S_ISFIFO(inode->i_mode) && inode->i_pipe) {
+        while (i < ss->nr_pages && error == 0) {
+            spd.pages = &ss->pages[i];
+            spd.partial = &ss->partial[i];
+            spd.nr_pages = min(ss->nr_pages - i, PIPE_BUFFERS);
+            spd.flags = 0;
+            spd.ops = &hammerfs_pipe_buf_ops;
+            spd.spd_release = hammerfs_spd_release;
+            expect = 0;
+            for (j = 0; j < spd.nr_pages; ++j)
+                expect += spd.partial[j].len;
+            i += spd.nr_pages;
+            n = splice_to_pipe(inode->i_pipe, &spd);
+            if (n < 0)
+                error = -n;
+            else if (n != expect)
+                error = EINTR;
+        }
+    } else {
+        for (; i < ss->nr_pages && error == 0; ++i) {
+            n = ss->out->f_op->sendpage(ss->out, ss->pages[i],
+                                        ss->partial[i].offset,
+                                        ss->partial[i].len, &pos,
+                                        i + 1 < ss->nr_pages);
+            if (n < 0)
+                error = -n;
+            else if (n != ss->partial[i].len)
+                error = EINTR;
+            page_cache_release(ss->pages[i]);
+        }
+    }
+    while (i < ss->nr_pages)
+        page_cache_release(ss->pages[i++]);
+    ss->nr_pages = 0;
+    ss->copy_page = NULL;
+    sink->full = 0;
+    return(error);
+}
+
+static int hammerfs_ioctl_mirror_splice(struct hammer_inode *ip,
+                                        struct hammerfs_ioc_mirror_splice __user *uarg)
+{
+    struct hammerfs_ioc_mirror_splice ms;
+    struct hammerfs_splice_sink *ss;
+    struct hammerfs_mframe_sink mf;
+    struct inode *inode;
+    struct file *out;
+    int error;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return(-EPERM);
+    if (copy_from_user(&ms, uarg, sizeof(ms)))
+        return(-EFAULT);
+    if (ms.flags & ~HAMMERFS_MIRROR_FRAMES)
+        return(-EINVAL);
+    if ((out = fget(ms.fd)) == NULL)
+        return(-EBADF);
+    inode = out->f_path.dentry->d_inode;
+    if (!(out->f_mode & FMODE_WRITE)) {
+        error = -EBADF;
+    } else if (!(S_ISFIFO(inode->i_mode) && inode->i_pipe) &&
+               out->f_op->sendpage == NULL) {
+        error = -EINVAL;
+    } else if ((ss = kmalloc(sizeof(*ss), M_HAMMER,
+                             M_WAITOK | M_ZERO)) == NULL) {
+        error = -ENOMEM;
+    } else {
+        ss->sink.add = hammerfs_splice_add;
+        ss->sink.flush = hammerfs_splice_flush;
+        ss->out = out;
+        if ((ms.flags & HAMMERFS_MIRROR_FRAMES) == 0) {
+            error = -hammerfs_mirror_stream(ip, &ms.mirror, &ss->sink);
+        } else if ((error = -hammerfs_mframe_init(&mf, &ss->sink)) == 0) {
+            error = -hammerfs_mirror_stream(ip, &ms.mirror, &mf.sink);
+            hammerfs_mframe_done(&mf);
+        }
+        hammerfs_splice_flush(&ss->sink);
+        kfree(ss, M_HAMMER);
+        if (error == 0 && copy_to_user(uarg, &ms, sizeof(ms)))
+            error = -EFAULT;
+    }
+    fput(out);
+    return(error);
+}
+
+static int hammerfs_ioctl_mirror_split(struct hammer_inode *ip,
+                                       struct hammerfs_ioc_mirror_split __user *uarg)
+{
+    struct hammerfs_ioc_mirror_split split;
+    struct hammerfs_mirror_range *ranges;
+    int error;
+
+    if (!capable(CAP_SYS_ADMIN))
+        return(-EPERM);
+    if (copy_from_user(&split, uarg, sizeof(split)))
+        return(-EFAULT);
+    if (split.count < 1 || split.count > HAMMERFS_MIRROR_SPLIT_MAX)
+        return(-EINVAL);
+    ranges = kmalloc(split.count * sizeof(*ranges), M_HAMMER, M_WAITOK);
+    if (ranges == NULL)
+        return(-ENOMEM);
+    error = -hammerfs_mirror_split(ip->hmp, &split, ranges);
+    if (error == 0 &&
+        (copy_to_user(split.ranges, ranges, split.count * sizeof(*ranges)) ||
+         copy_to_user(uarg, &split, sizeof(split)))) {
+        error = -EFAULT;
+    }
+    kfree(ranges, M_HAMMER);
+    return(error);
+}
+
+static int hammerfs_ioctl_pfs_summary(struct hammer_inode *ip,
+                                      struct hammerfs_ioc_pfs_summary __user *uarg)
+{
+    struct hammerfs_ioc_pfs_summary ps;
+    struct hammerfs_pfs_summary *ary;
+    int count;
+    int error;
+
+    if (copy_from_user(&ps, uarg, sizeof(ps)))
+        return(-EFAULT);
+    if (ps.count < 0)
+        return(-EINVAL);
+    error = -hammerfs_pfs_summary(ip->hmp, 0, &ary, &count);
+    if (error)
+        return(error);
+    if (copy_to_user(ps.ary, ary, min(ps.count, count) * sizeof(*ary)))
+        return(-EFAULT);
+    ps.count = count;
+    if (copy_to_user(uarg, &ps, sizeof(ps)))
+        return(-EFAULT);
+    return(0);
+}
+
+static long hammerfs_ioctl(struct file *file, unsigned int cmd,
+                           unsigned long arg)
+{
+    struct inode *inode = file->f_dentry->d_inode;
+    struct hammer_inode *ip = (struct hammer_inode *)inode->i_private;
+    int error;
+
+    hammerfs_debug(ip->hmp, HAMMERFS_DBG_FILE, HAMMERFS_DBG_TRACE,
+                   "hammerfs_ioctl(ino=%lu, cmd=%08x)\n", inode->i_ino, cmd);
+
+    switch (cmd) {
+    case HAMMERIOC_GETHISTORY:
+        error = hammerfs_ioctl_gethistory(ip, (void __user *)arg);
+        break;
+    case HAMMERFSIOC_GETHISTORY_STREAM:
+        error = hammerfs_ioctl_history_stream(file, ip, (void __user *)arg);
+        break;
+    case HAMMERIOC_MIRROR_READ:
+        error = hammerfs_ioctl_mirror_read(ip, (void __user *)arg);
+        break;
+    case HAMMERFSIOC_MIRROR_READ_SPLICE:
+        error = hammerfs_ioctl_mirror_splice(ip, (void __user *)arg);
+        break;
+    case HAMMERFSIOC_MIRROR_SPLIT:
+        error = hammerfs_ioctl_mirror_split(ip, (void __user *)arg);
+        break;
+    case HAMMERFSIOC_PFS_SUMMARY:
+        error = hammerfs_ioctl_pfs_summary(ip, (void __user *)arg);
+        break;
+    default:
+        error = -ENOTTY;
+        break;
+    }
+    return(error);
+}
+
 struct file_operations hammerfs_file_operations = {
     .owner = THIS_MODULE,
     .open = hammerfs_open,
+    .release = hammerfs_release,
+    .unlocked_ioctl = hammerfs_ioctl,
 //    .read = hammerfs_read,
     .read = &do_sync_read,
     .aio_read = generic_file_aio_read,
@@ -225,8 +695,10 @@ struct file_operations hammerfs_file_operations = {
 
 int hammerfs_setattr(struct dentry *dentry, struct iattr *iattr)
 {
-    printk(KERN_INFO "hammerfs_setattr(ino=%lu, name=%s)\n",
-                     dentry->d_inode->i_ino, dentry->d_name.name);
+    hammerfs_debug((hammer_mount_t)dentry->d_sb->s_fs_info,
+                   HAMMERFS_DBG_INODE, HAMMERFS_DBG_TRACE,
+                   "hammerfs_setattr(ino=%lu, name=%s)\n",
+                   dentry->d_inode->i_ino, dentry->d_name.name);
 
     return -EPERM;
 }
@@ -236,8 +708,10 @@ int hammerfs_getattr(struct vfsmount *mnt, struct dentry *dentry,
 {
     struct inode *inode;
 
-    printk(KERN_INFO "hammerfs_getattr(ino=%lu, name=%s)\n",
-                     dentry->d_inode->i_ino, dentry->d_name.name);
+    hammerfs_debug((hammer_mount_t)dentry->d_sb->s_fs_info,
+                   HAMMERFS_DBG_INODE, HAMMERFS_DBG_TRACE,
+                   "hammerfs_getattr(ino=%lu, name=%s)\n",
+                   dentry->d_inode->i_ino, dentry->d_name.name);
 
     inode = dentry->d_inode;
     generic_fillattr(inode, stat);
@@ -75,6 +75,10 @@
 #if defined(_KERNEL) || defined(_KERNEL_STRUCTURES)
 
 MALLOC_DECLARE(M_HAMMER);
+MALLOC_DECLARE(M_HAMMER_MISC);	/* hmp->m_misc */
+MALLOC_DECLARE(M_HAMMER_INO);	/* hmp->m_inodes, slab backed */
+MALLOC_DECLARE(M_HAMMER_BUF);	/* struct hammer_buffer, slab backed */
+MALLOC_DECLARE(M_HAMMER_NODE);	/* struct hammer_node, slab backed */
 
 /*
  * Kernel trace
@@ -126,6 +130,7 @@ typedef struct hammer_transaction *hammer_transaction_t;
 
 #define HAMMER_TRANSF_NEWINODE	0x0001
 #define HAMMER_TRANSF_DIDIO	0x0002
+#define HAMMER_TRANSF_BULK	0x0004	/* Linux: bulk scan, cold buffers */
 
 /*
  * HAMMER locks
@@ -138,6 +143,11 @@ struct hammer_lock {
 	struct thread *locktd;
 };
 
+/*
+ * Linux: set in refs of a pinned structure, see hammer_pin().
+ */
+#define HAMMER_REFS_PINNED	0x40000000
+
 static __inline int
 hammer_islocked(struct hammer_lock *lock)
 {
@@ -162,7 +172,7 @@ hammer_islastref(struct hammer_lock *lock)
 static __inline int
 hammer_lock_excl_owned(struct hammer_lock *lock, thread_t td)
 {
-	if (lock->lockcount > 0 && 0)
+	if (lock->lockcount > 0 && lock->locktd == td)
 		return(1);
 	return(0);
 }
@@ -282,6 +292,7 @@ TAILQ_HEAD(hammer_node_list, hammer_node);
 
 struct hammer_inode {
 	RB_ENTRY(hammer_inode)	rb_node;
+	LIST_ENTRY(hammer_inode) hash_entry;	/* Linux: inos_hash */
 	hammer_inode_state_t	flush_state;
 	hammer_flush_group_t	flush_group;
 	TAILQ_ENTRY(hammer_inode) flush_entry;
@@ -464,6 +475,41 @@ RB_PROTOTYPE2(hammer_und_rb_tree, hammer_undo, rb_node,
 RB_PROTOTYPE2(hammer_res_rb_tree, hammer_reserve, rb_node,
 	      hammer_res_rb_compare, hammer_off_t);
 
+/*
+ * Linux: hashed lookup index over rb_bufs_root, rb_nods_root and
+ * rb_inos_root.
+ *
+ * A cache hit only takes the spinlock of its bucket and references the
+ * structure under it, so lookups on different cpus only contend when they
+ * hash to the same bucket.  Insertions and removals also hold tree_spin
+ * around the RB tree update; the trees are kept for the ordered scans
+ * (recovery, snapshot invalidation).  Lock order is tree_spin, then the
+ * bucket.
+ */
+#define HAMMER_HASH_SHIFT	9
+#define HAMMER_HASH_SIZE	(1 << HAMMER_HASH_SHIFT)
+
+struct hammer_hash_bucket {
+	spinlock_t		spin;
+	union {
+		LIST_HEAD(, hammer_buffer) bufs;
+		LIST_HEAD(, hammer_node) nods;
+		LIST_HEAD(, hammer_inode) inos;
+	} u;
+};
+
+struct hammer_hash {
+	spinlock_t		tree_spin;
+	struct hammer_hash_bucket *buckets;	/* HAMMER_HASH_SIZE */
+};
+
+static __inline struct hammer_hash_bucket *
+hammer_hash_bucket(struct hammer_hash *hash, u_int64_t key)
+{
+	key *= 0x9E3779B97F4A7C15ULL;
+	return(&hash->buckets[key >> (64 - HAMMER_HASH_SHIFT)]);
+}
+
 /*
  * IO management - embedded at the head of various in-memory structures
  *
@@ -492,6 +538,16 @@ struct worklist {
 TAILQ_HEAD(hammer_io_list, hammer_io);
 typedef struct hammer_io_list *hammer_io_list_t;
 
+/*
+ * Linux: the clean, unreferenced buffers of a mount are kept on one LRU
+ * list per partition of PFSs, lru_list[0] holding those of no single PFS.
+ * Buffers only bulk scans have used go on the cold list, which holds at
+ * most HAMMER_LRU_COLD_MAX of them.
+ */
+#define HAMMER_LRU_PARTS	8
+#define HAMMER_LRU_COLD		HAMMER_LRU_PARTS
+#define HAMMER_LRU_COLD_MAX	256
+
 struct hammer_io {
 	struct worklist		worklist;
 	struct hammer_lock	lock;
@@ -505,6 +561,12 @@ struct hammer_io {
 	int			bytes;	   /* buffer cache buffer size */
 	int			loading;   /* loading/unloading interlock */
 	int			modify_refs;
+	TAILQ_ENTRY(hammer_io)	lru_entry; /* Linux: hmp->lru_list[] */
+	int			lru_queued;
+	int			lru_ref;   /* Linux: referenced again */
+	int			lru_part;  /* Linux: lru_list[] queued on */
+	int			lru_pfs;   /* Linux: see hammer_io_lru_tag */
+	int			lru_cold;  /* Linux: only bulk scans used it */
 
 	u_int		modified : 1;	/* bp's data was modified */
 	u_int		released : 1;	/* bp released (w/ B_LOCKED set) */
@@ -555,6 +617,7 @@ typedef struct hammer_volume *hammer_volume_t;
 struct hammer_buffer {
 	struct hammer_io io;
 	RB_ENTRY(hammer_buffer) rb_node;
+	LIST_ENTRY(hammer_buffer) hash_entry;	/* Linux: bufs_hash */
 	void *ondisk;
 	hammer_off_t zoneX_offset;
 	hammer_off_t zone2_offset;
@@ -581,6 +644,7 @@ struct hammer_node {
 	struct hammer_lock	lock;		/* node-by-node lock */
 	TAILQ_ENTRY(hammer_node) entry;		/* per-buffer linkage */
 	RB_ENTRY(hammer_node)	rb_node;	/* per-cluster linkage */
+	LIST_ENTRY(hammer_node)	hash_entry;	/* Linux: nods_hash */
 	hammer_off_t		node_offset;	/* full offset spec */
 	struct hammer_mount	*hmp;
 	struct hammer_buffer	*buffer;	/* backing buffer */
@@ -686,6 +750,9 @@ struct hammer_flusher {
 	struct hammer_flusher_info_list ready_list;
 };
 
+struct hammerfs_stats;
+struct hammerfs_pfs_summary;
+
 /*
  * Internal hammer mount data structure
  */
@@ -699,6 +766,9 @@ struct hammer_mount {
 	struct hammer_res_rb_tree rb_resv_root;
 	struct hammer_buf_rb_tree rb_bufs_root;
 	struct hammer_pfs_rb_tree rb_pfsm_root;
+	struct hammer_hash	inos_hash;	/* Linux: lookup indexes */
+	struct hammer_hash	nods_hash;
+	struct hammer_hash	bufs_hash;
 	struct hammer_volume *rootvol;
 	struct hammer_base_elm root_btree_beg;
 	struct hammer_base_elm root_btree_end;
@@ -735,6 +805,10 @@ struct hammer_mount {
 	struct hammer_io_list alt_data_list;	/* dirty data buffers */
 	struct hammer_io_list meta_list;	/* dirty meta bufs    */
 	struct hammer_io_list lose_list;	/* loose buffers      */
+	struct hammer_io_list lru_list[HAMMER_LRU_PARTS + 1]; /* Linux */
+	int	count_lru_part[HAMMER_LRU_PARTS + 1];
+	spinlock_t	lru_spin;
+	int	count_lru;
 	int	locked_dirty_space;		/* meta/volu count    */
 	int	io_running_space;
 	int	objid_cache_count;
@@ -760,12 +834,20 @@ struct hammer_mount {
 	hammer_flush_group_t	next_flush_group;
 	TAILQ_HEAD(, hammer_objid_cache) objid_cache_list;
 	TAILQ_HEAD(, hammer_reclaim) reclaim_list;
+
+	struct hammerfs_stats	*stats;		/* per-cpu, see hammerfs_stats.h */
+	struct hammer_node	*rootnode;	/* pinned, see hammerfs_pin_root */
+	TAILQ_ENTRY(hammer_mount) shrink_entry;	/* see hammerfs_add_shrinker */
+	struct hammer_lock	pfs_summary_lock;
+	struct hammerfs_pfs_summary *pfs_summary; /* see hammerfs_pfs_summary */
+	int			pfs_count;
 };
 
 typedef struct hammer_mount	*hammer_mount_t;
 
 #define HAMMER_MOUNT_CRITICAL_ERROR	0x0001
 #define HAMMER_MOUNT_FLUSH_RECOVERY	0x0002
+#define HAMMER_MOUNT_SHRINKER		0x0004	/* Linux: see hammer_vfsops.c */
 
 struct hammer_sync_info {
 	int error;
@@ -907,6 +989,11 @@ int	hammer_lock_status(struct hammer_lock *lock);
 void	hammer_unlock(struct hammer_lock *lock);
 void	hammer_ref(struct hammer_lock *lock);
 void	hammer_unref(struct hammer_lock *lock);
+int	hammer_unref_notlast(struct hammer_lock *lock);
+void	hammer_pin(struct hammer_lock *lock);
+void	hammer_unpin(struct hammer_lock *lock);
+int	hammer_hash_init(struct hammer_hash *hash);
+void	hammer_hash_free(struct hammer_hash *hash);
 
 void	hammer_sync_lock_ex(hammer_transaction_t trans);
 void	hammer_sync_lock_sh(hammer_transaction_t trans);
@@ -991,6 +1078,8 @@ void	*hammer_bread_ext(struct hammer_mount *hmp, hammer_off_t off, int bytes,
 			int *errorp, struct hammer_buffer **bufferp);
 void	*hammer_bnew_ext(struct hammer_mount *hmp, hammer_off_t off, int bytes,
 			int *errorp, struct hammer_buffer **bufferp);
+void	*hammer_bread_bulk(struct hammer_mount *hmp, hammer_off_t off, int bytes,
+			int *errorp, struct hammer_buffer **bufferp);
 
 hammer_volume_t hammer_get_root_volume(hammer_mount_t hmp, int *errorp);
 
@@ -1010,6 +1099,7 @@ void		hammer_flush_buffer_nodes(hammer_buffer_t buffer);
 
 void		hammer_rel_volume(hammer_volume_t volume, int flush);
 void		hammer_rel_buffer(hammer_buffer_t buffer, int flush);
+int		hammer_reclaim_buffers(hammer_mount_t hmp, int count);
 
 int		hammer_vfs_export(struct mount *mp, int op,
 			const struct export_args *export);
@@ -1023,6 +1113,8 @@ void		hammer_delete_node(hammer_transaction_t trans,
 			hammer_node_t node);
 void		hammer_cache_node(hammer_node_cache_t cache,
 			hammer_node_t node);
+void		hammer_cache_node_copy(hammer_node_cache_t cache,
+			hammer_node_cache_t src);
 void		hammer_uncache_node(hammer_node_cache_t cache);
 void		hammer_flush_node(hammer_node_t node);
 
@@ -1145,6 +1237,9 @@ void hammer_io_write_interlock(hammer_io_t io);
 void hammer_io_done_interlock(hammer_io_t io);
 void hammer_io_clear_modify(struct hammer_io *io, int inval);
 void hammer_io_clear_modlist(struct hammer_io *io);
+void hammer_io_lru_remove(struct hammer_io *io);
+void hammer_io_lru_tag(struct hammer_io *io, u_int32_t localization);
+int hammer_io_lru_part(struct hammer_io *io);
 void hammer_io_flush_sync(hammer_mount_t hmp);
 
 void hammer_modify_volume(hammer_transaction_t trans, hammer_volume_t volume,
@@ -1,2 +1,39 @@
 #include "dfly_wrap.h"
+
+/*
+ * hammer_blockmap_lookup() is wrapped below to keep per-mount statistics.
+ */
+#define hammer_blockmap_lookup dfly_hammer_blockmap_lookup
 #include "dfly/vfs/hammer/hammer_blockmap.c"
+#undef hammer_blockmap_lookup
+
+#include "hammerfs_stats.h"
+
+hammer_off_t
+hammer_blockmap_lookup(hammer_mount_t hmp, hammer_off_t zone_offset,
+		       int *errorp)
+{
+	hammer_off_t result_offset;
+	u_int64_t start;
+	u_int64_t ns;
+
+	/*
+	 * Normal blockmaps are direct-mapped and translate without I/O,
+	 * only hammer_verify_zone reads the layer1/layer2 entries.  Nothing
+	 * is cached either way, so these are not hits and misses.
+	 */
+	if (hammer_verify_zone == 0)
+		hammerfs_stats_inc(hmp, blockmap_direct);
+	else
+		hammerfs_stats_inc(hmp, blockmap_verified);
+
+	start = hammerfs_clock();
+	result_offset = dfly_hammer_blockmap_lookup(hmp, zone_offset, errorp);
+	ns = hammerfs_lat_record(hmp, HAMMERFS_LAT_BLOCKMAP_LOOKUP, start);
+	trace_mark(hammer_blockmap_lookup,
+		   "zone_offset %016llx result %016llx error %d ns %llu",
+		   (unsigned long long)zone_offset,
+		   (unsigned long long)result_offset, *errorp,
+		   (unsigned long long)ns);
+	return(result_offset);
+}
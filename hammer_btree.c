@@ -1,2 +1,334 @@
 #include "dfly_wrap.h"
+
+/*
+ * The B-Tree descent entry points are wrapped below to keep per-mount
+ * latency statistics.  hammer_btree_first() and hammer_btree_last() call
+ * the unwrapped lookup, so they are timed as a whole.  As-of iterations
+ * are taken over as well, see hammer_btree_iterate().  Extraction is
+ * wrapped for the data buffers of bulk scans and to charge data buffers
+ * to their PFS, see hammer_btree_extract().
+ */
+#define hammer_btree_lookup dfly_hammer_btree_lookup
+#define hammer_btree_extract dfly_hammer_btree_extract
+#define hammer_btree_first dfly_hammer_btree_first
+#define hammer_btree_last dfly_hammer_btree_last
+#define hammer_btree_iterate dfly_hammer_btree_iterate
 #include "dfly/vfs/hammer/hammer_btree.c"
+#undef hammer_btree_lookup
+#undef hammer_btree_first
+#undef hammer_btree_last
+#undef hammer_btree_iterate
+#undef hammer_btree_extract
+
+int hammer_btree_iterate(hammer_cursor_t cursor);
+
+#include "hammerfs_stats.h"
+
+/*
+ * Charge the data buffer of the record the cursor extracted to the
+ * record's PFS, as hammer_load_node() does for node buffers.  Lookups
+ * extract by themselves, so this is also done after a descent.
+ */
+static __inline void
+hammerfs_btree_tag_data(hammer_cursor_t cursor)
+{
+	if (cursor->data && cursor->data_buffer && cursor->leaf) {
+		hammer_io_lru_tag(&cursor->data_buffer->io,
+				  cursor->leaf->base.localization);
+	}
+}
+
+/*
+ * A bulk scan reads record data through hammer_bread_bulk() first, the
+ * extraction then finds the buffer in cursor->data_buffer.
+ */
+int
+hammer_btree_extract(hammer_cursor_t cursor, int flags)
+{
+	hammer_node_ondisk_t node = cursor->node->ondisk;
+	hammer_btree_elm_t elm = &node->elms[cursor->index];
+	int error;
+
+	if ((cursor->trans->flags & HAMMER_TRANSF_BULK) &&
+	    (flags & HAMMER_CURSOR_GET_DATA) &&
+	    node->type == HAMMER_BTREE_TYPE_LEAF &&
+	    elm->leaf.base.btype == HAMMER_BTREE_TYPE_RECORD &&
+	    elm->leaf.data_offset) {
+		hammer_bread_bulk(cursor->trans->hmp, elm->leaf.data_offset,
+				  elm->leaf.data_len, &error,
+				  &cursor->data_buffer);
+		if (error)
+			return(error);
+	}
+	error = dfly_hammer_btree_extract(cursor, flags);
+	if (error == 0)
+		hammerfs_btree_tag_data(cursor);
+	return(error);
+}
+
+static __inline int
+hammerfs_btree_timed(hammer_cursor_t cursor, int (*func)(hammer_cursor_t))
+{
+	hammer_mount_t hmp = cursor->trans->hmp;
+	u_int64_t start;
+	u_int64_t ns;
+	int error;
+
+	start = hammerfs_clock();
+	error = func(cursor);
+	if (error == 0)
+		hammerfs_btree_tag_data(cursor);
+	ns = hammerfs_lat_record(hmp, HAMMERFS_LAT_BTREE_LOOKUP, start);
+	trace_mark(hammer_btree_lookup,
+		   "localization %08x obj_id %016llx key %016llx rec_type %d "
+		   "error %d ns %llu",
+		   cursor->key_beg.localization,
+		   (unsigned long long)cursor->key_beg.obj_id,
+		   (unsigned long long)cursor->key_beg.key,
+		   cursor->key_beg.rec_type, error, (unsigned long long)ns);
+	return(error);
+}
+
+int
+hammer_btree_lookup(hammer_cursor_t cursor)
+{
+	return(hammerfs_btree_timed(cursor, dfly_hammer_btree_lookup));
+}
+
+/*
+ * hammer_btree_first() as in hammer_btree.c, but iterating with the
+ * hammer_btree_iterate() below.
+ */
+static int
+hammerfs_btree_first(hammer_cursor_t cursor)
+{
+	int error;
+
+	error = dfly_hammer_btree_lookup(cursor);
+	if (error == ENOENT) {
+		cursor->flags &= ~HAMMER_CURSOR_ATEDISK;
+		error = hammer_btree_iterate(cursor);
+	}
+	cursor->flags |= HAMMER_CURSOR_ATEDISK;
+	return(error);
+}
+
+int
+hammer_btree_first(hammer_cursor_t cursor)
+{
+	return(hammerfs_btree_timed(cursor, hammerfs_btree_first));
+}
+
+int
+hammer_btree_last(hammer_cursor_t cursor)
+{
+	return(hammerfs_btree_timed(cursor, dfly_hammer_btree_last));
+}
+
+/*
+ * Return the index of the first element at or after index i of a leaf
+ * which is visible as-of the specified transaction id, or node->count if
+ * there is none in this node.
+ *
+ * Historical versions of a record share all key fields and are sorted
+ * by create_tid, and at most one of them can be visible at any given
+ * transaction id: the last one created at or before asof.  Each run of
+ * versions is therefore resolved with two binary searches instead of
+ * being iterated element by element (see also hammerread.c).
+ */
+static int
+hammer_btree_skip_history(hammer_node_ondisk_t node, int i, hammer_tid_t asof)
+{
+	hammer_base_elm_t base;
+	int b;
+	int s;
+	int j;
+	int m;
+
+	if (asof == 0)
+		asof = HAMMER_MAX_TID;
+
+	while (i < node->count) {
+		base = &node->elms[i].base;
+		if (hammer_btree_chkts(asof, base) == 0)
+			return(i);
+
+		/*
+		 * Locate the end of the run.  Comparisons which differ only
+		 * in create_tid return -1, 0 or +1.
+		 */
+		b = i;
+		s = node->count;
+		while (s - b > 1) {
+			j = b + (s - b) / 2;
+			if (hammer_btree_cmp(base, &node->elms[j].base) >= -1)
+				b = j;
+			else
+				s = j;
+		}
+
+		/*
+		 * An undeletable record (create_tid 0) sorts last in its
+		 * run, which breaks the ordering the search relies on.
+		 */
+		if (node->elms[s - 1].base.create_tid == 0) {
+			while (++i < s) {
+				if (hammer_btree_chkts(asof,
+						       &node->elms[i].base) == 0)
+					return(i);
+			}
+			continue;
+		}
+
+		/*
+		 * Locate the last version in [i, s) created at or before
+		 * asof.  If it is not visible no version in the run is.
+		 */
+		b = i - 1;
+		j = s;
+		while (j - b > 1) {
+			m = b + (j - b) / 2;
+			if (node->elms[m].base.create_tid <= asof)
+				b = m;
+			else
+				j = m;
+		}
+		if (b > i && hammer_btree_chkts(asof, &node->elms[b].base) == 0)
+			return(b);
+		i = s;
+	}
+	return(node->count);
+}
+
+/*
+ * Return non-zero if no record in the subtree of internal element elm can
+ * be visible as-of the specified transaction id.  The subtree's keys lie
+ * between elm[0] and elm[1].  If the two only differ in create_tid the
+ * subtree holds versions of a single record, all created at or after
+ * elm[0]'s create_tid.
+ *
+ * mirror_tid does not help here, it is an upper bound of the TIDs in the
+ * subtree.
+ */
+static __inline int
+hammer_btree_skip_subtree(hammer_btree_elm_t elm, hammer_tid_t asof)
+{
+	return(asof != 0 && elm[0].base.create_tid > asof &&
+	       hammer_btree_cmp(&elm[0].base, &elm[1].base) == -1);
+}
+
+/*
+ * As-of iteration.  On a filesystem with a lot of history the leaves are
+ * mostly old versions of records which hammer_btree_chkts() rejects one
+ * at a time.  Here each run of versions is skipped with a binary search
+ * and subtrees holding only versions created after asof are not entered.
+ * Mirroring and reblocking scans, and scans of the current state, are
+ * left to the original.
+ */
+int
+hammer_btree_iterate(hammer_cursor_t cursor)
+{
+	hammer_mount_t hmp = cursor->trans->hmp;
+	hammer_node_ondisk_t node;
+	hammer_btree_elm_t elm;
+	int error = 0;
+	int i;
+	int r;
+	int s;
+
+	if ((cursor->flags & HAMMER_CURSOR_ASOF) == 0 ||
+	    (cursor->flags & (HAMMER_CURSOR_MIRROR_FILTERED |
+			      HAMMER_CURSOR_REBLOCKING))) {
+		return(dfly_hammer_btree_iterate(cursor));
+	}
+
+	/*
+	 * Skip past the current record
+	 */
+	node = cursor->node->ondisk;
+	if (node == NULL)
+		return(ENOENT);
+	if (cursor->index < node->count &&
+	    (cursor->flags & HAMMER_CURSOR_ATEDISK)) {
+		++cursor->index;
+	}
+
+	/*
+	 * Loop until an element is found or we are done.
+	 */
+	for (;;) {
+		++hammer_stats_btree_iterations;
+		hammer_flusher_clean_loose_ios(hmp);
+
+		if (cursor->index == node->count) {
+			KKASSERT(cursor->parent == NULL || cursor->parent->ondisk->elms[cursor->parent_index].internal.subtree_offset == cursor->node->node_offset);
+			error = hammer_cursor_up(cursor);
+			if (error)
+				break;
+			/* reload stale pointer */
+			node = cursor->node->ondisk;
+			KKASSERT(cursor->index != node->count);
+			++cursor->index;
+			continue;
+		}
+
+		if (node->type == HAMMER_BTREE_TYPE_INTERNAL) {
+			elm = &node->elms[cursor->index];
+			r = hammer_btree_cmp(&cursor->key_end, &elm[0].base);
+			s = hammer_btree_cmp(&cursor->key_beg, &elm[1].base);
+			if (r < 0) {
+				error = ENOENT;
+				break;
+			}
+			if (r == 0 && (cursor->flags &
+				       HAMMER_CURSOR_END_INCLUSIVE) == 0) {
+				error = ENOENT;
+				break;
+			}
+			KKASSERT(s <= 0);
+			KKASSERT(elm->internal.subtree_offset != 0);
+
+			if (hammer_btree_skip_subtree(elm, cursor->asof)) {
+				hammerfs_stats_inc(hmp, asof_skipped_subtrees);
+				++cursor->index;
+				continue;
+			}
+
+			error = hammer_cursor_down(cursor);
+			if (error)
+				break;
+			KKASSERT(cursor->index == 0);
+			/* reload stale pointer */
+			node = cursor->node->ondisk;
+			continue;
+		}
+
+		/*
+		 * Leaf.  Invisible versions beyond key_end may be skipped
+		 * as well, the scan ends at the next element either way.
+		 */
+		i = hammer_btree_skip_history(node, cursor->index,
+					      cursor->asof);
+		if (i != cursor->index) {
+			hammerfs_stats_add(hmp, asof_skipped_elms,
+					   i - cursor->index);
+			cursor->index = i;
+			continue;
+		}
+		elm = &node->elms[cursor->index];
+		r = hammer_btree_cmp(&cursor->key_end, &elm->base);
+		if (r < 0) {
+			error = ENOENT;
+			break;
+		}
+		if (r == 0 &&
+		    (cursor->flags & HAMMER_CURSOR_END_INCLUSIVE) == 0) {
+			error = ENOENT;
+			break;
+		}
+		if (elm->leaf.base.btype != HAMMER_BTREE_TYPE_RECORD)
+			error = EINVAL;
+		break;
+	}
+	return(error);
+}
@@ -36,6 +36,7 @@
 
 #include "dfly_wrap.h"
 #include "vfs/hammer/hammer.h"
+#include "hammerfs_stats.h"
 #include <vm/vm_extern.h>
 #include <sys/buf.h>
 #include <sys/buf2.h>
@@ -156,6 +157,58 @@ RB_GENERATE_XLOOKUP(hammer_ino_rb_tree, INFO, hammer_inode, rb_node,
 RB_GENERATE2(hammer_pfs_rb_tree, hammer_pseudofs_inmem, rb_node,
              hammer_pfs_rb_compare, u_int32_t, localization);
 
+/*
+ * Linux: lookup index for inodes, see struct hammer_hash and the buffer
+ * and node versions in hammer_ondisk.c.  The asof is part of the hash, so
+ * the inodes of each snapshot view are spread like those of the live
+ * filesystem instead of piling up in the buckets of their objects.
+ */
+static __inline struct hammer_hash_bucket *
+hammer_ino_hash_bucket(hammer_mount_t hmp, int64_t obj_id,
+		       hammer_tid_t asof, u_int32_t localization)
+{
+	return(hammer_hash_bucket(&hmp->inos_hash, (u_int64_t)obj_id ^
+				  ((u_int64_t)localization << 32) ^ asof));
+}
+
+static hammer_inode_t
+hammer_ino_hash_ref(hammer_mount_t hmp, hammer_inode_info_t iinfo)
+{
+	struct hammer_hash_bucket *bucket;
+	hammer_inode_t ip;
+
+	bucket = hammer_ino_hash_bucket(hmp, iinfo->obj_id, iinfo->obj_asof,
+					iinfo->obj_localization);
+	spin_lock(&bucket->spin);
+	LIST_FOREACH(ip, &bucket->u.inos, hash_entry) {
+		if (hammer_inode_info_cmp(iinfo, ip) == 0) {
+			hammer_ref(&ip->lock);
+			break;
+		}
+	}
+	spin_unlock(&bucket->spin);
+	return(ip);
+}
+
+static int
+hammer_ino_hash_insert(hammer_mount_t hmp, hammer_inode_t ip)
+{
+	struct hammer_hash_bucket *bucket;
+
+	spin_lock(&hmp->inos_hash.tree_spin);
+	if (RB_INSERT(hammer_ino_rb_tree, &hmp->rb_inos_root, ip)) {
+		spin_unlock(&hmp->inos_hash.tree_spin);
+		return(EEXIST);
+	}
+	bucket = hammer_ino_hash_bucket(hmp, ip->obj_id, ip->obj_asof,
+					ip->obj_localization);
+	spin_lock(&bucket->spin);
+	LIST_INSERT_HEAD(&bucket->u.inos, ip, hash_entry);
+	spin_unlock(&bucket->spin);
+	spin_unlock(&hmp->inos_hash.tree_spin);
+	return(0);
+}
+
 /*
  * The kernel is not actively referencing this vnode but is still holding
  * it cached.
@@ -380,21 +433,22 @@ hammer_get_inode(hammer_transaction_t trans, hammer_inode_t dip,
 	iinfo.obj_asof = asof;
 	iinfo.obj_localization = localization;
 loop:
-	ip = hammer_ino_rb_tree_RB_LOOKUP_INFO(&hmp->rb_inos_root, &iinfo);
+	ip = hammer_ino_hash_ref(hmp, &iinfo);
 	if (ip) {
 #if 0
 		if (ip->vp == NULL)
 			trans->flags |= HAMMER_TRANSF_NEWINODE;
 #endif
-		hammer_ref(&ip->lock);
+		hammerfs_stats_inc(hmp, inode_hits);
 		*errorp = 0;
 		return(ip);
 	}
+	hammerfs_stats_inc(hmp, inode_misses);
 
 	/*
 	 * Allocate a new inode structure and deal with races later.
 	 */
-    ip = kzalloc(sizeof(struct hammer_inode), GFP_KERNEL);
+	ip = kmalloc(sizeof(*ip), hmp->m_inodes, M_WAITOK|M_ZERO);
 	++hammer_count_inodes;
 	++hmp->count_inodes;
 	ip->obj_id = obj_id;
@@ -454,10 +508,14 @@ retry:
 		 *
 		 * cache[1] tries to cache the location of the object data.
 		 * The assumption is that it is near the directory data.
+		 *
+		 * Linux: the node dip->cache[1] holds is not referenced and
+		 * may be flushed meanwhile, it is copied under the cache
+		 * spinlock.
 		 */
 		hammer_cache_node(&ip->cache[0], cursor.node);
-		if (dip && dip->cache[1].node)
-			hammer_cache_node(&ip->cache[1], dip->cache[1].node);
+		if (dip)
+			hammer_cache_node_copy(&ip->cache[1], &dip->cache[1]);
 
 		/*
 		 * The file should not contain any data past the file size
@@ -489,7 +547,7 @@ retry:
 	 * another instantiation/lookup the insertion will fail.
 	 */
 	if (*errorp == 0) {
-		if (RB_INSERT(hammer_ino_rb_tree, &hmp->rb_inos_root, ip)) {
+		if (hammer_ino_hash_insert(hmp, ip)) {
 			hammer_free_inode(ip);
 			hammer_done_cursor(&cursor);
 			goto loop;
@@ -675,7 +733,7 @@ hammer_create_inode(hammer_transaction_t trans, struct vattr *vap,
 	if (error) {
 		hammer_free_inode(ip);
 		ip = NULL;
-	} else if (RB_INSERT(hammer_ino_rb_tree, &hmp->rb_inos_root, ip)) {
+	} else if (hammer_ino_hash_insert(hmp, ip)) {
 		panic("hammer_create_inode: duplicate obj_id %llx", ip->obj_id);
 		/* not reached */
 		hammer_free_inode(ip);
@@ -751,7 +809,7 @@ retry:
 		ip = NULL;
 	}
 
-	pfsm = kzalloc(sizeof(*pfsm), GFP_KERNEL);
+	pfsm = kmalloc(sizeof(*pfsm), hmp->m_misc, M_WAITOK|M_ZERO);
 	pfsm->localization = localization;
 	pfsm->pfsd.unique_uuid = trans->rootvol->ondisk->vol_fsid;
 	pfsm->pfsd.shared_uuid = pfsm->pfsd.unique_uuid;
@@ -1218,9 +1276,11 @@ retry:
 void
 hammer_rel_inode(struct hammer_inode *ip, int flush)
 {
-// since all the lock handling and reference counting has been
-// replaced by no-ops, better make this a no-op, too (at least for
-// the time being)
+	/*
+	 * Linux: inodes are not unloaded yet, the last reference stays
+	 * with the inode until the port grows a reclaim path.
+	 */
+	hammer_unref_notlast(&ip->lock);
 #if 0
 	/*hammer_mount_t hmp = ip->hmp;*/
 
@@ -51,6 +51,7 @@
 #include "dfly_wrap.h"
 
 #include <vfs/hammer/hammer.h>
+#include "hammerfs_stats.h"
 #include <sys/fcntl.h>
 #include <sys/nlookup.h>
 #include <sys/buf.h>
@@ -64,6 +65,7 @@ static void hammer_io_direct_read_complete(struct bio *nbio);
 static void hammer_io_direct_write_complete(struct bio *nbio);
 static int hammer_io_direct_uncache_callback(hammer_inode_t ip, void *data);
 static void hammer_io_set_modlist(struct hammer_io *io);
+static void hammer_io_lru_add(struct hammer_io *io);
 static void hammer_io_flush_mark(hammer_volume_t volume);
 static void hammer_io_flush_sync_done(struct bio *bio);
 
@@ -95,7 +97,25 @@ hammer_io_init(hammer_io_t io, hammer_volume_t volume, enum hammer_io_type type)
 static void
 hammer_io_disassociate(hammer_io_structure_t iou)
 {
-    panic("hammer_io_disassociate");
+	/*
+	 * Linux: there is no buffer cache to hand the bp back to, it is
+	 * simply detached and the caller frees it with dfly_brelse().
+	 */
+	KKASSERT(iou->io.released);
+	KKASSERT(iou->io.modified == 0);
+	iou->io.bp = NULL;
+	iou->io.reclaim = 0;
+
+	switch(iou->io.type) {
+	case HAMMER_STRUCTURE_VOLUME:
+		iou->volume.ondisk = NULL;
+		break;
+	case HAMMER_STRUCTURE_DATA_BUFFER:
+	case HAMMER_STRUCTURE_META_BUFFER:
+	case HAMMER_STRUCTURE_UNDO_BUFFER:
+		iou->buffer.ondisk = NULL;
+		break;
+	}
 #if 0
 	struct buf *bp = iou->io.bp;
 
@@ -192,12 +212,25 @@ int
 hammer_io_read(struct super_block *sb, struct hammer_io *io, hammer_off_t limit)
 {
 	struct buf *bp;
+	u_int64_t start;
+	u_int64_t ns;
 	int   error;
 
 	if ((bp = io->bp) == NULL) {
 		hammer_count_io_running_read += io->bytes;
-	    bread(sb, io->offset, io->bytes, &io->bp);
+		start = hammerfs_clock();
+		error = -bread(sb, io->offset, io->bytes, &io->bp);
+		if (error && io->bp) {
+			dfly_brelse(io->bp);
+			io->bp = NULL;
+		}
+		ns = hammerfs_lat_record(io->hmp, HAMMERFS_LAT_IO_READ, start);
+		trace_mark(hammer_io_read, "offset %lld bytes %d ns %llu",
+			   (long long)io->offset, io->bytes,
+			   (unsigned long long)ns);
 		hammer_stats_disk_read += io->bytes;
+		hammerfs_stats_inc(io->hmp, disk_reads);
+		hammerfs_stats_add(io->hmp, disk_read_bytes, io->bytes);
 		hammer_count_io_running_read -= io->bytes;
 	} else {
 		error = 0;
@@ -311,7 +344,26 @@ hammer_io_inval(hammer_volume_t volume, hammer_off_t zone2_offset)
 struct buf *
 hammer_io_release(struct hammer_io *io, int flush)
 {
-    panic("hammer_io_release");
+	union hammer_io_structure *iou = (void *)io;
+	struct buf *bp;
+
+	/*
+	 * Linux: the port never modifies a buffer and the kernel has no
+	 * way to take a bp back, so a clean bp stays associated with the
+	 * io (and ondisk valid) until HAMMER flushes or reclaims it.  Only
+	 * a disassociated bp is returned for disposal.
+	 */
+	if ((bp = io->bp) == NULL)
+		return(NULL);
+	KKASSERT(io->modified == 0 && io->running == 0);
+	io->released = 1;
+	if (flush || io->reclaim) {
+		hammer_io_disassociate(iou);
+		return(bp);
+	}
+	if (io->type != HAMMER_STRUCTURE_VOLUME && io->lock.refs == 1)
+		hammer_io_lru_add(io);
+	return(NULL);
 #if 0
 	union hammer_io_structure *iou = (void *)io;
 	struct buf *bp;
@@ -447,7 +499,6 @@ hammer_io_release(struct hammer_io *io, int flush)
 	}
 	return(bp);
 #endif
-    return 0;
 }
 
 /*
@@ -755,8 +806,6 @@ restart:
 void
 hammer_io_clear_modlist(struct hammer_io *io)
 {
-    panic("hammer_io_clear_modlist");
-#if 0
 	KKASSERT(io->modified == 0);
 	if (io->mod_list) {
 		crit_enter();	/* biodone race against list */
@@ -765,7 +814,86 @@ hammer_io_clear_modlist(struct hammer_io *io)
 		io->mod_list = NULL;
 		crit_exit();
 	}
-#endif
+}
+
+/*
+ * Linux: the io is losing its last reference but keeps its clean bp, see
+ * hammer_io_release().  hmp->lru_list[] holds such ios oldest first for
+ * hammer_reclaim_buffers(), on the list of the io's PFS partition or, if
+ * only bulk scans have used it, on the cold list.  An io stays on its
+ * list when it is referenced again so that the lookup paths never take
+ * lru_spin, lru_ref gives it a second chance instead.
+ */
+static void
+hammer_io_lru_add(struct hammer_io *io)
+{
+	struct hammer_mount *hmp = io->hmp;
+	int part;
+
+	if (io->lru_queued) {
+		io->lru_ref = 1;
+		return;
+	}
+	part = hammer_io_lru_part(io);
+	spin_lock(&hmp->lru_spin);
+	if (io->lru_queued == 0) {
+		TAILQ_INSERT_TAIL(&hmp->lru_list[part], io, lru_entry);
+		io->lru_queued = 1;
+		io->lru_part = part;
+		++hmp->count_lru_part[part];
+		++hmp->count_lru;
+	}
+	spin_unlock(&hmp->lru_spin);
+}
+
+/*
+ * Linux: take the io off hmp->lru_list[], called before the governing
+ * hammer_buffer is destroyed.
+ */
+void
+hammer_io_lru_remove(struct hammer_io *io)
+{
+	struct hammer_mount *hmp = io->hmp;
+
+	spin_lock(&hmp->lru_spin);
+	if (io->lru_queued) {
+		TAILQ_REMOVE(&hmp->lru_list[io->lru_part], io, lru_entry);
+		io->lru_queued = 0;
+		--hmp->count_lru_part[io->lru_part];
+		--hmp->count_lru;
+	}
+	spin_unlock(&hmp->lru_spin);
+}
+
+/*
+ * Linux: the lru_list[] an io goes on.
+ */
+int
+hammer_io_lru_part(struct hammer_io *io)
+{
+	if (io->lru_cold)
+		return(HAMMER_LRU_COLD);
+	if (io->lru_pfs > 0)
+		return(1 + (io->lru_pfs - 1) % (HAMMER_LRU_PARTS - 1));
+	return(0);
+}
+
+/*
+ * Linux: note that the io holds B-Tree elements or record data of the
+ * PFS of localization.  lru_pfs is the PFS id + 1 while all of it came
+ * from one PFS, -1 once it is shared and 0 before it is known.  An io on
+ * an lru list moves to the partition of its tag the next time it is
+ * queued.
+ */
+void
+hammer_io_lru_tag(struct hammer_io *io, u_int32_t localization)
+{
+	int pfs = (localization >> 16) + 1;
+
+	if (io->lru_pfs == 0)
+		io->lru_pfs = pfs;
+	else if (io->lru_pfs != pfs)
+		io->lru_pfs = -1;
 }
 
 static void
@@ -1,2 +1,183 @@
 #include "dfly_wrap.h"
 #include "dfly/vfs/hammer/hammer_ioctl.c"
+
+#include "hammerfs.h"
+
+/*
+ * Linux: HAMMERIOC_GETHISTORY as called from hammerfs_ioctl(), which
+ * copies hist in and out.  History is read-only, so the transaction
+ * is a simple one.
+ */
+int
+hammerfs_ioc_gethistory(hammer_inode_t ip, struct hammer_ioc_history *hist)
+{
+	struct hammer_transaction trans;
+	int error;
+
+	hammer_simple_transaction(&trans, ip->hmp);
+	error = hammer_ioc_gethistory(&trans, ip, hist);
+	hammer_done_transaction(&trans);
+	return(error);
+}
+
+/*
+ * Linux: start streaming the history described by hc->hist (head.flags,
+ * beg_tid, end_tid, key and nxt_key, as for HAMMERIOC_GETHISTORY) over
+ * the same key range hammer_ioc_gethistory() searches.
+ */
+int
+hammerfs_history_start(hammer_inode_t ip, struct hammerfs_history_cursor *hc)
+{
+	struct hammer_ioc_history *hist = &hc->hist;
+	hammer_base_elm_t beg = &hc->next;
+	hammer_base_elm_t end = &hc->key_end;
+
+	hammer_uncache_node(&hc->cache);
+	hc->eof = 1;
+
+	if (hist->beg_tid > hist->end_tid)
+		return(EINVAL);
+	if (hist->head.flags & HAMMER_IOC_HISTORY_ATKEY) {
+		if (hist->key > hist->nxt_key)
+			return(EINVAL);
+	}
+
+	hist->obj_id = ip->obj_id;
+	hist->count = 0;
+	hist->nxt_tid = hist->end_tid;
+	hist->head.flags &= ~HAMMER_IOC_HISTORY_NEXT_TID;
+	hist->head.flags &= ~HAMMER_IOC_HISTORY_NEXT_KEY;
+	hist->head.flags &= ~HAMMER_IOC_HISTORY_EOF;
+	hist->head.flags &= ~HAMMER_IOC_HISTORY_UNSYNCED;
+	if ((ip->flags & HAMMER_INODE_MODMASK) &
+	    ~(HAMMER_INODE_ATIME | HAMMER_INODE_MTIME)) {
+		hist->head.flags |= HAMMER_IOC_HISTORY_UNSYNCED;
+	}
+
+	bzero(beg, sizeof(*beg));
+	bzero(end, sizeof(*end));
+	beg->obj_id = hist->obj_id;
+	beg->create_tid = hist->beg_tid;
+	if (beg->create_tid == HAMMER_MIN_TID)
+		beg->create_tid = 1;
+	end->obj_id = hist->obj_id;
+	end->create_tid = hist->end_tid;
+
+	if (hist->head.flags & HAMMER_IOC_HISTORY_ATKEY) {
+		beg->key = hist->key;
+		end->key = HAMMER_MAX_KEY;
+		beg->localization = ip->obj_localization +
+				    HAMMER_LOCALIZE_MISC;
+		end->localization = ip->obj_localization +
+				    HAMMER_LOCALIZE_MISC;
+
+		switch(ip->ino_data.obj_type) {
+		case HAMMER_OBJTYPE_REGFILE:
+			++beg->key;
+			beg->rec_type = HAMMER_RECTYPE_DATA;
+			break;
+		case HAMMER_OBJTYPE_DIRECTORY:
+			beg->rec_type = HAMMER_RECTYPE_DIRENTRY;
+			break;
+		case HAMMER_OBJTYPE_DBFILE:
+			beg->rec_type = HAMMER_RECTYPE_DB;
+			break;
+		default:
+			return(EINVAL);
+		}
+		end->rec_type = beg->rec_type;
+	} else {
+		beg->rec_type = HAMMER_RECTYPE_INODE;
+		end->rec_type = HAMMER_RECTYPE_INODE;
+		beg->localization = ip->obj_localization +
+				    HAMMER_LOCALIZE_INODE;
+		end->localization = ip->obj_localization +
+				    HAMMER_LOCALIZE_INODE;
+	}
+	hc->eof = 0;
+	return(0);
+}
+
+/*
+ * Linux: return up to max (at least 2) more transaction ids of the
+ * history started by hammerfs_history_start() in ary.  *countp is 0 once
+ * the history is exhausted, with HAMMER_IOC_HISTORY_EOF or _NEXT_KEY set
+ * in hc->hist.head.flags.
+ *
+ * Both tids of an element are returned by the same call, so a call stops
+ * at the first element which might not fit and the next one starts over
+ * at it.  That lookup begins at the leaf the previous call ended in
+ * (hc->cache), it does not descend from the root again.  add_history()
+ * keeps the last tid returned in hist_ary[0] to drop duplicates.
+ */
+int
+hammerfs_history_read(hammer_inode_t ip, struct hammerfs_history_cursor *hc,
+		      struct hammer_ioc_hist_entry *ary, int max, int *countp)
+{
+	struct hammer_ioc_history *hist = &hc->hist;
+	struct hammer_transaction trans;
+	struct hammer_cursor cursor;
+	hammer_btree_elm_t elm;
+	int count;
+	int error;
+	int i;
+
+	*countp = 0;
+	if (max < 2)
+		return(EINVAL);
+	if (hc->eof)
+		return(0);
+
+	hammer_simple_transaction(&trans, ip->hmp);
+	error = hammer_init_cursor(&trans, &cursor, &hc->cache, NULL);
+	if (error)
+		goto done;
+	cursor.key_beg = hc->next;
+	cursor.key_end = hc->key_end;
+	cursor.flags |= HAMMER_CURSOR_END_EXCLUSIVE;
+
+	count = 0;
+	error = hammer_btree_first(&cursor);
+	while (error == 0) {
+		elm = &cursor.node->ondisk->elms[cursor.index];
+		if (max - count < 2) {
+			hc->next = elm->base;
+			break;
+		}
+
+		i = hist->count;
+		add_history(ip, hist, elm);
+		while (i < hist->count)
+			ary[count++] = hist->hist_ary[i++];
+		if (hist->count) {
+			hist->hist_ary[0] = hist->hist_ary[hist->count - 1];
+			hist->count = 1;
+		}
+		if (hist->head.flags & HAMMER_IOC_HISTORY_NEXT_KEY) {
+			hc->eof = 1;
+			break;
+		}
+		error = hammer_btree_iterate(&cursor);
+	}
+	if (error == ENOENT) {
+		hist->head.flags |= HAMMER_IOC_HISTORY_EOF;
+		hc->eof = 1;
+		error = 0;
+	}
+	if (error == 0)
+		*countp = count;
+	if (hc->eof)
+		hammer_uncache_node(&hc->cache);
+	else
+		hammer_cache_node(&hc->cache, cursor.node);
+done:
+	hammer_done_cursor(&cursor);
+	hammer_done_transaction(&trans);
+	return(error);
+}
+
+void
+hammerfs_history_done(struct hammerfs_history_cursor *hc)
+{
+	hammer_uncache_node(&hc->cache);
+}
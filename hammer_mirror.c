@@ -1,2 +1,460 @@
 #include "dfly_wrap.h"
 #include "dfly/vfs/hammer/hammer_mirror.c"
+
+#include "hammerfs.h"
+
+/*
+ * Linux: HAMMERIOC_MIRROR_READ as called from hammerfs_ioctl(), which
+ * copies mirror in and out.  The records go to mirror->ubuf through
+ * copyout().  Mirror-reads are bulk scans (HAMMER_TRANSF_BULK), the
+ * buffers they load are not kept.
+ */
+int
+hammerfs_ioc_mirror_read(hammer_inode_t ip, struct hammer_ioc_mirror_rw *mirror)
+{
+	struct hammer_transaction trans;
+	int error;
+
+	hammer_simple_transaction(&trans, ip->hmp);
+	trans.flags |= HAMMER_TRANSF_BULK;
+	error = hammer_ioc_mirror_read(&trans, ip, mirror);
+	hammer_done_transaction(&trans);
+	return(error);
+}
+
+static const char hammerfs_mirror_pad[HAMMER_HEAD_ALIGN];
+
+/*
+ * Linux: pass one mrecord to the sink, header, data and the padding to
+ * the next HAMMER_HEAD_ALIGN boundary.
+ */
+static int
+hammerfs_mirror_add(struct hammerfs_mirror_sink *sink, const void *head,
+		    int head_len, const void *data, int data_len)
+{
+	int bytes = head_len + data_len;
+	int error;
+
+	error = sink->add(sink, head, head_len, 0);
+	if (error == 0 && data_len)
+		error = sink->add(sink, data, data_len, 1);
+	if (error == 0 && HAMMER_HEAD_DOALIGN(bytes) != bytes) {
+		error = sink->add(sink, hammerfs_mirror_pad,
+				  HAMMER_HEAD_DOALIGN(bytes) - bytes, 0);
+	}
+	return(error);
+}
+
+/*
+ * Linux: hammer_ioc_mirror_read() writing the mrecord stream to a sink
+ * instead of mirror->ubuf, which is not used.  mirror->size still bounds
+ * the bytes returned by one call and mirror->key_cur is where the next
+ * call has to start.
+ *
+ * The records carry no rec_crc if the sink covers them with a CRC of
+ * its own (sink->nocrc).
+ *
+ * Whenever the sink asks for it (sink->full) the scan stops at a record
+ * boundary, releases its cursor and flushes the sink, then picks up at
+ * mirror->key_cur from the B-Tree node it stopped in.  The sink never
+ * sees a flush with B-Tree locks held, and data passed to add() only
+ * stays valid until then.
+ */
+int
+hammerfs_mirror_stream(hammer_inode_t ip, struct hammer_ioc_mirror_rw *mirror,
+		       struct hammerfs_mirror_sink *sink)
+{
+	struct hammer_transaction trans;
+	struct hammer_node_cache cache;
+	struct hammer_cmirror cmirror;
+	struct hammer_cursor cursor;
+	union hammer_ioc_mrecord_any mrec;
+	hammer_btree_leaf_elm_t elm;
+	const int crc_start = HAMMER_MREC_CRCOFF;
+	int error;
+	int error2;
+	int data_len;
+	int bytes;
+	int eatdisk;
+	int done;
+	u_int32_t localization;
+	u_int32_t rec_crc;
+
+	localization = (u_int32_t)mirror->pfs_id << 16;
+
+	if ((mirror->key_beg.localization | mirror->key_end.localization) &
+	    HAMMER_LOCALIZE_PSEUDOFS_MASK) {
+		return(EINVAL);
+	}
+	if (hammer_btree_cmp(&mirror->key_beg, &mirror->key_end) > 0)
+		return(EINVAL);
+	if (mirror->size < 0)
+		return(EINVAL);
+
+	mirror->key_cur = mirror->key_beg;
+	mirror->key_cur.localization &= HAMMER_LOCALIZE_MASK;
+	mirror->key_cur.localization += localization;
+	bzero(&mrec, sizeof(mrec));
+	bzero(&cmirror, sizeof(cmirror));
+	bzero(&cache, sizeof(cache));
+	sink->full = 0;
+
+	hammer_simple_transaction(&trans, ip->hmp);
+	trans.flags |= HAMMER_TRANSF_BULK;
+	do {
+		error = hammer_init_cursor(&trans, &cursor, &cache, NULL);
+		if (error) {
+			hammer_done_cursor(&cursor);
+			break;
+		}
+		cursor.key_beg = mirror->key_cur;
+		cursor.key_end = mirror->key_end;
+		cursor.key_end.localization &= HAMMER_LOCALIZE_MASK;
+		cursor.key_end.localization += localization;
+
+		cursor.flags |= HAMMER_CURSOR_END_INCLUSIVE;
+		cursor.flags |= HAMMER_CURSOR_BACKEND;
+		cursor.flags |= HAMMER_CURSOR_MIRROR_FILTERED;
+		cursor.cmirror = &cmirror;
+		cmirror.mirror_tid = mirror->tid_beg;
+
+		done = 1;
+		error = hammer_btree_first(&cursor);
+		while (error == 0) {
+			error = hammer_signal_check(trans.hmp);
+			if (error)
+				break;
+
+			/*
+			 * key_cur is the element being looked at until it
+			 * has been passed to the sink.
+			 */
+			if (cursor.node->ondisk->type ==
+			    HAMMER_BTREE_TYPE_INTERNAL) {
+				mirror->key_cur = cmirror.skip_beg;
+				bytes = sizeof(mrec.skip);
+				data_len = 0;
+			} else {
+				elm = &cursor.node->ondisk->elms[cursor.index].leaf;
+				mirror->key_cur = elm->base;
+				if (elm->base.create_tid < mirror->tid_beg ||
+				    elm->base.create_tid > mirror->tid_end) {
+					data_len = -1;
+					bytes = sizeof(mrec.rec);
+				} else {
+					data_len = (elm->data_offset) ?
+						   elm->data_len : 0;
+					bytes = sizeof(mrec.rec) + data_len;
+				}
+			}
+			if (mirror->count + HAMMER_HEAD_DOALIGN(bytes) >
+			    mirror->size) {
+				break;
+			}
+			if (sink->full) {
+				done = 0;
+				break;
+			}
+
+			mrec.head.signature = HAMMER_IOC_MIRROR_SIGNATURE;
+			mrec.head.rec_size = bytes;
+			if (cursor.node->ondisk->type ==
+			    HAMMER_BTREE_TYPE_INTERNAL) {
+				mrec.head.type = HAMMER_MREC_TYPE_SKIP;
+				mrec.skip.skip_beg = cmirror.skip_beg;
+				mrec.skip.skip_end = cmirror.skip_end;
+				if (sink->nocrc == 0) {
+					mrec.head.rec_crc =
+					    crc32(&mrec.head.rec_size,
+						  bytes - crc_start);
+				}
+				error = hammerfs_mirror_add(sink, &mrec, bytes,
+							    NULL, 0);
+				eatdisk = 0;
+			} else if (data_len < 0) {
+				mrec.head.type = HAMMER_MREC_TYPE_PASS;
+				mrec.rec.leaf = *elm;
+				if (sink->nocrc == 0) {
+					mrec.head.rec_crc =
+					    crc32(&mrec.head.rec_size,
+						  bytes - crc_start);
+				}
+				error = hammerfs_mirror_add(sink, &mrec, bytes,
+							    NULL, 0);
+				eatdisk = 1;
+			} else {
+				if (data_len) {
+					error = hammer_btree_extract(&cursor,
+						    HAMMER_CURSOR_GET_DATA);
+					if (error)
+						break;
+				}
+				mrec.head.type = HAMMER_MREC_TYPE_REC;
+				mrec.rec.leaf = *elm;
+				if (elm->base.delete_tid > mirror->tid_end)
+					mrec.rec.leaf.base.delete_tid = 0;
+				if (sink->nocrc == 0) {
+					rec_crc = crc32(&mrec.head.rec_size,
+						sizeof(mrec.rec) - crc_start);
+					if (data_len) {
+						rec_crc = crc32_ext(cursor.data,
+							    data_len, rec_crc);
+					}
+					mrec.head.rec_crc = rec_crc;
+				}
+				error = hammerfs_mirror_add(sink, &mrec,
+							    sizeof(mrec.rec),
+							    cursor.data,
+							    data_len);
+				eatdisk = 1;
+			}
+			if (error)
+				break;
+
+			mirror->count += HAMMER_HEAD_DOALIGN(bytes);
+			if (eatdisk)
+				cursor.flags |= HAMMER_CURSOR_ATEDISK;
+			else
+				cursor.flags &= ~HAMMER_CURSOR_ATEDISK;
+			error = hammer_btree_iterate(&cursor);
+		}
+		if (error == ENOENT) {
+			mirror->key_cur = mirror->key_end;
+			error = 0;
+		}
+		if (error == EDEADLK) {
+			done = 0;
+			error = 0;
+		}
+		if (done == 0)
+			hammer_cache_node(&cache, cursor.node);
+		hammer_done_cursor(&cursor);
+
+		/*
+		 * Whatever went to the sink is accounted for in key_cur
+		 * and count, so it is flushed even if the scan was
+		 * interrupted.
+		 */
+		if (error == 0 || error == EINTR) {
+			error2 = sink->flush(sink);
+			if (error2)
+				error = error2;
+		}
+	} while (error == 0 && done == 0);
+	hammer_uncache_node(&cache);
+	hammer_done_transaction(&trans);
+
+	if (error == EINTR) {
+		mirror->head.flags |= HAMMER_IOC_HEAD_INTR;
+		error = 0;
+	}
+	mirror->key_cur.localization &= HAMMER_LOCALIZE_MASK;
+	return(error);
+}
+
+/*
+ * Linux: the largest base which sorts before *base, for the end of the
+ * range to the left of a split point.  A create_tid of 0 sorts last.
+ */
+static int
+hammerfs_base_pred(hammer_base_elm_t base)
+{
+	if (base->create_tid == 0) {
+		base->create_tid = HAMMER_MAX_TID;
+		return(0);
+	}
+	if (base->create_tid > 1) {
+		--base->create_tid;
+		return(0);
+	}
+	return(EINVAL);
+}
+
+/*
+ * Linux: one pass over the internal nodes level[] of the split below.
+ * Subtrees intersecting key_beg..key_end are counted in *nsubp and, if
+ * next is not NULL, their offsets stored there.  Separators inside the
+ * range are numbered from 0, and with ranges not NULL separator
+ * i * nseps / count becomes the start of range i (and, less one, the end
+ * of range i - 1) for i = 1..count-1.  *leavesp is set if the subtrees
+ * are leaves.
+ */
+static int
+hammerfs_split_level(hammer_transaction_t trans, hammer_off_t *level,
+		     int nlevel, hammer_base_elm_t key_beg,
+		     hammer_base_elm_t key_end, hammer_off_t *next,
+		     int *nsubp, int *leavesp,
+		     struct hammerfs_mirror_range *ranges, int nseps,
+		     int count, int *nrangesp)
+{
+	hammer_btree_internal_elm_t elm;
+	struct hammer_base_elm pred;
+	hammer_node_t node;
+	int error = 0;
+	int nsub = 0;
+	int sep = 0;
+	int r = 1;
+	int i;
+	int j;
+
+	for (i = 0; i < nlevel && error == 0; ++i) {
+		node = hammer_get_node(trans, level[i], 0, &error);
+		if (error)
+			break;
+		hammer_lock_sh(&node->lock);
+		if (node->ondisk->type != HAMMER_BTREE_TYPE_INTERNAL) {
+			*leavesp = 1;
+			hammer_unlock(&node->lock);
+			hammer_rel_node(node);
+			continue;
+		}
+		for (j = 0; j < node->ondisk->count; ++j) {
+			elm = &node->ondisk->elms[j].internal;
+			if (hammer_btree_cmp(&elm[1].base, key_beg) <= 0)
+				continue;
+			if (hammer_btree_cmp(&elm[0].base, key_end) > 0)
+				break;
+			if (elm->base.btype == HAMMER_BTREE_TYPE_LEAF)
+				*leavesp = 1;
+			if (next)
+				next[nsub] = elm->subtree_offset;
+			++nsub;
+			if (hammer_btree_cmp(&elm->base, key_beg) <= 0)
+				continue;
+
+			/*
+			 * A separator inside the range.
+			 */
+			if (ranges && r < count &&
+			    sep == (int64_t)r * nseps / count) {
+				pred = elm->base;
+				if (hammerfs_base_pred(&pred) == 0 &&
+				    hammer_btree_cmp(&pred,
+					&ranges[*nrangesp - 1].key_beg) >= 0) {
+					ranges[*nrangesp - 1].key_end = pred;
+					ranges[*nrangesp].key_beg = elm->base;
+					++*nrangesp;
+				}
+				while (r < count &&
+				       sep == (int64_t)r * nseps / count) {
+					++r;
+				}
+			}
+			++sep;
+		}
+		hammer_unlock(&node->lock);
+		hammer_rel_node(node);
+	}
+	*nsubp = nsub;
+	return(error);
+}
+
+/*
+ * Linux: split split->key_beg..key_end of PFS split->pfs_id into at most
+ * split->count ranges for concurrent mirror-reads, returned in ranges[]
+ * in key order with split->count set to their number.  The ranges are
+ * disjoint and cover the whole key range, so the mrecord streams read
+ * over them add up to the one a single scan would produce.
+ *
+ * The split points are separators of internal B-Tree nodes.  The tree is
+ * walked breadth first until a level has HAMMERFS_SPLIT_FANOUT subtrees
+ * per range or its subtrees are leaves, and the separators of that level
+ * are divided evenly, so each range holds about the same number of
+ * subtrees.
+ */
+#define HAMMERFS_SPLIT_FANOUT	4
+
+int
+hammerfs_mirror_split(hammer_mount_t hmp, struct hammerfs_ioc_mirror_split *split,
+		      struct hammerfs_mirror_range *ranges)
+{
+	struct hammer_transaction trans;
+	struct hammer_base_elm key_beg;
+	struct hammer_base_elm key_end;
+	hammer_volume_t volume;
+	hammer_off_t *level;
+	hammer_off_t *next;
+	u_int32_t localization;
+	int nlevel;
+	int nnext;
+	int leaves;
+	int nranges;
+	int error;
+	int i;
+
+	localization = (u_int32_t)split->pfs_id << 16;
+
+	if ((split->key_beg.localization | split->key_end.localization) &
+	    HAMMER_LOCALIZE_PSEUDOFS_MASK) {
+		return(EINVAL);
+	}
+	if (hammer_btree_cmp(&split->key_beg, &split->key_end) > 0)
+		return(EINVAL);
+	if (split->count < 1 || split->count > HAMMERFS_MIRROR_SPLIT_MAX)
+		return(EINVAL);
+
+	key_beg = split->key_beg;
+	key_beg.localization += localization;
+	key_end = split->key_end;
+	key_end.localization += localization;
+
+	/*
+	 * A level is only descended into while it has fewer subtrees than
+	 * wanted, so the next one has at most HAMMER_BTREE_INT_ELMS times
+	 * that many.
+	 */
+	nnext = split->count * HAMMERFS_SPLIT_FANOUT * HAMMER_BTREE_INT_ELMS;
+	level = kmalloc(nnext * sizeof(*level), M_HAMMER, M_WAITOK);
+	next = kmalloc(nnext * sizeof(*next), M_HAMMER, M_WAITOK);
+
+	hammer_simple_transaction(&trans, hmp);
+	volume = hammer_get_root_volume(trans.hmp, &error);
+	if (error)
+		goto done;
+	level[0] = volume->ondisk->vol0_btree_root;
+	nlevel = 1;
+	hammer_rel_volume(volume, 0);
+
+	for (;;) {
+		leaves = 0;
+		error = hammerfs_split_level(&trans, level, nlevel,
+					     &key_beg, &key_end, next,
+					     &nnext, &leaves, NULL, 0, 0, NULL);
+		if (error || leaves || nnext == 0 ||
+		    nnext >= split->count * HAMMERFS_SPLIT_FANOUT) {
+			break;
+		}
+		bcopy(next, level, nnext * sizeof(*next));
+		nlevel = nnext;
+	}
+	if (error)
+		goto done;
+
+	/*
+	 * All but possibly the first subtree start with a separator.  A
+	 * leaf root has none.
+	 */
+	ranges[0].key_beg = key_beg;
+	nranges = 1;
+	if (nnext > 1) {
+		error = hammerfs_split_level(&trans, level, nlevel,
+					     &key_beg, &key_end, NULL,
+					     &nnext, &leaves, ranges,
+					     nnext - 1, split->count,
+					     &nranges);
+		if (error)
+			goto done;
+	}
+	ranges[nranges - 1].key_end = key_end;
+
+	for (i = 0; i < nranges; ++i) {
+		ranges[i].key_beg.localization &= HAMMER_LOCALIZE_MASK;
+		ranges[i].key_end.localization &= HAMMER_LOCALIZE_MASK;
+	}
+	split->count = nranges;
+done:
+	hammer_done_transaction(&trans);
+	kfree(next, M_HAMMER);
+	kfree(level, M_HAMMER);
+	return(error);
+}
@@ -42,6 +42,7 @@
 #include "dfly_wrap.h"
 
 #include "hammer.h"
+#include "hammerfs_stats.h"
 #include <sys/fcntl.h>
 #include <sys/nlookup.h>
 #include <sys/buf.h>
@@ -50,7 +51,21 @@
 static void hammer_free_volume(hammer_volume_t volume);
 static int hammer_load_volume(hammer_volume_t volume);
 static int hammer_load_buffer(hammer_buffer_t buffer, int isnew);
-static int hammer_load_node(hammer_node_t node, int isnew);
+static int hammer_load_node(hammer_node_t node, int isnew, int bulk);
+static hammer_buffer_t hammer_get_buffer_bulk(hammer_mount_t hmp,
+			hammer_off_t buf_offset, int bytes, int isnew,
+			int bulk, int *errorp);
+static void hammer_trim_cold(hammer_mount_t hmp);
+
+/*
+ * Linux: protects node->cache_list and the node pointer of every
+ * hammer_node_cache in place of DragonFly's critical sections.  It has to
+ * be found before cache->node can be looked at, and a cache belongs to no
+ * particular node or mount (hammer_mirror_read() keeps one on its stack),
+ * so there is just the one.  It is only held to update the lists.
+ */
+static spinlock_t hammer_node_cache_spin =
+	__SPIN_LOCK_UNLOCKED(hammer_node_cache_spin);
 
 static int
 hammer_vol_rb_compare(hammer_volume_t vol1, hammer_volume_t vol2)
@@ -89,6 +104,157 @@ RB_GENERATE2(hammer_buf_rb_tree, hammer_buffer, rb_node,
 RB_GENERATE2(hammer_nod_rb_tree, hammer_node, rb_node,
 	     hammer_nod_rb_compare, hammer_off_t, node_offset);
 
+/*
+ * Linux: lookup indexes for buffers and nodes, see struct hammer_hash.
+ *
+ * A lookup returns the structure with a reference taken under the bucket
+ * spinlock.  A removal rechecks the reference count under the same
+ * spinlock and fails with EBUSY if a lookup got there first, in which case
+ * the structure must not be destroyed.
+ *
+ * node->ondisk is also set and cleared under the bucket spinlock, see
+ * hammer_rel_node(), so a node lookup can tell whether the node it
+ * referenced still has its on-disk data.
+ */
+static hammer_buffer_t
+hammer_buf_hash_ref(hammer_mount_t hmp, hammer_off_t buf_offset)
+{
+	struct hammer_hash_bucket *bucket;
+	hammer_buffer_t buffer;
+
+	bucket = hammer_hash_bucket(&hmp->bufs_hash, buf_offset);
+	spin_lock(&bucket->spin);
+	LIST_FOREACH(buffer, &bucket->u.bufs, hash_entry) {
+		if (buffer->zoneX_offset == buf_offset) {
+			if (buffer->io.lock.refs == 0)
+				++hammer_count_refedbufs;
+			hammer_ref(&buffer->io.lock);
+			break;
+		}
+	}
+	spin_unlock(&bucket->spin);
+	return(buffer);
+}
+
+static int
+hammer_buf_hash_insert(hammer_mount_t hmp, hammer_buffer_t buffer)
+{
+	struct hammer_hash_bucket *bucket;
+
+	spin_lock(&hmp->bufs_hash.tree_spin);
+	if (RB_INSERT(hammer_buf_rb_tree, &hmp->rb_bufs_root, buffer)) {
+		spin_unlock(&hmp->bufs_hash.tree_spin);
+		return(EEXIST);
+	}
+	bucket = hammer_hash_bucket(&hmp->bufs_hash, buffer->zoneX_offset);
+	spin_lock(&bucket->spin);
+	LIST_INSERT_HEAD(&bucket->u.bufs, buffer, hash_entry);
+	spin_unlock(&bucket->spin);
+	spin_unlock(&hmp->bufs_hash.tree_spin);
+	return(0);
+}
+
+/*
+ * The caller holds the last reference.
+ */
+static int
+hammer_buf_hash_remove(hammer_mount_t hmp, hammer_buffer_t buffer)
+{
+	struct hammer_hash_bucket *bucket;
+
+	bucket = hammer_hash_bucket(&hmp->bufs_hash, buffer->zoneX_offset);
+	spin_lock(&hmp->bufs_hash.tree_spin);
+	spin_lock(&bucket->spin);
+	if (buffer->io.lock.refs != 1) {
+		spin_unlock(&bucket->spin);
+		spin_unlock(&hmp->bufs_hash.tree_spin);
+		return(EBUSY);
+	}
+	LIST_REMOVE(buffer, hash_entry);
+	RB_REMOVE(hammer_buf_rb_tree, &hmp->rb_bufs_root, buffer);
+	spin_unlock(&bucket->spin);
+	spin_unlock(&hmp->bufs_hash.tree_spin);
+	return(0);
+}
+
+static hammer_node_t
+hammer_nod_hash_ref(hammer_mount_t hmp, hammer_off_t node_offset,
+		    int *loadedp)
+{
+	struct hammer_hash_bucket *bucket;
+	hammer_node_t node;
+
+	bucket = hammer_hash_bucket(&hmp->nods_hash, node_offset);
+	spin_lock(&bucket->spin);
+	LIST_FOREACH(node, &bucket->u.nods, hash_entry) {
+		if (node->node_offset == node_offset) {
+			hammer_ref(&node->lock);
+			*loadedp = (node->ondisk != NULL);
+			break;
+		}
+	}
+	spin_unlock(&bucket->spin);
+	return(node);
+}
+
+/*
+ * Whether a node the caller referenced by other means still has its
+ * on-disk data.
+ */
+static int
+hammer_nod_hash_loaded(hammer_node_t node)
+{
+	struct hammer_hash_bucket *bucket;
+	int loaded;
+
+	bucket = hammer_hash_bucket(&node->hmp->nods_hash, node->node_offset);
+	spin_lock(&bucket->spin);
+	loaded = (node->ondisk != NULL);
+	spin_unlock(&bucket->spin);
+	return(loaded);
+}
+
+static int
+hammer_nod_hash_insert(hammer_mount_t hmp, hammer_node_t node)
+{
+	struct hammer_hash_bucket *bucket;
+
+	spin_lock(&hmp->nods_hash.tree_spin);
+	if (RB_INSERT(hammer_nod_rb_tree, &hmp->rb_nods_root, node)) {
+		spin_unlock(&hmp->nods_hash.tree_spin);
+		return(EEXIST);
+	}
+	bucket = hammer_hash_bucket(&hmp->nods_hash, node->node_offset);
+	spin_lock(&bucket->spin);
+	LIST_INSERT_HEAD(&bucket->u.nods, node, hash_entry);
+	spin_unlock(&bucket->spin);
+	spin_unlock(&hmp->nods_hash.tree_spin);
+	return(0);
+}
+
+/*
+ * The caller holds the last reference.
+ */
+static int
+hammer_nod_hash_remove(hammer_mount_t hmp, hammer_node_t node)
+{
+	struct hammer_hash_bucket *bucket;
+
+	bucket = hammer_hash_bucket(&hmp->nods_hash, node->node_offset);
+	spin_lock(&hmp->nods_hash.tree_spin);
+	spin_lock(&bucket->spin);
+	if (node->lock.refs != 1) {
+		spin_unlock(&bucket->spin);
+		spin_unlock(&hmp->nods_hash.tree_spin);
+		return(EBUSY);
+	}
+	LIST_REMOVE(node, hash_entry);
+	RB_REMOVE(hammer_nod_rb_tree, &hmp->rb_nods_root, node);
+	spin_unlock(&bucket->spin);
+	spin_unlock(&hmp->nods_hash.tree_spin);
+	return(0);
+}
+
 /************************************************************************
  *				VOLUMES					*
  ************************************************************************
@@ -470,6 +636,9 @@ hammer_rel_volume(hammer_volume_t volume, int flush)
 {
 	struct buf *bp = NULL;
 
+	if (hammer_unref_notlast(&volume->io.lock))
+		return;
+
 	crit_enter();
 	if (volume->io.lock.refs == 1) {
 		++volume->io.loading;
@@ -511,6 +680,22 @@ hammer_mountcheck_volumes(struct hammer_mount *hmp)
 hammer_buffer_t
 hammer_get_buffer(hammer_mount_t hmp, hammer_off_t buf_offset,
 		  int bytes, int isnew, int *errorp)
+{
+	return(hammer_get_buffer_bulk(hmp, buf_offset, bytes, isnew, 0,
+				      errorp));
+}
+
+/*
+ * Linux: hammer_get_buffer() on behalf of a bulk scan if bulk is set.  A
+ * buffer the scan has to load is admitted cold (io.lru_cold): once
+ * unreferenced it goes on the cold list, which is kept short and is the
+ * first to be reclaimed.  Any other access makes it a normal buffer, as
+ * are those the scan finds cached, and a bulk scan touching a buffer does
+ * not make it any warmer.
+ */
+static hammer_buffer_t
+hammer_get_buffer_bulk(hammer_mount_t hmp, hammer_off_t buf_offset,
+		       int bytes, int isnew, int bulk, int *errorp)
 {
 	hammer_buffer_t buffer;
 	hammer_volume_t volume;
@@ -520,21 +705,22 @@ hammer_get_buffer(hammer_mount_t hmp, hammer_off_t buf_offset,
 	int zone;
 
 	buf_offset &= ~HAMMER_BUFMASK64;
+	if (bulk)
+		hammer_trim_cold(hmp);
 again:
 	/*
 	 * Shortcut if the buffer is already cached
 	 */
-	buffer = RB_LOOKUP(hammer_buf_rb_tree, &hmp->rb_bufs_root, buf_offset);
+	buffer = hammer_buf_hash_ref(hmp, buf_offset);
 	if (buffer) {
-		if (buffer->io.lock.refs == 0)
-			++hammer_count_refedbufs;
-		hammer_ref(&buffer->io.lock);
-
 		/*
 		 * Once refed the ondisk field will not be cleared by
 		 * any other action.
 		 */
+		if (bulk == 0)
+			buffer->io.lru_cold = 0;
 		if (buffer->ondisk && buffer->io.loading == 0) {
+			hammerfs_stats_inc(hmp, buffer_hits);
 			*errorp = 0;
 			return(buffer);
 		}
@@ -615,7 +801,7 @@ again:
 	 * Allocate a new buffer structure.  We will check for races later.
 	 */
 	++hammer_count_buffers;
-	buffer = kmalloc(sizeof(*buffer), hmp->m_misc,
+	buffer = kmalloc(sizeof(*buffer), M_HAMMER_BUF,
 			 M_WAITOK|M_ZERO|M_USE_RESERVE);
 	buffer->zone2_offset = zone2_offset;
 	buffer->zoneX_offset = buf_offset;
@@ -624,16 +810,17 @@ again:
 	buffer->io.offset = volume->ondisk->vol_buf_beg +
 			    (zone2_offset & HAMMER_OFF_SHORT_MASK);
 	buffer->io.bytes = bytes;
+	buffer->io.lru_cold = bulk;
 	TAILQ_INIT(&buffer->clist);
 	hammer_ref(&buffer->io.lock);
 
 	/*
 	 * Insert the buffer into the RB tree and handle late collisions.
 	 */
-	if (RB_INSERT(hammer_buf_rb_tree, &hmp->rb_bufs_root, buffer)) {
+	if (hammer_buf_hash_insert(hmp, buffer)) {
 		hammer_unref(&buffer->io.lock);
 		--hammer_count_buffers;
-		kfree(buffer, hmp->m_misc);
+		kfree(buffer, M_HAMMER_BUF);
 		goto again;
 	}
 	++hammer_count_refedbufs;
@@ -643,6 +830,7 @@ found:
 	 * Deal with on-disk info and loading races.
 	 */
 	if (buffer->ondisk == NULL || buffer->io.loading) {
+		hammerfs_stats_inc(hmp, buffer_misses);
 		*errorp = hammer_load_buffer(buffer, isnew);
 		if (*errorp) {
 			hammer_rel_buffer(buffer, 1);
@@ -676,8 +864,7 @@ hammer_sync_buffers(hammer_mount_t hmp, hammer_off_t base_offset, int bytes)
 		 HAMMER_ZONE_LARGE_DATA);
 
 	while (bytes > 0) {
-		buffer = RB_LOOKUP(hammer_buf_rb_tree, &hmp->rb_bufs_root,
-				   base_offset);
+		buffer = hammer_buf_hash_ref(hmp, base_offset);
 		if (buffer && (buffer->io.modified || buffer->io.running)) {
 			error = hammer_ref_buffer(buffer);
 			if (error == 0) {
@@ -691,6 +878,8 @@ hammer_sync_buffers(hammer_mount_t hmp, hammer_off_t base_offset, int bytes)
 				hammer_rel_buffer(buffer, 0);
 			}
 		}
+		if (buffer)
+			hammer_rel_buffer(buffer, 0);	/* lookup ref */
 		base_offset += HAMMER_BUFSIZE;
 		bytes -= HAMMER_BUFSIZE;
 	}
@@ -718,8 +907,7 @@ hammer_del_buffers(hammer_mount_t hmp, hammer_off_t base_offset,
 	KKASSERT(error == 0);
 
 	while (bytes > 0) {
-		buffer = RB_LOOKUP(hammer_buf_rb_tree, &hmp->rb_bufs_root,
-				   base_offset);
+		buffer = hammer_buf_hash_ref(hmp, base_offset);
 		if (buffer) {
 			error = hammer_ref_buffer(buffer);
 			if (error == 0) {
@@ -730,6 +918,7 @@ hammer_del_buffers(hammer_mount_t hmp, hammer_off_t base_offset,
 				KKASSERT(buffer->io.volume == volume);
 				hammer_rel_buffer(buffer, 0);
 			}
+			hammer_rel_buffer(buffer, 0);	/* lookup ref */
 		} else {
 			hammer_io_inval(volume, zone2_offset);
 		}
@@ -868,6 +1057,9 @@ hammer_rel_buffer(hammer_buffer_t buffer, int flush)
 	struct buf *bp = NULL;
 	int freeme = 0;
 
+	if (hammer_unref_notlast(&buffer->io.lock))
+		return;
+
 	hmp = buffer->io.hmp;
 
 	crit_enter();
@@ -880,8 +1072,18 @@ hammer_rel_buffer(hammer_buffer_t buffer, int flush)
 			if (buffer->io.lock.refs == 1)
 				--hammer_count_refedbufs;
 
+			/*
+			 * Linux: take the buffer off the lru_list before
+			 * the lookup index, hammer_reclaim_buffers() must
+			 * not find it once the index lets go of it.
+			 */
+			if (buffer->io.bp == NULL &&
+			    buffer->io.lock.refs == 1)
+				hammer_io_lru_remove(&buffer->io);
+
 			if (buffer->io.bp == NULL &&
-			    buffer->io.lock.refs == 1) {
+			    buffer->io.lock.refs == 1 &&
+			    hammer_buf_hash_remove(hmp, buffer) == 0) {
 				/*
 				 * Final cleanup
 				 *
@@ -889,9 +1091,6 @@ hammer_rel_buffer(hammer_buffer_t buffer, int flush)
 				 * B-Tree nodes to have refs if the buffer
 				 * has no additional refs.
 				 */
-				RB_REMOVE(hammer_buf_rb_tree,
-					  &buffer->io.hmp->rb_bufs_root,
-					  buffer);
 				volume = buffer->io.volume;
 				buffer->io.volume = NULL; /* sanity */
 				hammer_rel_volume(volume, 0);
@@ -910,7 +1109,115 @@ hammer_rel_buffer(hammer_buffer_t buffer, int flush)
 		dfly_brelse(bp);
 	if (freeme) {
 		--hammer_count_buffers;
-		kfree(buffer, hmp->m_misc);
+		kfree(buffer, M_HAMMER_BUF);
+	}
+}
+
+/*
+ * Linux: look at the buffer at the head of hmp->lru_list[part].  It is
+ * destroyed unless it is referenced or, on a PFS list, was referenced
+ * again since it was last looked at, in which case it goes to the tail.
+ * A buffer on the cold list which is no longer cold goes to its PFS list
+ * instead, one that is cold is destroyed even if a bulk scan referenced
+ * it again.  Destroying a buffer also destroys the B-Tree nodes it backs.
+ *
+ * Returns 1 if the buffer was destroyed, 0 if not and -1 if the list is
+ * empty.
+ */
+static int
+hammer_reclaim_buffer(hammer_mount_t hmp, int part)
+{
+	struct hammer_io *io;
+	hammer_buffer_t buffer;
+	int npart;
+
+	spin_lock(&hmp->lru_spin);
+	if ((io = TAILQ_FIRST(&hmp->lru_list[part])) == NULL) {
+		spin_unlock(&hmp->lru_spin);
+		return(-1);
+	}
+	TAILQ_REMOVE(&hmp->lru_list[part], io, lru_entry);
+	npart = part;
+	if (part == HAMMER_LRU_COLD && io->lru_cold == 0)
+		npart = hammer_io_lru_part(io);
+	if (io->lock.refs || npart != part ||
+	    (io->lru_ref && part != HAMMER_LRU_COLD)) {
+		io->lru_ref = 0;
+		io->lru_part = npart;
+		--hmp->count_lru_part[part];
+		++hmp->count_lru_part[npart];
+		TAILQ_INSERT_TAIL(&hmp->lru_list[npart], io, lru_entry);
+		spin_unlock(&hmp->lru_spin);
+		return(0);
+	}
+
+	/*
+	 * The buffer cannot be destroyed while it is on the list and we
+	 * hold lru_spin, see hammer_rel_buffer().
+	 */
+	++hammer_count_refedbufs;
+	hammer_ref(&io->lock);
+	io->lru_queued = 0;
+	--hmp->count_lru_part[part];
+	--hmp->count_lru;
+	spin_unlock(&hmp->lru_spin);
+
+	buffer = (void *)io;
+	hammer_rel_buffer(buffer, 1);
+	return(1);
+}
+
+/*
+ * Linux: give memory back under pressure.  Look at up to count of the
+ * unreferenced buffers that still have a clean bp, from the cold list
+ * first and then from the lru_list[] with the most buffers, see
+ * hammer_reclaim_buffer().
+ *
+ * Taking from the largest partition first makes a PFS which streams
+ * through many buffers, a backup or mirror-read, give back its own before
+ * the working set of the other PFSs is touched.
+ *
+ * Returns the number of buffers whose bp was released.
+ */
+int
+hammer_reclaim_buffers(hammer_mount_t hmp, int count)
+{
+	int freed = 0;
+	int part;
+	int i;
+	int r;
+
+	while (count-- > 0) {
+		part = HAMMER_LRU_COLD;
+		if (hmp->count_lru_part[part] == 0) {
+			part = 0;
+			for (i = 1; i < HAMMER_LRU_PARTS; ++i) {
+				if (hmp->count_lru_part[i] >
+				    hmp->count_lru_part[part]) {
+					part = i;
+				}
+			}
+		}
+		if ((r = hammer_reclaim_buffer(hmp, part)) < 0)
+			break;
+		freed += r;
+	}
+	return(freed);
+}
+
+/*
+ * Linux: keep the cold list at HAMMER_LRU_COLD_MAX buffers, called by
+ * bulk scans before they load a buffer.  What a scan has passed is given
+ * back right away, but a buffer it comes back to soon is still there.
+ */
+static void
+hammer_trim_cold(hammer_mount_t hmp)
+{
+	int count = hmp->count_lru_part[HAMMER_LRU_COLD] - HAMMER_LRU_COLD_MAX;
+
+	while (count-- > 0) {
+		if (hammer_reclaim_buffer(hmp, HAMMER_LRU_COLD) < 0)
+			break;
 	}
 }
 
@@ -926,7 +1233,7 @@ hammer_rel_buffer(hammer_buffer_t buffer, int flush)
 static __inline
 void *
 _hammer_bread(hammer_mount_t hmp, hammer_off_t buf_offset, int bytes,
-	     int *errorp, struct hammer_buffer **bufferp)
+	     int bulk, int *errorp, struct hammer_buffer **bufferp)
 {
 	hammer_buffer_t buffer;
 	int32_t xoff = (int32_t)buf_offset & HAMMER_BUFMASK;
@@ -939,7 +1246,8 @@ _hammer_bread(hammer_mount_t hmp, hammer_off_t buf_offset, int bytes,
 			       buffer->zoneX_offset != buf_offset)) {
 		if (buffer)
 			hammer_rel_buffer(buffer, 0);
-		buffer = hammer_get_buffer(hmp, buf_offset, bytes, 0, errorp);
+		buffer = hammer_get_buffer_bulk(hmp, buf_offset, bytes, 0,
+						bulk, errorp);
 		*bufferp = buffer;
 	} else {
 		*errorp = 0;
@@ -958,7 +1266,8 @@ void *
 hammer_bread(hammer_mount_t hmp, hammer_off_t buf_offset,
 	     int *errorp, struct hammer_buffer **bufferp)
 {
-	return(_hammer_bread(hmp, buf_offset, HAMMER_BUFSIZE, errorp, bufferp));
+	return(_hammer_bread(hmp, buf_offset, HAMMER_BUFSIZE, 0,
+			     errorp, bufferp));
 }
 
 void *
@@ -966,7 +1275,18 @@ hammer_bread_ext(hammer_mount_t hmp, hammer_off_t buf_offset, int bytes,
 	         int *errorp, struct hammer_buffer **bufferp)
 {
 	bytes = (bytes + HAMMER_BUFMASK) & ~HAMMER_BUFMASK;
-	return(_hammer_bread(hmp, buf_offset, bytes, errorp, bufferp));
+	return(_hammer_bread(hmp, buf_offset, bytes, 0, errorp, bufferp));
+}
+
+/*
+ * Linux: hammer_bread_ext() for bulk scans, see hammer_get_buffer_bulk().
+ */
+void *
+hammer_bread_bulk(hammer_mount_t hmp, hammer_off_t buf_offset, int bytes,
+		  int *errorp, struct hammer_buffer **bufferp)
+{
+	bytes = (bytes + HAMMER_BUFMASK) & ~HAMMER_BUFMASK;
+	return(_hammer_bread(hmp, buf_offset, bytes, 1, errorp, bufferp));
 }
 
 /*
@@ -1055,6 +1375,7 @@ hammer_get_node(hammer_transaction_t trans, hammer_off_t node_offset,
 {
 	hammer_mount_t hmp = trans->hmp;
 	hammer_node_t node;
+	int loaded;
 
 	KKASSERT((node_offset & HAMMER_OFF_ZONE_MASK) == HAMMER_ZONE_BTREE);
 
@@ -1062,25 +1383,31 @@ hammer_get_node(hammer_transaction_t trans, hammer_off_t node_offset,
 	 * Locate the structure, allocating one if necessary.
 	 */
 again:
-	node = RB_LOOKUP(hammer_nod_rb_tree, &hmp->rb_nods_root, node_offset);
+	node = hammer_nod_hash_ref(hmp, node_offset, &loaded);
 	if (node == NULL) {
 		++hammer_count_nodes;
-		node = kmalloc(sizeof(*node), hmp->m_misc, M_WAITOK|M_ZERO|M_USE_RESERVE);
+		node = kmalloc(sizeof(*node), M_HAMMER_NODE, M_WAITOK|M_ZERO|M_USE_RESERVE);
 		node->node_offset = node_offset;
 		node->hmp = hmp;
 		TAILQ_INIT(&node->cursor_list);
 		TAILQ_INIT(&node->cache_list);
-		if (RB_INSERT(hammer_nod_rb_tree, &hmp->rb_nods_root, node)) {
+		hammer_ref(&node->lock);
+		if (hammer_nod_hash_insert(hmp, node)) {
 			--hammer_count_nodes;
-			kfree(node, hmp->m_misc);
+			kfree(node, M_HAMMER_NODE);
 			goto again;
 		}
+		loaded = 0;
 	}
-	hammer_ref(&node->lock);
-	if (node->ondisk) {
+	if (loaded) {
+		hammerfs_stats_inc(hmp, node_hits);
+		if ((trans->flags & HAMMER_TRANSF_BULK) == 0)
+			node->buffer->io.lru_cold = 0;
 		*errorp = 0;
 	} else {
-		*errorp = hammer_load_node(node, isnew);
+		hammerfs_stats_inc(hmp, node_misses);
+		*errorp = hammer_load_node(node, isnew,
+					   trans->flags & HAMMER_TRANSF_BULK);
 		trans->flags |= HAMMER_TRANSF_DIDIO;
 	}
 	if (*errorp) {
@@ -1101,11 +1428,14 @@ hammer_ref_node(hammer_node_t node)
 }
 
 /*
- * Load a node's on-disk data reference.
+ * Load a node's on-disk data reference.  Linux: bulk is set when a bulk
+ * scan loads the node, see hammer_get_buffer_bulk().
  */
 static int
-hammer_load_node(hammer_node_t node, int isnew)
+hammer_load_node(hammer_node_t node, int isnew, int bulk)
 {
+	struct hammer_hash_bucket *bucket;
+	hammer_node_ondisk_t ondisk;
 	hammer_buffer_t buffer;
 	hammer_off_t buf_offset;
 	int error;
@@ -1120,38 +1450,57 @@ hammer_load_node(hammer_node_t node, int isnew)
 		 * the buffer's clist and node->ondisk determines
 		 * whether the buffer is referenced.
 		 *
-		 * We could be racing a buffer release, in which case
-		 * node->buffer may become NULL while we are blocked
-		 * referencing the buffer.
+		 * Linux: an unreferenced node->buffer can be destroyed
+		 * by hammer_reclaim_buffers() at any time, so the buffer
+		 * is always referenced through the lookup index.  The
+		 * node may still be on the clist of a buffer which is
+		 * being destroyed, it is moved over under the bucket
+		 * spinlock, see hammer_flush_buffer_nodes().
 		 */
-		if ((buffer = node->buffer) != NULL) {
-			error = hammer_ref_buffer(buffer);
-			if (error == 0 && node->buffer == NULL) {
-				TAILQ_INSERT_TAIL(&buffer->clist,
-						  node, entry);
-				node->buffer = buffer;
-			}
-		} else {
-			buf_offset = node->node_offset & ~HAMMER_BUFMASK64;
-			buffer = hammer_get_buffer(node->hmp, buf_offset,
-						   HAMMER_BUFSIZE, 0, &error);
-			if (buffer) {
-				KKASSERT(error == 0);
-				TAILQ_INSERT_TAIL(&buffer->clist,
-						  node, entry);
-				node->buffer = buffer;
-			}
-		}
+		buf_offset = node->node_offset & ~HAMMER_BUFMASK64;
+		buffer = hammer_get_buffer_bulk(node->hmp, buf_offset,
+						HAMMER_BUFSIZE, 0, bulk,
+						&error);
 		if (error)
 			goto failed;
-		node->ondisk = (void *)((char *)buffer->ondisk +
-				        (node->node_offset & HAMMER_BUFMASK));
+		bucket = hammer_hash_bucket(&node->hmp->bufs_hash, buf_offset);
+		spin_lock(&bucket->spin);
+		if (node->buffer != buffer) {
+			if (node->buffer)
+				TAILQ_REMOVE(&node->buffer->clist, node, entry);
+			TAILQ_INSERT_TAIL(&buffer->clist, node, entry);
+			node->buffer = buffer;
+		}
+		spin_unlock(&bucket->spin);
+		ondisk = (void *)((char *)buffer->ondisk +
+				  (node->node_offset & HAMMER_BUFMASK));
 		if (isnew == 0 && 
 		    (node->flags & HAMMER_NODE_CRCGOOD) == 0) {
-			if (hammer_crc_test_btree(node->ondisk) == 0)
+			if (hammer_crc_test_btree(ondisk) == 0)
 				Debugger("CRC FAILED: B-TREE NODE");
 			node->flags |= HAMMER_NODE_CRCGOOD;
 		}
+
+		/*
+		 * Linux: charge the buffer to the PFS of the node's
+		 * elements, see hammer_reclaim_buffers().
+		 */
+		if (ondisk->count) {
+			hammer_io_lru_tag(&buffer->io,
+			    ondisk->elms[0].base.localization);
+			hammer_io_lru_tag(&buffer->io,
+			    ondisk->elms[ondisk->count - 1].base.localization);
+		}
+
+		/*
+		 * Linux: lookups see the node loaded from here on, see
+		 * hammer_rel_node().
+		 */
+		bucket = hammer_hash_bucket(&node->hmp->nods_hash,
+					    node->node_offset);
+		spin_lock(&bucket->spin);
+		node->ondisk = ondisk;
+		spin_unlock(&bucket->spin);
 	}
 failed:
 	--node->loading;
@@ -1168,13 +1517,15 @@ hammer_ref_node_safe(struct hammer_mount *hmp, hammer_node_cache_t cache,
 {
 	hammer_node_t node;
 
-	node = cache->node;
-	if (node != NULL) {
+	spin_lock(&hammer_node_cache_spin);
+	if ((node = cache->node) != NULL)
 		hammer_ref(&node->lock);
-		if (node->ondisk)
+	spin_unlock(&hammer_node_cache_spin);
+	if (node != NULL) {
+		if (hammer_nod_hash_loaded(node))
 			*errorp = 0;
 		else
-			*errorp = hammer_load_node(node, 0);
+			*errorp = hammer_load_node(node, 0, 0);
 		if (*errorp) {
 			hammer_rel_node(node);
 			node = NULL;
@@ -1192,23 +1543,21 @@ hammer_ref_node_safe(struct hammer_mount *hmp, hammer_node_cache_t cache,
 void
 hammer_rel_node(hammer_node_t node)
 {
+	struct hammer_hash_bucket *bucket;
 	hammer_buffer_t buffer;
 
 	/*
 	 * If this isn't the last ref just decrement the ref count and
 	 * return.
 	 */
-	if (node->lock.refs > 1) {
-		hammer_unref(&node->lock);
+	if (hammer_unref_notlast(&node->lock))
 		return;
-	}
 
 	/*
 	 * If there is no ondisk info or no buffer the node failed to load,
-	 * remove the last reference and destroy the node.
+	 * destroy the node along with the last reference.
 	 */
 	if (node->ondisk == NULL) {
-		hammer_unref(&node->lock);
 		hammer_flush_node(node);
 		/* node is stale now */
 		return;
@@ -1221,12 +1570,27 @@ hammer_rel_node(hammer_node_t node)
 	if (node->flags & HAMMER_NODE_NEEDSCRC)
 		return;
 
+	/*
+	 * Linux: a lookup can reference the node again until it is
+	 * disassociated from the buffer.  That is done under the bucket
+	 * spinlock lookups take their reference under, and only if ours
+	 * is still the last one, otherwise the lookup now holds it.
+	 */
+	bucket = hammer_hash_bucket(&node->hmp->nods_hash, node->node_offset);
+	spin_lock(&bucket->spin);
+	if (node->lock.refs != 1) {
+		spin_unlock(&bucket->spin);
+		hammer_unref(&node->lock);
+		return;
+	}
+
 	/*
 	 * Do final cleanups and then either destroy the node and leave it
 	 * passively cached.  The buffer reference is removed regardless.
 	 */
 	buffer = node->buffer;
 	node->ondisk = NULL;
+	spin_unlock(&bucket->spin);
 
 	if ((node->flags & HAMMER_NODE_FLUSH) == 0) {
 		hammer_unref(&node->lock);
@@ -1237,7 +1601,6 @@ hammer_rel_node(hammer_node_t node)
 	/*
 	 * Destroy the node.
 	 */
-	hammer_unref(&node->lock);
 	hammer_flush_node(node);
 	/* node is stale */
 	hammer_rel_buffer(buffer, 0);
@@ -1268,14 +1631,47 @@ hammer_cache_node(hammer_node_cache_t cache, hammer_node_t node)
 	 */
 	if (node == NULL || (node->flags & HAMMER_NODE_DELETED))
 		return;
-	if (cache->node == node)
-		return;
-	while (cache->node)
+	spin_lock(&hammer_node_cache_spin);
+	while (cache->node != node) {
+		if (cache->node == NULL) {
+			if ((node->flags & HAMMER_NODE_DELETED) == 0) {
+				cache->node = node;
+				TAILQ_INSERT_TAIL(&node->cache_list,
+						  cache, entry);
+			}
+			break;
+		}
+		spin_unlock(&hammer_node_cache_spin);
 		hammer_uncache_node(cache);
-	if (node->flags & HAMMER_NODE_DELETED)
-		return;
-	cache->node = node;
-	TAILQ_INSERT_TAIL(&node->cache_list, cache, entry);
+		spin_lock(&hammer_node_cache_spin);
+	}
+	spin_unlock(&hammer_node_cache_spin);
+}
+
+/*
+ * Linux: passively cache the node src caches, if any.  That node is not
+ * referenced, holding the cache spinlock keeps it from being destroyed.
+ */
+void
+hammer_cache_node_copy(hammer_node_cache_t cache, hammer_node_cache_t src)
+{
+	hammer_node_t node;
+
+	spin_lock(&hammer_node_cache_spin);
+	while ((node = src->node) != NULL && cache->node != node) {
+		if (cache->node == NULL) {
+			if ((node->flags & HAMMER_NODE_DELETED) == 0) {
+				cache->node = node;
+				TAILQ_INSERT_TAIL(&node->cache_list,
+						  cache, entry);
+			}
+			break;
+		}
+		spin_unlock(&hammer_node_cache_spin);
+		hammer_uncache_node(cache);
+		spin_lock(&hammer_node_cache_spin);
+	}
+	spin_unlock(&hammer_node_cache_spin);
 }
 
 void
@@ -1283,39 +1679,69 @@ hammer_uncache_node(hammer_node_cache_t cache)
 {
 	hammer_node_t node;
 
+	spin_lock(&hammer_node_cache_spin);
 	if ((node = cache->node) != NULL) {
 		TAILQ_REMOVE(&node->cache_list, cache, entry);
 		cache->node = NULL;
 		if (TAILQ_EMPTY(&node->cache_list))
-			hammer_flush_node(node);
+			hammer_ref(&node->lock);
+		else
+			node = NULL;
 	}
+	spin_unlock(&hammer_node_cache_spin);
+	if (node)
+		hammer_flush_node(node);
 }
 
 /*
  * Remove a node's cache references and destroy the node if it has no
  * other references or backing store.
+ *
+ * Linux: the caller holds a reference, which is released.  Destroying
+ * the node with it held keeps anybody else from destroying it first.
  */
 void
 hammer_flush_node(hammer_node_t node)
 {
+	struct hammer_hash_bucket *bucket;
 	hammer_node_cache_t cache;
 	hammer_buffer_t buffer;
 	hammer_mount_t hmp = node->hmp;
+	int freeme = 0;
 
+	/*
+	 * Linux: the node is removed from the lookup index and taken off
+	 * its buffer's clist under the spinlock protecting the clist, so
+	 * hammer_flush_buffer_nodes() either references it first or no
+	 * longer finds it.  Its caches are cleared under the cache
+	 * spinlock held across the removal, so hammer_ref_node_safe() and
+	 * hammer_cache_node_copy() cannot find it afterwards either.
+	 */
+	bucket = hammer_hash_bucket(&hmp->bufs_hash,
+				    node->node_offset & ~HAMMER_BUFMASK64);
+	spin_lock(&bucket->spin);
+	spin_lock(&hammer_node_cache_spin);
 	while ((cache = TAILQ_FIRST(&node->cache_list)) != NULL) {
 		TAILQ_REMOVE(&node->cache_list, cache, entry);
 		cache->node = NULL;
 	}
-	if (node->lock.refs == 0 && node->ondisk == NULL) {
+	if (node->ondisk == NULL && hammer_nod_hash_remove(hmp, node) == 0)
+		freeme = 1;
+	spin_unlock(&hammer_node_cache_spin);
+	if (freeme) {
 		KKASSERT((node->flags & HAMMER_NODE_NEEDSCRC) == 0);
-		RB_REMOVE(hammer_nod_rb_tree, &node->hmp->rb_nods_root, node);
 		if ((buffer = node->buffer) != NULL) {
 			node->buffer = NULL;
 			TAILQ_REMOVE(&buffer->clist, node, entry);
 			/* buffer is unreferenced because ondisk is NULL */
 		}
+	}
+	spin_unlock(&bucket->spin);
+	if (freeme) {
 		--hammer_count_nodes;
-		kfree(node, hmp->m_misc);
+		kfree(node, M_HAMMER_NODE);
+	} else {
+		hammer_unref(&node->lock);
 	}
 }
 
@@ -1325,28 +1751,41 @@ hammer_flush_node(hammer_node_t node)
  * none of the nodes should have any references.  The buffer is locked.
  *
  * We may be interlocked with the buffer.
+ *
+ * Linux: node->buffer and the clist are protected by the spinlock of
+ * the buffer's bucket in the lookup index, see hammer_load_node().  All
+ * nodes are taken off the clist under it, an unreferenced one with a
+ * reference to destroy it once the spinlock is released.  A node may
+ * also have been found by a lookup racing hammer_reclaim_buffers(), it
+ * is left to that lookup.
  */
 void
 hammer_flush_buffer_nodes(hammer_buffer_t buffer)
 {
+	struct hammer_hash_bucket *bucket;
 	hammer_node_t node;
 
-	while ((node = TAILQ_FIRST(&buffer->clist)) != NULL) {
-		KKASSERT(node->ondisk == NULL);
-		KKASSERT((node->flags & HAMMER_NODE_NEEDSCRC) == 0);
+	bucket = hammer_hash_bucket(&buffer->io.hmp->bufs_hash,
+				    buffer->zoneX_offset);
+	for (;;) {
+		spin_lock(&bucket->spin);
+		while ((node = TAILQ_FIRST(&buffer->clist)) != NULL) {
+			KKASSERT(node->ondisk == NULL);
+			KKASSERT((node->flags & HAMMER_NODE_NEEDSCRC) == 0);
 
-		if (node->lock.refs == 0) {
-			hammer_ref(&node->lock);
-			node->flags |= HAMMER_NODE_FLUSH;
-			hammer_rel_node(node);
-		} else {
-			KKASSERT(node->loading != 0);
-			KKASSERT(node->buffer != NULL);
-			buffer = node->buffer;
 			node->buffer = NULL;
 			TAILQ_REMOVE(&buffer->clist, node, entry);
 			/* buffer is unreferenced because ondisk is NULL */
+			if (node->lock.refs == 0) {
+				hammer_ref(&node->lock);
+				node->flags |= HAMMER_NODE_FLUSH;
+				break;
+			}
 		}
+		spin_unlock(&bucket->spin);
+		if (node == NULL)
+			break;
+		hammer_rel_node(node);
 	}
 }
 
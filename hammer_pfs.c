@@ -1,2 +1,148 @@
 #include "dfly_wrap.h"
 #include "dfly/vfs/hammer/hammer_pfs.c"
+
+#include "hammerfs.h"
+
+/*
+ * Linux: the PFSs of the mount as of hmp->asof, PFS 0 first and then
+ * those with a PFS record in the root inode, in pfs_id order.  pfs_id,
+ * mirror_flags and sync_end_tid of up to max of them are set in ary[],
+ * *countp is set to their number.  A master is synced up to the volume's
+ * next TID, like hammer_ioc_get_pseudofs() reports it.
+ */
+int
+hammerfs_pfs_list(hammer_mount_t hmp, struct hammerfs_pfs_summary *ary,
+		  int max, int *countp)
+{
+	struct hammer_transaction trans;
+	struct hammer_cursor cursor;
+	hammer_pseudofs_inmem_t pfsm;
+	hammer_btree_leaf_elm_t elm;
+	u_int32_t localization;
+	int count = 0;
+	int cerror;
+	int error;
+
+	hammer_simple_transaction(&trans, hmp);
+	localization = HAMMER_DEF_LOCALIZATION;
+	error = hammer_init_cursor(&trans, &cursor, NULL, NULL);
+	if (error)
+		goto done;
+	cursor.key_beg.localization = HAMMER_DEF_LOCALIZATION +
+				      HAMMER_LOCALIZE_MISC;
+	cursor.key_beg.obj_id = HAMMER_OBJID_ROOT;
+	cursor.key_beg.rec_type = HAMMER_RECTYPE_PFS;
+	cursor.key_beg.key = 1LL << 16;
+	cursor.key_end = cursor.key_beg;
+	cursor.key_end.key = HAMMER_LOCALIZE_PSEUDOFS_MASK;
+	cursor.key_end.create_tid = HAMMER_MAX_TID;
+	cursor.asof = hmp->asof;
+	cursor.flags |= HAMMER_CURSOR_END_INCLUSIVE | HAMMER_CURSOR_ASOF;
+
+	/*
+	 * PFS 0 always exists, the others are found at their first
+	 * visible record.
+	 */
+	cerror = hammer_btree_first(&cursor);
+	for (;;) {
+		pfsm = hammer_load_pseudofs(&trans, localization, &error);
+		if (error == 0) {
+			if (count < max) {
+				ary[count].pfs_id = localization >> 16;
+				ary[count].mirror_flags =
+					pfsm->pfsd.mirror_flags;
+				if (pfsm->pfsd.mirror_flags &
+				    HAMMER_PFSD_SLAVE) {
+					ary[count].sync_end_tid =
+						pfsm->pfsd.sync_end_tid;
+				} else {
+					ary[count].sync_end_tid =
+					    trans.rootvol->ondisk->vol0_next_tid;
+				}
+			}
+			++count;
+		}
+		hammer_rel_pseudofs(hmp, pfsm);
+		if (error && error != ENOENT)
+			break;
+
+		error = 0;
+		while (cerror == 0) {
+			elm = &cursor.node->ondisk->elms[cursor.index].leaf;
+			if ((u_int32_t)elm->base.key != localization)
+				break;
+			cerror = hammer_btree_iterate(&cursor);
+		}
+		if (cerror) {
+			if (cerror != ENOENT)
+				error = cerror;
+			break;
+		}
+		localization = (u_int32_t)elm->base.key;
+	}
+done:
+	hammer_done_cursor(&cursor);
+	hammer_done_transaction(&trans);
+	*countp = count;
+	return(error);
+}
+
+/*
+ * Linux: add up the records of PFS pfs_id between key_beg and key_end
+ * (inclusive, localization without the PFS) in sum.  Records visible as
+ * of hmp->asof count towards inodes, records and, for file data,
+ * data_bytes, the data of all others towards history_bytes.  The scan
+ * does not keep the buffers it loads (HAMMER_TRANSF_BULK).
+ */
+int
+hammerfs_pfs_scan(hammer_mount_t hmp, int pfs_id,
+		  hammer_base_elm_t key_beg, hammer_base_elm_t key_end,
+		  struct hammerfs_pfs_summary *sum)
+{
+	struct hammer_transaction trans;
+	struct hammer_cursor cursor;
+	hammer_btree_leaf_elm_t elm;
+	u_int32_t localization;
+	int error;
+
+	localization = (u_int32_t)pfs_id << 16;
+
+	hammer_simple_transaction(&trans, hmp);
+	trans.flags |= HAMMER_TRANSF_BULK;
+	error = hammer_init_cursor(&trans, &cursor, NULL, NULL);
+	if (error)
+		goto done;
+	cursor.key_beg = *key_beg;
+	cursor.key_beg.localization &= HAMMER_LOCALIZE_MASK;
+	cursor.key_beg.localization += localization;
+	cursor.key_end = *key_end;
+	cursor.key_end.localization &= HAMMER_LOCALIZE_MASK;
+	cursor.key_end.localization += localization;
+	cursor.flags |= HAMMER_CURSOR_END_INCLUSIVE;
+
+	error = hammer_btree_first(&cursor);
+	while (error == 0) {
+		error = hammer_signal_check(hmp);
+		if (error)
+			break;
+		elm = &cursor.node->ondisk->elms[cursor.index].leaf;
+		if (hammer_btree_chkts(hmp->asof, &elm->base) == 0) {
+			++sum->records;
+			if (elm->base.rec_type == HAMMER_RECTYPE_INODE)
+				++sum->inodes;
+			if (elm->base.rec_type == HAMMER_RECTYPE_DATA ||
+			    elm->base.rec_type == HAMMER_RECTYPE_DB) {
+				sum->data_bytes += elm->data_len;
+			}
+		} else if (elm->data_offset) {
+			sum->history_bytes += elm->data_len;
+		}
+		error = hammer_btree_iterate(&cursor);
+	}
+	if (error == ENOENT)
+		error = 0;
+done:
+	hammer_done_cursor(&cursor);
+	hammer_done_transaction(&trans);
+	return(error);
+}
@@ -42,10 +42,74 @@
 #include <vfs/hammer/hammer.h>
 #include <sys/dirent.h>
 
+/*
+ * Linux: the state of a hammer_lock is protected by one of a small hash
+ * of spinlocks in place of DragonFly's critical sections, and waiters
+ * sleep on the lock with ssleep() under that spinlock so that no wakeup
+ * is lost.  Hashing keeps a zero-filled hammer_lock valid, as the core
+ * embeds them in structures it never initializes.
+ *
+ * Shared holders only take the spinlock for the count update, so readers
+ * of the same node or inode run in parallel.
+ */
+#define HAMMER_LOCK_HSIZE	64	/* power of 2 */
+
+static struct hammer_lock_spin {
+	spinlock_t	spin;
+} ____cacheline_aligned_in_smp hammer_lock_spins[HAMMER_LOCK_HSIZE] = {
+	[0 ... HAMMER_LOCK_HSIZE - 1] = {
+		.spin = __SPIN_LOCK_UNLOCKED(hammer_lock_spins.spin)
+	}
+};
+
+static __inline spinlock_t *
+hammer_lock_spin(struct hammer_lock *lock)
+{
+	unsigned long h = (unsigned long)lock;
+
+	h = (h >> 6) ^ (h >> 12);
+	return(&hammer_lock_spins[h & (HAMMER_LOCK_HSIZE - 1)].spin);
+}
+
+/*
+ * Wake up waiters after releasing the lock.  Called with the spinlock
+ * held.
+ */
+static __inline void
+hammer_lock_wakeup(struct hammer_lock *lock)
+{
+	if (lock->wanted) {
+		lock->wanted = 0;
+		wakeup(lock);
+	}
+}
+
 void
 hammer_lock_ex_ident(struct hammer_lock *lock, const char *ident)
 {
-    // no-op
+	thread_t td = curthread;
+	spinlock_t *spin = hammer_lock_spin(lock);
+
+	spin_lock(spin);
+	if (lock->locktd != td) {
+		while (lock->locktd != NULL || lock->lockcount) {
+			++lock->exwanted;
+			lock->wanted = 1;
+			if (hammer_debug_locks) {
+				kprintf("hammer_lock_ex: held by %p\n",
+					lock->locktd);
+			}
+			++hammer_contention_count;
+			ssleep(lock, spin, 0, ident, 0);
+			if (hammer_debug_locks)
+				kprintf("hammer_lock_ex: try again\n");
+			--lock->exwanted;
+		}
+		lock->locktd = td;
+	}
+	KKASSERT(lock->lockcount >= 0);
+	++lock->lockcount;
+	spin_unlock(spin);
 }
 
 /*
@@ -54,8 +118,20 @@ hammer_lock_ex_ident(struct hammer_lock *lock, const char *ident)
 int
 hammer_lock_ex_try(struct hammer_lock *lock)
 {
-    // no-op
+	thread_t td = curthread;
+	spinlock_t *spin = hammer_lock_spin(lock);
 
+	spin_lock(spin);
+	if (lock->locktd != td) {
+		if (lock->locktd != NULL || lock->lockcount) {
+			spin_unlock(spin);
+			return(EAGAIN);
+		}
+		lock->locktd = td;
+	}
+	KKASSERT(lock->lockcount >= 0);
+	++lock->lockcount;
+	spin_unlock(spin);
 	return(0);
 }
 
@@ -68,13 +144,37 @@ hammer_lock_ex_try(struct hammer_lock *lock)
 void
 hammer_lock_sh(struct hammer_lock *lock)
 {
-    // no-op
+	spinlock_t *spin = hammer_lock_spin(lock);
+
+	spin_lock(spin);
+	while (lock->locktd != NULL) {
+		if (lock->locktd == curthread) {
+			/* lock_sh on exclusive, counts as a recursion */
+			++lock->lockcount;
+			spin_unlock(spin);
+			return;
+		}
+		lock->wanted = 1;
+		ssleep(lock, spin, 0, "hmrlck", 0);
+	}
+	KKASSERT(lock->lockcount <= 0);
+	--lock->lockcount;
+	spin_unlock(spin);
 }
 
 int
 hammer_lock_sh_try(struct hammer_lock *lock)
 {
-    // no-op
+	spinlock_t *spin = hammer_lock_spin(lock);
+
+	spin_lock(spin);
+	if (lock->locktd) {
+		spin_unlock(spin);
+		return(EAGAIN);
+	}
+	KKASSERT(lock->lockcount <= 0);
+	--lock->lockcount;
+	spin_unlock(spin);
 	return(0);
 }
 
@@ -89,8 +189,27 @@ hammer_lock_sh_try(struct hammer_lock *lock)
 int
 hammer_lock_upgrade(struct hammer_lock *lock)
 {
-    // no-op
-    return(0);
+	spinlock_t *spin = hammer_lock_spin(lock);
+	int error;
+
+	spin_lock(spin);
+	if (lock->lockcount > 0) {
+		if (lock->locktd != curthread)
+			panic("hammer_lock_upgrade: illegal lock state");
+		error = 0;
+	} else if (lock->lockcount == -1) {
+		lock->lockcount = 1;
+		lock->locktd = curthread;
+		error = 0;
+	} else if (lock->lockcount != 0) {
+		error = EDEADLK;
+	} else {
+		panic("hammer_lock_upgrade: lock is not held");
+		/* NOT REACHED */
+		error = 0;
+	}
+	spin_unlock(spin);
+	return(error);
 }
 
 /*
@@ -99,13 +218,34 @@ hammer_lock_upgrade(struct hammer_lock *lock)
 void
 hammer_lock_downgrade(struct hammer_lock *lock)
 {
-    // no-op
+	spinlock_t *spin = hammer_lock_spin(lock);
+
+	KKASSERT(lock->lockcount == 1 && lock->locktd == curthread);
+	spin_lock(spin);
+	lock->lockcount = -1;
+	lock->locktd = NULL;
+	hammer_lock_wakeup(lock);
+	spin_unlock(spin);
 }
 
 void
 hammer_unlock(struct hammer_lock *lock)
 {
-    // no-op
+	spinlock_t *spin = hammer_lock_spin(lock);
+
+	spin_lock(spin);
+	KKASSERT(lock->lockcount != 0);
+	if (lock->lockcount < 0) {
+		if (++lock->lockcount == 0)
+			hammer_lock_wakeup(lock);
+	} else {
+		KKASSERT(lock->locktd == curthread);
+		if (--lock->lockcount == 0) {
+			lock->locktd = NULL;
+			hammer_lock_wakeup(lock);
+		}
+	}
+	spin_unlock(spin);
 }
 
 /*
@@ -122,26 +262,99 @@ hammer_lock_status(struct hammer_lock *lock)
 	panic("hammer_lock_status: lock must be held: %p", lock);
 }
 
+/*
+ * Linux: references are counted with atomic operations and never take
+ * the lock's spinlock.  The release functions of the referenced
+ * structures drop all but the last reference with hammer_unref_notlast(),
+ * only the last one goes through the interlocked slow path.
+ */
 void
 hammer_ref(struct hammer_lock *lock)
 {
-#if 0
 	KKASSERT(lock->refs >= 0);
-	crit_enter();
-	++lock->refs;
-	crit_exit();
-#endif
+	if ((lock->refs & HAMMER_REFS_PINNED) == 0)
+		atomic_add_int(&lock->refs, 1);
 }
 
 void
 hammer_unref(struct hammer_lock *lock)
 {
-#if 0
 	KKASSERT(lock->refs > 0);
-	crit_enter();
-	--lock->refs;
-	crit_exit();
-#endif
+	if ((lock->refs & HAMMER_REFS_PINNED) == 0)
+		atomic_subtract_int(&lock->refs, 1);
+}
+
+/*
+ * Drop a reference unless it is the last one.  Returns 0, with the
+ * reference still held, if the caller holds the last reference.
+ */
+int
+hammer_unref_notlast(struct hammer_lock *lock)
+{
+	int refs;
+
+	for (;;) {
+		refs = lock->refs;
+		KKASSERT(refs > 0);
+		if (refs & HAMMER_REFS_PINNED)
+			return(1);
+		if (refs == 1)
+			return(0);
+		if (atomic_cmpset_int(&lock->refs, refs, refs - 1))
+			return(1);
+	}
+}
+
+/*
+ * Pin a structure the caller holds the only reference to, taking over
+ * that reference.  Until hammer_unpin() hands it back, hammer_ref() and
+ * hammer_unref() leave refs alone, so threads referencing the structure
+ * concurrently only share its cache line instead of bouncing it.  To the
+ * code testing refs a pinned structure looks referenced more than once.
+ *
+ * Pinning is only done while the mount is quiescent, see
+ * hammerfs_pin_root().
+ */
+void
+hammer_pin(struct hammer_lock *lock)
+{
+	KKASSERT(lock->refs == 1);
+	lock->refs = HAMMER_REFS_PINNED | 1;
+}
+
+void
+hammer_unpin(struct hammer_lock *lock)
+{
+	KKASSERT(lock->refs == (HAMMER_REFS_PINNED | 1));
+	lock->refs = 1;
+}
+
+/*
+ * Linux: set up and tear down a lookup index, see struct hammer_hash.
+ * The bucket lists start out empty as the array is zeroed.
+ */
+int
+hammer_hash_init(struct hammer_hash *hash)
+{
+	int i;
+
+	hash->buckets = kmalloc(sizeof(*hash->buckets) * HAMMER_HASH_SIZE,
+				M_HAMMER, M_WAITOK|M_ZERO);
+	if (hash->buckets == NULL)
+		return(ENOMEM);
+	spin_lock_init(&hash->tree_spin);
+	for (i = 0; i < HAMMER_HASH_SIZE; ++i)
+		spin_lock_init(&hash->buckets[i].spin);
+	return(0);
+}
+
+void
+hammer_hash_free(struct hammer_hash *hash)
+{
+	if (hash->buckets) {
+		kfree(hash->buckets, M_HAMMER);
+		hash->buckets = NULL;
+	}
 }
 
 /*
@@ -1,2 +1,66 @@
 #include "dfly_wrap.h"
+
+/*
+ * Read-only transactions on a read-only mount are started and finished
+ * below without touching shared state.
+ */
+#define hammer_simple_transaction dfly_hammer_simple_transaction
+#define hammer_done_transaction dfly_hammer_done_transaction
 #include "dfly/vfs/hammer/hammer_transaction.c"
+#undef hammer_simple_transaction
+#undef hammer_done_transaction
+
+/*
+ * Return if a read-only transaction on hmp can take the fast path: the
+ * mount never modifies anything, so there is no TID to allocate and no
+ * flusher to wait for, and the root volume is pinned (see
+ * hammerfs_pin_root()), so it is used without a reference.
+ */
+static __inline int
+hammer_transaction_isfast(struct hammer_mount *hmp)
+{
+	return(hmp->ronly && hmp->rootvol &&
+	       (hmp->rootvol->io.lock.refs & HAMMER_REFS_PINNED));
+}
+
+/*
+ * Start a simple read-only transaction.  This will not stall.
+ *
+ * On the fast path the only thing written is the caller's transaction,
+ * so lookups, readdirs and reads on different cpus do not contend on the
+ * mount.  The timestamp only has second resolution, nothing reads it on
+ * a read-only mount.
+ */
+void
+hammer_simple_transaction(struct hammer_transaction *trans,
+			  struct hammer_mount *hmp)
+{
+	unsigned long sec;
+
+	if (hammer_transaction_isfast(hmp) == 0) {
+		dfly_hammer_simple_transaction(trans, hmp);
+		return;
+	}
+	trans->type = HAMMER_TRANS_RO;
+	trans->hmp = hmp;
+	trans->rootvol = hmp->rootvol;
+	trans->tid = 0;
+	trans->sync_lock_refs = 0;
+	trans->flags = 0;
+
+	sec = get_seconds();
+	trans->time = (u_int64_t)sec * 1000000ULL;
+	trans->time32 = (u_int32_t)sec;
+}
+
+void
+hammer_done_transaction(struct hammer_transaction *trans)
+{
+	if (trans->type != HAMMER_TRANS_RO ||
+	    hammer_transaction_isfast(trans->hmp) == 0) {
+		dfly_hammer_done_transaction(trans);
+		return;
+	}
+	KKASSERT(trans->sync_lock_refs == 0);
+	trans->rootvol = NULL;
+}
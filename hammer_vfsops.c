@@ -0,0 +1,752 @@
+/*
+ * mount-time setup for HAMMER Filesystem
+ *
+ * Everything here only depends on the core and on buffer_head access to
+ * the volume, so it is shared by the kernel module (super.c) and by the
+ * userspace build in user/.
+ */
+
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/buffer_head.h> // for sb_bread
+#include <linux/mm.h> // for register_shrinker
+#include <linux/mutex.h>
+#include <linux/dcache.h> // for sysctl_vfs_cache_pressure
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/cpumask.h>
+#include "hammerfs.h"
+#include "hammerfs_stats.h"
+
+#include "dfly_wrap.h"
+#include <vfs/hammer/hammer.h>
+
+// from vfs/hammer/hammer_vfsops.c
+int hammer_debug_io;
+int hammer_debug_general;
+int hammer_debug_debug = 1;     /* medium-error panics */
+int hammer_debug_inode;
+int hammer_debug_locks;
+int hammer_debug_btree;
+int hammer_debug_tid;
+int hammer_debug_recover;       /* -1 will disable, +1 will force */
+int hammer_debug_recover_faults;
+int hammer_cluster_enable = 1;      /* enable read clustering by default */
+int hammer_count_fsyncs;
+int hammer_count_inodes;
+int hammer_count_iqueued;
+int hammer_count_reclaiming;
+int hammer_count_records;
+int hammer_count_record_datas;
+int hammer_count_volumes;
+int hammer_count_buffers;
+int hammer_count_nodes;
+int64_t hammer_count_extra_space_used;
+int64_t hammer_stats_btree_lookups;
+int64_t hammer_stats_btree_searches;
+int64_t hammer_stats_btree_inserts;
+int64_t hammer_stats_btree_deletes;
+int64_t hammer_stats_btree_elements;
+int64_t hammer_stats_btree_splits;
+int64_t hammer_stats_btree_iterations;
+int64_t hammer_stats_record_iterations;
+
+int64_t hammer_stats_file_read;
+int64_t hammer_stats_file_write;
+int64_t hammer_stats_file_iopsr;
+int64_t hammer_stats_file_iopsw;
+int64_t hammer_stats_disk_read;
+int64_t hammer_stats_disk_write;
+int64_t hammer_stats_inode_flushes;
+int64_t hammer_stats_commits;
+
+int hammer_count_dirtybufspace;     /* global */
+int hammer_count_refedbufs;     /* global */
+int hammer_count_reservations;
+int hammer_count_io_running_read;
+int hammer_count_io_running_write;
+int hammer_count_io_locked;
+int hammer_limit_dirtybufspace;     /* per-mount */
+int hammer_limit_recs;          /* as a whole XXX */
+int hammer_autoflush = 2000;        /* auto flush */
+int hammer_bio_count;
+int hammer_verify_zone;
+int hammer_verify_data = 1;
+int hammer_write_mode;
+int64_t hammer_contention_count;
+int64_t hammer_zone_limit;
+
+MALLOC_DEFINE(M_HAMMER, "HAMMER-mount", "");
+
+/*
+ * DragonFly creates m_misc and m_inodes per mount with kmalloc_create().
+ * Here they are shared by all mounts, and the types of the objects a
+ * walk churns through are backed by slab caches (see dfly_kmalloc()).
+ */
+MALLOC_DEFINE(M_HAMMER_MISC, "HAMMER-others", "");
+MALLOC_DEFINE(M_HAMMER_INO, "HAMMER-inodes", "");
+MALLOC_DEFINE(M_HAMMER_BUF, "HAMMER-buffers", "");
+MALLOC_DEFINE(M_HAMMER_NODE, "HAMMER-nodes", "");
+
+const char *hammerfs_lat_names[HAMMERFS_LAT_OPS] = {
+    "io_read",
+    "btree_lookup",
+    "blockmap_lookup",
+    "readpage_bread"
+};
+
+static int hammerfs_shrink(int nr_to_scan, gfp_t gfp_mask);
+
+static struct shrinker hammerfs_shrinker = {
+    .shrink = hammerfs_shrink,
+    .seeks  = DEFAULT_SEEKS,
+};
+
+/*
+ * Mounts the shrinker takes buffers from, see hammerfs_add_shrinker().
+ */
+static TAILQ_HEAD(, hammer_mount) hammerfs_mounts =
+    TAILQ_HEAD_INITIALIZER(hammerfs_mounts);
+static DEFINE_MUTEX(hammerfs_mounts_lock);
+
+static void
+hammerfs_uninit_malloc(void)
+{
+    malloc_uninit(M_HAMMER_NODE);
+    malloc_uninit(M_HAMMER_BUF);
+    malloc_uninit(M_HAMMER_INO);
+    malloc_uninit(M_HAMMER_MISC);
+    malloc_uninit(M_HAMMER);
+}
+
+/*
+ * Register the malloc types, create their slab caches and register the
+ * shrinker.  Called once before the first mount.  Returns 0 or a negative
+ * error code.
+ */
+int
+hammerfs_init_caches(void)
+{
+    int error;
+
+    malloc_init(M_HAMMER);
+    malloc_init(M_HAMMER_MISC);
+    malloc_init(M_HAMMER_INO);
+    malloc_init(M_HAMMER_BUF);
+    malloc_init(M_HAMMER_NODE);
+
+    error = dfly_malloc_cache_create(M_HAMMER_INO,
+                                     sizeof(struct hammer_inode));
+    if (error == 0)
+        error = dfly_malloc_cache_create(M_HAMMER_BUF,
+                                         sizeof(struct hammer_buffer));
+    if (error == 0)
+        error = dfly_malloc_cache_create(M_HAMMER_NODE,
+                                         sizeof(struct hammer_node));
+    if (error) {
+        hammerfs_uninit_malloc();
+        return(error);
+    }
+    register_shrinker(&hammerfs_shrinker);
+    return(0);
+}
+
+/*
+ * Undo hammerfs_init_caches().  All objects must have been freed.
+ */
+void
+hammerfs_destroy_caches(void)
+{
+    unregister_shrinker(&hammerfs_shrinker);
+    hammerfs_uninit_malloc();
+}
+
+/*
+ * Initialize a freshly allocated, zeroed hammer_mount before any volume
+ * is installed.  Returns 0 or a negative error code.
+ */
+// corresponds to the first half of hammer_vfs_mount
+int
+hammerfs_init_mount(struct hammer_mount *hmp)
+{
+    int i;
+
+    hmp->root_btree_beg.localization = 0x00000000U;
+    hmp->root_btree_beg.obj_id = -0x8000000000000000LL;
+    hmp->root_btree_beg.key = -0x8000000000000000LL;
+    hmp->root_btree_beg.create_tid = 1;
+    hmp->root_btree_beg.delete_tid = 1;
+    hmp->root_btree_beg.rec_type = 0;
+    hmp->root_btree_beg.obj_type = 0;
+
+    hmp->root_btree_end.localization = 0xFFFFFFFFU;
+    hmp->root_btree_end.obj_id = 0x7FFFFFFFFFFFFFFFLL;
+    hmp->root_btree_end.key = 0x7FFFFFFFFFFFFFFFLL;
+    hmp->root_btree_end.create_tid = 0xFFFFFFFFFFFFFFFFULL;
+    hmp->root_btree_end.delete_tid = 0;   /* special case */
+    hmp->root_btree_end.rec_type = 0xFFFFU;
+    hmp->root_btree_end.obj_type = 0;
+
+    hmp->krate.freq = 1;    /* maximum reporting rate (hz) */
+    hmp->krate.count = -16; /* initial burst */
+
+    hmp->sync_lock.refs = 1;
+    hmp->free_lock.refs = 1;
+    hmp->undo_lock.refs = 1;
+    hmp->blkmap_lock.refs = 1;
+    hmp->pfs_summary_lock.refs = 1;
+
+    TAILQ_INIT(&hmp->delay_list);
+    TAILQ_INIT(&hmp->flush_group_list);
+    TAILQ_INIT(&hmp->objid_cache_list);
+    TAILQ_INIT(&hmp->undo_lru_list);
+    TAILQ_INIT(&hmp->reclaim_list);
+
+    hmp->master_id = 0;
+
+    hmp->asof = HAMMER_MAX_TID;
+
+    RB_INIT(&hmp->rb_vols_root);
+    RB_INIT(&hmp->rb_inos_root);
+    RB_INIT(&hmp->rb_nods_root);
+    RB_INIT(&hmp->rb_undo_root);
+    RB_INIT(&hmp->rb_resv_root);
+    RB_INIT(&hmp->rb_bufs_root);
+    RB_INIT(&hmp->rb_pfsm_root);
+
+    hmp->ronly = 1;
+
+    hmp->m_misc = M_HAMMER_MISC;
+    hmp->m_inodes = M_HAMMER_INO;
+
+    TAILQ_INIT(&hmp->volu_list);
+    TAILQ_INIT(&hmp->undo_list);
+    TAILQ_INIT(&hmp->data_list);
+    TAILQ_INIT(&hmp->meta_list);
+    TAILQ_INIT(&hmp->lose_list);
+    for (i = 0; i <= HAMMER_LRU_PARTS; ++i)
+        TAILQ_INIT(&hmp->lru_list[i]);
+    spin_lock_init(&hmp->lru_spin);
+
+    if (hammer_hash_init(&hmp->inos_hash) ||
+        hammer_hash_init(&hmp->nods_hash) ||
+        hammer_hash_init(&hmp->bufs_hash))
+        return(-ENOMEM);
+
+    hmp->stats = alloc_percpu(struct hammerfs_stats);
+    if (hmp->stats == NULL)
+        return(-ENOMEM);
+    return(0);
+}
+
+/*
+ * Release what hammerfs_init_mount() allocated.
+ */
+void
+hammerfs_free_mount(struct hammer_mount *hmp)
+{
+    hammerfs_remove_shrinker(hmp);
+    hammerfs_unpin_root(hmp);
+    if (hmp->stats) {
+        free_percpu(hmp->stats);
+        hmp->stats = NULL;
+    }
+    if (hmp->pfs_summary) {
+        kfree(hmp->pfs_summary, M_HAMMER);
+        hmp->pfs_summary = NULL;
+    }
+    hammer_hash_free(&hmp->bufs_hash);
+    hammer_hash_free(&hmp->nods_hash);
+    hammer_hash_free(&hmp->inos_hash);
+}
+
+/*
+ * Add up the per-cpu copies of the mount's statistics.
+ */
+void
+hammerfs_stats_sum(struct hammer_mount *hmp, struct hammerfs_stats *sum)
+{
+    u_int64_t *src;
+    u_int64_t *dst = (u_int64_t *)sum;
+    int cpu;
+    int i;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu) {
+        src = (u_int64_t *)per_cpu_ptr(hmp->stats, cpu);
+        for (i = 0; i < sizeof(*sum) / sizeof(u_int64_t); ++i)
+            dst[i] += src[i];
+    }
+}
+
+/*
+ * Return the number of samples in a latency histogram.
+ */
+u_int64_t
+hammerfs_lat_count(const u_int64_t *hist)
+{
+    u_int64_t count = 0;
+    int b;
+
+    for (b = 0; b < HAMMERFS_LAT_BUCKETS; ++b)
+        count += hist[b];
+    return(count);
+}
+
+/*
+ * Return the upper bound in ns of the bucket holding the pct'th
+ * percentile of a latency histogram, 0 if it is empty.
+ */
+u_int64_t
+hammerfs_lat_percentile(const u_int64_t *hist, int pct)
+{
+    u_int64_t count = hammerfs_lat_count(hist);
+    u_int64_t want;
+    u_int64_t seen = 0;
+    int b;
+
+    if (count == 0)
+        return(0);
+    want = (count * pct + 99) / 100;
+    for (b = 0; b < HAMMERFS_LAT_BUCKETS; ++b) {
+        seen += hist[b];
+        if (seen >= want)
+            break;
+    }
+    return(b ? 1ULL << b : 0);
+}
+
+/**
+ * Load a HAMMER volume by name.  Returns 0 on success or a positive error
+ * code on failure.
+ */
+// corresponds to hammer_install_volume
+int
+hammerfs_install_volume(struct hammer_mount *hmp, struct super_block *sb) {
+    struct buffer_head * bh;
+    hammer_volume_t volume;
+    struct hammer_volume_ondisk *ondisk;
+    int error = 0;
+
+    /*
+     * Allocate a volume structure
+     */
+    ++hammer_count_volumes;
+    volume = kmalloc(sizeof(*volume), hmp->m_misc, M_WAITOK|M_ZERO);
+    volume->vol_name = kstrdup(sb->s_id, hmp->m_misc);
+    volume->io.hmp = hmp;   /* bootstrap */
+    volume->io.offset = 0LL;
+    volume->io.bytes = HAMMER_BUFSIZE;
+
+    volume->sb = sb;
+
+    /*
+     * Extract the volume number from the volume header and do various
+     * sanity checks.
+     */
+    bh = sb_bread(sb, 0);
+    if(!bh) {
+        printk(KERN_ERR "HAMMER: %s: unable to read superblock\n", sb->s_id);
+        error = -EINVAL;
+        goto failed;
+    }
+
+    ondisk = (struct hammer_volume_ondisk *)bh->b_data;
+    if (ondisk->vol_signature != HAMMER_FSBUF_VOLUME) {
+        printk(KERN_ERR "hammer_mount: volume %s has an invalid header\n",
+                volume->vol_name);
+        error = -EINVAL;
+        goto failed;
+    }
+
+    volume->ondisk = ondisk;
+    volume->vol_no = ondisk->vol_no;
+    volume->buffer_base = ondisk->vol_buf_beg;
+    volume->vol_flags = ondisk->vol_flags;
+    volume->nblocks = ondisk->vol_nblocks; 
+    volume->maxbuf_off = HAMMER_ENCODE_RAW_BUFFER(volume->vol_no,
+                                ondisk->vol_buf_end - ondisk->vol_buf_beg);
+    volume->maxraw_off = ondisk->vol_buf_end;
+
+    if (RB_EMPTY(&hmp->rb_vols_root)) {
+        hmp->fsid = ondisk->vol_fsid;
+    } else if (bcmp(&hmp->fsid, &ondisk->vol_fsid, sizeof(uuid_t))) {
+        printk(KERN_ERR "hammer_mount: volume %s's fsid does not match "
+                        "other volumes\n", volume->vol_name);
+        error = -EINVAL;
+        goto failed;
+    }
+
+    /*
+     * Insert the volume structure into the red-black tree.
+     */
+    if (RB_INSERT(hammer_vol_rb_tree, &hmp->rb_vols_root, volume)) {
+        printk(KERN_ERR "hammer_mount: volume %s has a duplicate vol_no %d\n",
+            volume->vol_name, volume->vol_no);
+        error = -EEXIST;
+    }
+
+    /*
+     * Set the root volume .  HAMMER special cases rootvol the structure.
+     * We do not hold a ref because this would prevent related I/O
+     * from being flushed.
+     */
+    if (error == 0 && ondisk->vol_rootvol == ondisk->vol_no) {
+        hmp->rootvol = volume;
+        hmp->nvolumes = ondisk->vol_count;
+    }
+
+    return(0);
+
+failed:
+    if(bh)
+        brelse(bh);
+    return(error);
+}
+
+/*
+ * Report critical errors.  ip may be NULL.
+ */
+// from vfs/hammer/hammer_vfsops.c
+void
+hammer_critical_error(hammer_mount_t hmp, hammer_inode_t ip,
+              int error, const char *msg)
+{
+    printk(KERN_CRIT "HAMMER: Critical error %s\n", msg);
+    hmp->error = error;
+}
+
+/*
+ * Pin the root volume and the root B-Tree node, which every transaction
+ * and every B-Tree search from the top references, so that parallel
+ * readers do not contend on their reference counts (see hammer_pin()).
+ * Called once the volumes are installed.  Returns 0 or a negative error
+ * code.
+ */
+int
+hammerfs_pin_root(struct hammer_mount *hmp)
+{
+    struct hammer_transaction trans;
+    hammer_volume_t volume;
+    hammer_node_t node;
+    int error;
+
+    volume = hammer_get_root_volume(hmp, &error);
+    if (volume == NULL)
+        return(-error);
+    hammer_pin(&volume->io.lock);
+
+    hammer_simple_transaction(&trans, hmp);
+    node = hammer_get_node(&trans, volume->ondisk->vol0_btree_root, 0,
+                           &error);
+    hammer_done_transaction(&trans);
+    if (node == NULL) {
+        hammerfs_unpin_root(hmp);
+        return(-error);
+    }
+    hammer_pin(&node->lock);
+    hmp->rootnode = node;
+    return(0);
+}
+
+/*
+ * Drop the references hammerfs_pin_root() took.  The mount must be idle.
+ */
+void
+hammerfs_unpin_root(struct hammer_mount *hmp)
+{
+    hammer_volume_t volume = hmp->rootvol;
+
+    if (hmp->rootnode) {
+        hammer_unpin(&hmp->rootnode->lock);
+        hammer_rel_node(hmp->rootnode);
+        hmp->rootnode = NULL;
+    }
+    if (volume && (volume->io.lock.refs & HAMMER_REFS_PINNED)) {
+        hammer_unpin(&volume->io.lock);
+        hammer_rel_volume(volume, 0);
+    }
+}
+
+/*
+ * Parse the comma separated mount options in data, which may be NULL and
+ * is modified.  The only option is asof=0x%016llx, which mounts the
+ * filesystem as of that TID like mount_hammer -o asof does.  Returns 0
+ * or a negative error code.
+ */
+int
+hammerfs_parse_options(struct hammer_mount *hmp, char *data)
+{
+    u_int32_t localization;
+    hammer_tid_t asof;
+    char *opt;
+    int ispfs;
+
+    while ((opt = strsep(&data, ",")) != NULL) {
+        if (*opt == 0)
+            continue;
+        if (strncmp(opt, "asof=", 5) == 0) {
+            localization = HAMMER_DEF_LOCALIZATION;
+            if (hammer_str_to_tid(opt + 5, &ispfs, &asof, &localization) ||
+                ispfs || asof == 0) {
+                printk(KERN_ERR "HAMMER: bad asof TID %s\n", opt + 5);
+                return(-EINVAL);
+            }
+            hmp->asof = asof;
+        } else {
+            printk(KERN_ERR "HAMMER: unknown mount option %s\n", opt);
+            return(-EINVAL);
+        }
+    }
+    return(0);
+}
+
+/*
+ * Split a "name@@0x%016llx[:%05d]" path component into the name and the
+ * TID (and PFS) it is to be looked up as of, like hammer_vop_nresolve().
+ * *asofp and *localizationp come in as the directory's and are only
+ * changed if the extension is valid; otherwise the whole component is a
+ * plain name.  Returns the length of the name, which is 0 when the
+ * component names the root of a PFS (*ispfsp is set).
+ */
+int
+hammerfs_name_asof(const char *name, int nlen, hammer_tid_t *asofp,
+                   u_int32_t *localizationp, int *ispfsp)
+{
+    char buf[32];
+    int i;
+
+    *ispfsp = 0;
+    for (i = 0; i + 1 < nlen; ++i) {
+        if (name[i] == '@' && name[i + 1] == '@')
+            break;
+    }
+    if (i + 1 >= nlen || nlen - i - 2 >= sizeof(buf))
+        return(nlen);
+    bcopy(name + i + 2, buf, nlen - i - 2);
+    buf[nlen - i - 2] = 0;
+    if (hammer_str_to_tid(buf, ispfsp, asofp, localizationp))
+        return(nlen);
+    return(i);
+}
+
+/*
+ * Memory pressure.  Unreferenced buffers keep their data until HAMMER
+ * flushes them, the shrinker releases them oldest first from each
+ * mount's lru_list[] along with the B-Tree nodes they back, starting with
+ * the PFSs which hold the most (see hammer_reclaim_buffers()).  Shrinkers
+ * have no private argument, so one shrinker serves all mounts on
+ * hammerfs_mounts and each call starts with the next mount.
+ *
+ * Returns the number of buffers left to reclaim, scaled by
+ * vfs_cache_pressure like the dcache and icache.
+ */
+static int
+hammerfs_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+    struct hammer_mount *hmp;
+    int count = 0;
+    int freed;
+    int n;
+
+    if (nr_to_scan && !(gfp_mask & __GFP_FS))
+        return(-1);
+
+    mutex_lock(&hammerfs_mounts_lock);
+    TAILQ_FOREACH(hmp, &hammerfs_mounts, shrink_entry) {
+        n = min(nr_to_scan, hmp->count_lru);
+        if (n > 0) {
+            freed = hammer_reclaim_buffers(hmp, n);
+            hammerfs_stats_add(hmp, shrink_scanned, n);
+            hammerfs_stats_add(hmp, shrink_freed, freed);
+            nr_to_scan -= n;
+        }
+        count += hmp->count_lru;
+    }
+    if ((hmp = TAILQ_FIRST(&hammerfs_mounts)) != NULL) {
+        TAILQ_REMOVE(&hammerfs_mounts, hmp, shrink_entry);
+        TAILQ_INSERT_TAIL(&hammerfs_mounts, hmp, shrink_entry);
+    }
+    mutex_unlock(&hammerfs_mounts_lock);
+    return(count / 100 * sysctl_vfs_cache_pressure);
+}
+
+/*
+ * Let the shrinker take buffers from a mount.  Called once the mount is
+ * set up.
+ */
+void
+hammerfs_add_shrinker(struct hammer_mount *hmp)
+{
+    mutex_lock(&hammerfs_mounts_lock);
+    TAILQ_INSERT_TAIL(&hammerfs_mounts, hmp, shrink_entry);
+    hmp->flags |= HAMMER_MOUNT_SHRINKER;
+    mutex_unlock(&hammerfs_mounts_lock);
+}
+
+/*
+ * Take a mount off the shrinker's list.  Waits for a running shrinker
+ * call to finish.
+ */
+void
+hammerfs_remove_shrinker(struct hammer_mount *hmp)
+{
+    mutex_lock(&hammerfs_mounts_lock);
+    if (hmp->flags & HAMMER_MOUNT_SHRINKER) {
+        TAILQ_REMOVE(&hammerfs_mounts, hmp, shrink_entry);
+        hmp->flags &= ~HAMMER_MOUNT_SHRINKER;
+    }
+    mutex_unlock(&hammerfs_mounts_lock);
+}
+
+/*
+ * Per-PFS summary.  Each PFS is split into key ranges at B-Tree
+ * separators (hammerfs_mirror_split()), and the ranges of all PFSs are
+ * handed out one at a time to nworkers threads, the caller being one of
+ * them.  HAMMERFS_PFS_WORKERS bounds nworkers and, per PFS, the ranges.
+ */
+#define HAMMERFS_PFS_WORKERS    16
+
+struct hammerfs_pfs_unit {
+    int pfs;                            /* index in the summary */
+    struct hammerfs_mirror_range range;
+    struct hammerfs_pfs_summary sum;
+};
+
+struct hammerfs_pfs_work {
+    struct hammer_mount *hmp;
+    struct hammerfs_pfs_summary *ary;
+    struct hammerfs_pfs_unit *units;
+    int nunits;
+    atomic_t next;                      /* next unit to scan */
+    atomic_t running;                   /* workers not done */
+    int error;
+    struct completion done;
+};
+
+static int
+hammerfs_pfs_worker(void *arg)
+{
+    struct hammerfs_pfs_work *work = arg;
+    struct hammerfs_pfs_unit *unit;
+    int error;
+    int i;
+
+    while ((i = atomic_inc_return(&work->next) - 1) < work->nunits) {
+        unit = &work->units[i];
+        error = hammerfs_pfs_scan(work->hmp, work->ary[unit->pfs].pfs_id,
+                                  &unit->range.key_beg,
+                                  &unit->range.key_end, &unit->sum);
+        if (error)
+            work->error = error;
+    }
+    if (atomic_dec_and_test(&work->running))
+        complete(&work->done);
+    return(0);
+}
+
+static int
+hammerfs_pfs_compute(struct hammer_mount *hmp, int nworkers)
+{
+    struct hammerfs_ioc_mirror_split split;
+    struct hammerfs_mirror_range *ranges;
+    struct hammerfs_pfs_summary *ary;
+    struct hammerfs_pfs_work work;
+    struct task_struct *td;
+    int count;
+    int error;
+    int i;
+    int j;
+
+    error = hammerfs_pfs_list(hmp, NULL, 0, &count);
+    if (error)
+        return(error);
+    ary = kmalloc(count * sizeof(*ary), M_HAMMER, M_WAITOK | M_ZERO);
+    error = hammerfs_pfs_list(hmp, ary, count, &count);
+    if (error) {
+        kfree(ary, M_HAMMER);
+        return(error);
+    }
+
+    memset(&work, 0, sizeof(work));
+    work.hmp = hmp;
+    work.ary = ary;
+    work.units = kmalloc(count * nworkers * sizeof(*work.units), M_HAMMER,
+                         M_WAITOK | M_ZERO);
+    ranges = kmalloc(nworkers * sizeof(*ranges), M_HAMMER, M_WAITOK);
+    for (i = 0; i < count && error == 0; ++i) {
+        memset(&split, 0, sizeof(split));
+        split.key_beg = hmp->root_btree_beg;
+        split.key_beg.localization = 0;
+        split.key_end = hmp->root_btree_end;
+        split.key_end.localization = HAMMER_LOCALIZE_MASK;
+        split.pfs_id = ary[i].pfs_id;
+        split.count = nworkers;
+        error = hammerfs_mirror_split(hmp, &split, ranges);
+        for (j = 0; error == 0 && j < split.count; ++j) {
+            work.units[work.nunits].pfs = i;
+            work.units[work.nunits].range = ranges[j];
+            ++work.nunits;
+        }
+    }
+    kfree(ranges, M_HAMMER);
+
+    if (error == 0) {
+        if (nworkers > work.nunits)
+            nworkers = work.nunits;
+        atomic_set(&work.next, 0);
+        atomic_set(&work.running, nworkers);
+        init_completion(&work.done);
+        for (i = 1; i < nworkers; ++i) {
+            td = kthread_run(hammerfs_pfs_worker, &work, "hammer-pfs");
+            if (IS_ERR(td))
+                atomic_sub(1, &work.running);
+        }
+        hammerfs_pfs_worker(&work);
+        wait_for_completion(&work.done);
+        error = work.error;
+    }
+
+    for (i = 0; error == 0 && i < work.nunits; ++i) {
+        struct hammerfs_pfs_summary *sum = &ary[work.units[i].pfs];
+
+        sum->inodes += work.units[i].sum.inodes;
+        sum->records += work.units[i].sum.records;
+        sum->data_bytes += work.units[i].sum.data_bytes;
+        sum->history_bytes += work.units[i].sum.history_bytes;
+    }
+    kfree(work.units, M_HAMMER);
+    if (error) {
+        kfree(ary, M_HAMMER);
+        return(error);
+    }
+    hmp->pfs_summary = ary;
+    hmp->pfs_count = count;
+    return(0);
+}
+
+/*
+ * Return the summary of every PFS of the mount in *aryp, computed with
+ * nworkers threads (0 for one per online cpu) by the first caller and
+ * kept until unmount; the mount is read-only, so it does not go stale.
+ * Returns a positive errno.
+ */
+int
+hammerfs_pfs_summary(struct hammer_mount *hmp, int nworkers,
+                     struct hammerfs_pfs_summary **aryp, int *countp)
+{
+    int error = 0;
+
+    if (nworkers <= 0)
+        nworkers = num_online_cpus();
+    if (nworkers > HAMMERFS_PFS_WORKERS)
+        nworkers = HAMMERFS_PFS_WORKERS;
+
+    hammer_lock_ex(&hmp->pfs_summary_lock);
+    if (hmp->pfs_summary == NULL)
+        error = hammerfs_pfs_compute(hmp, nworkers);
+    hammer_unlock(&hmp->pfs_summary_lock);
+    *aryp = hmp->pfs_summary;
+    *countp = hmp->pfs_count;
+    return(error);
+}
@@ -6,6 +6,91 @@
 #include "dfly_wrap.h"
 
 #include "hammer.h"
+#include "hammerfs_ioctl.h"
+
+/*
+ * Debug messages of the Linux glue.
+ *
+ * A message is printed if its level is at most hammerfs_debug_level and
+ * its subsystem is set in hammerfs_debug_mask (module parameters
+ * debug_level and debug_mask, writable at runtime).  Messages go through
+ * the mount's krate, so a busy path cannot flood the console.  Without
+ * CONFIG_HAMMER_FS_DEBUG only HAMMERFS_DBG_ERR messages are compiled in.
+ */
+#define HAMMERFS_DBG_ERR        1
+#define HAMMERFS_DBG_INFO       2
+#define HAMMERFS_DBG_TRACE      3       /* every VFS entry point */
+
+#define HAMMERFS_DBG_SUPER      0x0001
+#define HAMMERFS_DBG_INODE      0x0002  /* lookup, getattr, setattr */
+#define HAMMERFS_DBG_FILE       0x0004  /* open, ioctl */
+#define HAMMERFS_DBG_DIR        0x0008  /* readdir */
+#define HAMMERFS_DBG_READ       0x0010  /* readpage */
+#define HAMMERFS_DBG_ALL        0xffff
+
+extern int hammerfs_debug_level;
+extern unsigned int hammerfs_debug_mask;
+
+#ifdef CONFIG_HAMMER_FS_DEBUG
+#define hammerfs_debug_enabled(subsys, level)                   \
+    unlikely((level) <= hammerfs_debug_level &&                 \
+             ((subsys) & hammerfs_debug_mask))
+#else
+#define hammerfs_debug_enabled(subsys, level)                   \
+    unlikely((level) == HAMMERFS_DBG_ERR &&                     \
+             (level) <= hammerfs_debug_level &&                 \
+             ((subsys) & hammerfs_debug_mask))
+#endif
+
+#define hammerfs_debug(hmp, subsys, level, fmt, args...)        \
+    do {                                                        \
+        if (hammerfs_debug_enabled(subsys, level))              \
+            krateprintf(&(hmp)->krate, "%sHAMMER: " fmt,        \
+                        (level) == HAMMERFS_DBG_ERR ?           \
+                        KERN_ERR : KERN_DEBUG, ## args);        \
+    } while (0)
+
+/*
+ * Where a HAMMERFSIOC_GETHISTORY_STREAM walk stands between calls, kept
+ * per open file (see hammer_ioctl.c and hammerfs_ioctl.h).
+ */
+struct hammerfs_history_cursor {
+    struct hammer_node_cache cache;     /* leaf the last call ended in */
+    struct hammer_base_elm next;        /* first element not returned */
+    struct hammer_base_elm key_end;
+    struct hammer_ioc_history hist;     /* parameters and add_history() state */
+    int eof;
+};
+
+/*
+ * Receiver of a mirror-read stream, see hammerfs_mirror_stream() in
+ * hammer_mirror.c.  add() is passed the pieces of each mrecord in order,
+ * isdata set for record data, which points into a HAMMER buffer and is
+ * only valid until the next flush().  add() sets full once the sink
+ * wants to be flushed.  Both return a positive errno like the core.
+ * Records passed to a sink with nocrc set have rec_crc 0.
+ */
+struct hammerfs_mirror_sink {
+    int (*add)(struct hammerfs_mirror_sink *sink, const void *addr, int len,
+               int isdata);
+    int (*flush)(struct hammerfs_mirror_sink *sink);
+    int full;
+    int nocrc;
+};
+
+/*
+ * Sink writing the records passed to it to out as HAMMERFS_MIRROR_FRAMES
+ * frames, see mframe.c.
+ */
+struct hammerfs_mframe_sink {
+    struct hammerfs_mirror_sink sink;
+    struct hammerfs_mirror_sink *out;
+    struct hammerfs_mframe_head head;
+    int raw_len;
+    char *raw;                          /* records of the next frame */
+    char *frame;                        /* compressed payload */
+    u_int32_t *table;                   /* compressor hash table */
+};
 
 extern struct inode_operations hammerfs_inode_operations;
 extern struct file_operations hammerfs_file_operations;
@@ -16,4 +101,57 @@ extern struct address_space_operations hammerfs_address_space_operations;
 int hammerfs_get_inode(struct super_block *sb, struct hammer_inode *ip, struct inode **inode);
 int hammerfs_get_itype(char obj_type);
 
+int hammerfs_init_caches(void);
+void hammerfs_destroy_caches(void);
+int hammerfs_init_mount(struct hammer_mount *hmp);
+void hammerfs_free_mount(struct hammer_mount *hmp);
+int hammerfs_install_volume(struct hammer_mount *hmp, struct super_block *sb);
+int hammerfs_pin_root(struct hammer_mount *hmp);
+void hammerfs_unpin_root(struct hammer_mount *hmp);
+int hammerfs_parse_options(struct hammer_mount *hmp, char *data);
+int hammerfs_name_asof(const char *name, int nlen, hammer_tid_t *asofp,
+                       u_int32_t *localizationp, int *ispfsp);
+void hammerfs_add_shrinker(struct hammer_mount *hmp);
+void hammerfs_remove_shrinker(struct hammer_mount *hmp);
+
+int hammerfs_ioc_gethistory(struct hammer_inode *ip,
+                            struct hammer_ioc_history *hist);
+int hammerfs_history_start(struct hammer_inode *ip,
+                           struct hammerfs_history_cursor *hc);
+int hammerfs_history_read(struct hammer_inode *ip,
+                          struct hammerfs_history_cursor *hc,
+                          struct hammer_ioc_hist_entry *ary, int max,
+                          int *countp);
+void hammerfs_history_done(struct hammerfs_history_cursor *hc);
+int hammerfs_ioc_mirror_read(struct hammer_inode *ip,
+                             struct hammer_ioc_mirror_rw *mirror);
+int hammerfs_mirror_stream(struct hammer_inode *ip,
+                           struct hammer_ioc_mirror_rw *mirror,
+                           struct hammerfs_mirror_sink *sink);
+int hammerfs_mirror_split(struct hammer_mount *hmp,
+                          struct hammerfs_ioc_mirror_split *split,
+                          struct hammerfs_mirror_range *ranges);
+
+int hammerfs_pfs_list(struct hammer_mount *hmp,
+                      struct hammerfs_pfs_summary *ary, int max, int *countp);
+int hammerfs_pfs_scan(struct hammer_mount *hmp, int pfs_id,
+                      struct hammer_base_elm *key_beg,
+                      struct hammer_base_elm *key_end,
+                      struct hammerfs_pfs_summary *sum);
+int hammerfs_pfs_summary(struct hammer_mount *hmp, int nworkers,
+                         struct hammerfs_pfs_summary **aryp, int *countp);
+int hammerfs_lz_compress(const void *src, int len, void *dst, int dmax,
+                         u_int32_t *table);
+int hammerfs_lz_decompress(const void *src, int slen, void *dst, int dmax);
+int hammerfs_mframe_init(struct hammerfs_mframe_sink *ms,
+                         struct hammerfs_mirror_sink *out);
+void hammerfs_mframe_done(struct hammerfs_mframe_sink *ms);
+int hammerfs_mframe_decode(const struct hammerfs_mframe_head *head,
+                           const void *payload, void *raw, int reccrc);
+
+int hammerfs_init_stats(void);
+void hammerfs_exit_stats(void);
+int hammerfs_register_stats(struct super_block *sb);
+void hammerfs_unregister_stats(struct super_block *sb);
+
 #endif /* _HAMMERFS_H */
@@ -0,0 +1,151 @@
+#ifndef _HAMMERFS_IOCTL_H
+#define _HAMMERFS_IOCTL_H
+
+/*
+ * Linux-only ioctls of HAMMER Filesystem
+ *
+ * The DragonFly ioctls (vfs/hammer/hammer_ioctl.h) that are implemented
+ * on Linux keep their numbers and structures.  Ours use numbers from 64
+ * up in the same 'h' group.
+ *
+ * HAMMERFSIOC_GETHISTORY_STREAM returns the same transaction ids as
+ * HAMMERIOC_GETHISTORY, in as many calls as it takes to fill hist_ary
+ * (max entries, at least 2) each time.  The open file remembers where the
+ * walk stopped and the next call continues from there, without searching
+ * the B-Tree from its root again.  The first call on a file descriptor,
+ * or one with HAMMERFS_IOC_HISTORY_RESTART set, starts a new walk with
+ * HAMMER_IOC_HISTORY_ATKEY, beg_tid, end_tid, key and nxt_key as for
+ * HAMMERIOC_GETHISTORY; other calls ignore them.
+ *
+ * A call returns count 0 only when the walk is over.  head.flags then
+ * has HAMMER_IOC_HISTORY_EOF set, or HAMMER_IOC_HISTORY_NEXT_KEY with
+ * nxt_key set as for HAMMERIOC_GETHISTORY.
+ *
+ * HAMMERFSIOC_MIRROR_READ_SPLICE writes the mrecord stream
+ * HAMMERIOC_MIRROR_READ would copy to ubuf to the pipe or socket fd
+ * instead; ubuf is ignored.  Record data is handed over by reference to
+ * the block device's page cache where it is large enough to be worth it.
+ * size, count and key_cur work as for HAMMERIOC_MIRROR_READ, so an
+ * incremental sync is a loop restarting at key_cur.  If the call fails
+ * part of a batch may have been written, the caller has to start over
+ * from the key_cur of the last call that succeeded.
+ *
+ * With HAMMERFS_MIRROR_FRAMES in flags the records are written as a
+ * sequence of frames instead: a struct hammerfs_mframe_head followed by
+ * frame_size bytes of payload, which are raw_size bytes of mrecords
+ * compressed as per algo.  Frames hold whole records of up to
+ * HAMMERFS_MFRAME_SIZE bytes, and the records inside have rec_crc 0:
+ * frame_crc covers the frame head from algo on and the uncompressed
+ * records.  The compressed format is that of an LZ4 block.  size and
+ * count still count mrecord bytes.  The plain stream stays the default.
+ *
+ * HAMMERFSIOC_MIRROR_SPLIT divides key_beg..key_end of a PFS into at
+ * most count ranges (HAMMERFS_MIRROR_SPLIT_MAX) for concurrent
+ * mirror-reads, split at B-Tree separators so that they hold about the
+ * same number of subtrees.  The ranges are returned in key order in
+ * ranges[] and count is set to their number, which is smaller if the
+ * tree is.  They are disjoint and cover the whole range: the record
+ * streams of mirror-reads over them, in range order, are the stream a
+ * single mirror-read over key_beg..key_end would return, except that a
+ * range starting inside a subtree the single scan skips returns PASS
+ * records for that leaf instead.  Each stream can be applied on its own.
+ *
+ * HAMMERFSIOC_PFS_SUMMARY returns a struct hammerfs_pfs_summary for each
+ * PFS of the mount, as of the mount's TID, in pfs_id order.  count is
+ * the number of entries in ary on input and the number of PFSs on
+ * output; if it went up, only the first entries were filled in.  The
+ * summary is computed by the first caller, with one scan of the B-Tree
+ * spread over the cpus, and kept until unmount.  inodes and records
+ * count the visible records, data_bytes their file data, history_bytes
+ * the data of the records which are no longer visible.  sync_end_tid is
+ * the TID a slave was last synced to, or the volume's next TID for a
+ * master.  /proc/fs/hammer/<dev>/pfs shows the same.
+ *
+ * The mirror ioctls require CAP_SYS_ADMIN.
+ */
+
+#include <vfs/hammer/hammer_ioctl.h>
+
+struct hammerfs_ioc_history_stream {
+    struct hammer_ioc_head head;
+    int64_t obj_id;                     /* out */
+    hammer_tid_t beg_tid;               /* in, on restart */
+    hammer_tid_t end_tid;               /* in, on restart */
+    int64_t key;                        /* in, on restart */
+    int64_t nxt_key;                    /* in, on restart, out */
+    int max;                            /* in, entries in hist_ary */
+    int count;                          /* out */
+    struct hammer_ioc_hist_entry *hist_ary;
+};
+
+#define HAMMERFS_IOC_HISTORY_RESTART    0x0100
+
+struct hammerfs_ioc_mirror_splice {
+    struct hammer_ioc_mirror_rw mirror;
+    int fd;                             /* in, pipe or socket */
+    int flags;                          /* in */
+};
+
+#define HAMMERFS_MIRROR_FRAMES          0x0001
+
+struct hammerfs_mframe_head {
+    u_int32_t signature;                /* HAMMERFS_MFRAME_SIGNATURE */
+    u_int32_t frame_crc;
+    u_int16_t algo;
+    u_int16_t reserved01;
+    u_int32_t raw_size;                 /* bytes of mrecords */
+    u_int32_t frame_size;               /* bytes of payload that follow */
+    u_int32_t reserved02;
+};
+
+#define HAMMERFS_MFRAME_SIGNATURE       0x4d46524dU
+#define HAMMERFS_MFRAME_CRCOFF \
+    (offsetof(struct hammerfs_mframe_head, algo))
+#define HAMMERFS_MFRAME_SIZE            (256 * 1024)
+
+#define HAMMERFS_MFRAME_STORED          0       /* payload is raw */
+#define HAMMERFS_MFRAME_LZ              1
+
+struct hammerfs_mirror_range {
+    struct hammer_base_elm key_beg;
+    struct hammer_base_elm key_end;     /* inclusive */
+};
+
+struct hammerfs_ioc_mirror_split {
+    struct hammer_ioc_head head;
+    struct hammer_base_elm key_beg;     /* in, range to split */
+    struct hammer_base_elm key_end;     /* in */
+    int pfs_id;                         /* in */
+    int count;                          /* in, max ranges, out */
+    struct hammerfs_mirror_range *ranges;
+};
+
+#define HAMMERFS_MIRROR_SPLIT_MAX       64
+
+struct hammerfs_pfs_summary {
+    u_int32_t pfs_id;
+    u_int32_t mirror_flags;             /* HAMMER_PFSD_xxx */
+    int64_t inodes;
+    int64_t records;
+    int64_t data_bytes;
+    int64_t history_bytes;
+    hammer_tid_t sync_end_tid;
+};
+
+struct hammerfs_ioc_pfs_summary {
+    struct hammer_ioc_head head;
+    int count;                          /* in, entries in ary, out */
+    int reserved01;
+    struct hammerfs_pfs_summary *ary;
+};
+
+#define HAMMERFSIOC_GETHISTORY_STREAM \
+    _IOWR('h', 64, struct hammerfs_ioc_history_stream)
+#define HAMMERFSIOC_MIRROR_READ_SPLICE \
+    _IOWR('h', 65, struct hammerfs_ioc_mirror_splice)
+#define HAMMERFSIOC_MIRROR_SPLIT \
+    _IOWR('h', 66, struct hammerfs_ioc_mirror_split)
+#define HAMMERFSIOC_PFS_SUMMARY \
+    _IOWR('h', 67, struct hammerfs_ioc_pfs_summary)
+
+#endif /* _HAMMERFS_IOCTL_H */
@@ -0,0 +1,94 @@
+#ifndef _HAMMERFS_STATS_H
+#define _HAMMERFS_STATS_H
+
+/*
+ * Per-mount statistics for HAMMER Filesystem
+ *
+ * The counters live in per-cpu copies hanging off hmp->stats so that the
+ * hot paths never share a cache line; readers add the copies up with
+ * hammerfs_stats_sum().  They are exported as /proc/fs/hammer/<dev>/stats
+ * (see stats.c).
+ *
+ * A hit is a lookup satisfied from memory, a miss one that had to load
+ * something from the volume.
+ *
+ * The same per-cpu block carries a log2 latency histogram for each of the
+ * operations below; bucket b counts latencies of [2^(b-1), 2^b) ns.  They
+ * are exported as /proc/fs/hammer/<dev>/latency.  Each timed operation
+ * also fires a kernel marker of the same name (see Documentation/markers.txt)
+ * carrying its arguments and latency.
+ */
+
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/bitops.h>
+#include <linux/marker.h>
+
+struct hammer_mount;
+
+#define HAMMERFS_LAT_IO_READ         0  /* hammer_io_read() */
+#define HAMMERFS_LAT_BTREE_LOOKUP    1  /* hammer_btree_lookup/first/last() */
+#define HAMMERFS_LAT_BLOCKMAP_LOOKUP 2  /* hammer_blockmap_lookup() */
+#define HAMMERFS_LAT_READPAGE_BREAD  3  /* sb_bread loop of readpage */
+#define HAMMERFS_LAT_OPS             4
+
+#define HAMMERFS_LAT_BUCKETS         40 /* last bucket is >= 2^38 ns */
+
+extern const char *hammerfs_lat_names[HAMMERFS_LAT_OPS];
+
+struct hammerfs_stats {
+    u_int64_t inode_hits;       /* hammer_get_inode() */
+    u_int64_t inode_misses;
+    u_int64_t buffer_hits;      /* hammer_get_buffer() */
+    u_int64_t buffer_misses;
+    u_int64_t node_hits;        /* hammer_get_node() */
+    u_int64_t node_misses;
+    u_int64_t blockmap_direct;  /* hammer_blockmap_lookup(), direct-mapped */
+    u_int64_t blockmap_verified; /* hammer_verify_zone, read layer1/layer2 */
+    u_int64_t disk_reads;       /* hammer_io_read() */
+    u_int64_t disk_read_bytes;
+    u_int64_t file_reads;       /* hammerfs_readpage() */
+    u_int64_t file_read_bytes;
+    u_int64_t shrink_scanned;   /* lru_list buffers the shrinker looked at */
+    u_int64_t shrink_freed;     /* and released */
+    u_int64_t asof_skipped_elms;     /* by hammer_btree_iterate() */
+    u_int64_t asof_skipped_subtrees;
+
+    u_int64_t lat[HAMMERFS_LAT_OPS][HAMMERFS_LAT_BUCKETS];
+};
+
+#define hammerfs_stats_add(hmp, field, n)                       \
+    do {                                                        \
+        per_cpu_ptr((hmp)->stats, get_cpu())->field += (n);     \
+        put_cpu();                                              \
+    } while (0)
+
+#define hammerfs_stats_inc(hmp, field) hammerfs_stats_add(hmp, field, 1)
+
+void hammerfs_stats_sum(struct hammer_mount *hmp, struct hammerfs_stats *sum);
+u_int64_t hammerfs_lat_count(const u_int64_t *hist);
+u_int64_t hammerfs_lat_percentile(const u_int64_t *hist, int pct);
+
+static __inline u_int64_t
+hammerfs_clock(void)
+{
+    return ktime_to_ns(ktime_get());
+}
+
+/*
+ * Account the latency of an operation started at hammerfs_clock() time
+ * start and return it, for the caller's marker.
+ */
+static __inline u_int64_t
+hammerfs_lat_record(struct hammer_mount *hmp, int op, u_int64_t start)
+{
+    u_int64_t ns = hammerfs_clock() - start;
+    int bucket = fls64(ns);
+
+    if (bucket >= HAMMERFS_LAT_BUCKETS)
+        bucket = HAMMERFS_LAT_BUCKETS - 1;
+    hammerfs_stats_inc(hmp, lat[op][bucket]);
+    return ns;
+}
+
+#endif /* _HAMMERFS_STATS_H */
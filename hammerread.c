@@ -60,6 +60,7 @@
 #include <string.h>
 #include <errno.h>
 #include <dirent.h>
+#include <time.h>
 #endif
 
 #ifdef LIBSTAND
@@ -73,6 +74,9 @@ struct blockentry {
 	hammer_off_t	off;
 	int		use;
 	char		*data;
+#ifdef TESTING
+	int		verified;	// bitmask of CRC checked B-Tree nodes
+#endif
 };
 
 #ifdef TESTING
@@ -91,6 +95,15 @@ struct hfs {
 	int64_t		buf_beg;
 	int		lru;
 	struct blockentry cache[NUMCACHE];
+#ifdef TESTING
+	int		verify;		// check B-Tree node and data CRCs
+	struct blockentry *last;	// entry returned by the last hread
+	hammer_off_t	verified_data;	// data_offset of last checked record
+	int64_t		vnodes;		// B-Tree nodes checked
+	int64_t		vrecords;	// records checked
+	int64_t		vbytes;		// bytes run through the CRC
+	int64_t		vnsec;		// time spent in the CRC
+#endif
 };
 
 static void *
@@ -120,6 +133,7 @@ hread(struct hfs *hfs, hammer_off_t off)
 				    boff & HAMMER_OFF_SHORT_MASK);
 		if (res != HAMMER_BUFSIZE)
 			err(1, "short read on off %llx", boff);
+		be->verified = 0;
 #else	// libstand
 		size_t rlen;
 		int rv = hfs->f->f_dev->dv_strategy(hfs->f->f_devdata, F_READ,
@@ -131,9 +145,158 @@ hread(struct hfs *hfs, hammer_off_t off)
 	}
 
 	be->use = ++hfs->lru;
+#ifdef TESTING
+	hfs->last = be;
+#endif
 	return &be->data[off & HAMMER_BUFMASK];
 }
 
+#ifdef TESTING
+/*
+ * Slicing-by-8 implementation of the crc32() used by HAMMER (see
+ * libkern/crc32.c).  It processes 8 bytes per iteration instead of one,
+ * which keeps verification from dominating extraction time.
+ */
+static uint32_t hcrc_tab[8][256];
+
+static void
+hcrc_init(void)
+{
+	uint32_t c;
+
+	for (int i = 0; i < 256; i++) {
+		c = i;
+		for (int k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ 0xEDB88320U : (c >> 1);
+		hcrc_tab[0][i] = c;
+	}
+	for (int i = 0; i < 256; i++) {
+		c = hcrc_tab[0][i];
+		for (int t = 1; t < 8; t++) {
+			c = hcrc_tab[0][c & 0xFF] ^ (c >> 8);
+			hcrc_tab[t][i] = c;
+		}
+	}
+}
+
+static uint32_t
+hcrc32_ext(const void *buf, size_t size, uint32_t ocrc)
+{
+	const uint8_t *p = buf;
+	uint32_t crc = ~ocrc;
+	uint32_t w1;
+	uint32_t w2;
+
+	while (size && ((uintptr_t)p & 7)) {
+		crc = hcrc_tab[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+		--size;
+	}
+	while (size >= 8) {
+		// little-endian only, like the on-disk format
+		memcpy(&w1, p, 4);
+		memcpy(&w2, p + 4, 4);
+		w1 ^= crc;
+		crc = hcrc_tab[7][w1 & 0xFF] ^
+		      hcrc_tab[6][(w1 >> 8) & 0xFF] ^
+		      hcrc_tab[5][(w1 >> 16) & 0xFF] ^
+		      hcrc_tab[4][w1 >> 24] ^
+		      hcrc_tab[3][w2 & 0xFF] ^
+		      hcrc_tab[2][(w2 >> 8) & 0xFF] ^
+		      hcrc_tab[1][(w2 >> 16) & 0xFF] ^
+		      hcrc_tab[0][w2 >> 24];
+		p += 8;
+		size -= 8;
+	}
+	while (size--)
+		crc = hcrc_tab[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return (crc ^ ~0U);
+}
+
+static int64_t
+hnsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+/*
+ * Check the CRC of a B-Tree node just returned by hread().  Each node
+ * is only checked once while its buffer stays in the cache.
+ */
+static int
+hverify_node(struct hfs *hfs, hammer_off_t nodeoff, hammer_node_ondisk_t node)
+{
+	struct blockentry *be = hfs->last;
+	int bit = 1 << ((nodeoff & HAMMER_BUFMASK) / sizeof(*node));
+	int64_t t0;
+	hammer_crc_t crc;
+
+	if (be->verified & bit)
+		return (0);
+	t0 = hnsec();
+	crc = hcrc32_ext(&node->crc + 1, HAMMER_BTREE_CRCSIZE, 0);
+	hfs->vnsec += hnsec() - t0;
+	hfs->vbytes += HAMMER_BTREE_CRCSIZE;
+	++hfs->vnodes;
+	if (crc != node->crc) {
+		warnx("B-Tree node %016llx: bad crc %08x (expected %08x)",
+		      (long long)nodeoff, crc, node->crc);
+		errno = EIO;
+		return (-1);
+	}
+	be->verified |= bit;
+	return (0);
+}
+
+/*
+ * Check the data CRC of a leaf element.  The record's data may span
+ * several buffers; it is only checked on first access, not on every
+ * buffer-sized piece hreadf() copies out of it.
+ */
+static int
+hverify_data(struct hfs *hfs, hammer_btree_leaf_elm_t e)
+{
+	hammer_off_t off = e->data_offset;
+	int64_t len = e->data_len;
+	int64_t t0;
+	hammer_crc_t crc = 0;
+
+	if (off == hfs->verified_data)
+		return (0);
+	if (e->base.rec_type == HAMMER_RECTYPE_INODE) {
+		if (len != sizeof(struct hammer_inode_data))
+			goto bad;
+		len = HAMMER_INODE_CRCSIZE;
+	}
+	while (len > 0) {
+		int64_t n = HAMMER_BUFSIZE - (off & HAMMER_BUFMASK);
+		char *data;
+
+		n = MIN(n, len);
+		if ((data = hread(hfs, off)) == NULL)
+			return (-1);
+		t0 = hnsec();
+		crc = hcrc32_ext(data, n, crc);
+		hfs->vnsec += hnsec() - t0;
+		hfs->vbytes += n;
+		off += n;
+		len -= n;
+	}
+	++hfs->vrecords;
+	if (crc != e->data_crc) {
+bad:
+		warnx("record %016llx: bad data crc %08x (expected %08x)",
+		      (long long)e->data_offset, crc, e->data_crc);
+		errno = EIO;
+		return (-1);
+	}
+	hfs->verified_data = e->data_offset;
+	return (0);
+}
+#endif
+
 #else	/* BOOT2 */
 
 struct dmadat {
@@ -282,6 +445,87 @@ hammer_btree_search_node(hammer_base_elm_t elm, hammer_node_ondisk_t node)
 	return(b);
 }
 
+/*
+ * (from hammer_btree.c)
+ *
+ * Determine whether a particular record is visible as-of the specified
+ * transaction id.  Return 0 if it is visible, -1 if it was created after
+ * the as-of id, and +1 if it was deleted at or before the as-of id.
+ */
+static int
+hammer_btree_chkts(hammer_tid_t asof, hammer_base_elm_t base)
+{
+	if (asof == 0) {
+		if (base->delete_tid)
+			return(1);
+		return(0);
+	}
+	if (asof < base->create_tid)
+		return(-1);
+	if (base->delete_tid && asof >= base->delete_tid)
+		return(1);
+	return(0);
+}
+
+/*
+ * Return the index of the first element at or after index i which is
+ * visible as-of the specified transaction id, or node->count if there
+ * is none in this node.
+ *
+ * Historical versions of a record share all key fields and are sorted
+ * by create_tid, and at most one of them can be visible at any given
+ * transaction id: the last one created at or before asof.  Each run of
+ * versions is therefore resolved with two binary searches instead of
+ * being iterated element by element.
+ */
+static int
+hammer_btree_skip_history(hammer_node_ondisk_t node, int i, hammer_tid_t asof)
+{
+	hammer_base_elm_t base;
+	int b;
+	int s;
+	int j;
+
+	if (asof == 0)
+		asof = HAMMER_MAX_TID;
+
+	while (i < node->count) {
+		base = &node->elms[i].base;
+
+		/*
+		 * Locate the end of the run.  Comparisons which differ only
+		 * in create_tid return -1, 0 or +1.
+		 */
+		b = i;
+		s = node->count;
+		while (s - b > 1) {
+			j = b + (s - b) / 2;
+			if (hammer_btree_cmp(base, &node->elms[j].base) >= -1)
+				b = j;
+			else
+				s = j;
+		}
+
+		/*
+		 * Locate the last version in [i, s) created at or before
+		 * asof.  If it is not visible no version in the run is.
+		 */
+		b = i - 1;
+		j = s;
+		while (j - b > 1) {
+			int m = b + (j - b) / 2;
+			if (node->elms[m].base.create_tid <= asof)
+				b = m;
+			else
+				j = m;
+		}
+		if (b >= i && hammer_btree_chkts(asof, &node->elms[b].base) == 0)
+			return(b);
+		i = s;
+	}
+	return(node->count);
+}
+
 #if 0
 /*
  * (from hammer_subs.c)
@@ -403,8 +647,14 @@ hprintb(hammer_base_elm_t e)
 #endif /* DEBUG > 1 */
 #endif /* !BOOT2 */
 
+/*
+ * Locate the first leaf element >= key (and <= end if end is non-NULL)
+ * which is visible as-of the specified transaction id.  Pass
+ * HAMMER_MAX_TID (or 0) to see the current state of the filesystem.
+ */
 static hammer_btree_leaf_elm_t
-hfind(struct hfs *hfs, hammer_base_elm_t key, hammer_base_elm_t end)
+hfind(struct hfs *hfs, hammer_base_elm_t key, hammer_base_elm_t end,
+      hammer_tid_t asof)
 {
 #if DEBUG > 1
 	printf("searching for ");
@@ -422,10 +672,21 @@ hfind(struct hfs *hfs, hammer_base_elm_t key, hammer_base_elm_t end)
 	hammer_node_ondisk_t node;
 	hammer_btree_elm_t e = NULL;
 
+	/*
+	 * Start at the oldest version of the key so older versions which
+	 * may be visible as-of the requested transaction id are not
+	 * skipped by the descent.
+	 */
+	search.create_tid = 1;
+
 loop:
 	node = hread(hfs, nodeoff);
 	if (node == NULL)
 		return (NULL);
+#ifdef TESTING
+	if (hfs->verify && hverify_node(hfs, nodeoff, node))
+		return (NULL);
+#endif
 
 #if DEBUG > 3
 	for (int i = 0; i < node->count; i++) {
@@ -461,23 +722,24 @@ loop:
 		goto loop;
 	}
 
+	n = e - node->elms;
 	r = hammer_btree_cmp(key, &e->base);
 	// If we're more off than the createtid, take the next elem
-	if (r > 1) {
-		e++;
+	if (r > 1)
 		n++;
-	}
 
-	// Skip deleted elements
-	while (n <= node->count && e->base.delete_tid != 0) {
-		e++;
-		n++;
-	}
+	// Skip elements not visible as-of the requested tid
+	n = hammer_btree_skip_history(node, n, asof);
 
 	// In the unfortunate event when there is no next
 	// element in this node, we repeat the search with
 	// a key beyond the right boundary
-	if (n > node->count) {
+	if (n >= node->count) {
+		// Nothing further to the right, or past the end of the range
+		if (nodeoff == hfs->root ||
+		    hammer_btree_cmp(&backtrack, &search) <= 0 ||
+		    (end != NULL && hammer_btree_cmp(end, &backtrack) < -1))
+			goto fail;
 		search = backtrack;
 		nodeoff = hfs->root;
 
@@ -489,6 +751,7 @@ loop:
 #endif
 		goto loop;
 	}
+	e = &node->elms[n];
 
 #if DEBUG > 1
 	printf("  result: ");
@@ -511,7 +774,8 @@ fail:
 
 #ifndef BOOT2
 static int
-hreaddir(struct hfs *hfs, ino_t ino, int64_t *off, struct dirent *de)
+hreaddir(struct hfs *hfs, ino_t ino, hammer_tid_t asof, int64_t *off,
+	 struct dirent *de)
 {
 	struct hammer_base_elm key, end;
 
@@ -530,12 +794,16 @@ hreaddir(struct hfs *hfs, ino_t ino, int64_t *off, struct dirent *de)
 
 	hammer_btree_leaf_elm_t e;
 
-	e = hfind(hfs, &key, &end);
+	e = hfind(hfs, &key, &end, asof);
 	if (e == NULL) {
 		errno = ENOENT;
 		return (-1);
 	}
 
+#ifdef TESTING
+	if (hfs->verify && hverify_data(hfs, e))
+		return (-1);
+#endif
 	*off = e->base.key + 1;		// remember next pos
 
 	de->d_namlen = e->data_len - HAMMER_ENTRY_NAME_OFF;
@@ -552,7 +820,7 @@ hreaddir(struct hfs *hfs, ino_t ino, int64_t *off, struct dirent *de)
 #endif
 
 static ino_t
-hresolve(struct hfs *hfs, ino_t dirino, const char *name)
+hresolve(struct hfs *hfs, ino_t dirino, hammer_tid_t asof, const char *name)
 {
 	struct hammer_base_elm key, end;
 	size_t namel = strlen(name);
@@ -570,7 +838,7 @@ hresolve(struct hfs *hfs, ino_t dirino, const char *name)
 	end.key = HAMMER_MAX_KEY;
 
 	hammer_btree_leaf_elm_t e;
-	while ((e = hfind(hfs, &key, &end)) != NULL) {
+	while ((e = hfind(hfs, &key, &end, asof)) != NULL) {
 		key.key = e->base.key + 1;
 
 		size_t elen = e->data_len - HAMMER_ENTRY_NAME_OFF;
@@ -599,7 +867,7 @@ hresolve(struct hfs *hfs, ino_t dirino, const char *name)
 }
 
 static ino_t
-hlookup(struct hfs *hfs, const char *path)
+hlookup(struct hfs *hfs, hammer_tid_t asof, const char *path)
 {
 #if DEBUG > 2
 	printf("%s(%s)\n", __FUNCTION__, path);
@@ -626,7 +894,7 @@ hlookup(struct hfs *hfs, const char *path)
 			ls = 1;
 #endif
 
-		ino = hresolve(hfs, ino, name);
+		ino = hresolve(hfs, ino, asof, name);
 	} while (ino != (ino_t)-1 && *path != 0);
 
 	return (ino);
@@ -635,7 +903,7 @@ hlookup(struct hfs *hfs, const char *path)
 
 #ifndef BOOT2
 static int
-hstat(struct hfs *hfs, ino_t ino, struct stat* st)
+hstat(struct hfs *hfs, ino_t ino, hammer_tid_t asof, struct stat* st)
 {
 	struct hammer_base_elm key;
 
@@ -648,7 +916,7 @@ hstat(struct hfs *hfs, ino_t ino, struct stat* st)
 	key.localization = HAMMER_LOCALIZE_INODE;
 	key.rec_type = HAMMER_RECTYPE_INODE;
 
-	hammer_btree_leaf_elm_t e = hfind(hfs, &key, &key);
+	hammer_btree_leaf_elm_t e = hfind(hfs, &key, &key, asof);
 	if (e == NULL) {
 #ifndef BOOT2
 		errno = ENOENT;
@@ -656,6 +924,10 @@ hstat(struct hfs *hfs, ino_t ino, struct stat* st)
 		return -1;
 	}
 
+#ifdef TESTING
+	if (hfs->verify && hverify_data(hfs, e))
+		return (-1);
+#endif
 	hammer_data_ondisk_t ed = hread(hfs, e->data_offset);
 	if (ed == NULL)
 		return (-1);
@@ -670,7 +942,8 @@ hstat(struct hfs *hfs, ino_t ino, struct stat* st)
 #endif
 
 static ssize_t
-hreadf(struct hfs *hfs, ino_t ino, int64_t off, int64_t len, char *buf)
+hreadf(struct hfs *hfs, ino_t ino, hammer_tid_t asof, int64_t off, int64_t len,
+       char *buf)
 {
 	int64_t startoff = off;
 	struct hammer_base_elm key, end;
@@ -684,7 +957,7 @@ hreadf(struct hfs *hfs, ino_t ino, int64_t off, int64_t len, char *buf)
 
 	while (len > 0) {
 		key.key = off + 1;
-		hammer_btree_leaf_elm_t e = hfind(hfs, &key, &end);
+		hammer_btree_leaf_elm_t e = hfind(hfs, &key, &end, asof);
 		int64_t dlen;
 
 		if (e == NULL || off > e->base.key) {
@@ -704,6 +977,11 @@ hreadf(struct hfs *hfs, ino_t ino, int64_t off, int64_t len, char *buf)
 			int64_t boff = off - doff;
 			hammer_off_t roff = e->data_offset;
 
+#ifdef TESTING
+			if (hfs->verify && hverify_data(hfs, e))
+				return (-1);
+#endif
+
 			dlen = e->data_len;
 			dlen -= boff;
 			dlen = MIN(dlen, len);
@@ -762,7 +1040,7 @@ lookup(const char *path)
 {
 	hammerinit();
 
-	ino_t ino = hlookup(&hfs, path);
+	ino_t ino = hlookup(&hfs, HAMMER_MAX_TID, path);
 
 	if (ino == -1)
 		ino = 0;
@@ -774,7 +1052,7 @@ fsread(ino_t ino, void *buf, size_t len)
 {
 	hammerinit();
 
-	ssize_t rlen = hreadf(&hfs, ino, fs_off, len, buf);
+	ssize_t rlen = hreadf(&hfs, ino, HAMMER_MAX_TID, fs_off, len, buf);
 	if (rlen != -1)
 		fs_off += rlen;
 	return (rlen);
@@ -799,6 +1077,15 @@ hinit(struct hfs *hfs)
 #endif
 	}
 	hfs->lru = 0;
+#ifdef TESTING
+	hcrc_init();
+	hfs->last = NULL;
+	hfs->verified_data = 0;
+	hfs->vnodes = 0;
+	hfs->vrecords = 0;
+	hfs->vbytes = 0;
+	hfs->vnsec = 0;
+#endif
 
 	hammer_volume_ondisk_t volhead = hread(hfs, HAMMER_ZONE_ENCODE(1, 0));
 	if (volhead == NULL)
@@ -863,12 +1150,12 @@ hammer_open(const char *path, struct open_file *f)
 	printf("hammer_open %s %p %ld\n", path, f);
 #endif
 
-	hf->ino = hlookup(&hf->hfs, path);
+	hf->ino = hlookup(&hf->hfs, HAMMER_MAX_TID, path);
 	if (hf->ino == -1)
 		goto fail;
 
 	struct stat st;
-	if (hstat(&hf->hfs, hf->ino, &st) == -1)
+	if (hstat(&hf->hfs, hf->ino, HAMMER_MAX_TID, &st) == -1)
 		goto fail;
 	hf->fsize = st.st_size;
 
@@ -914,7 +1201,8 @@ hammer_read(struct open_file *f, void *buf, size_t len, size_t *resid)
 	if (f->f_offset + len > hf->fsize)
 		maxlen = hf->fsize - f->f_offset;
 
-	ssize_t rlen = hreadf(&hf->hfs, hf->ino, f->f_offset, maxlen, buf);
+	ssize_t rlen = hreadf(&hf->hfs, hf->ino, HAMMER_MAX_TID, f->f_offset,
+			    maxlen, buf);
 	if (rlen == -1)
 		return (EINVAL);
 
@@ -950,7 +1238,7 @@ hammer_stat(struct open_file *f, struct stat *st)
 {
 	struct hfile *hf = f->f_fsdata;
 
-	return (hstat(&hf->hfs, hf->ino, st));
+	return (hstat(&hf->hfs, hf->ino, HAMMER_MAX_TID, st));
 }
 
 static int
@@ -959,7 +1247,7 @@ hammer_readdir(struct open_file *f, struct dirent *d)
 	struct hfile *hf = f->f_fsdata;
 
 	int64_t off = f->f_offset;
-	int rv = hreaddir(&hf->hfs, hf->ino, &off, d);
+	int rv = hreaddir(&hf->hfs, hf->ino, HAMMER_MAX_TID, &off, d);
 	f->f_offset = off;
 	return (rv);
 }
@@ -981,29 +1269,58 @@ struct fs_ops hammer_fsops = {
 int
 main(int argc, char **argv)
 {
-	if (argc < 2) {
-		fprintf(stderr, "usage: hammerread <dev>\n");
+	hammer_tid_t asof = HAMMER_MAX_TID;
+	int verify = 0;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "a:v")) != -1) {
+		switch (ch) {
+		case 'a':
+			// as-of transaction id, e.g. 0x00000001061a8ba0
+			asof = strtoull(optarg, NULL, 0);
+			break;
+		case 'v':
+			// verify B-Tree node and record data CRCs
+			verify = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) {
+usage:
+		fprintf(stderr, "usage: hammerread [-v] [-a asof-tid] <dev> "
+				"[path ...]\n");
 		return (1);
 	}
 
 	struct hfs hfs;
-	hfs.fd = open(argv[1], O_RDONLY);
+	hfs.fd = open(argv[0], O_RDONLY);
 	if (hfs.fd == -1)
-		err(1, "unable to open %s", argv[1]);
+		err(1, "unable to open %s", argv[0]);
 
 	if (hinit(&hfs) == -1)
 		err(1, "invalid hammerfs");
+	hfs.verify = verify;
 
-	for (int i = 2; i < argc; i++) {
-		ino_t ino = hlookup(&hfs, argv[i]);
+	int64_t t0 = hnsec();
+	int rc = 0;
+
+	for (int i = 1; i < argc; i++) {
+		ino_t ino = hlookup(&hfs, asof, argv[i]);
 		if (ino == (ino_t)-1) {
 			warn("hlookup %s", argv[i]);
+			rc = 1;
 			continue;
 		}
 
 		struct stat st;
-		if (hstat(&hfs, ino, &st)) {
+		if (hstat(&hfs, ino, asof, &st)) {
 			warn("hstat %s", argv[i]);
+			rc = 1;
 			continue;
 		}
 
@@ -1015,7 +1332,7 @@ main(int argc, char **argv)
 		if (S_ISDIR(st.st_mode)) {
 			int64_t off = 0;
 			struct dirent de;
-			while (hreaddir(&hfs, ino, &off, &de) == 0) {
+			while (hreaddir(&hfs, ino, asof, &off, &de) == 0) {
 				printf("%s %d %llx\n",
 				       de.d_name, de.d_type, de.d_ino);
 			}
@@ -1024,7 +1341,13 @@ main(int argc, char **argv)
 			int64_t off = 0;
 			while (off < st.st_size) {
 				int64_t len = MIN(100000, st.st_size - off);
-				int64_t rl = hreadf(&hfs, ino, off, len, buf);
+				int64_t rl = hreadf(&hfs, ino, asof, off, len,
+						    buf);
+				if (rl == -1) {
+					warn("hreadf %s", argv[i]);
+					rc = 1;
+					break;
+				}
 				fwrite(buf, rl, 1, stdout);
 				off += rl;
 			}
@@ -1032,6 +1355,20 @@ main(int argc, char **argv)
 		}
 	}
 
-	return 0;
+	if (verify) {
+		// Report what verification cost relative to the whole run
+		int64_t total = hnsec() - t0;
+
+		fprintf(stderr, "verified %lld nodes, %lld records, "
+				"%lld bytes: crc %.1f ms of %.1f ms "
+				"(%.1f%%, %.0f MB/s)\n",
+			(long long)hfs.vnodes, (long long)hfs.vrecords,
+			(long long)hfs.vbytes,
+			hfs.vnsec / 1e6, total / 1e6,
+			total ? 100.0 * hfs.vnsec / total : 0.0,
+			hfs.vnsec ? hfs.vbytes * 1e3 / hfs.vnsec : 0.0);
+	}
+
+	return (rc);
 }
 #endif
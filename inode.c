@@ -9,6 +9,7 @@
 #include <linux/errno.h>
 #include <linux/string.h>
 #include "hammerfs.h"
+#include "hammerfs_stats.h"
 
 #include "dfly_wrap.h"
 #include <vfs/hammer/hammer.h>
@@ -26,23 +27,43 @@ struct inode *hammerfs_iget(struct super_block *sb, ino_t ino) {
    /*
     * Lookup the requested HAMMER inode.  The structure must be
     * left unlocked while we manipulate the related vnode to avoid
-    * a deadlock.
+    * a deadlock.  On an asof mount everything is historical.
     */
     ip = hammer_get_inode(&trans, NULL, ino,
                           hmp->asof, HAMMER_DEF_LOCALIZATION, 
-                          0, &error);
+                          (hmp->asof != HAMMER_MAX_TID ? HAMMER_INODE_RO : 0),
+                          &error);
     if (ip == NULL) {
         hammer_done_transaction(&trans);
         goto failed;
     }
     error = hammerfs_get_inode(sb, ip, &inode);
-//    hammer_rel_inode(ip, 0);
     hammer_done_transaction(&trans);
+    if (error)
+        return ERR_PTR(error);
 
     return inode;
 failed:
-    iget_failed(inode);
-    return ERR_PTR(error);
+    return ERR_PTR(-error);
+}
+
+/*
+ * The Linux inode cache is keyed by the HAMMER inode, so every snapshot
+ * view of an object (obj_id, asof, localization) gets its own Linux inode
+ * and page cache, and finding it again reuses both.
+ */
+static int hammerfs_test_inode(struct inode *inode, void *data) {
+    return(inode->i_private == data);
+}
+
+static int hammerfs_set_inode(struct inode *inode, void *data) {
+    inode->i_private = data;
+    return(0);
+}
+
+static unsigned long hammerfs_inode_hash(struct hammer_inode *ip) {
+    return((unsigned long)(ip->obj_id ^ ip->obj_asof ^
+                           ((u_int64_t)ip->obj_localization << 32)));
 }
 
 /*
@@ -55,7 +76,21 @@ int hammerfs_get_inode(struct super_block *sb,
                        struct inode **inode) {
     int error;
 
-    (*inode) = new_inode(sb);
+    /*
+     * The reference the caller got on ip goes to the Linux inode, an
+     * inode that is already cached holds one.
+     */
+    (*inode) = iget5_locked(sb, hammerfs_inode_hash(ip), hammerfs_test_inode,
+                            hammerfs_set_inode, ip);
+    if (*inode == NULL) {
+        hammer_rel_inode(ip, 0);
+        return(-ENOMEM);
+    }
+    if (!((*inode)->i_state & I_NEW)) {
+        hammer_rel_inode(ip, 0);
+        return(0);
+    }
+
     (*inode)->i_op = &hammerfs_inode_operations;
     (*inode)->i_fop = &hammerfs_file_operations;
     (*inode)->i_mapping->a_ops = &hammerfs_address_space_operations;
@@ -65,7 +100,6 @@ int hammerfs_get_inode(struct super_block *sb,
     (*inode)->i_nlink = ip->ino_data.nlinks;
     (*inode)->i_size = ip->ino_data.size;
     (*inode)->i_mode = ip->ino_data.mode | hammerfs_get_itype(ip->ino_data.obj_type);
-    (*inode)->i_private = ip;
 
     /*
      * We must provide a consistent atime and mtime for snapshots
@@ -87,6 +121,7 @@ int hammerfs_get_inode(struct super_block *sb,
     i->i_blocks;
     i->i_blkbits;
 */
+    unlock_new_inode(*inode);
     return(0);
 }
 
@@ -141,13 +176,17 @@ int hammerfs_readpage(struct file *file, struct page *page) {
     hammer_off_t zone2_offset;
     int vol_no;
     hammer_volume_t volume;
-
-    printk ("hammerfs_readpage(page->index=%d)\n", (int) page->index);
+    u_int64_t start;
+    u_int64_t ns;
+    int bread_bytes;
 
     inode = file->f_path.dentry->d_inode;
     ip = (struct hammer_inode *)inode->i_private;
     sb = inode->i_sb;
     hmp = (hammer_mount_t)sb->s_fs_info;
+
+    hammerfs_debug(hmp, HAMMERFS_DBG_READ, HAMMERFS_DBG_TRACE,
+                   "hammerfs_readpage(page->index=%lu)\n", page->index);
     hammer_simple_transaction(&trans, ip->hmp);
     hammer_init_cursor(&trans, &cursor, &ip->cache[1], ip);
     file_offset = page->index * PAGE_SIZE;
@@ -165,6 +204,11 @@ int hammerfs_readpage(struct file *file, struct page *page) {
         goto failed;
     }
 
+    ++hammer_stats_file_iopsr;
+    hammer_stats_file_read += PAGE_SIZE;
+    hammerfs_stats_inc(hmp, file_reads);
+    hammerfs_stats_add(hmp, file_read_bytes, PAGE_SIZE);
+
    /*
     * Key range (begin and end inclusive) to scan.  Note that the key's
     * stored in the actual records represent BASE+LEN, not BASE.  The
@@ -226,7 +270,8 @@ int hammerfs_readpage(struct file *file, struct page *page) {
         rec_offset += roff;
         n = cursor.leaf->data_len - roff;
         if (n <= 0) {
-            printk("hammerfs_readpage: bad n=%d roff=%d\n", n, roff);
+            hammerfs_debug(hmp, HAMMERFS_DBG_READ, HAMMERFS_DBG_ERR,
+                           "hammerfs_readpage: bad n=%d roff=%d\n", n, roff);
             n = 0;
         } else if (n > PAGE_SIZE - boff) {
             n = PAGE_SIZE - boff;
@@ -282,6 +327,8 @@ int hammerfs_readpage(struct file *file, struct page *page) {
         // offset on disk
         sb_offset = volume->ondisk->vol_buf_beg + (zone2_offset & HAMMER_OFF_SHORT_MASK);
 
+        start = hammerfs_clock();
+        bread_bytes = n;
         while(n > 0 && boff != PAGE_SIZE) {
             block_num = sb_offset / BLOCK_SIZE;
             block_offset = sb_offset % BLOCK_SIZE;
@@ -301,6 +348,10 @@ int hammerfs_readpage(struct file *file, struct page *page) {
             boff += bytes_read;
             roff += bytes_read;
         }
+        ns = hammerfs_lat_record(hmp, HAMMERFS_LAT_READPAGE_BREAD, start);
+        trace_mark(hammerfs_readpage_bread, "sb_offset %lld bytes %d ns %llu",
+                   (long long)sb_offset, bread_bytes - n,
+                   (unsigned long long)ns);
 
        /*
         * Iterate until we have filled the request.
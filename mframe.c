@@ -0,0 +1,363 @@
+/*
+ * Framed mirror-read streams for HAMMER Filesystem
+ *
+ * A frame sink sits between hammerfs_mirror_stream() and the sink the
+ * stream goes out through.  It gathers whole mrecords into a buffer of
+ * HAMMERFS_MFRAME_SIZE bytes and on flush writes them out as one frame,
+ * compressed and with one CRC for all of them (see hammerfs_ioctl.h).
+ * hammerfs_mframe_decode() turns a frame back into the plain stream.
+ *
+ * The compressor is a greedy LZ77 with a single hash table probe per
+ * position, which writes LZ4 block format: sequences of a token (literal
+ * run and match length, 4 bits each), the literals, a 16 bit little
+ * endian match offset and the extra length bytes.  As for LZ4 the last
+ * match starts at least HAMMERFS_LZ_MFLIMIT bytes before the end and the
+ * last HAMMERFS_LZ_LASTLIT bytes are literals.
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+#include "hammerfs.h"
+
+#include "dfly_wrap.h"
+#include <vfs/hammer/hammer.h>
+
+#define HAMMERFS_LZ_MINMATCH    4
+#define HAMMERFS_LZ_LASTLIT     5
+#define HAMMERFS_LZ_MFLIMIT     12
+#define HAMMERFS_LZ_MAXOFF      65535
+#define HAMMERFS_LZ_SKIP        6       /* log2 of misses per step increase */
+#define HAMMERFS_LZ_HASHBITS    12
+#define HAMMERFS_LZ_HASHSIZE    (1 << HAMMERFS_LZ_HASHBITS)
+
+/*
+ * Room for the largest record the stream loop may add after the sink
+ * did not ask to be flushed.
+ */
+#define HAMMERFS_MFRAME_REC \
+    HAMMER_HEAD_DOALIGN(sizeof(struct hammer_ioc_mrecord_rec) + HAMMER_XBUFSIZE)
+
+static inline u_int32_t hammerfs_lz_read32(const u_char *p)
+{
+    u_int32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return(v);
+}
+
+static inline int hammerfs_lz_hash(u_int32_t v)
+{
+    return((v * 2654435761U) >> (32 - HAMMERFS_LZ_HASHBITS));
+}
+
+static u_char *hammerfs_lz_length(u_char *op, int len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return(op);
+}
+
+/*
+ * Append a sequence of nlit literals and a match of mlen bytes at off
+ * (mlen 0 for the literals which end the block).  Returns NULL if it
+ * would not fit before oend.
+ */
+static u_char *hammerfs_lz_sequence(u_char *op, u_char *oend,
+                                    const u_char *lit, int nlit,
+                                    int off, int mlen)
+{
+    u_char *token;
+
+    if (oend - op < 1 + nlit + nlit / 255 + 1 + 2 + mlen / 255 + 1)
+        return(NULL);
+    token = op++;
+    if (nlit >= 15) {
+        *token = 15 << 4;
+        op = hammerfs_lz_length(op, nlit - 15);
+    } else {
+        *token = nlit << 4;
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (mlen == 0)
+        return(op);
+
+    *op++ = off & 0xff;
+    *op++ = off >> 8;
+    mlen -= HAMMERFS_LZ_MINMATCH;
+    if (mlen >= 15) {
+        *token |= 15;
+        op = hammerfs_lz_length(op, mlen - 15);
+    } else {
+        *token |= mlen;
+    }
+    return(op);
+}
+
+/*
+ * Compress len bytes at src to at most dmax bytes at dst.  table holds
+ * HAMMERFS_LZ_HASHSIZE entries.  Returns the compressed length, or 0 if
+ * it would be more than dmax.
+ */
+int hammerfs_lz_compress(const void *src, int len, void *dst, int dmax,
+                         u_int32_t *table)
+{
+    const u_char *base = src;
+    const u_char *ip = base;
+    const u_char *anchor = base;
+    const u_char *mflimit = base + len - HAMMERFS_LZ_MFLIMIT;
+    const u_char *matchlimit = base + len - HAMMERFS_LZ_LASTLIT;
+    const u_char *ref;
+    u_char *op = dst;
+    u_char *oend = op + dmax;
+    u_int32_t v;
+    int misses = 0;
+    int mlen;
+    int h;
+
+    memset(table, 0, HAMMERFS_LZ_HASHSIZE * sizeof(*table));
+    if (len > HAMMERFS_LZ_MFLIMIT) {
+        while (ip <= mflimit) {
+            v = hammerfs_lz_read32(ip);
+            h = hammerfs_lz_hash(v);
+            ref = base + table[h];
+            table[h] = ip - base;
+            if (ref >= ip || ip - ref > HAMMERFS_LZ_MAXOFF ||
+                hammerfs_lz_read32(ref) != v) {
+                ip += 1 + (misses++ >> HAMMERFS_LZ_SKIP);
+                continue;
+            }
+            misses = 0;
+
+            mlen = HAMMERFS_LZ_MINMATCH;
+            while (ip + mlen < matchlimit && ref[mlen] == ip[mlen])
+                ++mlen;
+            op = hammerfs_lz_sequence(op, oend, anchor, ip - anchor,
+                                      ip - ref, mlen);
+            if (op == NULL)
+                return(0);
+            ip += mlen;
+            anchor = ip;
+        }
+    }
+    op = hammerfs_lz_sequence(op, oend, anchor, base + len - anchor, 0, 0);
+    if (op == NULL)
+        return(0);
+    return(op - (u_char *)dst);
+}
+
+/*
+ * Decompress slen bytes at src to at most dmax bytes at dst.  Returns the
+ * decompressed length, or -1 if the input is corrupt or too long.
+ */
+int hammerfs_lz_decompress(const void *src, int slen, void *dst, int dmax)
+{
+    const u_char *ip = src;
+    const u_char *iend = ip + slen;
+    const u_char *ref;
+    u_char *op = dst;
+    u_char *oend = op + dmax;
+    int token;
+    int nlit;
+    int mlen;
+    int off;
+    int c;
+
+    while (ip < iend) {
+        token = *ip++;
+        nlit = token >> 4;
+        if (nlit == 15) {
+            do {
+                if (ip == iend)
+                    return(-1);
+                c = *ip++;
+                nlit += c;
+            } while (c == 255);
+        }
+        if (nlit > iend - ip || nlit > oend - op)
+            return(-1);
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return(-1);
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > op - (u_char *)dst)
+            return(-1);
+        mlen = token & 15;
+        if (mlen == 15) {
+            do {
+                if (ip == iend)
+                    return(-1);
+                c = *ip++;
+                mlen += c;
+            } while (c == 255);
+        }
+        mlen += HAMMERFS_LZ_MINMATCH;
+        if (mlen > oend - op)
+            return(-1);
+        ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            while (mlen--)
+                *op++ = *ref++;
+        }
+    }
+    return(op - (u_char *)dst);
+}
+
+static int hammerfs_mframe_add(struct hammerfs_mirror_sink *sink,
+                               const void *addr, int len, int isdata)
+{
+    struct hammerfs_mframe_sink *ms;
+
+    ms = container_of(sink, struct hammerfs_mframe_sink, sink);
+    if (len > HAMMERFS_MFRAME_SIZE - ms->raw_len)
+        return(EFBIG);
+    memcpy(ms->raw + ms->raw_len, addr, len);
+    ms->raw_len += len;
+    if (ms->raw_len > HAMMERFS_MFRAME_SIZE - HAMMERFS_MFRAME_REC)
+        sink->full = 1;
+    return(0);
+}
+
+/*
+ * Write what has been gathered as one frame, stored as is if it does not
+ * compress, and flush the sink below.
+ */
+static int hammerfs_mframe_flush(struct hammerfs_mirror_sink *sink)
+{
+    struct hammerfs_mframe_sink *ms;
+    struct hammerfs_mframe_head *head;
+    struct hammerfs_mirror_sink *out;
+    const void *payload;
+    int error;
+    int n;
+
+    ms = container_of(sink, struct hammerfs_mframe_sink, sink);
+    out = ms->out;
+    if (ms->raw_len) {
+        head = &ms->head;
+        n = hammerfs_lz_compress(ms->raw, ms->raw_len, ms->frame,
+                                 ms->raw_len - 1, ms->table);
+        if (n) {
+            head->algo = HAMMERFS_MFRAME_LZ;
+            payload = ms->frame;
+        } else {
+            head->algo = HAMMERFS_MFRAME_STORED;
+            payload = ms->raw;
+            n = ms->raw_len;
+        }
+        head->signature = HAMMERFS_MFRAME_SIGNATURE;
+        head->reserved01 = 0;
+        head->raw_size = ms->raw_len;
+        head->frame_size = n;
+        head->reserved02 = 0;
+        head->frame_crc = crc32_ext(ms->raw, ms->raw_len,
+                                    crc32(&head->algo,
+                                          sizeof(*head) -
+                                          HAMMERFS_MFRAME_CRCOFF));
+        ms->raw_len = 0;
+        sink->full = 0;
+
+        error = out->add(out, head, sizeof(*head), 0);
+        if (error == 0)
+            error = out->add(out, payload, n, 0);
+        if (error)
+            return(error);
+    }
+    return(out->flush(out));
+}
+
+/*
+ * Set up ms to frame the stream going to out.  The records passed to
+ * ms->sink need no rec_crc.
+ */
+int hammerfs_mframe_init(struct hammerfs_mframe_sink *ms,
+                         struct hammerfs_mirror_sink *out)
+{
+    char *buf;
+
+    buf = vmalloc(2 * HAMMERFS_MFRAME_SIZE +
+                  HAMMERFS_LZ_HASHSIZE * sizeof(u_int32_t));
+    if (buf == NULL)
+        return(ENOMEM);
+    memset(ms, 0, sizeof(*ms));
+    ms->sink.add = hammerfs_mframe_add;
+    ms->sink.flush = hammerfs_mframe_flush;
+    ms->sink.nocrc = 1;
+    ms->out = out;
+    ms->raw = buf;
+    ms->frame = buf + HAMMERFS_MFRAME_SIZE;
+    ms->table = (u_int32_t *)(buf + 2 * HAMMERFS_MFRAME_SIZE);
+    return(0);
+}
+
+void hammerfs_mframe_done(struct hammerfs_mframe_sink *ms)
+{
+    vfree(ms->raw);
+    ms->raw = NULL;
+}
+
+/*
+ * Check a frame and uncompress its records to raw, which holds
+ * HAMMERFS_MFRAME_SIZE bytes.  With reccrc set the rec_crc of each record
+ * is filled in, for consumers of the plain stream which check it.
+ */
+int hammerfs_mframe_decode(const struct hammerfs_mframe_head *head,
+                           const void *payload, void *raw, int reccrc)
+{
+    struct hammer_ioc_mrecord_head *mrec;
+    u_int32_t crc;
+    int off;
+    int n;
+
+    if (head->signature != HAMMERFS_MFRAME_SIGNATURE ||
+        head->raw_size > HAMMERFS_MFRAME_SIZE ||
+        head->frame_size > head->raw_size) {
+        return(EINVAL);
+    }
+    switch(head->algo) {
+    case HAMMERFS_MFRAME_STORED:
+        if (head->frame_size != head->raw_size)
+            return(EINVAL);
+        memcpy(raw, payload, head->raw_size);
+        break;
+    case HAMMERFS_MFRAME_LZ:
+        n = hammerfs_lz_decompress(payload, head->frame_size, raw,
+                                   head->raw_size);
+        if (n != head->raw_size)
+            return(EINVAL);
+        break;
+    default:
+        return(EINVAL);
+    }
+    crc = crc32(&head->algo, sizeof(*head) - HAMMERFS_MFRAME_CRCOFF);
+    if (crc32_ext(raw, head->raw_size, crc) != head->frame_crc)
+        return(EINVAL);
+
+    for (off = 0; reccrc && off < head->raw_size; off += n) {
+        mrec = (struct hammer_ioc_mrecord_head *)((char *)raw + off);
+        if (head->raw_size - off < sizeof(*mrec) ||
+            mrec->rec_size < sizeof(*mrec) ||
+            mrec->rec_size > head->raw_size - off) {
+            return(EINVAL);
+        }
+        mrec->rec_crc = crc32(&mrec->rec_size,
+                              mrec->rec_size - HAMMER_MREC_CRCOFF);
+        n = HAMMER_HEAD_DOALIGN(mrec->rec_size);
+    }
+    return(0);
+}
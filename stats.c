@@ -0,0 +1,386 @@
+/*
+ * /proc/fs/hammer statistics for HAMMER Filesystem
+ *
+ *   /proc/fs/hammer/stats         module-wide hammer_count_* and
+ *                                 hammer_stats_* counters
+ *   /proc/fs/hammer/<dev>/stats   per-mount counters, see hammerfs_stats.h
+ *   /proc/fs/hammer/malloc        usage of the HAMMER malloc types
+ *   /proc/fs/hammer/<dev>/latency per-mount latency histograms
+ *   /proc/fs/hammer/<dev>/pfs     per-PFS summary
+ *
+ * The stats files print one "name value" pair per line, except for
+ * lru_parts, which lists the buffers on each PFS partition's LRU list
+ * (HAMMER_LRU_PARTS, partition 0 for buffers of no single PFS).  The
+ * global counters use the names of the vfs.hammer sysctls on DragonFly.
+ *
+ * The latency file prints a summary line per operation,
+ *
+ *   <op> count <n> p50 <ns> p90 <ns> p99 <ns>
+ *
+ * followed by one "  <ns> <count>" line per non-empty bucket, where <ns>
+ * is the bucket's upper bound.  Percentiles are bucket upper bounds too.
+ *
+ * The malloc file prints one line per malloc type, like vmstat -m,
+ *
+ *   <type> inuse <n> memuse <bytes> calls <n> [size <bytes>]
+ *
+ * where size is the object size of types backed by a slab cache.
+ *
+ * The pfs file prints one line per PFS, see hammerfs_pfs_summary(),
+ *
+ *   <pfs_id> inodes <n> records <n> data_bytes <bytes>
+ *       history_bytes <bytes> sync_end_tid <tid> [slave]
+ *
+ * The first read of it scans the B-Tree, later ones are served from the
+ * summary kept in the mount.
+ */
+
+#include <linux/module.h>
+#include <linux/fs.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include "hammerfs.h"
+#include "hammerfs_stats.h"
+
+#include "dfly_wrap.h"
+#include <vfs/hammer/hammer.h>
+
+#define HAMMERFS_PROC_ROOT "fs/hammer"
+
+static struct proc_dir_entry *hammerfs_proc_root;
+
+static int
+hammerfs_global_stats_show(struct seq_file *m, void *v)
+{
+    seq_printf(m, "count_fsyncs %d\n", hammer_count_fsyncs);
+    seq_printf(m, "count_inodes %d\n", hammer_count_inodes);
+    seq_printf(m, "count_iqueued %d\n", hammer_count_iqueued);
+    seq_printf(m, "count_reclaiming %d\n", hammer_count_reclaiming);
+    seq_printf(m, "count_records %d\n", hammer_count_records);
+    seq_printf(m, "count_record_datas %d\n", hammer_count_record_datas);
+    seq_printf(m, "count_volumes %d\n", hammer_count_volumes);
+    seq_printf(m, "count_buffers %d\n", hammer_count_buffers);
+    seq_printf(m, "count_nodes %d\n", hammer_count_nodes);
+    seq_printf(m, "count_extra_space_used %lld\n",
+               (long long)hammer_count_extra_space_used);
+    seq_printf(m, "count_dirtybufspace %d\n", hammer_count_dirtybufspace);
+    seq_printf(m, "count_refedbufs %d\n", hammer_count_refedbufs);
+    seq_printf(m, "count_reservations %d\n", hammer_count_reservations);
+    seq_printf(m, "count_io_running_read %d\n", hammer_count_io_running_read);
+    seq_printf(m, "count_io_running_write %d\n",
+               hammer_count_io_running_write);
+    seq_printf(m, "count_io_locked %d\n", hammer_count_io_locked);
+
+    seq_printf(m, "stats_btree_lookups %lld\n",
+               (long long)hammer_stats_btree_lookups);
+    seq_printf(m, "stats_btree_searches %lld\n",
+               (long long)hammer_stats_btree_searches);
+    seq_printf(m, "stats_btree_inserts %lld\n",
+               (long long)hammer_stats_btree_inserts);
+    seq_printf(m, "stats_btree_deletes %lld\n",
+               (long long)hammer_stats_btree_deletes);
+    seq_printf(m, "stats_btree_elements %lld\n",
+               (long long)hammer_stats_btree_elements);
+    seq_printf(m, "stats_btree_splits %lld\n",
+               (long long)hammer_stats_btree_splits);
+    seq_printf(m, "stats_btree_iterations %lld\n",
+               (long long)hammer_stats_btree_iterations);
+    seq_printf(m, "stats_record_iterations %lld\n",
+               (long long)hammer_stats_record_iterations);
+    seq_printf(m, "stats_file_read %lld\n",
+               (long long)hammer_stats_file_read);
+    seq_printf(m, "stats_file_iopsr %lld\n",
+               (long long)hammer_stats_file_iopsr);
+    seq_printf(m, "stats_disk_read %lld\n",
+               (long long)hammer_stats_disk_read);
+    return 0;
+}
+
+static int
+hammerfs_malloc_show(struct seq_file *m, void *v)
+{
+    struct malloc_type *type;
+    long inuse;
+    long memuse;
+    int i;
+
+    for (type = kmemstatistics; type; type = type->ks_next) {
+        inuse = 0;
+        memuse = 0;
+        for (i = 0; i < SMP_MAXCPU; ++i) {
+            inuse += type->ks_inuse[i];
+            memuse += type->ks_memuse[i];
+        }
+        seq_printf(m, "%s inuse %ld memuse %ld calls %lld",
+                   type->ks_shortdesc, inuse, memuse,
+                   (long long)type->ks_calls);
+        if (type->ks_cache)
+            seq_printf(m, " size %ld", type->ks_size);
+        seq_putc(m, '\n');
+    }
+    return 0;
+}
+
+static int
+hammerfs_mount_stats_show(struct seq_file *m, void *v)
+{
+    hammer_mount_t hmp = m->private;
+    struct hammerfs_stats st;
+    int i;
+
+    hammerfs_stats_sum(hmp, &st);
+
+    seq_printf(m, "inodes %d\n", hmp->count_inodes);
+    seq_printf(m, "inode_hits %llu\n", (unsigned long long)st.inode_hits);
+    seq_printf(m, "inode_misses %llu\n", (unsigned long long)st.inode_misses);
+    seq_printf(m, "buffer_hits %llu\n", (unsigned long long)st.buffer_hits);
+    seq_printf(m, "buffer_misses %llu\n",
+               (unsigned long long)st.buffer_misses);
+    seq_printf(m, "node_hits %llu\n", (unsigned long long)st.node_hits);
+    seq_printf(m, "node_misses %llu\n", (unsigned long long)st.node_misses);
+    seq_printf(m, "blockmap_direct %llu\n",
+               (unsigned long long)st.blockmap_direct);
+    seq_printf(m, "blockmap_verified %llu\n",
+               (unsigned long long)st.blockmap_verified);
+    seq_printf(m, "disk_reads %llu\n", (unsigned long long)st.disk_reads);
+    seq_printf(m, "disk_read_bytes %llu\n",
+               (unsigned long long)st.disk_read_bytes);
+    seq_printf(m, "file_reads %llu\n", (unsigned long long)st.file_reads);
+    seq_printf(m, "file_read_bytes %llu\n",
+               (unsigned long long)st.file_read_bytes);
+    seq_printf(m, "lru_buffers %d\n", hmp->count_lru);
+    seq_printf(m, "lru_parts");
+    for (i = 0; i < HAMMER_LRU_PARTS; ++i)
+        seq_printf(m, " %d", hmp->count_lru_part[i]);
+    seq_printf(m, "\n");
+    seq_printf(m, "lru_cold %d\n", hmp->count_lru_part[HAMMER_LRU_COLD]);
+    seq_printf(m, "shrink_scanned %llu\n",
+               (unsigned long long)st.shrink_scanned);
+    seq_printf(m, "shrink_freed %llu\n", (unsigned long long)st.shrink_freed);
+    seq_printf(m, "asof_skipped_elms %llu\n",
+               (unsigned long long)st.asof_skipped_elms);
+    seq_printf(m, "asof_skipped_subtrees %llu\n",
+               (unsigned long long)st.asof_skipped_subtrees);
+    return 0;
+}
+
+static int
+hammerfs_mount_latency_show(struct seq_file *m, void *v)
+{
+    hammer_mount_t hmp = m->private;
+    struct hammerfs_stats st;
+    u_int64_t *hist;
+    int op;
+    int b;
+
+    hammerfs_stats_sum(hmp, &st);
+
+    for (op = 0; op < HAMMERFS_LAT_OPS; ++op) {
+        hist = st.lat[op];
+        seq_printf(m, "%s count %llu p50 %llu p90 %llu p99 %llu\n",
+                   hammerfs_lat_names[op],
+                   (unsigned long long)hammerfs_lat_count(hist),
+                   (unsigned long long)hammerfs_lat_percentile(hist, 50),
+                   (unsigned long long)hammerfs_lat_percentile(hist, 90),
+                   (unsigned long long)hammerfs_lat_percentile(hist, 99));
+        for (b = 0; b < HAMMERFS_LAT_BUCKETS; ++b) {
+            if (hist[b]) {
+                seq_printf(m, "  %llu %llu\n",
+                           b ? 1ULL << b : 0ULL,
+                           (unsigned long long)hist[b]);
+            }
+        }
+    }
+    return 0;
+}
+
+static int
+hammerfs_mount_pfs_show(struct seq_file *m, void *v)
+{
+    hammer_mount_t hmp = m->private;
+    struct hammerfs_pfs_summary *ary;
+    int count;
+    int error;
+    int i;
+
+    error = hammerfs_pfs_summary(hmp, 0, &ary, &count);
+    if (error)
+        return -error;
+    for (i = 0; i < count; ++i) {
+        seq_printf(m, "%05u inodes %lld records %lld data_bytes %lld"
+                   " history_bytes %lld sync_end_tid 0x%016llx%s\n",
+                   ary[i].pfs_id, (long long)ary[i].inodes,
+                   (long long)ary[i].records, (long long)ary[i].data_bytes,
+                   (long long)ary[i].history_bytes,
+                   (unsigned long long)ary[i].sync_end_tid,
+                   (ary[i].mirror_flags & HAMMER_PFSD_SLAVE) ?
+                   " slave" : "");
+    }
+    return 0;
+}
+
+static int
+hammerfs_global_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hammerfs_global_stats_show, NULL);
+}
+
+static int
+hammerfs_malloc_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hammerfs_malloc_show, NULL);
+}
+
+static int
+hammerfs_mount_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hammerfs_mount_stats_show, PDE(inode)->data);
+}
+
+static int
+hammerfs_mount_latency_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hammerfs_mount_latency_show, PDE(inode)->data);
+}
+
+static int
+hammerfs_mount_pfs_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, hammerfs_mount_pfs_show, PDE(inode)->data);
+}
+
+static const struct file_operations hammerfs_global_stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = hammerfs_global_stats_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations hammerfs_malloc_fops = {
+    .owner   = THIS_MODULE,
+    .open    = hammerfs_malloc_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations hammerfs_mount_stats_fops = {
+    .owner   = THIS_MODULE,
+    .open    = hammerfs_mount_stats_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations hammerfs_mount_latency_fops = {
+    .owner   = THIS_MODULE,
+    .open    = hammerfs_mount_latency_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations hammerfs_mount_pfs_fops = {
+    .owner   = THIS_MODULE,
+    .open    = hammerfs_mount_pfs_open,
+    .read    = seq_read,
+    .llseek  = seq_lseek,
+    .release = single_release,
+};
+
+/*
+ * Called once at module load.
+ */
+int
+hammerfs_init_stats(void)
+{
+    hammerfs_proc_root = proc_mkdir(HAMMERFS_PROC_ROOT, NULL);
+    if (hammerfs_proc_root == NULL)
+        return -ENOMEM;
+    if (proc_create("stats", S_IRUGO, hammerfs_proc_root,
+                    &hammerfs_global_stats_fops) == NULL)
+        goto failed;
+    if (proc_create("malloc", S_IRUGO, hammerfs_proc_root,
+                    &hammerfs_malloc_fops) == NULL) {
+        remove_proc_entry("stats", hammerfs_proc_root);
+        goto failed;
+    }
+    return 0;
+
+failed:
+    remove_proc_entry(HAMMERFS_PROC_ROOT, NULL);
+    return -ENOMEM;
+}
+
+void
+hammerfs_exit_stats(void)
+{
+    remove_proc_entry("malloc", hammerfs_proc_root);
+    remove_proc_entry("stats", hammerfs_proc_root);
+    remove_proc_entry(HAMMERFS_PROC_ROOT, NULL);
+}
+
+/*
+ * Files created in each mount's directory.
+ */
+static const struct {
+    const char *name;
+    const struct file_operations *fops;
+} hammerfs_mount_files[] = {
+    { "stats",   &hammerfs_mount_stats_fops },
+    { "latency", &hammerfs_mount_latency_fops },
+    { "pfs",     &hammerfs_mount_pfs_fops },
+};
+
+#define HAMMERFS_MOUNT_FILES \
+    (sizeof(hammerfs_mount_files) / sizeof(hammerfs_mount_files[0]))
+
+static void
+hammerfs_remove_mount_files(struct super_block *sb, int count)
+{
+    char path[sizeof(HAMMERFS_PROC_ROOT) + sizeof(sb->s_id) + 16];
+    int i;
+
+    /*
+     * Only names relative to /proc are translated, not to a parent.
+     */
+    for (i = 0; i < count; ++i) {
+        snprintf(path, sizeof(path), HAMMERFS_PROC_ROOT "/%s/%s",
+                 sb->s_id, hammerfs_mount_files[i].name);
+        remove_proc_entry(path, NULL);
+    }
+    remove_proc_entry(sb->s_id, hammerfs_proc_root);
+}
+
+/*
+ * Create /proc/fs/hammer/<dev>/ for a mount.  The directory is named
+ * after sb->s_id, which is unique among mounted block devices.
+ */
+int
+hammerfs_register_stats(struct super_block *sb)
+{
+    struct proc_dir_entry *dir;
+    int i;
+
+    dir = proc_mkdir(sb->s_id, hammerfs_proc_root);
+    if (dir == NULL)
+        return -ENOMEM;
+    for (i = 0; i < HAMMERFS_MOUNT_FILES; ++i) {
+        if (proc_create_data(hammerfs_mount_files[i].name, S_IRUGO, dir,
+                             hammerfs_mount_files[i].fops,
+                             sb->s_fs_info) == NULL) {
+            hammerfs_remove_mount_files(sb, i);
+            return -ENOMEM;
+        }
+    }
+    return 0;
+}
+
+void
+hammerfs_unregister_stats(struct super_block *sb)
+{
+    hammerfs_remove_mount_files(sb, HAMMERFS_MOUNT_FILES);
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+#
+# Generate a set of synthetic images and run hammer_bench over each one.
+# Results go to stdout, one key=value line per benchmark.
+#
+#	./bench.sh [workdir] [hammer_bench options]
+#
+# The images are kept in workdir (default /tmp/hammer_bench) and are only
+# regenerated when missing.
+#
+
+dir=${1:-/tmp/hammer_bench}
+[ $# -gt 0 ] && shift
+bin=$(dirname "$0")
+
+mkdir -p "$dir" || exit 1
+
+#	name	hammer_mkimage options
+images="
+	wide	-n 20000 -f 20000 -s 4K
+	deep	-n 20000 -f 8 -s 1K:64K
+	large	-n 64 -f 64 -s 4M:16M -p 20
+	history	-n 2000 -f 100 -s 16K:256K -H 8 -x 10
+"
+
+echo "$images" | while read name opts; do
+	[ -z "$name" ] && continue
+	img="$dir/$name.img"
+	info="$dir/$name.info"
+	if [ ! -f "$img" -o ! -f "$info" ]; then
+		"$bin/hammer_mkimage" $opts "$img" > "$info" || exit 1
+	fi
+
+	# One as-of point per history version: version v is visible
+	# at tid_beg + 1 + v.
+	tid_beg=$(sed -n 's/.*tid_beg=\([^ ]*\).*/\1/p' "$info")
+	history=$(sed -n 's/.*history=\([^ ]*\).*/\1/p' "$info")
+	asof=""
+	v=0
+	while [ $v -lt $history ]; do
+		asof="$asof -a $(printf '0x%x' $((tid_beg + 1 + v)))"
+		v=$((v + 1))
+	done
+
+	"$bin/hammer_bench" $asof "$@" "$img" || exit 1
+done
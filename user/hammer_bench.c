@@ -0,0 +1,1156 @@
+/*
+ * hammer_bench - read-path benchmarks over the userspace HAMMER core
+ *
+ *	hammer_bench [-L] [-b bench[,bench...]] [-n ops] [-B bufsize]
+ *		     [-S bytes] [-a tid]... [-j threads] [-r seed] image
+ *
+ * Benchmarks: lookup (cold and warm), readdir, seqread, randread, asof,
+ * mirror, pfs, isolation, reclaim.
+ * Every benchmark starts from a fresh mount and asks the kernel to drop
+ * the image from the page cache, so core caches start out empty.
+ *
+ * One line of key=value pairs is printed per result, e.g.
+ *
+ *	bench=lookup_warm image=t.img ops=10000 ns_per_op=812 ...
+ *
+ * The btree_* and disk_read fields are the deltas of the core's
+ * hammer_stats_* counters over the timed section, the *_hits and *_misses
+ * fields those of the mount's counters (see hammerfs_stats.h).  With -L
+ * every result is followed by one lat=<op> line per instrumented core
+ * operation, with percentiles taken from the mount's log2 histograms.
+ */
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <limits.h>
+
+#include <pthread.h>
+
+#include "hammer_user.h"
+#include "hammerfs_stats.h"
+
+struct bench_file {
+	char		*path;
+	int64_t		size;
+};
+
+struct bench_dir {
+	char		*path;
+	int		nentries;
+};
+
+struct bench_stats {
+	int64_t		ns;
+	int64_t		btree_lookups;
+	int64_t		btree_searches;
+	int64_t		btree_iterations;
+	int64_t		disk_read;
+	struct hammerfs_stats mount;	/* per-mount counters */
+};
+
+struct bench_name {
+	char		*name;
+	int		dtype;
+};
+
+struct bench_names {
+	struct bench_name *ary;
+	int		count;
+	int		alloc;
+};
+
+static struct bench_file *files;
+static int nfiles;
+static struct bench_dir *dirs;
+static int ndirs;
+
+static const char *image;
+static const char *image_name;
+static const char *bench_name;
+static int latency;
+static int nops = 10000;
+static int nthreads = 1;
+static size_t bufsize = 4096;
+static int64_t seqbytes = 256LL * 1024 * 1024;
+static char *buf;
+
+static int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+static int64_t
+rand64(void)
+{
+	return(((int64_t)random() << 31) ^ random());
+}
+
+static void
+stats_start(struct bench_stats *st, struct hu_mount *mnt)
+{
+	hammerfs_stats_sum(mnt->hmp, &st->mount);
+	st->btree_lookups = hammer_stats_btree_lookups;
+	st->btree_searches = hammer_stats_btree_searches;
+	st->btree_iterations = hammer_stats_btree_iterations;
+	st->disk_read = hammer_stats_disk_read;
+	st->ns = now_ns();
+}
+
+static void
+stats_stop(struct bench_stats *st, struct hu_mount *mnt)
+{
+	struct hammerfs_stats sum;
+	u_int64_t *src = (u_int64_t *)&sum;
+	u_int64_t *dst = (u_int64_t *)&st->mount;
+	int i;
+
+	st->ns = now_ns() - st->ns;
+	hammerfs_stats_sum(mnt->hmp, &sum);
+	for (i = 0; i < sizeof(sum) / sizeof(u_int64_t); ++i)
+		dst[i] = src[i] - dst[i];
+	st->btree_lookups = hammer_stats_btree_lookups - st->btree_lookups;
+	st->btree_searches = hammer_stats_btree_searches - st->btree_searches;
+	st->btree_iterations = hammer_stats_btree_iterations -
+			       st->btree_iterations;
+	st->disk_read = hammer_stats_disk_read - st->disk_read;
+}
+
+static void
+stats_add(struct bench_stats *st, struct bench_stats *one)
+{
+	u_int64_t *src = (u_int64_t *)&one->mount;
+	u_int64_t *dst = (u_int64_t *)&st->mount;
+	int i;
+
+	st->ns += one->ns;
+	st->btree_lookups += one->btree_lookups;
+	st->btree_searches += one->btree_searches;
+	st->btree_iterations += one->btree_iterations;
+	st->disk_read += one->disk_read;
+	for (i = 0; i < sizeof(st->mount) / sizeof(u_int64_t); ++i)
+		dst[i] += src[i];
+}
+
+static void
+print_head(const char *bench)
+{
+	bench_name = bench;
+	printf("bench=%s image=%s", bench, image_name);
+}
+
+static void
+print_stats(struct bench_stats *st)
+{
+	u_int64_t *hist;
+	int op;
+
+	printf(" ns=%" PRId64 " btree_lookups=%" PRId64
+	       " btree_searches=%" PRId64 " btree_iterations=%" PRId64
+	       " disk_read=%" PRId64,
+	       st->ns, st->btree_lookups, st->btree_searches,
+	       st->btree_iterations, st->disk_read);
+	printf(" inode_hits=%" PRIu64 " inode_misses=%" PRIu64
+	       " buffer_hits=%" PRIu64 " buffer_misses=%" PRIu64
+	       " node_hits=%" PRIu64 " node_misses=%" PRIu64 "\n",
+	       st->mount.inode_hits, st->mount.inode_misses,
+	       st->mount.buffer_hits, st->mount.buffer_misses,
+	       st->mount.node_hits, st->mount.node_misses);
+
+	if (latency == 0)
+		return;
+	for (op = 0; op < HAMMERFS_LAT_OPS; ++op) {
+		hist = st->mount.lat[op];
+		if (hammerfs_lat_count(hist) == 0)
+			continue;
+		printf("bench=%s image=%s lat=%s count=%" PRIu64
+		       " p50_ns=%" PRIu64 " p90_ns=%" PRIu64
+		       " p99_ns=%" PRIu64 "\n",
+		       bench_name, image_name, hammerfs_lat_names[op],
+		       hammerfs_lat_count(hist),
+		       hammerfs_lat_percentile(hist, 50),
+		       hammerfs_lat_percentile(hist, 90),
+		       hammerfs_lat_percentile(hist, 99));
+	}
+}
+
+static int
+cmp_int64(const void *a1, const void *a2)
+{
+	int64_t v1 = *(const int64_t *)a1;
+	int64_t v2 = *(const int64_t *)a2;
+
+	return((v1 > v2) - (v1 < v2));
+}
+
+/*
+ * Latency distribution of n individually timed operations.
+ */
+static void
+print_latency(int64_t *lat, int n)
+{
+	if (n == 0) {
+		printf(" p50_ns=0 p90_ns=0 p99_ns=0 max_ns=0");
+		return;
+	}
+	qsort(lat, n, sizeof(*lat), cmp_int64);
+	printf(" p50_ns=%" PRId64 " p90_ns=%" PRId64 " p99_ns=%" PRId64
+	       " max_ns=%" PRId64,
+	       lat[n / 2], lat[(int64_t)n * 90 / 100],
+	       lat[(int64_t)n * 99 / 100], lat[n - 1]);
+}
+
+static double
+rate(int64_t count, int64_t ns)
+{
+	return(ns ? (double)count * 1e9 / ns : 0.0);
+}
+
+static void
+die(const char *what, int error)
+{
+	fprintf(stderr, "%s: %s\n", what, strerror(error));
+	exit(1);
+}
+
+/*
+ * Mount the image with empty core caches.  The page cache is dropped on
+ * a best effort basis; it has no effect on tmpfs.
+ */
+static void
+bench_mount(struct hu_mount *mnt)
+{
+	int error;
+	int fd;
+
+	fd = open(image, O_RDONLY);
+	if (fd >= 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+	error = hu_mount(mnt, image);
+	if (error)
+		die(image, error);
+}
+
+/*
+ * Unmount an image mounted by bench_mount().  The port does not tear down
+ * the core caches on unmount, so the buffers and B-Tree nodes are handed
+ * back through the shrinker first (twice, the first pass mostly takes back
+ * second chances); only the inodes stay behind.
+ */
+static void
+bench_umount(struct hu_mount *mnt)
+{
+	shrink_slab(INT_MAX, GFP_KERNEL);
+	shrink_slab(INT_MAX, GFP_KERNEL);
+	hu_umount(mnt);
+}
+
+static hammer_inode_t
+bench_namei(struct hu_mount *mnt, const char *path, hammer_tid_t asof)
+{
+	hammer_inode_t ip;
+	int error;
+
+	error = hu_namei(mnt, path, asof, &ip);
+	if (error)
+		die(path, error);
+	return(ip);
+}
+
+/*
+ * Read a whole file with bufsize reads, the way successive readpage
+ * calls would.
+ */
+static int64_t
+bench_read_file(hammer_inode_t ip)
+{
+	int64_t off;
+	ssize_t n;
+
+	for (off = 0; off < ip->ino_data.size; off += n) {
+		n = hu_read(ip, off, buf, bufsize);
+		if (n < 0)
+			die("hu_read", -n);
+		if (n == 0)
+			break;
+	}
+	return(off);
+}
+
+static int
+collect_name(void *arg, const char *name, int nlen, int64_t key,
+	     int64_t obj_id, int dtype)
+{
+	struct bench_names *names = arg;
+
+	if (names->count == names->alloc) {
+		names->alloc = names->alloc ? names->alloc * 2 : 64;
+		names->ary = realloc(names->ary,
+				     names->alloc * sizeof(*names->ary));
+	}
+	names->ary[names->count].name = strndup(name, nlen);
+	names->ary[names->count].dtype = dtype;
+	++names->count;
+	return(0);
+}
+
+/*
+ * Build the list of files and directories to draw samples from.
+ */
+static void
+walk(struct hu_mount *mnt, const char *path, hammer_inode_t dip)
+{
+	struct bench_names names;
+	hammer_inode_t ip;
+	int64_t pos;
+	char *child;
+	int error;
+	int i;
+
+	bzero(&names, sizeof(names));
+	pos = 0;
+	error = hu_readdir(dip, &pos, collect_name, &names);
+	if (error)
+		die(path, error);
+
+	dirs = realloc(dirs, (ndirs + 1) * sizeof(*dirs));
+	dirs[ndirs].path = strdup(path);
+	dirs[ndirs].nentries = names.count;
+	++ndirs;
+
+	for (i = 0; i < names.count; ++i) {
+		child = malloc(strlen(path) + strlen(names.ary[i].name) + 2);
+		sprintf(child, "%s/%s", path, names.ary[i].name);
+		error = hu_lookup(dip, names.ary[i].name,
+				  strlen(names.ary[i].name), &ip);
+		if (error)
+			die(child, error);
+		if (names.ary[i].dtype == DT_DIR) {
+			walk(mnt, child, ip);
+			free(child);
+		} else {
+			files = realloc(files, (nfiles + 1) * sizeof(*files));
+			files[nfiles].path = child;
+			files[nfiles].size = ip->ino_data.size;
+			++nfiles;
+		}
+		free(names.ary[i].name);
+	}
+	free(names.ary);
+}
+
+/*
+ * Path lookup latency.  Cold lookups each run on a fresh mount; warm
+ * lookups run on one mount after every path has been resolved once.
+ */
+static void
+bench_lookup(void)
+{
+	struct bench_stats st;
+	struct hu_mount mnt;
+	int64_t *lat;
+	int64_t t;
+	int i;
+
+	if (nfiles == 0)
+		return;
+	lat = malloc(nops * sizeof(*lat));
+
+	bzero(&st, sizeof(st));
+	for (i = 0; i < nops; ++i) {
+		const char *path = files[random() % nfiles].path;
+		struct bench_stats one;
+
+		bench_mount(&mnt);
+		stats_start(&one, &mnt);
+		bench_namei(&mnt, path, HAMMER_MAX_TID);
+		stats_stop(&one, &mnt);
+		bench_umount(&mnt);
+
+		lat[i] = one.ns;
+		stats_add(&st, &one);
+	}
+	print_head("lookup_cold");
+	printf(" ops=%d ns_per_op=%" PRId64, nops, st.ns / nops);
+	print_latency(lat, nops);
+	print_stats(&st);
+
+	bench_mount(&mnt);
+	for (i = 0; i < nfiles; ++i)
+		bench_namei(&mnt, files[i].path, HAMMER_MAX_TID);
+	stats_start(&st, &mnt);
+	for (i = 0; i < nops; ++i) {
+		const char *path = files[random() % nfiles].path;
+
+		t = now_ns();
+		bench_namei(&mnt, path, HAMMER_MAX_TID);
+		lat[i] = now_ns() - t;
+	}
+	stats_stop(&st, &mnt);
+	bench_umount(&mnt);
+
+	print_head("lookup_warm");
+	printf(" ops=%d ns_per_op=%" PRId64 " ops_per_sec=%.0f",
+	       nops, st.ns / nops, rate(nops, st.ns));
+	print_latency(lat, nops);
+	print_stats(&st);
+	free(lat);
+}
+
+static int
+count_entry(void *arg, const char *name, int nlen, int64_t key,
+	    int64_t obj_id, int dtype)
+{
+	++*(int64_t *)arg;
+	return(0);
+}
+
+/*
+ * Full scans of the largest directory until at least nops entries have
+ * been returned.  One untimed pass loads the directory's B-Tree nodes.
+ */
+static void
+bench_readdir(void)
+{
+	struct bench_stats st;
+	struct hu_mount mnt;
+	struct bench_dir *dir;
+	hammer_inode_t dip;
+	int64_t entries;
+	int64_t pos;
+	int passes;
+	int error;
+	int i;
+
+	dir = &dirs[0];
+	for (i = 1; i < ndirs; ++i) {
+		if (dirs[i].nentries > dir->nentries)
+			dir = &dirs[i];
+	}
+	if (dir->nentries == 0)
+		return;
+
+	bench_mount(&mnt);
+	dip = bench_namei(&mnt, dir->path, HAMMER_MAX_TID);
+	entries = 0;
+	pos = 0;
+	error = hu_readdir(dip, &pos, count_entry, &entries);
+	if (error)
+		die(dir->path, error);
+
+	entries = 0;
+	passes = 0;
+	stats_start(&st, &mnt);
+	while (entries < nops) {
+		pos = 0;
+		error = hu_readdir(dip, &pos, count_entry, &entries);
+		if (error)
+			die(dir->path, error);
+		++passes;
+	}
+	stats_stop(&st, &mnt);
+	bench_umount(&mnt);
+
+	print_head("readdir");
+	printf(" dir=%s dir_entries=%d passes=%d entries=%" PRId64
+	       " entries_per_sec=%.0f",
+	       dir->path[0] ? dir->path : "/", dir->nentries, passes, entries,
+	       rate(entries, st.ns));
+	print_stats(&st);
+}
+
+/*
+ * Sequential reads of whole files, in directory order, until seqbytes
+ * have been read or the files run out.
+ */
+static void
+bench_seqread(void)
+{
+	struct bench_stats st;
+	struct hu_mount mnt;
+	hammer_inode_t ip;
+	int64_t bytes;
+	int nread;
+	int i;
+
+	bench_mount(&mnt);
+	bytes = 0;
+	nread = 0;
+	stats_start(&st, &mnt);
+	for (i = 0; i < nfiles && bytes < seqbytes; ++i) {
+		ip = bench_namei(&mnt, files[i].path, HAMMER_MAX_TID);
+		bytes += bench_read_file(ip);
+		++nread;
+	}
+	stats_stop(&st, &mnt);
+	bench_umount(&mnt);
+
+	print_head("seqread");
+	printf(" bufsize=%zu files=%d bytes=%" PRId64 " mb_per_sec=%.1f",
+	       bufsize, nread, bytes, rate(bytes, st.ns) / (1024 * 1024));
+	print_stats(&st);
+}
+
+/*
+ * Random page-aligned 4K reads from uniformly chosen non-empty files.
+ * Inodes are resolved before the timed section.
+ */
+static void
+bench_randread(void)
+{
+	struct bench_stats st;
+	struct hu_mount mnt;
+	hammer_inode_t *ips;
+	hammer_inode_t ip;
+	int64_t *lat;
+	int64_t off;
+	int64_t t;
+	ssize_t n;
+	int nips;
+	int i;
+
+	bench_mount(&mnt);
+	ips = malloc(nfiles * sizeof(*ips));
+	nips = 0;
+	for (i = 0; i < nfiles; ++i) {
+		if (files[i].size > 0)
+			ips[nips++] = bench_namei(&mnt, files[i].path,
+						  HAMMER_MAX_TID);
+	}
+	if (nips == 0) {
+		bench_umount(&mnt);
+		free(ips);
+		return;
+	}
+	lat = malloc(nops * sizeof(*lat));
+
+	stats_start(&st, &mnt);
+	for (i = 0; i < nops; ++i) {
+		ip = ips[random() % nips];
+		off = rand64() % ((ip->ino_data.size + 4095) / 4096) * 4096;
+		t = now_ns();
+		n = hu_read(ip, off, buf, 4096);
+		lat[i] = now_ns() - t;
+		if (n < 0)
+			die("hu_read", -n);
+	}
+	stats_stop(&st, &mnt);
+	bench_umount(&mnt);
+
+	print_head("randread");
+	printf(" ops=%d iops=%.0f", nops, rate(nops, st.ns));
+	print_latency(lat, nops);
+	print_stats(&st);
+	free(lat);
+	free(ips);
+}
+
+/*
+ * Lookup and full read of a sample of files as of a given TID.  Files
+ * which did not exist at that point in time are counted as missing.
+ */
+static void
+bench_asof(hammer_tid_t asof)
+{
+	struct bench_stats st;
+	struct hu_mount mnt;
+	hammer_inode_t ip;
+	int64_t bytes;
+	int missing;
+	int nsample;
+	int error;
+	int i;
+
+	nsample = nops < nfiles ? nops : nfiles;
+	if (nsample == 0)
+		return;
+
+	bench_mount(&mnt);
+	bytes = 0;
+	missing = 0;
+	stats_start(&st, &mnt);
+	for (i = 0; i < nsample; ++i) {
+		error = hu_namei(&mnt, files[i].path, asof, &ip);
+		if (error == ENOENT) {
+			++missing;
+			continue;
+		}
+		if (error)
+			die(files[i].path, error);
+		bytes += bench_read_file(ip);
+	}
+	stats_stop(&st, &mnt);
+	bench_umount(&mnt);
+
+	print_head("asof");
+	printf(" asof=0x%016" PRIx64 " files=%d missing=%d bytes=%" PRId64
+	       " ns_per_file=%" PRId64 " mb_per_sec=%.1f",
+	       (uint64_t)asof, nsample, missing, bytes, st.ns / nsample,
+	       rate(bytes, st.ns) / (1024 * 1024));
+	print_stats(&st);
+}
+
+/*
+ * Mirror-read of the whole PFS 0 with tid_beg = 1 (full) and each -a TID
+ * (incremental), once into a user buffer like HAMMERIOC_MIRROR_READ, once
+ * streamed to /dev/null like HAMMERFSIOC_MIRROR_READ_SPLICE and once
+ * streamed as HAMMERFS_MIRROR_FRAMES to a temporary file.  The frames are
+ * then unpacked again (mode=unframe), wire_bytes is the size of the
+ * framed stream.
+ */
+static void
+bench_mirror_one(const char *mode, hammer_tid_t tid_beg)
+{
+	struct hammer_ioc_mirror_rw mirror;
+	struct bench_stats st;
+	struct hu_mount mnt;
+	hammer_inode_t root;
+	int64_t bytes;
+	char *ubuf;
+	int64_t wire;
+	int64_t raw;
+	int64_t t;
+	char tmp[] = "/tmp/hammer_bench.XXXXXX";
+	int frames;
+	int calls;
+	int error;
+	int fd;
+	int nfd;
+
+	bzero(&mirror, sizeof(mirror));
+	mirror.key_beg.obj_id = HAMMER_MIN_OBJID;
+	mirror.key_end.localization = HAMMER_LOCALIZE_MASK;
+	mirror.key_end.obj_id = HAMMER_MAX_OBJID;
+	mirror.key_end.key = HAMMER_MAX_KEY;
+	mirror.key_end.rec_type = HAMMER_MAX_RECTYPE;
+	mirror.key_end.create_tid = HAMMER_MAX_TID;
+	mirror.tid_beg = tid_beg;
+	mirror.tid_end = HAMMER_MAX_TID;
+
+	ubuf = malloc(4 * 1024 * 1024);
+	frames = strcmp(mode, "frames") == 0;
+	nfd = open("/dev/null", O_WRONLY);
+	if (nfd < 0)
+		die("/dev/null", errno);
+	if (frames) {
+		fd = mkstemp(tmp);
+		if (fd < 0)
+			die(tmp, errno);
+		unlink(tmp);
+	} else {
+		fd = nfd;
+	}
+	bench_mount(&mnt);
+	root = bench_namei(&mnt, "/", HAMMER_MAX_TID);
+	bytes = 0;
+	calls = 0;
+	stats_start(&st, &mnt);
+	do {
+		mirror.ubuf = ubuf;
+		mirror.size = 4 * 1024 * 1024;
+		mirror.count = 0;
+		if (strcmp(mode, "ubuf") == 0)
+			error = hu_mirror_read(root, &mirror);
+		else
+			error = hu_mirror_stream(root, &mirror, fd,
+				frames ? HAMMERFS_MIRROR_FRAMES : 0);
+		if (error)
+			die("mirror", error);
+		bytes += mirror.count;
+		++calls;
+		mirror.key_beg = mirror.key_cur;
+	} while (hammer_btree_cmp(&mirror.key_cur, &mirror.key_end) != 0);
+	stats_stop(&st, &mnt);
+	bench_umount(&mnt);
+	free(ubuf);
+
+	print_head("mirror");
+	printf(" mode=%s tid_beg=0x%016" PRIx64 " calls=%d bytes=%" PRId64
+	       " mb_per_sec=%.1f",
+	       mode, (uint64_t)tid_beg, calls, bytes,
+	       rate(bytes, st.ns) / (1024 * 1024));
+	if (frames)
+		printf(" wire_bytes=%" PRId64, (int64_t)lseek(fd, 0, SEEK_END));
+	print_stats(&st);
+
+	if (frames) {
+		lseek(fd, 0, SEEK_SET);
+		t = now_ns();
+		error = hu_mframe_unpack(fd, nfd, &raw, &wire);
+		t = now_ns() - t;
+		if (error)
+			die("unframe", error);
+		if (raw != bytes)
+			die("unframe", EINVAL);
+		print_head("mirror");
+		printf(" mode=unframe tid_beg=0x%016" PRIx64 " bytes=%" PRId64
+		       " wire_bytes=%" PRId64 " mb_per_sec=%.1f ns=%" PRId64
+		       "\n", (uint64_t)tid_beg, raw, wire,
+		       rate(raw, t) / (1024 * 1024), t);
+		close(fd);
+	}
+	close(nfd);
+}
+
+struct bench_mirror_thread {
+	pthread_t	td;
+	hammer_inode_t	root;
+	struct hammer_ioc_mirror_rw mirror;
+	int64_t		bytes;
+};
+
+static void *
+bench_mirror_thread(void *arg)
+{
+	struct bench_mirror_thread *mt = arg;
+	int error;
+	int fd;
+
+	fd = open("/dev/null", O_WRONLY);
+	if (fd < 0)
+		die("/dev/null", errno);
+	do {
+		mt->mirror.size = 4 * 1024 * 1024;
+		mt->mirror.count = 0;
+		error = hu_mirror_stream(mt->root, &mt->mirror, fd, 0);
+		if (error)
+			die("mirror", error);
+		mt->bytes += mt->mirror.count;
+		mt->mirror.key_beg = mt->mirror.key_cur;
+	} while (hammer_btree_cmp(&mt->mirror.key_cur,
+				  &mt->mirror.key_end) != 0);
+	close(fd);
+	return(NULL);
+}
+
+/*
+ * The same mirror-read split into -j ranges by hu_mirror_split(), one
+ * thread streaming each.
+ */
+static void
+bench_mirror_parallel(hammer_tid_t tid_beg)
+{
+	struct hammerfs_ioc_mirror_split split;
+	struct hammerfs_mirror_range *ranges;
+	struct bench_mirror_thread *mt;
+	struct bench_stats st;
+	struct hu_mount mnt;
+	hammer_inode_t root;
+	int64_t bytes;
+	int error;
+	int i;
+
+	ranges = calloc(nthreads, sizeof(*ranges));
+	mt = calloc(nthreads, sizeof(*mt));
+	bench_mount(&mnt);
+	root = bench_namei(&mnt, "/", HAMMER_MAX_TID);
+
+	stats_start(&st, &mnt);
+	bzero(&split, sizeof(split));
+	split.key_beg.obj_id = HAMMER_MIN_OBJID;
+	split.key_end.localization = HAMMER_LOCALIZE_MASK;
+	split.key_end.obj_id = HAMMER_MAX_OBJID;
+	split.key_end.key = HAMMER_MAX_KEY;
+	split.key_end.rec_type = HAMMER_MAX_RECTYPE;
+	split.key_end.create_tid = HAMMER_MAX_TID;
+	split.count = nthreads;
+	split.ranges = ranges;
+	error = hu_mirror_split(root, &split);
+	if (error)
+		die("mirror split", error);
+	for (i = 0; i < split.count; ++i) {
+		mt[i].root = root;
+		mt[i].mirror.key_beg = ranges[i].key_beg;
+		mt[i].mirror.key_end = ranges[i].key_end;
+		mt[i].mirror.tid_beg = tid_beg;
+		mt[i].mirror.tid_end = HAMMER_MAX_TID;
+		pthread_create(&mt[i].td, NULL, bench_mirror_thread, &mt[i]);
+	}
+	bytes = 0;
+	for (i = 0; i < split.count; ++i) {
+		pthread_join(mt[i].td, NULL);
+		bytes += mt[i].bytes;
+	}
+	stats_stop(&st, &mnt);
+	bench_umount(&mnt);
+
+	print_head("mirror");
+	printf(" mode=parallel tid_beg=0x%016" PRIx64 " threads=%d bytes=%"
+	       PRId64 " mb_per_sec=%.1f",
+	       (uint64_t)tid_beg, split.count, bytes,
+	       rate(bytes, st.ns) / (1024 * 1024));
+	print_stats(&st);
+	free(mt);
+	free(ranges);
+}
+
+static void
+bench_mirror(hammer_tid_t *asof, int nasof)
+{
+	int i;
+
+	bench_mirror_one("ubuf", 1);
+	bench_mirror_one("stream", 1);
+	bench_mirror_one("frames", 1);
+	if (nthreads > 1)
+		bench_mirror_parallel(1);
+	for (i = 0; i < nasof; ++i) {
+		bench_mirror_one("ubuf", asof[i]);
+		bench_mirror_one("stream", asof[i]);
+		bench_mirror_one("frames", asof[i]);
+		if (nthreads > 1)
+			bench_mirror_parallel(asof[i]);
+	}
+}
+
+/*
+ * The per-PFS summary of hu_pfs_summary(), computed on a fresh mount by
+ * one worker and by -j workers (mode=cold), then served from the mount
+ * (mode=cached).
+ */
+static void
+bench_pfs_one(int nworkers)
+{
+	struct hammerfs_pfs_summary ary[256];
+	struct hammerfs_ioc_pfs_summary ps;
+	struct bench_stats st;
+	struct hu_mount mnt;
+	hammer_inode_t root;
+	int64_t inodes;
+	int64_t data_bytes;
+	int error;
+	int pass;
+	int i;
+
+	bench_mount(&mnt);
+	root = bench_namei(&mnt, "/", HAMMER_MAX_TID);
+	for (pass = 0; pass < 2; ++pass) {
+		bzero(&ps, sizeof(ps));
+		ps.count = 256;
+		ps.ary = ary;
+		stats_start(&st, &mnt);
+		error = hu_pfs_summary(root, nworkers, &ps);
+		stats_stop(&st, &mnt);
+		if (error)
+			die("pfs summary", error);
+		inodes = 0;
+		data_bytes = 0;
+		for (i = 0; i < min(ps.count, 256); ++i) {
+			inodes += ary[i].inodes;
+			data_bytes += ary[i].data_bytes;
+		}
+		print_head("pfs");
+		printf(" mode=%s workers=%d pfs=%d inodes=%" PRId64
+		       " data_bytes=%" PRId64,
+		       pass ? "cached" : "cold", nworkers, ps.count, inodes,
+		       data_bytes);
+		print_stats(&st);
+	}
+	bench_umount(&mnt);
+}
+
+static void
+bench_pfs(void)
+{
+	bench_pfs_one(1);
+	if (nthreads > 1)
+		bench_pfs_one(nthreads);
+}
+
+/*
+ * Warm lookups of the PFS 0 files before and after a mirror-read of PFS 1
+ * (-b isolation needs an image made with hammer_mkimage -P).  The scan is
+ * followed by two rounds of memory pressure as large as the number of
+ * buffers it left behind (shrink_slab()), the first of which mostly takes
+ * back second chances.  The lookups after it show how much of their
+ * working set the scan cost them.
+ */
+static void
+bench_isolation(void)
+{
+	struct hammer_ioc_mirror_rw mirror;
+	struct bench_stats st;
+	struct hu_mount mnt;
+	hammer_inode_t root;
+	int64_t *lat;
+	int64_t bytes;
+	int64_t t;
+	int scanned;
+	int pass;
+	int error;
+	int fd;
+	int i;
+
+	if (nfiles == 0)
+		return;
+	lat = malloc(nops * sizeof(*lat));
+	fd = open("/dev/null", O_WRONLY);
+	if (fd < 0)
+		die("/dev/null", errno);
+	bench_mount(&mnt);
+	root = bench_namei(&mnt, "/", HAMMER_MAX_TID);
+	for (i = 0; i < nfiles; ++i)
+		bench_namei(&mnt, files[i].path, HAMMER_MAX_TID);
+
+	bytes = 0;
+	scanned = 0;
+	for (pass = 0; pass < 2; ++pass) {
+		if (pass) {
+			bzero(&mirror, sizeof(mirror));
+			mirror.key_beg.obj_id = HAMMER_MIN_OBJID;
+			mirror.key_end.localization = HAMMER_LOCALIZE_MASK;
+			mirror.key_end.obj_id = HAMMER_MAX_OBJID;
+			mirror.key_end.key = HAMMER_MAX_KEY;
+			mirror.key_end.rec_type = HAMMER_MAX_RECTYPE;
+			mirror.key_end.create_tid = HAMMER_MAX_TID;
+			mirror.tid_beg = 1;
+			mirror.tid_end = HAMMER_MAX_TID;
+			mirror.pfs_id = 1;
+			scanned = mnt.hmp->count_lru;
+			do {
+				mirror.size = 4 * 1024 * 1024;
+				mirror.count = 0;
+				error = hu_mirror_stream(root, &mirror, fd, 0);
+				if (error)
+					die("mirror", error);
+				bytes += mirror.count;
+				mirror.key_beg = mirror.key_cur;
+			} while (hammer_btree_cmp(&mirror.key_cur,
+						  &mirror.key_end) != 0);
+			scanned = mnt.hmp->count_lru - scanned;
+			shrink_slab(scanned, GFP_KERNEL);
+			shrink_slab(scanned, GFP_KERNEL);
+		}
+		stats_start(&st, &mnt);
+		for (i = 0; i < nops; ++i) {
+			const char *path = files[random() % nfiles].path;
+
+			t = now_ns();
+			bench_namei(&mnt, path, HAMMER_MAX_TID);
+			lat[i] = now_ns() - t;
+		}
+		stats_stop(&st, &mnt);
+
+		print_head("isolation");
+		printf(" mode=%s ops=%d ns_per_op=%" PRId64 " scan_bytes=%"
+		       PRId64 " scan_buffers=%d",
+		       pass ? "after_scan" : "before_scan", nops,
+		       st.ns / nops, bytes, scanned);
+		print_latency(lat, nops);
+		print_stats(&st);
+	}
+	bench_umount(&mnt);
+	close(fd);
+	free(lat);
+}
+
+struct bench_reclaim_thread {
+	pthread_t	td;
+	struct hu_mount	*mnt;
+	unsigned int	seed;
+};
+
+static int reclaim_running;
+
+static void *
+bench_reclaim_thread(void *arg)
+{
+	struct bench_reclaim_thread *rt = arg;
+	hammer_inode_t ip;
+	char *tbuf;
+	int64_t off;
+	ssize_t n;
+	int i;
+
+	tbuf = malloc(4096);
+	for (i = 0; i < nops; ++i) {
+		ip = bench_namei(rt->mnt, files[rand_r(&rt->seed) % nfiles].path,
+				 HAMMER_MAX_TID);
+		if (ip->ino_data.size == 0)
+			continue;
+		off = rand_r(&rt->seed) %
+		      ((ip->ino_data.size + 4095) / 4096) * 4096;
+		n = hu_read(ip, off, tbuf, 4096);
+		if (n < 0)
+			die("hu_read", -n);
+	}
+	free(tbuf);
+	__sync_fetch_and_sub(&reclaim_running, 1);
+	return(NULL);
+}
+
+/*
+ * Lookups and random 4K reads by -j threads, -n of each per thread,
+ * while the main thread hands every unreferenced buffer back through the
+ * shrinker (shrink_slab()) over and over.  This is mostly a stress test
+ * of buffer and B-Tree node teardown racing the read path; build with
+ * CFLAGS="-O1 -g -fsanitize=address" to have it check for more than
+ * crashes.
+ */
+static void
+bench_reclaim(void)
+{
+	struct bench_reclaim_thread *rt;
+	struct bench_stats st;
+	struct hu_mount mnt;
+	int64_t rounds;
+	int i;
+
+	if (nfiles == 0)
+		return;
+	rt = calloc(nthreads, sizeof(*rt));
+	bench_mount(&mnt);
+
+	/*
+	 * Resolve the inodes first, the loser of two lookups racing to
+	 * load the same inode would have to free it (hammer_free_inode()).
+	 */
+	for (i = 0; i < nfiles; ++i)
+		bench_namei(&mnt, files[i].path, HAMMER_MAX_TID);
+
+	stats_start(&st, &mnt);
+	reclaim_running = nthreads;
+	for (i = 0; i < nthreads; ++i) {
+		rt[i].mnt = &mnt;
+		rt[i].seed = random();
+		pthread_create(&rt[i].td, NULL, bench_reclaim_thread, &rt[i]);
+	}
+	rounds = 0;
+	while (reclaim_running) {
+		shrink_slab(INT_MAX, GFP_KERNEL);
+		++rounds;
+	}
+	for (i = 0; i < nthreads; ++i)
+		pthread_join(rt[i].td, NULL);
+	stats_stop(&st, &mnt);
+	bench_umount(&mnt);
+
+	print_head("reclaim");
+	printf(" threads=%d ops=%d ops_per_sec=%.0f shrink_rounds=%" PRId64
+	       " shrink_freed=%" PRIu64,
+	       nthreads, nops * nthreads, rate(nops * nthreads, st.ns),
+	       rounds, st.mount.shrink_freed);
+	print_stats(&st);
+	free(rt);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: hammer_bench [-L] [-b bench[,bench...]] [-n ops]\n"
+	    "                    [-B bufsize] [-S bytes] [-a tid]... [-j threads]\n"
+	    "                    [-r seed] image\n"
+	    "benchmarks: lookup readdir seqread randread asof mirror pfs "
+	    "isolation reclaim\n");
+	exit(1);
+}
+
+static int
+selected(const char *list, const char *bench)
+{
+	size_t len = strlen(bench);
+	const char *ptr;
+
+	if (list == NULL)
+		return(1);
+	for (ptr = list; (ptr = strstr(ptr, bench)) != NULL; ptr += len) {
+		if ((ptr == list || ptr[-1] == ',') &&
+		    (ptr[len] == 0 || ptr[len] == ','))
+			return(1);
+	}
+	return(0);
+}
+
+int
+main(int ac, char **av)
+{
+	struct hu_mount mnt;
+	hammer_inode_t root;
+	hammer_tid_t *asof = NULL;
+	const char *list = NULL;
+	char *ptr;
+	int nasof = 0;
+	int ch;
+	int i;
+
+	srandom(1);
+	while ((ch = getopt(ac, av, "a:b:n:B:j:LS:r:")) != -1) {
+		switch (ch) {
+		case 'a':
+			asof = realloc(asof, (nasof + 1) * sizeof(*asof));
+			asof[nasof++] = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			list = optarg;
+			break;
+		case 'n':
+			nops = strtol(optarg, NULL, 0);
+			break;
+		case 'B':
+			bufsize = hu_getsize(optarg, &ptr);
+			if (*ptr)
+				usage();
+			break;
+		case 'j':
+			nthreads = strtol(optarg, NULL, 0);
+			break;
+		case 'L':
+			latency = 1;
+			break;
+		case 'S':
+			seqbytes = hu_getsize(optarg, &ptr);
+			if (*ptr)
+				usage();
+			break;
+		case 'r':
+			srandom(strtoul(optarg, NULL, 0));
+			break;
+		default:
+			usage();
+		}
+	}
+	ac -= optind;
+	av += optind;
+	if (ac != 1 || nops <= 0 || bufsize == 0 || nthreads < 1 ||
+	    nthreads > HAMMERFS_MIRROR_SPLIT_MAX)
+		usage();
+	image = av[0];
+	image_name = strrchr(image, '/') ? strrchr(image, '/') + 1 : image;
+	buf = malloc(bufsize > 4096 ? bufsize : 4096);
+
+	bench_mount(&mnt);
+	root = bench_namei(&mnt, "/", HAMMER_MAX_TID);
+	walk(&mnt, "", root);
+	bench_umount(&mnt);
+
+	if (selected(list, "lookup"))
+		bench_lookup();
+	if (selected(list, "readdir"))
+		bench_readdir();
+	if (selected(list, "seqread"))
+		bench_seqread();
+	if (selected(list, "randread"))
+		bench_randread();
+	if (selected(list, "asof")) {
+		for (i = 0; i < nasof; ++i)
+			bench_asof(asof[i]);
+		bench_asof(HAMMER_MAX_TID);
+	}
+	if (selected(list, "mirror"))
+		bench_mirror(asof, nasof);
+	if (selected(list, "pfs"))
+		bench_pfs();
+	if (selected(list, "isolation"))
+		bench_isolation();
+	if (selected(list, "reclaim"))
+		bench_reclaim();
+	return(0);
+}
@@ -0,0 +1,869 @@
+/*
+ * hammer_check - offline B-Tree and blockmap consistency check
+ *
+ *	hammer_check [-j threads] [-R readsize] [-p interval] image
+ *
+ * The image is read directly, without mounting it, in three passes:
+ *
+ *	1. The volume header and the freemap: the volume and blockmap
+ *	   CRCs, every layer1 entry covering the volume and every layer2
+ *	   entry (one per 8MB big-block), with each layer1's blocks_free
+ *	   checked against the free layer2 entries below it.  The layer2
+ *	   entries are kept in memory for the other two passes.
+ *
+ *	2. The B-Tree, in parallel by subtree.  The top of the tree is
+ *	   expanded breadth-first until there are enough subtrees to keep
+ *	   -j threads busy, then every thread takes the next unchecked
+ *	   subtree, in key order, and walks it depth-first.  Each node is
+ *	   checked for its CRC, type, count and parent pointer, the order
+ *	   of its elements and whether they lie within the boundaries its
+ *	   parent gives it, and each leaf element for its data CRC.  Every
+ *	   node and record is charged to its big-block, which has to belong
+ *	   to the same zone and be appended past it.
+ *
+ *	3. The bytes charged to every big-block against its bytes_free.
+ *
+ * To stay I/O bound on large images the reads are batched: the children
+ * of an internal node, and the records of the last few thousand leaf
+ * elements a thread has seen, are sorted by offset and brought in with
+ * one pread() per run of nearby extents, up to -R bytes (default 4MB).
+ *
+ * Progress is reported to stderr every -p seconds (0 turns it off), the
+ * result to stdout as one line of key=value pairs, e.g.
+ *
+ *	check=ok image=t.img threads=4 nodes=... errors=0
+ *
+ * The exit status is 1 if anything was found.  Only single-volume
+ * filesystems are supported.
+ */
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdarg.h>
+
+#include <pthread.h>
+
+#include "hammer_user.h"
+
+#define CHK_MAXDEPTH	32
+#define CHK_PENDING	8192		/* records batched per thread */
+#define CHK_READ_GAP	HAMMER_BUFSIZE	/* gap read through in a run */
+#define CHK_MAXERRORS	100		/* errors reported in full */
+
+/*
+ * A subtree still to be checked: the node and what its parent says
+ * about it.  The root has no parent and no boundaries.
+ */
+struct chk_subtree {
+	hammer_off_t	offset;		/* zone-8 */
+	hammer_off_t	parent;
+	struct hammer_base_elm left;	/* inclusive */
+	struct hammer_base_elm right;	/* exclusive for leaf elements */
+	u_int8_t	btype;		/* 0 for the root */
+	int		depth;
+	int		readerr;
+};
+
+struct chk_extent {
+	off_t		pos;		/* image offset */
+	int		len;
+	int		idx;
+};
+
+/*
+ * Per-depth buffers for the children of the node being walked.
+ */
+struct chk_level {
+	struct hammer_node_ondisk *nodes;
+	struct chk_subtree *subs;
+};
+
+struct chk_worker {
+	pthread_t	td;
+	char		*rbuf;		/* readsize */
+	struct chk_extent *exts;	/* CHK_PENDING */
+	struct chk_level level[CHK_MAXDEPTH];
+	struct hammer_btree_leaf_elm *pend;
+	int		npend;
+
+	/* read unlocked by the progress report */
+	int64_t		nodes;
+	int64_t		leaves;
+	int64_t		records;
+	int64_t		data_bytes;
+	int64_t		read_bytes;
+	int64_t		reads;
+	int		maxdepth;
+};
+
+typedef void (*chk_extent_func_t)(struct chk_worker *w,
+				  struct chk_extent *ext, char *data,
+				  void *arg);
+
+static const char *image;
+static const char *image_name;
+static int fd;
+static int nthreads;
+static size_t readsize = 4 * 1024 * 1024;
+static int interval = 10;
+
+static int64_t buf_beg;
+static int64_t nblocks;
+static struct hammer_blockmap_layer2 *layer2;
+static int64_t *used;			/* bytes charged per big-block */
+
+static struct chk_subtree *units;
+static int nunits;
+static int next_unit;
+static int units_done;
+static int nrunning;
+static int64_t nerrors;
+
+static int64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+static void
+chk_error(const char *fmt, ...)
+{
+	va_list va;
+
+	if (__sync_add_and_fetch(&nerrors, 1) > CHK_MAXERRORS)
+		return;
+	va_start(va, fmt);
+	fprintf(stderr, "%s: ", image_name);
+	vfprintf(stderr, fmt, va);
+	fprintf(stderr, "\n");
+	va_end(va);
+}
+
+static off_t
+chk_pos(hammer_off_t off)
+{
+	return(buf_beg + (off & HAMMER_OFF_SHORT_MASK));
+}
+
+static int
+chk_cmp_extent(const void *a1, const void *a2)
+{
+	const struct chk_extent *e1 = a1;
+	const struct chk_extent *e2 = a2;
+
+	if (e1->pos < e2->pos)
+		return(-1);
+	if (e1->pos > e2->pos)
+		return(1);
+	return(0);
+}
+
+/*
+ * Read a set of extents sorted by position, one pread() per run of
+ * extents no further than CHK_READ_GAP apart and no larger than
+ * readsize, and call func on each.  data is NULL if it could not be read.
+ */
+static void
+chk_read(struct chk_worker *w, struct chk_extent *exts, int n,
+	 chk_extent_func_t func, void *arg)
+{
+	ssize_t got;
+	off_t beg;
+	off_t end;
+	int i;
+	int j;
+	int k;
+
+	qsort(exts, n, sizeof(*exts), chk_cmp_extent);
+	for (i = 0; i < n; i = j) {
+		beg = exts[i].pos;
+		end = beg + exts[i].len;
+		for (j = i + 1; j < n; ++j) {
+			if (exts[j].pos > end + CHK_READ_GAP ||
+			    exts[j].pos + exts[j].len - beg > (off_t)readsize)
+				break;
+			if (end < exts[j].pos + exts[j].len)
+				end = exts[j].pos + exts[j].len;
+		}
+		got = pread(fd, w->rbuf, end - beg, beg);
+		++w->reads;
+		if (got > 0)
+			w->read_bytes += got;
+		for (k = i; k < j; ++k) {
+			if (got < exts[k].pos + exts[k].len - beg)
+				func(w, &exts[k], NULL, arg);
+			else
+				func(w, &exts[k], w->rbuf + (exts[k].pos - beg),
+				     arg);
+		}
+	}
+}
+
+/*
+ * Charge an allocation to its big-block after checking it against the
+ * freemap.  Returns -1 if it does not point at allocated space.
+ */
+static int
+chk_charge(hammer_off_t off, int bytes, const char *what)
+{
+	struct hammer_blockmap_layer2 *l2;
+	int64_t block;
+	int zone;
+	int boff;
+
+	zone = HAMMER_ZONE_DECODE(off);
+	block = (off & HAMMER_OFF_SHORT_MASK) / HAMMER_LARGEBLOCK_SIZE64;
+	boff = (int)(off & HAMMER_LARGEBLOCK_MASK64);
+	if (zone < HAMMER_ZONE_BTREE_INDEX ||
+	    zone >= HAMMER_ZONE_UNAVAIL_INDEX ||
+	    HAMMER_VOL_DECODE(off) != 0 || block >= nblocks ||
+	    boff + bytes > HAMMER_LARGEBLOCK_SIZE) {
+		chk_error("%s %016llx: bad offset", what, (long long)off);
+		return(-1);
+	}
+	l2 = &layer2[block];
+	if (l2->zone != zone) {
+		chk_error("%s %016llx: big-block belongs to zone %d",
+			  what, (long long)off, l2->zone);
+		return(-1);
+	}
+	if (boff + bytes > l2->append_off) {
+		chk_error("%s %016llx: beyond append_off %08x",
+			  what, (long long)off, l2->append_off);
+		return(-1);
+	}
+	__sync_fetch_and_add(&used[block], (bytes + 15) & ~15);
+	return(0);
+}
+
+static void
+chk_record_done(struct chk_worker *w, struct chk_extent *ext, char *data,
+		void *arg)
+{
+	hammer_btree_leaf_elm_t leaf = &w->pend[ext->idx];
+
+	if (data == NULL) {
+		chk_error("record %016llx: read error",
+			  (long long)leaf->data_offset);
+		return;
+	}
+	if (!hammer_crc_test_leaf(data, leaf)) {
+		chk_error("record %016llx: bad data crc "
+			  "(obj %016llx rec_type %04x key %016llx)",
+			  (long long)leaf->data_offset,
+			  (long long)leaf->base.obj_id, leaf->base.rec_type,
+			  (long long)leaf->base.key);
+	}
+	w->data_bytes += leaf->data_len;
+}
+
+/*
+ * Verify the data of the pending records.
+ */
+static void
+chk_flush(struct chk_worker *w)
+{
+	int i;
+
+	for (i = 0; i < w->npend; ++i) {
+		w->exts[i].pos = chk_pos(w->pend[i].data_offset);
+		w->exts[i].len = w->pend[i].data_len;
+		w->exts[i].idx = i;
+	}
+	chk_read(w, w->exts, w->npend, chk_record_done, NULL);
+	w->npend = 0;
+}
+
+static void
+chk_record(struct chk_worker *w, hammer_btree_leaf_elm_t leaf)
+{
+	++w->records;
+	if (leaf->data_offset == 0 && leaf->data_len == 0)
+		return;
+	if (leaf->data_offset == 0 || leaf->data_len <= 0 ||
+	    leaf->data_len > HAMMER_XBUFSIZE) {
+		chk_error("record %016llx: bad data length %d",
+			  (long long)leaf->data_offset, leaf->data_len);
+		return;
+	}
+	if (chk_charge(leaf->data_offset, leaf->data_len, "record"))
+		return;
+	w->pend[w->npend++] = *leaf;
+	if (w->npend == CHK_PENDING)
+		chk_flush(w);
+}
+
+/*
+ * Check one node.  Returns 0 if its children, or records, can be
+ * trusted enough to be checked in turn.
+ */
+static int
+chk_node(struct chk_worker *w, struct chk_subtree *sub,
+	 hammer_node_ondisk_t node)
+{
+	hammer_base_elm_t last;
+	int internal;
+	int error = 0;
+	int cmp;
+	int i;
+
+	++w->nodes;
+	if (w->maxdepth < sub->depth)
+		w->maxdepth = sub->depth;
+	if (!hammer_crc_test_btree(node)) {
+		chk_error("node %016llx: bad crc", (long long)sub->offset);
+		return(-1);
+	}
+	internal = (node->type == HAMMER_BTREE_TYPE_INTERNAL);
+	if (!internal && node->type != HAMMER_BTREE_TYPE_LEAF) {
+		chk_error("node %016llx: bad type %02x",
+			  (long long)sub->offset, node->type);
+		return(-1);
+	}
+	if (sub->btype && node->type != sub->btype) {
+		chk_error("node %016llx: type %c, parent says %c",
+			  (long long)sub->offset, node->type, sub->btype);
+		return(-1);
+	}
+	if (node->count < 0 ||
+	    node->count > (internal ? HAMMER_BTREE_INT_ELMS :
+				      HAMMER_BTREE_LEAF_ELMS)) {
+		chk_error("node %016llx: bad count %d",
+			  (long long)sub->offset, node->count);
+		return(-1);
+	}
+	if (node->parent != sub->parent) {
+		chk_error("node %016llx: parent %016llx, expected %016llx",
+			  (long long)sub->offset, (long long)node->parent,
+			  (long long)sub->parent);
+		error = -1;
+	}
+
+	/*
+	 * Leaf elements are unique, an internal node's elements only
+	 * bound its subtrees and include the right-hand boundary.
+	 */
+	for (i = 1; i < node->count + internal; ++i) {
+		cmp = hammer_btree_cmp(&node->elms[i - 1].base,
+				       &node->elms[i].base);
+		if (cmp > 0 || (cmp == 0 && !internal)) {
+			chk_error("node %016llx: elements %d and %d out "
+				  "of order", (long long)sub->offset, i - 1, i);
+			error = -1;
+		}
+	}
+	if (sub->btype && (node->count || internal)) {
+		last = &node->elms[internal ? node->count :
+					      node->count - 1].base;
+		if (hammer_btree_cmp(&node->elms[0].base, &sub->left) < 0) {
+			chk_error("node %016llx: left of its parent's "
+				  "boundary", (long long)sub->offset);
+			error = -1;
+		}
+		cmp = hammer_btree_cmp(last, &sub->right);
+		if (cmp > 0 || (cmp == 0 && !internal)) {
+			chk_error("node %016llx: right of its parent's "
+				  "boundary", (long long)sub->offset);
+			error = -1;
+		}
+	}
+	if (internal)
+		return(error);
+
+	++w->leaves;
+	for (i = 0; i < node->count; ++i) {
+		if (node->elms[i].base.btype != HAMMER_BTREE_TYPE_RECORD) {
+			chk_error("node %016llx: element %d has btype %02x",
+				  (long long)sub->offset, i,
+				  node->elms[i].base.btype);
+			error = -1;
+			continue;
+		}
+		chk_record(w, &node->elms[i].leaf);
+	}
+	return(error);
+}
+
+/*
+ * Fill in the subtrees of an internal node.  Children that cannot be
+ * charged to the freemap are left out (offset 0).
+ */
+static void
+chk_children(struct chk_subtree *sub, hammer_node_ondisk_t node,
+	     struct chk_subtree *subs)
+{
+	hammer_btree_internal_elm_t elm;
+	int i;
+
+	for (i = 0; i < node->count; ++i) {
+		elm = &node->elms[i].internal;
+		bzero(&subs[i], sizeof(subs[i]));
+		if (HAMMER_ZONE_DECODE(elm->subtree_offset) !=
+		    HAMMER_ZONE_BTREE_INDEX ||
+		    (elm->base.btype != HAMMER_BTREE_TYPE_INTERNAL &&
+		     elm->base.btype != HAMMER_BTREE_TYPE_LEAF)) {
+			chk_error("node %016llx: element %d points at "
+				  "%016llx type %02x", (long long)sub->offset,
+				  i, (long long)elm->subtree_offset,
+				  elm->base.btype);
+			continue;
+		}
+		if (chk_charge(elm->subtree_offset,
+			       sizeof(struct hammer_node_ondisk), "node"))
+			continue;
+		subs[i].offset = elm->subtree_offset;
+		subs[i].parent = sub->offset;
+		subs[i].left = elm->base;
+		subs[i].right = node->elms[i + 1].base;
+		subs[i].btype = elm->base.btype;
+		subs[i].depth = sub->depth + 1;
+	}
+}
+
+static void
+chk_node_done(struct chk_worker *w, struct chk_extent *ext, char *data,
+	      void *arg)
+{
+	struct chk_level *lv = arg;
+
+	if (data == NULL) {
+		chk_error("node %016llx: read error",
+			  (long long)lv->subs[ext->idx].offset);
+		lv->subs[ext->idx].readerr = 1;
+		return;
+	}
+	bcopy(data, &lv->nodes[ext->idx], sizeof(lv->nodes[0]));
+}
+
+static int
+chk_read_node(struct chk_worker *w, struct chk_subtree *sub,
+	      hammer_node_ondisk_t node)
+{
+	struct chk_extent ext;
+	struct chk_level lv;
+
+	ext.pos = chk_pos(sub->offset);
+	ext.len = sizeof(*node);
+	ext.idx = 0;
+	lv.nodes = node;
+	lv.subs = sub;
+	sub->readerr = 0;
+	chk_read(w, &ext, 1, chk_node_done, &lv);
+	return(sub->readerr ? -1 : 0);
+}
+
+/*
+ * Check a subtree depth-first, reading the children of each internal
+ * node in one go.
+ */
+static void
+chk_subtree(struct chk_worker *w, struct chk_subtree *sub,
+	    hammer_node_ondisk_t node)
+{
+	struct chk_level *lv;
+	int n;
+	int i;
+
+	if (chk_node(w, sub, node) || node->type != HAMMER_BTREE_TYPE_INTERNAL)
+		return;
+	if (sub->depth + 1 >= CHK_MAXDEPTH) {
+		chk_error("node %016llx: tree deeper than %d levels",
+			  (long long)sub->offset, CHK_MAXDEPTH);
+		return;
+	}
+	lv = &w->level[sub->depth + 1];
+	if (lv->nodes == NULL) {
+		lv->nodes = malloc(HAMMER_BTREE_INT_ELMS * sizeof(*lv->nodes));
+		lv->subs = malloc(HAMMER_BTREE_INT_ELMS * sizeof(*lv->subs));
+	}
+	chk_children(sub, node, lv->subs);
+	for (i = n = 0; i < node->count; ++i) {
+		if (lv->subs[i].offset == 0)
+			continue;
+		w->exts[n].pos = chk_pos(lv->subs[i].offset);
+		w->exts[n].len = sizeof(*node);
+		w->exts[n].idx = i;
+		++n;
+	}
+
+	/*
+	 * The extent array is shared with chk_flush(), which cannot run
+	 * until the children have been read.
+	 */
+	chk_read(w, w->exts, n, chk_node_done, lv);
+	for (i = 0; i < node->count; ++i) {
+		if (lv->subs[i].offset && lv->subs[i].readerr == 0)
+			chk_subtree(w, &lv->subs[i], &lv->nodes[i]);
+	}
+}
+
+static void
+chk_worker_init(struct chk_worker *w)
+{
+	bzero(w, sizeof(*w));
+	w->rbuf = malloc(readsize);
+	w->exts = malloc(CHK_PENDING * sizeof(*w->exts));
+	w->pend = malloc(CHK_PENDING * sizeof(*w->pend));
+}
+
+static void
+chk_worker_free(struct chk_worker *w)
+{
+	int i;
+
+	for (i = 0; i < CHK_MAXDEPTH; ++i) {
+		free(w->level[i].nodes);
+		free(w->level[i].subs);
+	}
+	free(w->rbuf);
+	free(w->exts);
+	free(w->pend);
+}
+
+static void *
+chk_thread(void *arg)
+{
+	struct chk_worker *w = arg;
+	struct hammer_node_ondisk node;
+	int i;
+
+	while ((i = __sync_fetch_and_add(&next_unit, 1)) < nunits) {
+		if (chk_read_node(w, &units[i], &node) == 0)
+			chk_subtree(w, &units[i], &node);
+		__sync_fetch_and_add(&units_done, 1);
+	}
+	chk_flush(w);
+	__sync_fetch_and_sub(&nrunning, 1);
+	return(NULL);
+}
+
+/*
+ * Expand the top of the tree breadth-first until there are at least
+ * nthreads * 16 subtrees or only leaves are left.  The nodes expanded
+ * here are checked by the calling thread.
+ */
+static void
+chk_expand(struct chk_worker *w, hammer_off_t root)
+{
+	struct hammer_node_ondisk node;
+	struct chk_subtree *next;
+	struct chk_subtree *subs;
+	int nnext;
+	int expanded;
+	int i;
+	int j;
+
+	units = calloc(1, sizeof(*units));
+	units[0].offset = root;
+	nunits = chk_charge(root, sizeof(node), "root") ? 0 : 1;
+	subs = malloc(HAMMER_BTREE_INT_ELMS * sizeof(*subs));
+
+	do {
+		next = malloc((nunits * HAMMER_BTREE_INT_ELMS + 1) *
+			      sizeof(*next));
+		nnext = 0;
+		expanded = 0;
+		for (i = 0; i < nunits; ++i) {
+			if (units[i].btype == HAMMER_BTREE_TYPE_LEAF) {
+				next[nnext++] = units[i];
+				continue;
+			}
+			expanded = 1;
+			if (chk_read_node(w, &units[i], &node))
+				continue;
+			if (chk_node(w, &units[i], &node) ||
+			    node.type != HAMMER_BTREE_TYPE_INTERNAL)
+				continue;
+			chk_children(&units[i], &node, subs);
+			for (j = 0; j < node.count; ++j) {
+				if (subs[j].offset)
+					next[nnext++] = subs[j];
+			}
+		}
+		free(units);
+		units = next;
+		nunits = nnext;
+	} while (expanded && nunits < nthreads * 16);
+	free(subs);
+	chk_flush(w);
+}
+
+/*
+ * Pass 1: load and check the freemap.
+ */
+static void
+chk_freemap(hammer_blockmap_t freemap)
+{
+	struct hammer_blockmap_layer1 layer1;
+	struct hammer_blockmap_layer2 *l2;
+	hammer_off_t zone2;
+	int64_t block;
+	int64_t nfree;
+	int64_t n;
+	size_t bytes;
+	size_t done;
+	ssize_t got;
+
+	layer2 = calloc(nblocks, sizeof(*layer2));
+	used = calloc(nblocks, sizeof(*used));
+
+	for (block = 0; block < nblocks; block += HAMMER_BLOCKMAP_RADIX2) {
+		zone2 = HAMMER_ENCODE_RAW_BUFFER(0,
+				block * HAMMER_LARGEBLOCK_SIZE64);
+		if (pread(fd, &layer1, sizeof(layer1),
+			  chk_pos(freemap->phys_offset +
+				  HAMMER_BLOCKMAP_LAYER1_OFFSET(zone2))) !=
+		    sizeof(layer1)) {
+			chk_error("layer1 %016llx: read error",
+				  (long long)zone2);
+			continue;
+		}
+		if (layer1.layer1_crc != crc32(&layer1, HAMMER_LAYER1_CRCSIZE))
+			chk_error("layer1 %016llx: bad crc", (long long)zone2);
+		if (layer1.phys_offset == HAMMER_BLOCKMAP_UNAVAIL) {
+			chk_error("layer1 %016llx: unavailable",
+				  (long long)zone2);
+			continue;
+		}
+
+		n = nblocks - block;
+		if (n > HAMMER_BLOCKMAP_RADIX2)
+			n = HAMMER_BLOCKMAP_RADIX2;
+		bytes = n * sizeof(*layer2);
+		for (done = 0; done < bytes; done += got) {
+			got = pread(fd, (char *)&layer2[block] + done,
+				    MIN(bytes - done, readsize),
+				    chk_pos(layer1.phys_offset +
+					    HAMMER_BLOCKMAP_LAYER2_OFFSET(zone2)) +
+				    done);
+			if (got <= 0) {
+				chk_error("layer2 %016llx: read error",
+					  (long long)zone2);
+				break;
+			}
+		}
+
+		nfree = 0;
+		for (l2 = &layer2[block]; l2 < &layer2[block + n]; ++l2) {
+			zone2 = HAMMER_ENCODE_RAW_BUFFER(0,
+				(l2 - layer2) * HAMMER_LARGEBLOCK_SIZE64);
+			if (l2->entry_crc != crc32(l2, HAMMER_LAYER2_CRCSIZE)) {
+				chk_error("layer2 %016llx: bad crc",
+					  (long long)zone2);
+			}
+			if (l2->bytes_free > HAMMER_LARGEBLOCK_SIZE ||
+			    l2->append_off > HAMMER_LARGEBLOCK_SIZE ||
+			    (l2->zone == 0 &&
+			     (l2->bytes_free != HAMMER_LARGEBLOCK_SIZE ||
+			      l2->append_off != 0))) {
+				chk_error("layer2 %016llx: zone %d "
+					  "append_off %08x bytes_free %08x",
+					  (long long)zone2, l2->zone,
+					  l2->append_off, l2->bytes_free);
+			}
+			if (l2->zone == 0)
+				++nfree;
+		}
+		if (layer1.blocks_free != nfree) {
+			chk_error("layer1 %016llx: blocks_free %lld, "
+				  "%lld free in layer2",
+				  (long long)HAMMER_ENCODE_RAW_BUFFER(0,
+					block * HAMMER_LARGEBLOCK_SIZE64),
+				  (long long)layer1.blocks_free,
+				  (long long)nfree);
+		}
+	}
+}
+
+/*
+ * Pass 3: what the B-Tree references against what the freemap says is
+ * allocated, per big-block.
+ */
+static void
+chk_allocation(int64_t *allocp, int64_t *bigblocksp)
+{
+	struct hammer_blockmap_layer2 *l2;
+	int64_t alloc;
+	int64_t block;
+
+	for (block = 0; block < nblocks; ++block) {
+		l2 = &layer2[block];
+		if (l2->zone < HAMMER_ZONE_BTREE_INDEX ||
+		    l2->zone >= HAMMER_ZONE_UNAVAIL_INDEX)
+			continue;
+		alloc = HAMMER_LARGEBLOCK_SIZE - l2->bytes_free;
+		if (used[block] != alloc) {
+			chk_error("big-block %016llx: zone %d, %lld bytes "
+				  "allocated, %lld referenced",
+				  (long long)HAMMER_ENCODE_RAW_BUFFER(0,
+					block * HAMMER_LARGEBLOCK_SIZE64),
+				  l2->zone, (long long)alloc,
+				  (long long)used[block]);
+		}
+		*allocp += alloc;
+		++*bigblocksp;
+	}
+}
+
+static void
+chk_sum(struct chk_worker *sum, struct chk_worker *w)
+{
+	sum->nodes += w->nodes;
+	sum->leaves += w->leaves;
+	sum->records += w->records;
+	sum->data_bytes += w->data_bytes;
+	sum->read_bytes += w->read_bytes;
+	sum->reads += w->reads;
+	if (sum->maxdepth < w->maxdepth)
+		sum->maxdepth = w->maxdepth;
+}
+
+static void
+chk_progress(struct chk_worker *w0, struct chk_worker *ws, int64_t t0)
+{
+	struct chk_worker sum;
+	int64_t ns = now_ns() - t0;
+	int i;
+
+	bzero(&sum, sizeof(sum));
+	chk_sum(&sum, w0);
+	for (i = 0; i < nthreads; ++i)
+		chk_sum(&sum, &ws[i]);
+	fprintf(stderr, "%s: %d/%d subtrees, %lld nodes, %lld records, "
+			"%.1f GB read, %.0f MB/s, %lld errors\n",
+		image_name, units_done, nunits, (long long)sum.nodes,
+		(long long)sum.records, sum.read_bytes / 1e9,
+		ns ? sum.read_bytes * 1e3 / ns : 0.0, (long long)nerrors);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: hammer_check [-j threads] [-R readsize] [-p interval] "
+	    "image\n");
+	exit(1);
+}
+
+int
+main(int ac, char **av)
+{
+	struct hammer_volume_ondisk *vol;
+	struct chk_worker w0;
+	struct chk_worker sum;
+	struct chk_worker *ws;
+	int64_t alloc = 0;
+	int64_t bigblocks = 0;
+	int64_t t0;
+	int64_t tp;
+	int64_t ns;
+	int zone;
+	int ch;
+	int i;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((ch = getopt(ac, av, "j:p:R:")) != -1) {
+		switch (ch) {
+		case 'j':
+			nthreads = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			interval = strtol(optarg, NULL, 0);
+			break;
+		case 'R':
+			readsize = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	ac -= optind;
+	av += optind;
+	if (ac != 1 || nthreads < 1 || interval < 0 ||
+	    readsize < HAMMER_XBUFSIZE)
+		usage();
+	image = av[0];
+	image_name = strrchr(image, '/') ? strrchr(image, '/') + 1 : image;
+
+	fd = open(image, O_RDONLY);
+	if (fd < 0) {
+		perror(image);
+		exit(1);
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	vol = malloc(HAMMER_BUFSIZE);
+	if (pread(fd, vol, HAMMER_BUFSIZE, 0) != HAMMER_BUFSIZE ||
+	    vol->vol_signature != HAMMER_FSBUF_VOLUME) {
+		fprintf(stderr, "%s: not a HAMMER volume\n", image);
+		exit(1);
+	}
+	if (vol->vol_count != 1 || vol->vol_no != 0) {
+		fprintf(stderr, "%s: volume %d of %d, only single-volume "
+				"filesystems are supported\n",
+			image, vol->vol_no, vol->vol_count);
+		exit(1);
+	}
+	if (!hammer_crc_test_volume(vol))
+		chk_error("volume header: bad crc");
+	for (zone = HAMMER_ZONE_FREEMAP_INDEX; zone < HAMMER_MAX_ZONES;
+	     ++zone) {
+		if ((zone == HAMMER_ZONE_FREEMAP_INDEX ||
+		     zone >= HAMMER_ZONE_BTREE_INDEX) &&
+		    !hammer_crc_test_blockmap(&vol->vol0_blockmap[zone]))
+			chk_error("blockmap %d: bad crc", zone);
+	}
+	buf_beg = vol->vol_buf_beg;
+	nblocks = (vol->vol_buf_end - vol->vol_buf_beg) /
+		  HAMMER_LARGEBLOCK_SIZE64;
+
+	t0 = now_ns();
+	chk_freemap(&vol->vol0_blockmap[HAMMER_ZONE_FREEMAP_INDEX]);
+
+	chk_worker_init(&w0);
+	chk_expand(&w0, vol->vol0_btree_root);
+	ws = calloc(nthreads, sizeof(*ws));
+	nrunning = nthreads;
+	for (i = 0; i < nthreads; ++i) {
+		chk_worker_init(&ws[i]);
+		pthread_create(&ws[i].td, NULL, chk_thread, &ws[i]);
+	}
+	tp = now_ns();
+	while (nrunning) {
+		usleep(100000);
+		if (interval && now_ns() - tp >= interval * 1000000000LL) {
+			chk_progress(&w0, ws, t0);
+			tp = now_ns();
+		}
+	}
+	bzero(&sum, sizeof(sum));
+	chk_sum(&sum, &w0);
+	chk_worker_free(&w0);
+	for (i = 0; i < nthreads; ++i) {
+		pthread_join(ws[i].td, NULL);
+		chk_sum(&sum, &ws[i]);
+		chk_worker_free(&ws[i]);
+	}
+
+	chk_allocation(&alloc, &bigblocks);
+	ns = now_ns() - t0;
+	if (nerrors > CHK_MAXERRORS) {
+		fprintf(stderr, "%s: %lld more errors not shown\n",
+			image_name, (long long)(nerrors - CHK_MAXERRORS));
+	}
+	printf("check=%s image=%s threads=%d nodes=%lld leaves=%lld "
+	       "depth=%d records=%lld data_bytes=%lld bigblocks=%lld "
+	       "alloc_bytes=%lld reads=%lld read_bytes=%lld ms=%.1f "
+	       "mb_per_sec=%.1f errors=%lld\n",
+	       nerrors ? "failed" : "ok", image_name, nthreads,
+	       (long long)sum.nodes, (long long)sum.leaves, sum.maxdepth + 1,
+	       (long long)sum.records, (long long)sum.data_bytes,
+	       (long long)bigblocks, (long long)alloc, (long long)sum.reads,
+	       (long long)sum.read_bytes, ns / 1e6,
+	       ns ? sum.read_bytes * 1e3 / ns : 0.0, (long long)nerrors);
+	return(nerrors ? 1 : 0);
+}
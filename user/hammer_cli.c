@@ -0,0 +1,142 @@
+/*
+ * hammer_cli - drive the userspace HAMMER core against an image
+ *
+ *	hammer_cli [-a tid] [-o options] image ls|cat|stat|history|pfs path
+ *
+ * Options are the mount options of the kernel module, e.g. -o asof=0x...,
+ * and path components may carry a name@@0x%016llx[:%05d] extension.
+ * history prints the transaction ids at which the inode changed, the way
+ * HAMMERFSIOC_GETHISTORY_STREAM returns them.  pfs prints the summary of
+ * every PFS of the image, as /proc/fs/hammer/<dev>/pfs does; path only
+ * has to exist.
+ */
+
+#include <unistd.h>
+#include <inttypes.h>
+
+#include "hammer_user.h"
+#include "hammerfs.h"
+
+static int
+print_entry(void *arg, const char *name, int nlen, int64_t key,
+	    int64_t obj_id, int dtype)
+{
+	printf("%016" PRIx64 " %6" PRId64 " %.*s\n", key, obj_id, nlen, name);
+	return(0);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: hammer_cli [-a tid] [-o options] image "
+			"ls|cat|stat|history|pfs path\n");
+	exit(1);
+}
+
+int
+main(int ac, char **av)
+{
+	struct hammer_ioc_hist_entry hist[256];
+	struct hammerfs_history_cursor hc;
+	struct hammerfs_pfs_summary pfs[256];
+	struct hammerfs_ioc_pfs_summary ps;
+	struct hu_mount mnt;
+	hammer_inode_t ip;
+	hammer_tid_t asof = HAMMER_MAX_TID;
+	const char *opts = NULL;
+	const char *cmd;
+	char buf[65536];
+	int64_t pos;
+	ssize_t n;
+	off_t off;
+	int error;
+	int ch;
+	int i;
+
+	while ((ch = getopt(ac, av, "a:o:")) != -1) {
+		switch (ch) {
+		case 'a':
+			asof = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			opts = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	ac -= optind;
+	av += optind;
+	if (ac != 3)
+		usage();
+	cmd = av[1];
+
+	error = hu_mount_opts(&mnt, av[0], opts);
+	if (error) {
+		fprintf(stderr, "%s: %s\n", av[0], strerror(error));
+		exit(1);
+	}
+	error = hu_namei(&mnt, av[2], asof, &ip);
+	if (error) {
+		fprintf(stderr, "%s: %s\n", av[2], strerror(error));
+		exit(1);
+	}
+
+	if (strcmp(cmd, "ls") == 0) {
+		pos = 0;
+		error = hu_readdir(ip, &pos, print_entry, NULL);
+	} else if (strcmp(cmd, "cat") == 0) {
+		off = 0;
+		while ((n = hu_read(ip, off, buf, sizeof(buf))) > 0) {
+			fwrite(buf, 1, n, stdout);
+			off += n;
+		}
+		if (n < 0)
+			error = -n;
+	} else if (strcmp(cmd, "stat") == 0) {
+		printf("obj_id %016" PRIx64 " type %d mode %04o size %" PRId64
+		       " nlinks %" PRId64 " create_tid %016" PRIx64 "\n",
+		       (uint64_t)ip->obj_id, ip->ino_data.obj_type,
+		       ip->ino_data.mode, (int64_t)ip->ino_data.size,
+		       (int64_t)ip->ino_data.nlinks,
+		       (uint64_t)ip->ino_leaf.base.create_tid);
+	} else if (strcmp(cmd, "history") == 0) {
+		bzero(&hc, sizeof(hc));
+		hc.hist.beg_tid = HAMMER_MIN_TID;
+		hc.hist.end_tid = HAMMER_MAX_TID;
+		error = hammerfs_history_start(ip, &hc);
+		while (error == 0) {
+			error = hammerfs_history_read(ip, &hc, hist, 256, &i);
+			if (error || i == 0)
+				break;
+			for (n = 0; n < i; ++n) {
+				printf("%016" PRIx64 " %u\n",
+				       (uint64_t)hist[n].tid, hist[n].time32);
+			}
+		}
+		hammerfs_history_done(&hc);
+	} else if (strcmp(cmd, "pfs") == 0) {
+		bzero(&ps, sizeof(ps));
+		ps.count = 256;
+		ps.ary = pfs;
+		error = hu_pfs_summary(ip, 0, &ps);
+		for (i = 0; error == 0 && i < min(ps.count, 256); ++i) {
+			printf("%05u inodes %" PRId64 " records %" PRId64
+			       " data_bytes %" PRId64 " history_bytes %" PRId64
+			       " sync_end_tid 0x%016" PRIx64 "%s\n",
+			       pfs[i].pfs_id, pfs[i].inodes, pfs[i].records,
+			       pfs[i].data_bytes, pfs[i].history_bytes,
+			       (uint64_t)pfs[i].sync_end_tid,
+			       (pfs[i].mirror_flags & HAMMER_PFSD_SLAVE) ?
+			       " slave" : "");
+		}
+	} else {
+		usage();
+	}
+	if (error) {
+		fprintf(stderr, "%s: %s\n", av[2], strerror(error));
+		exit(1);
+	}
+	hu_umount(&mnt);
+	return(0);
+}
@@ -0,0 +1,819 @@
+/*
+ * hammer_mkimage - generate a synthetic single-volume HAMMER image
+ *
+ *	hammer_mkimage [-n files] [-f fanout] [-s size[:max]] [-p sparse%]
+ *		       [-H history] [-x deleted%] [-P pfs] [-r seed] image
+ *
+ * The image is built bottom-up: every record (inodes, directory entries
+ * and file data) is generated as a B-Tree leaf element with its data
+ * written through a simple per-zone large-block allocator, the elements
+ * are sorted with hammer_btree_cmp() and packed into full leaves, and the
+ * internal levels are stacked on top until a single root remains.  Node,
+ * record, blockmap and volume CRCs are set with the core's own helpers so
+ * the result mounts with the normal read path (user/hammer_cli, the
+ * kernel module, hammerread).
+ *
+ * Layout (zone-2, one 8MB large-block each unless noted):
+ *
+ *	0	freemap layer1
+ *	1	freemap layer2
+ *	2...	B-Tree, small-data and large-data large-blocks, handed out
+ *		in the order they are needed
+ *
+ * History: directories are created at tid_beg.  Every file then gets
+ * -H versions, version v being created at tid_beg + 1 + v and deleted
+ * when the next version is created, with its own size, holes and data.
+ * -x deletes a percentage of the files at the final TID, so those are
+ * only visible as-of an earlier TID.  File data is a pattern derived
+ * from (obj_id, version, offset) so readers can check what they got.
+ *
+ * PFS: with -P the files are divided among that many PFSs, each with a
+ * directory tree of its own under a PFS root inode.  PFS 1 and up get a
+ * PFS record in the root inode of PFS 0, synced up to the final TID.
+ *
+ * A summary is printed to stdout as key=value pairs for scripts.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <math.h>
+
+#include "hammer_user.h"
+
+#define MK_TID_BEG	0x0000000100000000ULL
+
+struct mk_zone {
+	int		zone;
+	hammer_off_t	next;		/* zone-2 offset, 0 if none yet */
+	hammer_off_t	limit;		/* end of current large-block */
+};
+
+struct mk_node {
+	hammer_off_t		offset;		/* zone-8 */
+	struct hammer_node_ondisk ondisk;
+};
+
+static int fd;
+static int64_t buf_beg = HAMMER_BUFSIZE;
+static int64_t nlargeblocks = 2;	/* freemap layer1 + layer2 */
+static struct hammer_blockmap_layer2 *layer2;
+static int layer2_max;
+
+static struct mk_zone btree_zone = { HAMMER_ZONE_BTREE_INDEX };
+static struct mk_zone small_zone = { HAMMER_ZONE_SMALL_DATA_INDEX };
+static struct mk_zone large_zone = { HAMMER_ZONE_LARGE_DATA_INDEX };
+
+static struct hammer_btree_leaf_elm *elms;
+static int nelms;
+static int maxelms;
+
+static int64_t next_obj_id = HAMMER_OBJID_ROOT;
+static u_int32_t localization;		/* PFS of the records made */
+static int64_t stat_inodes;
+static int64_t stat_dirs;
+static int64_t stat_bytes;
+static int64_t stat_data_bytes;
+static int64_t stat_live_inodes;	/* visible at the final TID */
+static int64_t stat_live_data_bytes;
+
+static struct hammer_inode dir_template;	/* for the namekey */
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: hammer_mkimage [-n files] [-f fanout] [-s size[:max]]\n"
+	    "                      [-p sparse%%] [-H history] [-x deleted%%]\n"
+	    "                      [-P pfs] [-r seed] image\n");
+	exit(1);
+}
+
+static int64_t
+getsize(const char *str)
+{
+	char *ptr;
+	int64_t val;
+
+	val = hu_getsize(str, &ptr);
+	if (*ptr && *ptr != ':') {
+		fprintf(stderr, "bad size: %s\n", str);
+		exit(1);
+	}
+	return(val);
+}
+
+static void
+mk_pwrite(const void *buf, size_t bytes, hammer_off_t zone2_offset)
+{
+	off_t off = buf_beg + (zone2_offset & HAMMER_OFF_SHORT_MASK);
+
+	if (pwrite(fd, buf, bytes, off) != (ssize_t)bytes) {
+		perror("pwrite");
+		exit(1);
+	}
+}
+
+static void
+mk_layer2_grow(void)
+{
+	int old = layer2_max;
+
+	if (nlargeblocks < layer2_max)
+		return;
+	layer2_max = old ? old * 2 : 64;
+	layer2 = realloc(layer2, layer2_max * sizeof(*layer2));
+	bzero(layer2 + old, (layer2_max - old) * sizeof(*layer2));
+}
+
+/*
+ * Allocate space in a zone.  Small allocations never cross a
+ * HAMMER_BUFSIZE boundary and large ones start on one, so every record
+ * can be brought in with a single hammer_bread_ext().  Sizes are
+ * rounded and charged to bytes_free as in hammer_blockmap_alloc(), the
+ * space skipped to reach a boundary is not charged.
+ * Returns a zone-X offset.
+ */
+static hammer_off_t
+mk_alloc(struct mk_zone *z, int bytes)
+{
+	struct hammer_blockmap_layer2 *l2;
+	hammer_off_t off;
+	int align;
+
+	bytes = (bytes + 15) & ~15;
+	align = (bytes >= HAMMER_BUFSIZE) ? HAMMER_BUFSIZE : HAMMER_HEAD_ALIGN;
+
+	off = (z->next + align - 1) & ~(hammer_off_t)(align - 1);
+	if (bytes < HAMMER_BUFSIZE &&
+	    (off & HAMMER_BUFMASK64) + bytes > HAMMER_BUFSIZE) {
+		off = (off + HAMMER_BUFMASK64) & ~HAMMER_BUFMASK64;
+	}
+	if (z->next == 0 || off + bytes > z->limit) {
+		mk_layer2_grow();
+		off = HAMMER_ENCODE_RAW_BUFFER(0,
+				nlargeblocks * HAMMER_LARGEBLOCK_SIZE64);
+		layer2[nlargeblocks].zone = z->zone;
+		layer2[nlargeblocks].bytes_free = HAMMER_LARGEBLOCK_SIZE;
+		++nlargeblocks;
+		z->limit = off + HAMMER_LARGEBLOCK_SIZE64;
+	}
+	z->next = off + bytes;
+	l2 = &layer2[(off & HAMMER_OFF_SHORT_MASK) / HAMMER_LARGEBLOCK_SIZE64];
+	l2->append_off = (u_int32_t)(off & HAMMER_LARGEBLOCK_MASK64) + bytes;
+	l2->bytes_free -= bytes;
+	stat_bytes += bytes;
+
+	return((off & ~HAMMER_OFF_ZONE_MASK) |
+	       HAMMER_ZONE_ENCODE(z->zone, 0));
+}
+
+static struct hammer_btree_leaf_elm *
+mk_elm(int64_t obj_id, u_int32_t rec_localization, u_int16_t rec_type,
+       int64_t key, hammer_tid_t create_tid, hammer_tid_t delete_tid)
+{
+	struct hammer_btree_leaf_elm *leaf;
+
+	if (nelms == maxelms) {
+		maxelms = maxelms ? maxelms * 2 : 4096;
+		elms = realloc(elms, maxelms * sizeof(*elms));
+	}
+	leaf = &elms[nelms++];
+	bzero(leaf, sizeof(*leaf));
+	leaf->base.obj_id = obj_id;
+	leaf->base.key = key;
+	leaf->base.create_tid = create_tid;
+	leaf->base.delete_tid = delete_tid;
+	leaf->base.rec_type = rec_type;
+	leaf->base.btype = HAMMER_BTREE_TYPE_RECORD;
+	leaf->base.localization = localization + rec_localization;
+	leaf->create_ts = (u_int32_t)time(NULL);
+	if (delete_tid)
+		leaf->delete_ts = leaf->create_ts;
+	return(leaf);
+}
+
+/*
+ * Attach data to a leaf: allocate, write, set data_offset/len/crc.
+ */
+static void
+mk_data(struct hammer_btree_leaf_elm *leaf, void *data, int bytes)
+{
+	struct mk_zone *z;
+
+	z = (bytes >= HAMMER_BUFSIZE) ? &large_zone : &small_zone;
+	leaf->data_offset = mk_alloc(z, bytes);
+	leaf->data_len = bytes;
+	hammer_crc_set_leaf(data, leaf);
+	mk_pwrite(data, bytes, leaf->data_offset);
+}
+
+static void
+mk_inode(int64_t obj_id, int64_t parent_obj_id, u_int8_t obj_type,
+	 int64_t size, hammer_tid_t create_tid, hammer_tid_t delete_tid)
+{
+	struct hammer_btree_leaf_elm *leaf;
+	struct hammer_inode_data ino;
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	bzero(&ino, sizeof(ino));
+	ino.version = HAMMER_INODE_DATA_VERSION;
+	ino.mode = (obj_type == HAMMER_OBJTYPE_DIRECTORY) ? 0755 : 0644;
+	ino.ctime = ino.mtime = ino.atime =
+		(u_int64_t)tv.tv_sec * 1000000ULL + tv.tv_usec;
+	ino.parent_obj_id = parent_obj_id;
+	hammer_guid_to_uuid(&ino.uid, 0);
+	hammer_guid_to_uuid(&ino.gid, 0);
+	ino.obj_type = obj_type;
+	ino.cap_flags = dir_template.ino_data.cap_flags;
+	ino.nlinks = 1;
+	ino.size = size;
+
+	leaf = mk_elm(obj_id, HAMMER_LOCALIZE_INODE, HAMMER_RECTYPE_INODE, 0,
+		      create_tid, delete_tid);
+	leaf->base.obj_type = obj_type;
+	mk_data(leaf, &ino, sizeof(ino));
+	++stat_inodes;
+	if (delete_tid == 0)
+		++stat_live_inodes;
+}
+
+static void
+mk_direntry(int64_t dir_obj_id, const char *name, int64_t obj_id,
+	    u_int8_t obj_type, hammer_tid_t create_tid,
+	    hammer_tid_t delete_tid)
+{
+	struct hammer_btree_leaf_elm *leaf;
+	struct hammer_entry_data *entry;
+	u_int32_t max_iterations;
+	int64_t namekey;
+	int nlen = strlen(name);
+	char buf[HAMMER_ENTRY_SIZE(256)];
+
+	/*
+	 * Collisions are resolved after sorting, see mk_collisions().
+	 */
+	namekey = hammer_directory_namekey(&dir_template, name, nlen,
+					   &max_iterations);
+
+	entry = (void *)buf;
+	bzero(entry, HAMMER_ENTRY_SIZE(nlen));
+	entry->obj_id = obj_id;
+	entry->localization = localization;
+	memcpy(entry->name, name, nlen);
+
+	leaf = mk_elm(dir_obj_id, HAMMER_LOCALIZE_MISC,
+		      HAMMER_RECTYPE_DIRENTRY, namekey,
+		      create_tid, delete_tid);
+	leaf->base.obj_type = obj_type;
+	mk_data(leaf, entry, HAMMER_ENTRY_SIZE(nlen));
+}
+
+/*
+ * Pattern for the file data: one 64 bit word per 8 bytes of file.
+ */
+static void
+mk_pattern(void *buf, int64_t obj_id, int version, int64_t off, int bytes)
+{
+	u_int64_t *w = buf;
+	int i;
+
+	for (i = 0; i < bytes / 8; ++i) {
+		w[i] = ((u_int64_t)obj_id << 32) ^
+		       ((u_int64_t)version << 24) ^ (u_int64_t)(off + i * 8);
+	}
+}
+
+static int64_t
+mk_filesize(int64_t size_min, int64_t size_max)
+{
+	double lmin, lmax;
+
+	if (size_max <= size_min)
+		return(size_min);
+	if (size_min == 0)
+		size_min = 1;
+	lmin = log((double)size_min);
+	lmax = log((double)size_max);
+	return((int64_t)exp(lmin + (lmax - lmin) * drand48()));
+}
+
+/*
+ * One version of a file: its inode record plus data records in
+ * hammer_blocksize() chunks, skipping chunks that are holes.
+ */
+static void
+mk_file_version(int64_t obj_id, int64_t parent_obj_id, int version,
+		int64_t size, int sparse, hammer_tid_t create_tid,
+		hammer_tid_t delete_tid)
+{
+	struct hammer_btree_leaf_elm *leaf;
+	static char *buf;
+	int64_t off;
+	int bytes;
+
+	if (buf == NULL)
+		buf = malloc(HAMMER_XBUFSIZE);
+
+	mk_inode(obj_id, parent_obj_id, HAMMER_OBJTYPE_REGFILE, size,
+		 create_tid, delete_tid);
+
+	for (off = 0; off < size; off += bytes) {
+		bytes = hammer_blocksize(off);
+		if (bytes > size - off)
+			bytes = HAMMER_HEAD_DOALIGN(size - off);
+		if (sparse && (int)(drand48() * 100) < sparse)
+			continue;
+		mk_pattern(buf, obj_id, version, off, bytes);
+		leaf = mk_elm(obj_id, HAMMER_LOCALIZE_MISC, HAMMER_RECTYPE_DATA,
+			      off + bytes, create_tid, delete_tid);
+		mk_data(leaf, buf, bytes);
+		stat_data_bytes += bytes;
+		if (delete_tid == 0)
+			stat_live_data_bytes += bytes;
+	}
+}
+
+/*
+ * The PFS record of PFS pfs_id, kept in the root inode of PFS 0.
+ */
+static void
+mk_pfs(int pfs_id, hammer_tid_t create_tid, hammer_tid_t sync_tid)
+{
+	struct hammer_btree_leaf_elm *leaf;
+	struct hammer_pseudofs_data pfsd;
+	u_int32_t save = localization;
+	int i;
+
+	bzero(&pfsd, sizeof(pfsd));
+	pfsd.sync_beg_tid = create_tid;
+	pfsd.sync_end_tid = sync_tid;
+	for (i = 0; i < (int)sizeof(pfsd.shared_uuid); ++i) {
+		((u_int8_t *)&pfsd.shared_uuid)[i] = (u_int8_t)lrand48();
+		((u_int8_t *)&pfsd.unique_uuid)[i] = (u_int8_t)lrand48();
+	}
+	snprintf(pfsd.label, sizeof(pfsd.label), "pfs%d", pfs_id);
+
+	localization = HAMMER_DEF_LOCALIZATION;
+	leaf = mk_elm(HAMMER_OBJID_ROOT, HAMMER_LOCALIZE_MISC,
+		      HAMMER_RECTYPE_PFS, (int64_t)pfs_id << 16,
+		      create_tid, 0);
+	mk_data(leaf, &pfsd, sizeof(pfsd));
+	localization = save;
+}
+
+/*
+ * Directories: files go fanout at a time into leaf directories, which go
+ * fanout at a time into their parents, up to the root of the PFS.
+ */
+static void
+mk_tree(int64_t nfiles, int fanout, int64_t size_min, int64_t size_max,
+	int sparse, int history, int deleted, hammer_tid_t tid_beg,
+	hammer_tid_t tid_del)
+{
+	int64_t ndirs, nleafdirs, first, count;
+	int64_t *dirs, *parents;
+	int64_t i, j;
+	char name[32];
+
+	/*
+	 * dirs[] holds obj_ids level by level, root last.
+	 */
+	nleafdirs = (nfiles + fanout - 1) / fanout;
+	if (nleafdirs == 0)
+		nleafdirs = 1;
+	ndirs = 0;
+	for (count = nleafdirs; count > 1; count = (count + fanout - 1) / fanout)
+		ndirs += count;
+	++ndirs;
+	dirs = calloc(ndirs, sizeof(*dirs));
+	parents = calloc(ndirs, sizeof(*parents));
+
+	dirs[ndirs - 1] = HAMMER_OBJID_ROOT;
+	parents[ndirs - 1] = HAMMER_OBJID_ROOT;
+	next_obj_id = HAMMER_OBJID_ROOT + 1;
+	for (i = 0; i < ndirs - 1; ++i)
+		dirs[i] = next_obj_id++;
+
+	first = 0;
+	for (count = nleafdirs; count > 1; count = (count + fanout - 1) / fanout) {
+		for (i = 0; i < count; ++i) {
+			j = first + count + i / fanout;
+			parents[first + i] = dirs[j];
+			snprintf(name, sizeof(name), "d%" PRId64, i % fanout);
+			mk_direntry(dirs[j], name, dirs[first + i],
+				    HAMMER_OBJTYPE_DIRECTORY, tid_beg, 0);
+		}
+		first += count;
+	}
+	for (i = 0; i < ndirs; ++i) {
+		mk_inode(dirs[i], parents[i], HAMMER_OBJTYPE_DIRECTORY, 0,
+			 tid_beg, 0);
+	}
+	stat_dirs += ndirs;
+
+	/*
+	 * Files
+	 */
+	for (i = 0; i < nfiles; ++i) {
+		int64_t obj_id = next_obj_id++;
+		int64_t dir = dirs[i / fanout];
+		hammer_tid_t gone;
+		int v;
+
+		gone = ((int)(drand48() * 100) < deleted) ? tid_del : 0;
+		snprintf(name, sizeof(name), "f%" PRId64, i % fanout);
+		mk_direntry(dir, name, obj_id, HAMMER_OBJTYPE_REGFILE,
+			    tid_beg + 1, gone);
+		for (v = 0; v < history; ++v) {
+			mk_file_version(obj_id, dir, v,
+					mk_filesize(size_min, size_max), sparse,
+					tid_beg + 1 + v,
+					(v == history - 1) ? gone :
+							     tid_beg + 2 + v);
+		}
+	}
+	free(dirs);
+	free(parents);
+}
+
+static void
+mk_crc_btree(hammer_node_ondisk_t ondisk)
+{
+	ondisk->crc = crc32(&ondisk->crc + 1, HAMMER_BTREE_CRCSIZE);
+}
+
+/*
+ * Copy a boundary into an element, keeping its btype.
+ */
+static void
+mk_setbound(hammer_base_elm_t base, hammer_base_elm_t bound)
+{
+	u_int8_t btype = base->btype;
+
+	*base = *bound;
+	base->btype = btype;
+}
+
+static int
+mk_cmp(const void *a, const void *b)
+{
+	return(hammer_btree_cmp((hammer_base_elm_t)a, (hammer_base_elm_t)b));
+}
+
+/*
+ * Directory entries whose names hash to the same namekey are moved to
+ * the next free iteration (the low 32 bits of the key), like
+ * hammer_ip_add_directory() does.  Returns the number of entries moved;
+ * the caller resorts and repeats until there are none.
+ */
+static int
+mk_collisions(void)
+{
+	int moved = 0;
+	int i;
+
+	for (i = 1; i < nelms; ++i) {
+		if (mk_cmp(&elms[i - 1], &elms[i]) != 0)
+			continue;
+		if (elms[i].base.rec_type != HAMMER_RECTYPE_DIRENTRY) {
+			fprintf(stderr, "duplicate B-Tree element %016" PRIx64
+				" %016" PRIx64 "\n",
+				elms[i].base.obj_id, elms[i].base.key);
+			exit(1);
+		}
+		++elms[i].base.key;
+		++moved;
+	}
+	return(moved);
+}
+
+/*
+ * Pack the sorted leaf elements into leaves and stack internal levels
+ * until one node remains.  Returns the root's zone-8 offset.
+ */
+static hammer_off_t
+mk_btree(int64_t *nnodesp, int *depthp)
+{
+	struct mk_node *level, *parents;
+	struct hammer_base_elm beg, end;
+	int nlevel, nparents;
+	int i, j, n;
+	int depth;
+
+	/*
+	 * Same boundaries hammerfs_init_mount() sets up.
+	 */
+	bzero(&beg, sizeof(beg));
+	beg.obj_id = HAMMER_MIN_OBJID;
+	beg.key = HAMMER_MIN_KEY;
+	beg.create_tid = 1;
+	beg.delete_tid = 1;
+	bzero(&end, sizeof(end));
+	end.localization = 0xFFFFFFFFU;
+	end.obj_id = HAMMER_MAX_OBJID;
+	end.key = HAMMER_MAX_KEY;
+	end.create_tid = HAMMER_MAX_TID;
+	end.rec_type = HAMMER_MAX_RECTYPE;
+
+	nlevel = (nelms + HAMMER_BTREE_LEAF_ELMS - 1) / HAMMER_BTREE_LEAF_ELMS;
+	if (nlevel == 0)
+		nlevel = 1;
+	level = calloc(nlevel, sizeof(*level));
+	for (i = 0; i < nlevel; ++i) {
+		n = nelms - i * HAMMER_BTREE_LEAF_ELMS;
+		if (n > HAMMER_BTREE_LEAF_ELMS)
+			n = HAMMER_BTREE_LEAF_ELMS;
+		level[i].ondisk.signature = HAMMER_BTREE_SIGNATURE_GOOD;
+		level[i].ondisk.type = HAMMER_BTREE_TYPE_LEAF;
+		level[i].ondisk.count = n;
+		for (j = 0; j < n; ++j) {
+			hammer_btree_leaf_elm_t leaf;
+
+			leaf = &level[i].ondisk.elms[j].leaf;
+			*leaf = elms[i * HAMMER_BTREE_LEAF_ELMS + j];
+
+			/*
+			 * mirror_tid bounds the TIDs below a node, the
+			 * mirroring scan skips subtrees by it.
+			 */
+			if (level[i].ondisk.mirror_tid < leaf->base.create_tid)
+				level[i].ondisk.mirror_tid =
+					leaf->base.create_tid;
+			if (level[i].ondisk.mirror_tid < leaf->base.delete_tid)
+				level[i].ondisk.mirror_tid =
+					leaf->base.delete_tid;
+		}
+		level[i].offset = mk_alloc(&btree_zone,
+					   sizeof(struct hammer_node_ondisk));
+	}
+	*nnodesp = nlevel;
+	depth = 1;
+
+	while (nlevel > 1) {
+		nparents = (nlevel + HAMMER_BTREE_INT_ELMS - 1) /
+			   HAMMER_BTREE_INT_ELMS;
+		parents = calloc(nparents, sizeof(*parents));
+		for (i = 0; i < nparents; ++i) {
+			n = nlevel - i * HAMMER_BTREE_INT_ELMS;
+			if (n > HAMMER_BTREE_INT_ELMS)
+				n = HAMMER_BTREE_INT_ELMS;
+			parents[i].ondisk.signature =
+				HAMMER_BTREE_SIGNATURE_GOOD;
+			parents[i].ondisk.type = HAMMER_BTREE_TYPE_INTERNAL;
+			parents[i].ondisk.count = n;
+			parents[i].offset = mk_alloc(&btree_zone,
+					sizeof(struct hammer_node_ondisk));
+			for (j = 0; j < n; ++j) {
+				struct mk_node *child;
+				hammer_btree_internal_elm_t elm;
+
+				child = &level[i * HAMMER_BTREE_INT_ELMS + j];
+				elm = &parents[i].ondisk.elms[j].internal;
+				elm->base = child->ondisk.elms[0].base;
+				elm->base.delete_tid = 0;
+				elm->base.btype = child->ondisk.type;
+				elm->subtree_offset = child->offset;
+				elm->mirror_tid = child->ondisk.mirror_tid;
+				child->ondisk.parent = parents[i].offset;
+
+				/*
+				 * The leftmost path carries the left edge
+				 * of the tree.
+				 */
+				if (i == 0 && j == 0) {
+					mk_setbound(&elm->base, &beg);
+					if (child->ondisk.type ==
+					    HAMMER_BTREE_TYPE_INTERNAL) {
+						mk_setbound(&child->ondisk.
+							    elms[0].base, &beg);
+					}
+				}
+				if (parents[i].ondisk.mirror_tid <
+				    child->ondisk.mirror_tid) {
+					parents[i].ondisk.mirror_tid =
+						child->ondisk.mirror_tid;
+				}
+			}
+		}
+
+		/*
+		 * The right boundary of each internal node is the left
+		 * boundary of its right neighbour.
+		 */
+		for (i = 0; i < nparents - 1; ++i) {
+			parents[i].ondisk.elms[parents[i].ondisk.count].base =
+				parents[i + 1].ondisk.elms[0].base;
+		}
+		parents[nparents - 1].ondisk.elms[
+			parents[nparents - 1].ondisk.count].base = end;
+
+		for (i = 0; i < nlevel; ++i) {
+			mk_crc_btree(&level[i].ondisk);
+			mk_pwrite(&level[i].ondisk, sizeof(level[i].ondisk),
+				  level[i].offset);
+		}
+		free(level);
+		level = parents;
+		nlevel = nparents;
+		*nnodesp += nlevel;
+		++depth;
+	}
+
+	mk_crc_btree(&level[0].ondisk);
+	mk_pwrite(&level[0].ondisk, sizeof(level[0].ondisk), level[0].offset);
+	*depthp = depth;
+	return(level[0].offset);
+}
+
+/*
+ * Write both freemap layers and the volume header.
+ */
+static void
+mk_volume(const char *name, hammer_off_t root, hammer_tid_t next_tid)
+{
+	struct hammer_volume_ondisk *vol;
+	struct hammer_blockmap_layer1 layer1;
+	hammer_blockmap_t blockmap;
+	hammer_off_t layer1_offset;
+	hammer_off_t layer2_offset;
+	int64_t i;
+	int zone;
+
+	layer1_offset = HAMMER_ENCODE_RAW_BUFFER(0, 0);
+	layer2_offset = HAMMER_ENCODE_RAW_BUFFER(0, HAMMER_LARGEBLOCK_SIZE64);
+
+	layer2[0].zone = HAMMER_ZONE_FREEMAP_INDEX;
+	layer2[1].zone = HAMMER_ZONE_FREEMAP_INDEX;
+	for (i = 0; i < nlargeblocks; ++i) {
+		if (layer2[i].zone == HAMMER_ZONE_FREEMAP_INDEX) {
+			layer2[i].append_off = HAMMER_LARGEBLOCK_SIZE;
+			layer2[i].bytes_free = 0;
+		}
+		layer2[i].entry_crc = crc32(&layer2[i], HAMMER_LAYER2_CRCSIZE);
+	}
+	mk_pwrite(layer2, nlargeblocks * sizeof(*layer2), layer2_offset);
+
+	bzero(&layer1, sizeof(layer1));
+	layer1.phys_offset = layer2_offset;
+	layer1.blocks_free = 0;
+	layer1.layer1_crc = crc32(&layer1, HAMMER_LAYER1_CRCSIZE);
+	mk_pwrite(&layer1, sizeof(layer1), layer1_offset);
+
+	vol = calloc(1, HAMMER_BUFSIZE);
+	vol->vol_signature = HAMMER_FSBUF_VOLUME;
+	vol->vol_buf_beg = buf_beg;
+	vol->vol_buf_end = buf_beg + nlargeblocks * HAMMER_LARGEBLOCK_SIZE64;
+	snprintf(vol->vol_name, sizeof(vol->vol_name), "%s", name);
+	for (i = 0; i < (int)sizeof(vol->vol_fsid); ++i)
+		((u_int8_t *)&vol->vol_fsid)[i] = (u_int8_t)lrand48();
+	vol->vol_no = 0;
+	vol->vol_count = 1;
+	vol->vol_version = HAMMER_VOL_VERSION_DEFAULT;
+	vol->vol_rootvol = 0;
+	vol->vol_flags = HAMMER_VOLF_VALID;
+	vol->vol_blocksize = HAMMER_BUFSIZE;
+	vol->vol_nblocks = nlargeblocks * HAMMER_BUFFERS_PER_LARGEBLOCK;
+	vol->vol0_stat_bigblocks = nlargeblocks;
+	vol->vol0_stat_freebigblocks = 0;
+	vol->vol0_stat_bytes = stat_bytes;
+	vol->vol0_stat_inodes = stat_inodes;
+	vol->vol0_stat_records = nelms;
+	vol->vol0_btree_root = root;
+	vol->vol0_next_tid = next_tid;
+
+	blockmap = &vol->vol0_blockmap[HAMMER_ZONE_FREEMAP_INDEX];
+	blockmap->phys_offset = layer1_offset;
+	hammer_crc_set_blockmap(blockmap);
+
+	for (zone = HAMMER_ZONE_BTREE_INDEX; zone < HAMMER_MAX_ZONES; ++zone) {
+		struct mk_zone *z = NULL;
+
+		blockmap = &vol->vol0_blockmap[zone];
+		blockmap->first_offset = HAMMER_ZONE_ENCODE(zone, 0);
+		blockmap->next_offset = HAMMER_ZONE_ENCODE(zone, 0);
+		blockmap->alloc_offset = HAMMER_ZONE_ENCODE(zone, 0);
+		if (zone == btree_zone.zone)
+			z = &btree_zone;
+		else if (zone == small_zone.zone)
+			z = &small_zone;
+		else if (zone == large_zone.zone)
+			z = &large_zone;
+		if (z && z->next) {
+			blockmap->next_offset = HAMMER_ZONE_ENCODE(zone,
+				z->next & HAMMER_OFF_LONG_MASK);
+			blockmap->alloc_offset = blockmap->next_offset;
+		}
+		hammer_crc_set_blockmap(blockmap);
+	}
+	hammer_crc_set_volume(vol);
+
+	if (pwrite(fd, vol, HAMMER_BUFSIZE, 0) != HAMMER_BUFSIZE) {
+		perror("pwrite");
+		exit(1);
+	}
+	free(vol);
+}
+
+int
+main(int ac, char **av)
+{
+	int64_t nfiles = 1000;
+	int64_t size_min = 16384;
+	int64_t size_max = 16384;
+	int64_t nnodes;
+	int64_t n;
+	int fanout = 64;
+	int sparse = 0;
+	int history = 1;
+	int deleted = 0;
+	int npfs = 1;
+	long seed = 1;
+	hammer_tid_t tid_beg, tid_del;
+	hammer_off_t root;
+	char *ptr;
+	int depth;
+	int ch;
+	int i;
+
+	while ((ch = getopt(ac, av, "n:f:s:p:H:x:P:r:")) != -1) {
+		switch (ch) {
+		case 'n':
+			nfiles = strtoll(optarg, NULL, 0);
+			break;
+		case 'f':
+			fanout = strtol(optarg, NULL, 0);
+			break;
+		case 's':
+			size_min = size_max = getsize(optarg);
+			if ((ptr = strchr(optarg, ':')) != NULL)
+				size_max = getsize(ptr + 1);
+			break;
+		case 'p':
+			sparse = strtol(optarg, NULL, 0);
+			break;
+		case 'H':
+			history = strtol(optarg, NULL, 0);
+			break;
+		case 'x':
+			deleted = strtol(optarg, NULL, 0);
+			break;
+		case 'P':
+			npfs = strtol(optarg, NULL, 0);
+			break;
+		case 'r':
+			seed = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+		}
+	}
+	ac -= optind;
+	av += optind;
+	if (ac != 1 || fanout < 2 || history < 1 || nfiles < 0 ||
+	    size_min < 0 || size_max < size_min || npfs < 1 || npfs > 65536)
+		usage();
+
+	srand48(seed);
+	fd = open(av[0], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(av[0]);
+		exit(1);
+	}
+	dir_template.ino_data.cap_flags = HAMMER_INODE_CAP_DIRHASH_ALG0;
+
+	tid_beg = MK_TID_BEG;
+	tid_del = tid_beg + 1 + history;
+
+	for (i = 0; i < npfs; ++i) {
+		localization = (u_int32_t)i << 16;
+		n = nfiles / npfs + (i < nfiles % npfs);
+		mk_tree(n, fanout, size_min, size_max, sparse, history,
+			deleted, tid_beg, tid_del);
+		if (i)
+			mk_pfs(i, tid_beg, tid_del);
+	}
+
+	do {
+		qsort(elms, nelms, sizeof(*elms), mk_cmp);
+	} while (mk_collisions());
+	root = mk_btree(&nnodes, &depth);
+	mk_volume(av[0], root, tid_del + 1);
+
+	if (ftruncate(fd, buf_beg + nlargeblocks * HAMMER_LARGEBLOCK_SIZE64)) {
+		perror("ftruncate");
+		exit(1);
+	}
+	close(fd);
+
+	printf("image=%s files=%" PRId64 " dirs=%" PRId64 " fanout=%d"
+	       " history=%d pfs=%d records=%d nodes=%" PRId64 " depth=%d"
+	       " data_bytes=%" PRId64 " alloc_bytes=%" PRId64
+	       " live_inodes=%" PRId64 " live_data_bytes=%" PRId64
+	       " tid_beg=0x%016" PRIx64 " tid_end=0x%016" PRIx64 "\n",
+	       av[0], nfiles, stat_dirs, fanout, history, npfs, nelms, nnodes,
+	       depth, stat_data_bytes, stat_bytes, stat_live_inodes,
+	       stat_live_data_bytes, (uint64_t)tid_beg, (uint64_t)tid_del);
+	return(0);
+}
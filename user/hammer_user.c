@@ -0,0 +1,659 @@
+/*
+ * Userspace front end to the HAMMER core, see hammer_user.h.
+ *
+ * Errors are returned as positive errno values like the core does,
+ * except for hu_read() which returns a negative errno.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "hammer_user.h"
+#include "hammerfs.h"
+#include "hammerfs_stats.h"
+
+int
+hu_mount(struct hu_mount *mnt, const char *path)
+{
+    return(hu_mount_opts(mnt, path, NULL));
+}
+
+// corresponds to hammerfs_fill_super
+int
+hu_mount_opts(struct hu_mount *mnt, const char *path, const char *opts)
+{
+    static int initialized;
+    hammer_mount_t hmp;
+    char *data;
+    int error;
+
+    /*
+     * The module does this at load time.
+     */
+    if (initialized == 0) {
+        sleepinit();
+        error = -hammerfs_init_caches();
+        if (error)
+            return(error);
+        initialized = 1;
+    }
+
+    bzero(mnt, sizeof(*mnt));
+    mnt->sb.s_fd = open(path, O_RDONLY);
+    if (mnt->sb.s_fd < 0)
+        return(errno);
+    snprintf(mnt->sb.s_id, sizeof(mnt->sb.s_id), "%s", path);
+    error = open_bdev_image(&mnt->sb);
+    if (error) {
+        close(mnt->sb.s_fd);
+        return(error);
+    }
+
+    hmp = kmalloc(sizeof(struct hammer_mount), M_HAMMER, M_WAITOK | M_ZERO);
+    if (!hmp) {
+        close_bdev_image(&mnt->sb);
+        close(mnt->sb.s_fd);
+        return(ENOMEM);
+    }
+    mnt->sb.s_fs_info = hmp;
+    mnt->hmp = hmp;
+
+    /*
+     * hammerfs_init_mount() and hammerfs_install_volume() return
+     * negative Linux error codes.
+     */
+    error = -hammerfs_init_mount(hmp);
+    if (error == 0 && opts) {
+        data = strdup(opts);
+        error = data ? -hammerfs_parse_options(hmp, data) : ENOMEM;
+        free(data);
+    }
+    if (error == 0)
+        error = -hammerfs_install_volume(hmp, &mnt->sb);
+
+    if (error == 0 && hmp->rootvol == NULL) {
+        printk(KERN_ERR "HAMMER: No root volume found!\n");
+        error = EINVAL;
+    }
+    if (error == 0 && hammer_mountcheck_volumes(hmp)) {
+        printk(KERN_ERR "HAMMER: Missing volumes, cannot mount!\n");
+        error = EINVAL;
+    }
+    if (error == 0)
+        error = -hammerfs_pin_root(hmp);
+    if (error) {
+        hu_umount(mnt);
+        return(error);
+    }
+    hammerfs_add_shrinker(hmp);
+    return(0);
+}
+
+/*
+ * The port does not reclaim inodes, buffers or nodes yet, so all that can
+ * be torn down is the mount structure, its pinned root and the image file
+ * with its mapping.
+ */
+void
+hu_umount(struct hu_mount *mnt)
+{
+    hammerfs_free_mount(mnt->hmp);
+    kfree(mnt->hmp, M_HAMMER);
+    mnt->hmp = NULL;
+    close_bdev_image(&mnt->sb);
+    if (mnt->sb.s_fd >= 0)
+        close(mnt->sb.s_fd);
+    mnt->sb.s_fd = -1;
+}
+
+// corresponds to hammerfs_iget, HAMMER_MAX_TID is the mount's asof
+hammer_inode_t
+hu_get_inode(struct hu_mount *mnt, int64_t obj_id, hammer_tid_t asof,
+             int *errorp)
+{
+    struct hammer_transaction trans;
+    hammer_inode_t ip;
+
+    if (asof == HAMMER_MAX_TID)
+        asof = mnt->hmp->asof;
+    hammer_simple_transaction(&trans, mnt->hmp);
+    ip = hammer_get_inode(&trans, NULL, obj_id, asof,
+                          HAMMER_DEF_LOCALIZATION,
+                          (asof != HAMMER_MAX_TID ? HAMMER_INODE_RO : 0),
+                          errorp);
+    hammer_done_transaction(&trans);
+    return(ip);
+}
+
+// corresponds to hammerfs_inode_lookup
+int
+hu_lookup(hammer_inode_t dip, const char *name, int nlen, hammer_inode_t *ipp)
+{
+    struct hammer_transaction trans;
+    struct hammer_cursor cursor;
+    int64_t namekey;
+    u_int32_t max_iterations;
+    u_int32_t localization;
+    hammer_tid_t asof;
+    int64_t obj_id;
+    int flags;
+    int ispfs;
+    int error;
+
+    *ipp = NULL;
+    if (dip->ino_data.obj_type != HAMMER_OBJTYPE_DIRECTORY)
+        return(ENOTDIR);
+
+    asof = dip->obj_asof;
+    localization = dip->obj_localization;
+    nlen = hammerfs_name_asof(name, nlen, &asof, &localization, &ispfs);
+    flags = dip->flags & HAMMER_INODE_RO;
+    if (asof != HAMMER_MAX_TID)
+        flags |= HAMMER_INODE_RO;
+
+    hammer_simple_transaction(&trans, dip->hmp);
+
+    if (ispfs && nlen == 0) {
+        obj_id = HAMMER_OBJID_ROOT;
+        error = 0;
+        goto found;
+    }
+
+    namekey = hammer_directory_namekey(dip, name, nlen, &max_iterations);
+
+    error = hammer_init_cursor(&trans, &cursor, &dip->cache[1], dip);
+    cursor.key_beg.localization = dip->obj_localization +
+                                  HAMMER_LOCALIZE_MISC;
+    cursor.key_beg.obj_id = dip->obj_id;
+    cursor.key_beg.key = namekey;
+    cursor.key_beg.create_tid = 0;
+    cursor.key_beg.delete_tid = 0;
+    cursor.key_beg.rec_type = HAMMER_RECTYPE_DIRENTRY;
+    cursor.key_beg.obj_type = 0;
+
+    cursor.key_end = cursor.key_beg;
+    cursor.key_end.key += max_iterations;
+    cursor.asof = asof;
+    cursor.flags |= HAMMER_CURSOR_END_INCLUSIVE | HAMMER_CURSOR_ASOF;
+
+    obj_id = 0;
+    localization = HAMMER_DEF_LOCALIZATION;
+
+    if (error == 0) {
+        error = hammer_ip_first(&cursor);
+        while (error == 0) {
+            error = hammer_ip_resolve_data(&cursor);
+            if (error)
+                break;
+            if (nlen == cursor.leaf->data_len - HAMMER_ENTRY_NAME_OFF &&
+                bcmp(name, cursor.data->entry.name, nlen) == 0) {
+                obj_id = cursor.data->entry.obj_id;
+                localization = cursor.data->entry.localization;
+                break;
+            }
+            error = hammer_ip_next(&cursor);
+        }
+    }
+    hammer_done_cursor(&cursor);
+
+found:
+    if (error == 0) {
+        *ipp = hammer_get_inode(&trans, dip, obj_id, asof, localization,
+                                flags, &error);
+    }
+    hammer_done_transaction(&trans);
+    return(error);
+}
+
+/*
+ * Resolve a '/' separated path relative to the root directory.
+ */
+int
+hu_namei(struct hu_mount *mnt, const char *path, hammer_tid_t asof,
+         hammer_inode_t *ipp)
+{
+    hammer_inode_t ip;
+    const char *end;
+    int error;
+
+    ip = hu_get_inode(mnt, HAMMER_OBJID_ROOT, asof, &error);
+    while (error == 0) {
+        while (*path == '/')
+            ++path;
+        if (*path == 0)
+            break;
+        for (end = path; *end && *end != '/'; ++end)
+            ;
+        error = hu_lookup(ip, path, end - path, &ip);
+        path = end;
+    }
+    *ipp = error ? NULL : ip;
+    return(error);
+}
+
+/*
+ * Directory keys are used as seek positions; *posp is the key to resume
+ * from and is advanced past every entry handed to filldir.
+ */
+// corresponds to hammerfs_readdir
+int
+hu_readdir(hammer_inode_t dip, int64_t *posp, hu_filldir_t filldir, void *arg)
+{
+    struct hammer_transaction trans;
+    struct hammer_cursor cursor;
+    hammer_base_elm_t base;
+    int error;
+
+    if (dip->ino_data.obj_type != HAMMER_OBJTYPE_DIRECTORY)
+        return(ENOTDIR);
+
+    hammer_simple_transaction(&trans, dip->hmp);
+
+    hammer_init_cursor(&trans, &cursor, &dip->cache[1], dip);
+    cursor.key_beg.localization = dip->obj_localization +
+                                  HAMMER_LOCALIZE_MISC;
+    cursor.key_beg.obj_id = dip->obj_id;
+    cursor.key_beg.create_tid = 0;
+    cursor.key_beg.delete_tid = 0;
+    cursor.key_beg.rec_type = HAMMER_RECTYPE_DIRENTRY;
+    cursor.key_beg.obj_type = 0;
+    cursor.key_beg.key = *posp;
+
+    cursor.key_end = cursor.key_beg;
+    cursor.key_end.key = HAMMER_MAX_KEY;
+    cursor.asof = dip->obj_asof;
+    cursor.flags |= HAMMER_CURSOR_END_INCLUSIVE | HAMMER_CURSOR_ASOF;
+
+    error = hammer_ip_first(&cursor);
+
+    while (error == 0) {
+        error = hammer_ip_resolve_data(&cursor);
+        if (error)
+            break;
+        base = &cursor.leaf->base;
+        KKASSERT(cursor.leaf->data_len > HAMMER_ENTRY_NAME_OFF);
+
+        if (filldir(arg, (void *)cursor.data->entry.name,
+                    cursor.leaf->data_len - HAMMER_ENTRY_NAME_OFF,
+                    base->key, cursor.data->entry.obj_id,
+                    hammer_get_dtype(base->obj_type))) {
+            break;
+        }
+        *posp = base->key + 1;
+        error = hammer_ip_next(&cursor);
+    }
+    hammer_done_cursor(&cursor);
+    hammer_done_transaction(&trans);
+
+    if (error == ENOENT)
+        error = 0;
+    return(error);
+}
+
+/*
+ * Read file data the way hammerfs_readpage does: locate the data records
+ * with the cursor, translate them through the blockmap and copy them out
+ * of BLOCK_SIZE buffer_heads.  Holes are zero-filled.  Returns the number
+ * of bytes read or a negative errno.
+ */
+// corresponds to hammerfs_readpage
+ssize_t
+hu_read(hammer_inode_t ip, off_t off, void *buf, size_t len)
+{
+    hammer_mount_t hmp = ip->hmp;
+    struct hammer_transaction trans;
+    struct hammer_cursor cursor;
+    struct buffer_head *bh;
+    hammer_volume_t volume;
+    hammer_base_elm_t base;
+    hammer_off_t zone2_offset;
+    int64_t rec_offset;
+    int64_t sb_offset;
+    u_int64_t start;
+    u_int64_t ns;
+    size_t boff;
+    int bread_bytes;
+    int block_offset;
+    int error;
+    int roff;
+    int n;
+
+    if (ip->ino_data.obj_type != HAMMER_OBJTYPE_REGFILE)
+        return(-EISDIR);
+    if (off >= ip->ino_data.size)
+        return(0);
+    if (len > ip->ino_data.size - off)
+        len = ip->ino_data.size - off;
+
+    ++hammer_stats_file_iopsr;
+    hammer_stats_file_read += len;
+    hammerfs_stats_inc(hmp, file_reads);
+    hammerfs_stats_add(hmp, file_read_bytes, len);
+
+    hammer_simple_transaction(&trans, hmp);
+    hammer_init_cursor(&trans, &cursor, &ip->cache[1], ip);
+
+   /*
+    * Key range (begin and end inclusive) to scan.  Note that the key's
+    * stored in the actual records represent BASE+LEN, not BASE.  The
+    * first record containing off will have a key > off.
+    */
+    cursor.key_beg.localization = ip->obj_localization +
+                                  HAMMER_LOCALIZE_MISC;
+    cursor.key_beg.obj_id = ip->obj_id;
+    cursor.key_beg.create_tid = 0;
+    cursor.key_beg.delete_tid = 0;
+    cursor.key_beg.obj_type = 0;
+    cursor.key_beg.key = off + 1;
+    cursor.asof = ip->obj_asof;
+    cursor.flags |= HAMMER_CURSOR_ASOF;
+
+    cursor.key_end = cursor.key_beg;
+    cursor.key_beg.rec_type = HAMMER_RECTYPE_DATA;
+    cursor.key_end.rec_type = HAMMER_RECTYPE_DATA;
+    cursor.key_end.key = HAMMER_MAX_KEY;
+    cursor.flags |= HAMMER_CURSOR_END_INCLUSIVE;
+
+    error = hammer_ip_first(&cursor);
+    boff = 0;
+
+    while (error == 0 && boff < len) {
+        base = &cursor.leaf->base;
+        rec_offset = base->key - cursor.leaf->data_len;
+        if (rec_offset >= off + (off_t)len)
+            break;
+
+       /*
+        * Zero-fill the gap between our position and the record.
+        */
+        n = (int)(rec_offset - (off + boff));
+        if (n > 0) {
+            if (n > len - boff)
+                n = len - boff;
+            bzero((char *)buf + boff, n);
+            boff += n;
+            n = 0;
+        }
+
+        roff = -n;
+        n = cursor.leaf->data_len - roff;
+        if (n <= 0) {
+            error = hammer_ip_next(&cursor);
+            continue;
+        }
+        if (n > len - boff)
+            n = len - boff;
+
+        zone2_offset = hammer_blockmap_lookup(hmp,
+                                              cursor.leaf->data_offset + roff,
+                                              &error);
+        if (error)
+            break;
+        volume = hammer_get_volume(hmp, HAMMER_VOL_DECODE(zone2_offset),
+                                   &error);
+        if (error)
+            break;
+        sb_offset = volume->ondisk->vol_buf_beg +
+                    (zone2_offset & HAMMER_OFF_SHORT_MASK);
+
+        start = hammerfs_clock();
+        bread_bytes = n;
+        while (n > 0) {
+            block_offset = sb_offset % BLOCK_SIZE;
+            roff = min(BLOCK_SIZE - block_offset, n);
+
+            bh = sb_bread(volume->sb, sb_offset / BLOCK_SIZE);
+            if (!bh) {
+                error = EIO;
+                break;
+            }
+            memcpy((char *)buf + boff, bh->b_data + block_offset, roff);
+            brelse(bh);
+
+            sb_offset += roff;
+            boff += roff;
+            n -= roff;
+        }
+        ns = hammerfs_lat_record(hmp, HAMMERFS_LAT_READPAGE_BREAD, start);
+        trace_mark(hammerfs_readpage_bread, "sb_offset %lld bytes %d ns %llu",
+                   (long long)(sb_offset - (bread_bytes - n)),
+                   bread_bytes - n,
+                   (unsigned long long)ns);
+        hammer_rel_volume(volume, 0);
+        if (error)
+            break;
+        error = hammer_ip_next(&cursor);
+    }
+    hammer_done_cursor(&cursor);
+    hammer_done_transaction(&trans);
+
+    if (error && error != ENOENT)
+        return(-error);
+
+    /*
+     * Trailing hole.
+     */
+    if (boff < len)
+        bzero((char *)buf + boff, len - boff);
+    return(len);
+}
+
+// corresponds to hammerfs_ioctl_mirror_read
+int
+hu_mirror_read(hammer_inode_t ip, struct hammer_ioc_mirror_rw *mirror)
+{
+    return(hammerfs_ioc_mirror_read(ip, mirror));
+}
+
+/*
+ * The sink of hu_mirror_stream() gathers records in a buffer of the size
+ * of a kernel splice batch and writes it out on flush.
+ */
+#define HU_SINK_SIZE    (128 * PAGE_SIZE)
+
+struct hu_fd_sink {
+    struct hammerfs_mirror_sink sink;
+    int fd;
+    size_t len;
+    char buf[HU_SINK_SIZE];
+};
+
+// corresponds to hammerfs_splice_add
+static int
+hu_fd_add(struct hammerfs_mirror_sink *sink, const void *addr, int len,
+          int isdata)
+{
+    struct hu_fd_sink *fs = (struct hu_fd_sink *)sink;
+
+    if (fs->len + len > HU_SINK_SIZE)
+        return(EFBIG);
+    bcopy(addr, fs->buf + fs->len, len);
+    fs->len += len;
+    if (fs->len > HU_SINK_SIZE - HAMMER_XBUFSIZE - 2 * PAGE_SIZE)
+        sink->full = 1;
+    return(0);
+}
+
+// corresponds to hammerfs_splice_flush
+static int
+hu_fd_flush(struct hammerfs_mirror_sink *sink)
+{
+    struct hu_fd_sink *fs = (struct hu_fd_sink *)sink;
+    ssize_t n;
+    size_t off;
+
+    for (off = 0; off < fs->len; off += n) {
+        n = write(fs->fd, fs->buf + off, fs->len - off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            return(errno);
+        }
+    }
+    fs->len = 0;
+    sink->full = 0;
+    return(0);
+}
+
+// corresponds to hammerfs_ioctl_mirror_splice
+int
+hu_mirror_stream(hammer_inode_t ip, struct hammer_ioc_mirror_rw *mirror,
+                 int fd, int flags)
+{
+    struct hammerfs_mframe_sink mf;
+    struct hu_fd_sink *fs;
+    int error;
+
+    if (flags & ~HAMMERFS_MIRROR_FRAMES)
+        return(EINVAL);
+    fs = calloc(1, sizeof(*fs));
+    if (fs == NULL)
+        return(ENOMEM);
+    fs->sink.add = hu_fd_add;
+    fs->sink.flush = hu_fd_flush;
+    fs->fd = fd;
+    if ((flags & HAMMERFS_MIRROR_FRAMES) == 0) {
+        error = hammerfs_mirror_stream(ip, mirror, &fs->sink);
+    } else if ((error = hammerfs_mframe_init(&mf, &fs->sink)) == 0) {
+        error = hammerfs_mirror_stream(ip, mirror, &mf.sink);
+        hammerfs_mframe_done(&mf);
+    }
+    free(fs);
+    return(error);
+}
+
+static int
+hu_read_full(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+    size_t off;
+
+    for (off = 0; off < len; off += n) {
+        n = read(fd, (char *)buf + off, len - off);
+        if (n < 0 && errno == EINTR) {
+            n = 0;
+            continue;
+        }
+        if (n < 0)
+            return(errno);
+        if (n == 0)
+            return(off ? EINVAL : ENOENT);
+    }
+    return(0);
+}
+
+/*
+ * Read HAMMERFS_MIRROR_FRAMES frames from infd up to its end and write
+ * the plain mrecord stream they hold to outfd, with rec_crc filled in.
+ * *rawp and *framep are set to the bytes written and read.
+ */
+int
+hu_mframe_unpack(int infd, int outfd, int64_t *rawp, int64_t *framep)
+{
+    struct hammerfs_mframe_head head;
+    char *payload;
+    char *raw;
+    ssize_t n;
+    size_t off;
+    int error;
+
+    *rawp = 0;
+    *framep = 0;
+    payload = malloc(HAMMERFS_MFRAME_SIZE);
+    raw = malloc(HAMMERFS_MFRAME_SIZE);
+    if (payload == NULL || raw == NULL) {
+        error = ENOMEM;
+        goto done;
+    }
+    while ((error = hu_read_full(infd, &head, sizeof(head))) == 0) {
+        if (head.frame_size > HAMMERFS_MFRAME_SIZE) {
+            error = EINVAL;
+            break;
+        }
+        error = hu_read_full(infd, payload, head.frame_size);
+        if (error == ENOENT)
+            error = EINVAL;
+        if (error == 0)
+            error = hammerfs_mframe_decode(&head, payload, raw, 1);
+        if (error)
+            break;
+        for (off = 0; off < head.raw_size; off += n) {
+            n = write(outfd, raw + off, head.raw_size - off);
+            if (n < 0 && errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            if (n < 0) {
+                error = errno;
+                goto done;
+            }
+        }
+        *rawp += head.raw_size;
+        *framep += sizeof(head) + head.frame_size;
+    }
+    if (error == ENOENT)
+        error = 0;
+done:
+    free(payload);
+    free(raw);
+    return(error);
+}
+
+// corresponds to hammerfs_ioctl_mirror_split
+int
+hu_mirror_split(hammer_inode_t ip, struct hammerfs_ioc_mirror_split *split)
+{
+    return(hammerfs_mirror_split(ip->hmp, split, split->ranges));
+}
+
+// corresponds to hammerfs_ioctl_pfs_summary, with the worker count exposed
+int
+hu_pfs_summary(hammer_inode_t ip, int nworkers,
+               struct hammerfs_ioc_pfs_summary *ps)
+{
+    struct hammerfs_pfs_summary *ary;
+    int count;
+    int error;
+
+    if (ps->count < 0)
+        return(EINVAL);
+    error = hammerfs_pfs_summary(ip->hmp, nworkers, &ary, &count);
+    if (error)
+        return(error);
+    bcopy(ary, ps->ary, min(ps->count, count) * sizeof(*ary));
+    ps->count = count;
+    return(0);
+}
+
+/*
+ * Parse a size given to one of the tools: a number as strtoll() takes it,
+ * optionally followed by k, m or g for KB, MB or GB.  *endp is set past
+ * what was parsed for the caller to check what follows.
+ */
+int64_t
+hu_getsize(const char *str, char **endp)
+{
+    int64_t val;
+    char *ptr;
+
+    val = strtoll(str, &ptr, 0);
+    switch (*ptr) {
+    case 'g':
+    case 'G':
+        val *= 1024;
+        /* fall through */
+    case 'm':
+    case 'M':
+        val *= 1024;
+        /* fall through */
+    case 'k':
+    case 'K':
+        val *= 1024;
+        ++ptr;
+        break;
+    }
+    *endp = ptr;
+    return(val);
+}
@@ -0,0 +1,52 @@
+#ifndef _HAMMER_USER_H
+#define _HAMMER_USER_H
+
+/*
+ * Userspace access to a HAMMER image through the real core: the same
+ * B-Tree, cursor, blockmap and inode code the kernel module runs, mounted
+ * read-only on top of include/linux_user.h.  The entry points correspond
+ * to the Linux VFS glue in super.c, file.c and inode.c.
+ */
+
+#include "linux_user.h"
+
+#include "dfly_wrap.h"
+#include <vfs/hammer/hammer.h>
+
+#include "hammerfs_ioctl.h"
+
+struct hu_mount {
+	struct super_block	sb;
+	hammer_mount_t		hmp;
+};
+
+/*
+ * Called for every directory entry by hu_readdir().  A non-zero return
+ * stops the scan.
+ */
+typedef int (*hu_filldir_t)(void *arg, const char *name, int nlen,
+			    int64_t key, int64_t obj_id, int dtype);
+
+int hu_mount(struct hu_mount *mnt, const char *path);
+int hu_mount_opts(struct hu_mount *mnt, const char *path, const char *opts);
+void hu_umount(struct hu_mount *mnt);
+
+hammer_inode_t hu_get_inode(struct hu_mount *mnt, int64_t obj_id,
+			    hammer_tid_t asof, int *errorp);
+int hu_lookup(hammer_inode_t dip, const char *name, int nlen,
+	      hammer_inode_t *ipp);
+int hu_namei(struct hu_mount *mnt, const char *path, hammer_tid_t asof,
+	     hammer_inode_t *ipp);
+int hu_readdir(hammer_inode_t dip, int64_t *posp, hu_filldir_t filldir,
+	       void *arg);
+ssize_t hu_read(hammer_inode_t ip, off_t off, void *buf, size_t len);
+int hu_mirror_read(hammer_inode_t ip, struct hammer_ioc_mirror_rw *mirror);
+int hu_mirror_stream(hammer_inode_t ip, struct hammer_ioc_mirror_rw *mirror,
+		     int fd, int flags);
+int hu_mframe_unpack(int infd, int outfd, int64_t *rawp, int64_t *framep);
+int hu_mirror_split(hammer_inode_t ip, struct hammerfs_ioc_mirror_split *split);
+int hu_pfs_summary(hammer_inode_t ip, int nworkers,
+		   struct hammerfs_ioc_pfs_summary *ps);
+int64_t hu_getsize(const char *str, char **endp);
+
+#endif /* _HAMMER_USER_H */
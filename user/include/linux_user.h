@@ -0,0 +1,358 @@
+#ifndef _LINUX_USER_H
+#define _LINUX_USER_H
+
+/*
+ * Userspace emulation of the Linux kernel interfaces used by the HAMMER
+ * port, so that the core (dfly/vfs/hammer plus the top-level port files)
+ * can be built and profiled as an ordinary process against an image
+ * file.  See user/Makefile.
+ *
+ * The linux/ and asm/ headers in this directory all resolve to this
+ * file.  The counterpart of dfly_wrap.c is user/linux_user.c.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <time.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define _MACHINE_STDINT_H_
+#define _LINUX_BUFFER_HEAD_H
+
+typedef unsigned long sector_t;
+
+// from sys/cdefs.h
+#define __offsetof(type, field)	offsetof(type, field)
+
+/*
+ * libc declares these with different types than libkern does; the
+ * libkern versions are the ones linked into the core.
+ */
+#define strtouq		dfly_strtouq
+
+// from linux/kernel.h
+#define KERN_EMERG	""
+#define KERN_ALERT	""
+#define KERN_CRIT	""
+#define KERN_ERR	""
+#define KERN_WARNING	""
+#define KERN_NOTICE	""
+#define KERN_INFO	""
+#define KERN_DEBUG	""
+
+#define printk		printf
+#define vprintk		vprintf
+#define simple_strtoul	strtoul
+
+#define min(x, y)	((x) < (y) ? (x) : (y))
+#define max(x, y)	((x) > (y) ? (x) : (y))
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define likely(x)	__builtin_expect(!!(x), 1)
+#define unlikely(x)	__builtin_expect(!!(x), 0)
+
+void panic(const char *fmt, ...) __attribute__((noreturn));
+
+// from asm/bug.h
+#define BUG()		panic("BUG at %s:%d", __FILE__, __LINE__)
+#define BUG_ON(exp)	do { if (unlikely(exp)) BUG(); } while (0)
+
+// from asm/atomic.h and asm/system.h
+typedef struct {
+	volatile int	counter;
+} atomic_t;
+
+#define atomic_add(i, v)	((void)__sync_fetch_and_add(&(v)->counter, (i)))
+#define atomic_sub(i, v)	((void)__sync_fetch_and_sub(&(v)->counter, (i)))
+#define atomic_set(v, i)	((v)->counter = (i))
+#define atomic_inc_return(v)	__sync_add_and_fetch(&(v)->counter, 1)
+#define atomic_dec_and_test(v)	(__sync_sub_and_fetch(&(v)->counter, 1) == 0)
+#define cmpxchg(ptr, old, new)	__sync_val_compare_and_swap(ptr, old, new)
+
+// from linux/gfp.h
+typedef unsigned int gfp_t;
+
+#define __GFP_WAIT	0x10u
+#define __GFP_IO	0x40u
+#define __GFP_FS	0x80u
+#define GFP_NOFS	(__GFP_WAIT | __GFP_IO)
+#define GFP_KERNEL	(__GFP_WAIT | __GFP_IO | __GFP_FS)
+
+// from linux/slab.h
+
+#define SLAB_HWCACHE_ALIGN	0x00002000UL
+#define SLAB_RECLAIM_ACCOUNT	0x00020000UL
+#define SLAB_MEM_SPREAD		0x00100000UL
+
+struct kmem_cache;
+
+void *kzalloc(size_t size, int flags);
+void kfree(const void *ptr);
+size_t ksize(const void *ptr);
+char *kstrdup(const char *s, int flags);
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, unsigned long flags,
+				     void (*ctor)(void *));
+void kmem_cache_destroy(struct kmem_cache *cachep);
+void *kmem_cache_alloc(struct kmem_cache *cachep, int flags);
+void *kmem_cache_zalloc(struct kmem_cache *cachep, int flags);
+void kmem_cache_free(struct kmem_cache *cachep, void *objp);
+
+/*
+ * from linux/mm.h
+ *
+ * There is no memory pressure in a process; shrink_slab() asks every
+ * registered shrinker to scan nr_to_scan objects and returns the sum of
+ * what they report as left.
+ */
+#define DEFAULT_SEEKS	2
+
+struct shrinker {
+	int		(*shrink)(int nr_to_scan, gfp_t gfp_mask);
+	int		seeks;
+	struct shrinker	*next;
+};
+
+void register_shrinker(struct shrinker *shrinker);
+void unregister_shrinker(struct shrinker *shrinker);
+unsigned long shrink_slab(int nr_to_scan, gfp_t gfp_mask);
+
+// from linux/dcache.h
+#define sysctl_vfs_cache_pressure	100
+
+// from linux/compiler.h and asm/uaccess.h, one address space
+#define __user
+
+static inline unsigned long
+copy_to_user(void *to, const void *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return(0);
+}
+
+static inline unsigned long
+copy_from_user(void *to, const void *from, unsigned long n)
+{
+	memcpy(to, from, n);
+	return(0);
+}
+
+// from linux/err.h
+#define MAX_ERRNO	4095
+
+#define ERR_PTR(error)	((void *)(long)(error))
+#define PTR_ERR(ptr)	((long)(ptr))
+#define IS_ERR(ptr)	((unsigned long)(ptr) >= (unsigned long)-MAX_ERRNO)
+
+/*
+ * from linux/mm_types.h and linux/pagemap.h
+ *
+ * The block device's page cache is a read-only mmap of the image, so a
+ * page is a window on it and is always up to date.  Reading a page only
+ * starts readahead of it (MADV_WILLNEED), the fault does the rest.  The
+ * count is kept so that pinned pages show up in a debugger.
+ */
+#define PAGE_SHIFT	12
+#define PAGE_SIZE	(1UL << PAGE_SHIFT)
+#define PAGE_MASK	(~(PAGE_SIZE - 1))
+
+typedef unsigned long pgoff_t;
+
+struct page {
+	void		*virtual;
+	atomic_t	_count;
+};
+
+struct address_space {
+	struct page	*a_pages;	/* one per page of the image */
+	unsigned long	nrpages;
+};
+
+struct page *read_mapping_page_async(struct address_space *mapping,
+				     pgoff_t index, void *data);
+void page_cache_release(struct page *page);
+
+#define wait_on_page_locked(page)	do { } while (0)
+#define PageUptodate(page)		1
+#define mark_page_accessed(page)	do { } while (0)
+
+/*
+ * from linux/vmalloc.h
+ *
+ * Only pages which are already contiguous in the image can be mapped.
+ */
+#define VM_MAP		0x00000004
+#define PAGE_KERNEL_RO	0
+
+void *vmap(struct page **pages, unsigned int count, unsigned long flags,
+	   int prot);
+void vunmap(const void *addr);
+
+#define vmalloc(size)	malloc(size)
+#define vfree(addr)	free(addr)
+
+// from linux/percpu.h, a process is a single cpu
+#define alloc_percpu(type)	((type *)calloc(1, sizeof(type)))
+#define free_percpu(ptr)	free(ptr)
+#define per_cpu_ptr(ptr, cpu)	(ptr)
+#define get_cpu()		0
+#define put_cpu()		do { } while (0)
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; ++(cpu))
+
+// from linux/ktime.h
+typedef int64_t ktime_t;
+
+ktime_t ktime_get(void);
+#define ktime_to_ns(kt)		(kt)
+
+// from linux/bitops.h
+static inline int
+fls64(uint64_t x)
+{
+	return(x ? 64 - __builtin_clzll(x) : 0);
+}
+
+// from linux/marker.h, markers are compiled out
+#define trace_mark(name, format, args...) do { } while (0)
+
+// from linux/cache.h
+#define ____cacheline_aligned_in_smp	__attribute__((aligned(64)))
+
+// from linux/sched.h, a task is a pthread
+struct task_struct;
+
+#define current			((struct task_struct *)pthread_self())
+#define TASK_INTERRUPTIBLE	1
+#define TASK_UNINTERRUPTIBLE	2
+#define MAX_SCHEDULE_TIMEOUT	LONG_MAX
+#define HZ			100
+
+#define signal_pending(task)	0
+
+long schedule_timeout(long timeout);
+
+// from linux/spinlock.h
+typedef pthread_mutex_t spinlock_t;
+
+#define __SPIN_LOCK_UNLOCKED(name)	PTHREAD_MUTEX_INITIALIZER
+#define spin_lock_init(lock)		pthread_mutex_init(lock, NULL)
+#define spin_lock(lock)			pthread_mutex_lock(lock)
+#define spin_unlock(lock)		pthread_mutex_unlock(lock)
+
+// from linux/mutex.h
+#define DEFINE_MUTEX(name)	pthread_mutex_t name = PTHREAD_MUTEX_INITIALIZER
+#define mutex_lock(lock)	pthread_mutex_lock(lock)
+#define mutex_unlock(lock)	pthread_mutex_unlock(lock)
+
+/*
+ * from linux/wait.h
+ *
+ * A wait queue counts its wakeups.  prepare_to_wait() samples the count
+ * and schedule_timeout() sleeps until it changes, so a wake_up_all()
+ * between the two is not lost.
+ */
+typedef struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	unsigned long	wakeups;
+} wait_queue_head_t;
+
+typedef struct {
+	wait_queue_head_t *q;
+	unsigned long	wakeups;
+} wait_queue_t;
+
+#define DEFINE_WAIT(name)	wait_queue_t name = { NULL, 0 }
+
+void init_waitqueue_head(wait_queue_head_t *q);
+void prepare_to_wait(wait_queue_head_t *q, wait_queue_t *wait, int state);
+void finish_wait(wait_queue_head_t *q, wait_queue_t *wait);
+void wake_up_all(wait_queue_head_t *q);
+
+// from asm-generic/ioctl.h
+#define _IOC(dir, type, nr, size) \
+	(((dir) << 30) | ((size) << 16) | ((type) << 8) | (nr))
+#define _IO(type, nr)		_IOC(0U, (type), (nr), 0)
+#define _IOW(type, nr, size)	_IOC(1U, (type), (nr), sizeof(size))
+#define _IOR(type, nr, size)	_IOC(2U, (type), (nr), sizeof(size))
+#define _IOWR(type, nr, size)	_IOC(3U, (type), (nr), sizeof(size))
+
+// from linux/completion.h
+struct completion {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cond;
+	unsigned int	done;
+};
+
+void init_completion(struct completion *x);
+void complete(struct completion *x);
+void wait_for_completion(struct completion *x);
+
+// from linux/kthread.h, a kernel thread is a detached pthread
+struct task_struct *kthread_run(int (*threadfn)(void *data), void *data,
+				const char *namefmt, ...);
+
+// from linux/cpumask.h
+#define num_online_cpus()	((int)sysconf(_SC_NPROCESSORS_ONLN))
+
+// from linux/time.h
+void do_gettimeofday(struct timeval *tv);
+#define get_seconds()	((unsigned long)time(NULL))
+
+// from linux/fs.h
+#define BLOCK_SIZE_BITS	10
+#define BLOCK_SIZE	(1 << BLOCK_SIZE_BITS)
+
+struct file;
+struct bio;
+
+struct inode {
+	struct address_space *i_mapping;
+};
+
+struct block_device {
+	struct inode	*bd_inode;
+};
+
+/*
+ * A super_block is the open image file.  Only the fields the core
+ * touches through dfly_wrap.h are present.
+ */
+struct super_block {
+	int		s_fd;		/* image file descriptor */
+	char		s_id[32];	/* name used in messages */
+	void		*s_fs_info;	/* struct hammer_mount */
+	struct block_device *s_bdev;	/* see open_bdev_image() */
+};
+
+/*
+ * Set up and tear down sb->s_bdev over the open image file, which is
+ * what get_sb_bdev() does in the kernel.
+ */
+int open_bdev_image(struct super_block *sb);
+void close_bdev_image(struct super_block *sb);
+
+// from linux/buffer_head.h
+struct buffer_head {
+	char		*b_data;
+	size_t		b_size;
+};
+
+struct buffer_head *sb_bread(struct super_block *sb, sector_t block);
+void brelse(struct buffer_head *bh);
+
+#endif /* _LINUX_USER_H */
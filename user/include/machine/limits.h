@@ -0,0 +1 @@
+#include "../linux_user.h"
@@ -0,0 +1 @@
+#include "../../../dfly/sys/queue.h"
@@ -0,0 +1,411 @@
+/*
+ * Userspace implementation of the Linux kernel services declared in
+ * include/linux_user.h.  Block reads go straight to the image file with
+ * pread(), allocations to the libc heap.
+ */
+
+#include <malloc.h>
+#include <sys/mman.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "linux_user.h"
+
+// from kernel/panic.c
+void panic(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    fprintf(stderr, "panic: ");
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+    abort();
+}
+
+// from mm/slab.c
+void *kzalloc(size_t size, int flags)
+{
+    return calloc(1, size);
+}
+
+void kfree(const void *ptr)
+{
+    free((void *)ptr);
+}
+
+size_t ksize(const void *ptr)
+{
+    return malloc_usable_size((void *)ptr);
+}
+
+char *kstrdup(const char *s, int flags)
+{
+    return s ? strdup(s) : NULL;
+}
+
+// from mm/vmscan.c
+static struct shrinker *shrinker_list;
+static pthread_mutex_t shrinker_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void register_shrinker(struct shrinker *shrinker)
+{
+    pthread_mutex_lock(&shrinker_lock);
+    shrinker->next = shrinker_list;
+    shrinker_list = shrinker;
+    pthread_mutex_unlock(&shrinker_lock);
+}
+
+void unregister_shrinker(struct shrinker *shrinker)
+{
+    struct shrinker **pp;
+
+    pthread_mutex_lock(&shrinker_lock);
+    for (pp = &shrinker_list; *pp; pp = &(*pp)->next) {
+        if (*pp == shrinker) {
+            *pp = shrinker->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shrinker_lock);
+}
+
+unsigned long shrink_slab(int nr_to_scan, gfp_t gfp_mask)
+{
+    struct shrinker *shrinker;
+    unsigned long left = 0;
+    int n;
+
+    pthread_mutex_lock(&shrinker_lock);
+    for (shrinker = shrinker_list; shrinker; shrinker = shrinker->next) {
+        n = shrinker->shrink(nr_to_scan, gfp_mask);
+        if (n > 0)
+            left += n;
+    }
+    pthread_mutex_unlock(&shrinker_lock);
+    return left;
+}
+
+/*
+ * A cache only remembers its object size, objects come from the heap.
+ */
+struct kmem_cache {
+    const char  *name;
+    size_t      size;
+    void        (*ctor)(void *);
+};
+
+struct kmem_cache *kmem_cache_create(const char *name, size_t size,
+                                     size_t align, unsigned long flags,
+                                     void (*ctor)(void *))
+{
+    struct kmem_cache *cachep;
+
+    cachep = calloc(1, sizeof(*cachep));
+    if (cachep) {
+        cachep->name = name;
+        cachep->size = size;
+        cachep->ctor = ctor;
+    }
+    return cachep;
+}
+
+void kmem_cache_destroy(struct kmem_cache *cachep)
+{
+    free(cachep);
+}
+
+void *kmem_cache_alloc(struct kmem_cache *cachep, int flags)
+{
+    void *objp = malloc(cachep->size);
+
+    if (objp && cachep->ctor)
+        cachep->ctor(objp);
+    return objp;
+}
+
+void *kmem_cache_zalloc(struct kmem_cache *cachep, int flags)
+{
+    return calloc(1, cachep->size);
+}
+
+void kmem_cache_free(struct kmem_cache *cachep, void *objp)
+{
+    free(objp);
+}
+
+// from kernel/wait.c
+static __thread wait_queue_t *current_wait;
+
+void init_waitqueue_head(wait_queue_head_t *q)
+{
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->wakeups = 0;
+}
+
+void prepare_to_wait(wait_queue_head_t *q, wait_queue_t *wait, int state)
+{
+    pthread_mutex_lock(&q->lock);
+    wait->q = q;
+    wait->wakeups = q->wakeups;
+    pthread_mutex_unlock(&q->lock);
+    current_wait = wait;
+}
+
+void finish_wait(wait_queue_head_t *q, wait_queue_t *wait)
+{
+    current_wait = NULL;
+    wait->q = NULL;
+}
+
+void wake_up_all(wait_queue_head_t *q)
+{
+    pthread_mutex_lock(&q->lock);
+    ++q->wakeups;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// from kernel/sched.c
+void init_completion(struct completion *x)
+{
+    pthread_mutex_init(&x->lock, NULL);
+    pthread_cond_init(&x->cond, NULL);
+    x->done = 0;
+}
+
+void complete(struct completion *x)
+{
+    pthread_mutex_lock(&x->lock);
+    ++x->done;
+    pthread_cond_signal(&x->cond);
+    pthread_mutex_unlock(&x->lock);
+}
+
+void wait_for_completion(struct completion *x)
+{
+    pthread_mutex_lock(&x->lock);
+    while (x->done == 0)
+        pthread_cond_wait(&x->cond, &x->lock);
+    --x->done;
+    pthread_mutex_unlock(&x->lock);
+}
+
+// from kernel/kthread.c
+struct kthread_start {
+    int (*threadfn)(void *data);
+    void *data;
+};
+
+static void *kthread_main(void *arg)
+{
+    struct kthread_start start = *(struct kthread_start *)arg;
+
+    free(arg);
+    start.threadfn(start.data);
+    return(NULL);
+}
+
+struct task_struct *kthread_run(int (*threadfn)(void *data), void *data,
+                                const char *namefmt, ...)
+{
+    struct kthread_start *start;
+    pthread_attr_t attr;
+    pthread_t td;
+    int error;
+
+    start = malloc(sizeof(*start));
+    if (start == NULL)
+        return(ERR_PTR(-ENOMEM));
+    start->threadfn = threadfn;
+    start->data = data;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    error = pthread_create(&td, &attr, kthread_main, start);
+    pthread_attr_destroy(&attr);
+    if (error) {
+        free(start);
+        return(ERR_PTR(-error));
+    }
+    return((struct task_struct *)td);
+}
+
+// from kernel/timer.c
+/*
+ * Sleep on the wait queue of the last prepare_to_wait() until it is woken
+ * up or timeout ticks have passed.  Returns the ticks left.
+ */
+long schedule_timeout(long timeout)
+{
+    wait_queue_t *wait = current_wait;
+    wait_queue_head_t *q;
+    struct timespec now;
+    struct timespec deadline;
+    int64_t left;
+
+    if (wait == NULL || wait->q == NULL)
+        panic("schedule_timeout: not on a wait queue");
+    q = wait->q;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    if (timeout != MAX_SCHEDULE_TIMEOUT) {
+        deadline.tv_sec += timeout / HZ;
+        deadline.tv_nsec += (timeout % HZ) * (1000000000L / HZ);
+        if (deadline.tv_nsec >= 1000000000L) {
+            ++deadline.tv_sec;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&q->lock);
+    while (q->wakeups == wait->wakeups) {
+        if (timeout == MAX_SCHEDULE_TIMEOUT) {
+            pthread_cond_wait(&q->cond, &q->lock);
+        } else if (pthread_cond_timedwait(&q->cond, &q->lock,
+                                          &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    if (timeout == MAX_SCHEDULE_TIMEOUT)
+        return(timeout);
+    clock_gettime(CLOCK_REALTIME, &now);
+    left = (int64_t)(deadline.tv_sec - now.tv_sec) * HZ +
+           (deadline.tv_nsec - now.tv_nsec) / (1000000000L / HZ);
+    return(left > 0 ? left : 0);
+}
+
+// from kernel/time.c
+void do_gettimeofday(struct timeval *tv)
+{
+    gettimeofday(tv, NULL);
+}
+
+// from kernel/time/timekeeping.c
+ktime_t ktime_get(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((ktime_t)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+// from fs/buffer.c
+struct buffer_head *sb_bread(struct super_block *sb, sector_t block)
+{
+    struct buffer_head *bh;
+    ssize_t n;
+
+    bh = malloc(sizeof(*bh) + BLOCK_SIZE);
+    if (bh == NULL)
+        return NULL;
+    bh->b_data = (char *)(bh + 1);
+    bh->b_size = BLOCK_SIZE;
+
+    n = pread(sb->s_fd, bh->b_data, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+    if (n != BLOCK_SIZE) {
+        printk(KERN_ERR "%s: read error at block %lu\n",
+               sb->s_id, (unsigned long)block);
+        free(bh);
+        return NULL;
+    }
+    return bh;
+}
+
+void brelse(struct buffer_head *bh)
+{
+    free(bh);
+}
+
+// from fs/block_dev.c
+struct bdev_image {
+    struct block_device bdev;
+    struct inode inode;
+    struct address_space mapping;
+    void *base;
+    size_t size;
+};
+
+int open_bdev_image(struct super_block *sb)
+{
+    struct bdev_image *bi;
+    struct stat st;
+    unsigned long i;
+
+    if (fstat(sb->s_fd, &st) < 0)
+        return(errno);
+    bi = calloc(1, sizeof(*bi));
+    if (bi == NULL)
+        return(ENOMEM);
+    bi->size = st.st_size;
+    bi->mapping.nrpages = (bi->size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    bi->mapping.a_pages = calloc(bi->mapping.nrpages, sizeof(struct page));
+    if (bi->size)
+        bi->base = mmap(NULL, bi->size, PROT_READ, MAP_SHARED, sb->s_fd, 0);
+    if (bi->mapping.a_pages == NULL || bi->base == MAP_FAILED) {
+        if (bi->base != MAP_FAILED && bi->base != NULL)
+            munmap(bi->base, bi->size);
+        free(bi->mapping.a_pages);
+        free(bi);
+        return(ENOMEM);
+    }
+    for (i = 0; i < bi->mapping.nrpages; ++i)
+        bi->mapping.a_pages[i].virtual = (char *)bi->base + i * PAGE_SIZE;
+    bi->inode.i_mapping = &bi->mapping;
+    bi->bdev.bd_inode = &bi->inode;
+    sb->s_bdev = &bi->bdev;
+    return(0);
+}
+
+void close_bdev_image(struct super_block *sb)
+{
+    struct bdev_image *bi = (struct bdev_image *)sb->s_bdev;
+
+    if (bi == NULL)
+        return;
+    if (bi->base)
+        munmap(bi->base, bi->size);
+    free(bi->mapping.a_pages);
+    free(bi);
+    sb->s_bdev = NULL;
+}
+
+// from mm/filemap.c
+struct page *read_mapping_page_async(struct address_space *mapping,
+                                     pgoff_t index, void *data)
+{
+    struct page *page;
+
+    if (index >= mapping->nrpages)
+        return(ERR_PTR(-EIO));
+    page = &mapping->a_pages[index];
+    madvise(page->virtual, PAGE_SIZE, MADV_WILLNEED);
+    atomic_add(1, &page->_count);
+    return(page);
+}
+
+void page_cache_release(struct page *page)
+{
+    atomic_sub(1, &page->_count);
+}
+
+// from mm/vmalloc.c
+void *vmap(struct page **pages, unsigned int count, unsigned long flags,
+           int prot)
+{
+    unsigned int i;
+
+    for (i = 1; i < count; ++i) {
+        if (pages[i] != pages[0] + i)
+            return(NULL);
+    }
+    return(pages[0]->virtual);
+}
+
+void vunmap(const void *addr)
+{
+}